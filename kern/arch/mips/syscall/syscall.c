@@ -160,6 +160,25 @@ syscall(struct trapframe *tf)
 	case SYS_close:
 		err = sys_close((int) tf->tf_a0);
 		break;
+
+	case SYS_fsync:
+		err = sys_fsync((int) tf->tf_a0);
+		break;
+
+	case SYS_fdatasync:
+		err = sys_fdatasync((int) tf->tf_a0);
+		break;
+
+	case SYS_getdirentry:
+		err = sys_getdirentry((int) tf->tf_a0, (userptr_t) tf->tf_a1,
+				      (size_t) tf->tf_a2, &retval);
+		break;
+
+	case SYS_getdirentries:
+		err = sys_getdirentries((int) tf->tf_a0,
+					(userptr_t) tf->tf_a1,
+					(size_t) tf->tf_a2, &retval);
+		break;
 	
 	case SYS_execv:
                 err = sys_execv((userptr_t)tf->tf_a0, (userptr_t *)tf->tf_a1);
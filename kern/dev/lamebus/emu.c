@@ -38,6 +38,12 @@
  * This makes it unnecessary to copy the system files to the simulated
  * disk, although we recommend doing so and trying running without this
  * device as part of testing your filesystem.
+ *
+ * Each trip to the "hardware" is slow, so file data, file sizes, and
+ * lookup results are cached for a while (emufs_cachetime seconds)
+ * before being fetched again; see the cache section below. Since
+ * someone on the host side can change files at any time, that's as
+ * coherent as it gets. Writes go straight through.
  */
 
 #include <types.h>
@@ -49,6 +55,7 @@
 #include <uio.h>
 #include <membar.h>
 #include <synch.h>
+#include <clock.h>
 #include <lamebus/emu.h>
 #include <platform/bus.h>
 #include <vfs.h>
@@ -261,23 +268,70 @@ emu_close(struct emu_softc *sc, uint32_t handle)
 	return result;
 }
 
+/*
+ * Get one of the bounce buffers allocated at attach time, waiting
+ * for one if they're all in use.
+ */
+static
+void *
+emu_getbounce(struct emu_softc *sc)
+{
+	void *buf;
+
+	P(sc->e_bouncesem);
+	lock_acquire(sc->e_bouncelock);
+	KASSERT(sc->e_nbounce > 0);
+	buf = sc->e_bounce[--sc->e_nbounce];
+	lock_release(sc->e_bouncelock);
+	return buf;
+}
+
+/*
+ * Give back a bounce buffer from emu_getbounce.
+ */
+static
+void
+emu_putbounce(struct emu_softc *sc, void *buf)
+{
+	lock_acquire(sc->e_bouncelock);
+	KASSERT(sc->e_nbounce < EMU_NBOUNCE);
+	sc->e_bounce[sc->e_nbounce++] = buf;
+	lock_release(sc->e_bouncelock);
+	V(sc->e_bouncesem);
+}
+
 /*
  * Common code for read and readdir.
+ *
+ * There is only one e_iobuf, so it can only be touched with e_lock
+ * held; but copying to user memory can fault and take arbitrarily
+ * long, and there's no reason to hold up everyone else's I/O while
+ * it does. So unless the destination is kernel memory, copy the data
+ * out of e_iobuf into one of the bounce buffers and do the uiomove
+ * after releasing the lock.
  */
 static
 int
 emu_doread(struct emu_softc *sc, uint32_t handle, uint32_t len,
 	   uint32_t op, struct uio *uio)
 {
+	char *bounce;
+	uint32_t got, newoffset;
 	int result;
 
 	KASSERT(uio->uio_rw == UIO_READ);
+	KASSERT(len <= EMU_MAXIO);
 
 	if (uio->uio_offset > (off_t)0xffffffff) {
 		/* beyond the largest size the file can have; generate EOF */
 		return 0;
 	}
 
+	bounce = NULL;
+	if (uio->uio_segflg != UIO_SYSSPACE) {
+		bounce = emu_getbounce(sc);
+	}
+
 	lock_acquire(sc->e_lock);
 
 	emu_wreg(sc, REG_HANDLE, handle);
@@ -286,16 +340,33 @@ emu_doread(struct emu_softc *sc, uint32_t handle, uint32_t len,
 	emu_wreg(sc, REG_OPER, op);
 	result = emu_waitdone(sc);
 	if (result) {
+		lock_release(sc->e_lock);
 		goto out;
 	}
 
 	membar_load_load();
-	result = uiomove(sc->e_iobuf, emu_rreg(sc, REG_IOLEN), uio);
+	got = emu_rreg(sc, REG_IOLEN);
+	newoffset = emu_rreg(sc, REG_OFFSET);
+	KASSERT(got <= len);
 
-	uio->uio_offset = emu_rreg(sc, REG_OFFSET);
+	if (bounce == NULL) {
+		result = uiomove(sc->e_iobuf, got, uio);
+		lock_release(sc->e_lock);
+	}
+	else {
+		memcpy(bounce, sc->e_iobuf, got);
+		lock_release(sc->e_lock);
+		result = uiomove(bounce, got, uio);
+	}
+
+	if (result == 0) {
+		uio->uio_offset = newoffset;
+	}
 
  out:
-	lock_release(sc->e_lock);
+	if (bounce != NULL) {
+		emu_putbounce(sc, bounce);
+	}
 	return result;
 }
 
@@ -322,38 +393,60 @@ emu_readdir(struct emu_softc *sc, uint32_t handle, uint32_t len,
 }
 
 /*
- * Write to a hardware-level file handle.
+ * Write to a hardware-level file handle. As in emu_doread, user data
+ * is copied in before taking e_lock.
  */
 static
 int
 emu_write(struct emu_softc *sc, uint32_t handle, uint32_t len,
 	  struct uio *uio)
 {
+	char *bounce;
+	off_t offset;
 	int result;
 
 	KASSERT(uio->uio_rw == UIO_WRITE);
+	KASSERT(len <= EMU_MAXIO);
 
 	if (uio->uio_offset > (off_t)0xffffffff) {
 		return EFBIG;
 	}
+	offset = uio->uio_offset;
 
-	lock_acquire(sc->e_lock);
+	bounce = NULL;
+	if (uio->uio_segflg != UIO_SYSSPACE) {
+		bounce = emu_getbounce(sc);
+		result = uiomove(bounce, len, uio);
+		if (result) {
+			emu_putbounce(sc, bounce);
+			return result;
+		}
+	}
 
-	emu_wreg(sc, REG_HANDLE, handle);
-	emu_wreg(sc, REG_IOLEN, len);
-	emu_wreg(sc, REG_OFFSET, uio->uio_offset);
+	lock_acquire(sc->e_lock);
 
-	result = uiomove(sc->e_iobuf, len, uio);
-	membar_store_store();
-	if (result) {
-		goto out;
+	if (bounce == NULL) {
+		result = uiomove(sc->e_iobuf, len, uio);
+		if (result) {
+			goto out;
+		}
 	}
+	else {
+		memcpy(sc->e_iobuf, bounce, len);
+	}
+	membar_store_store();
 
+	emu_wreg(sc, REG_HANDLE, handle);
+	emu_wreg(sc, REG_IOLEN, len);
+	emu_wreg(sc, REG_OFFSET, offset);
 	emu_wreg(sc, REG_OPER, EMU_OP_WRITE);
 	result = emu_waitdone(sc);
 
  out:
 	lock_release(sc->e_lock);
+	if (bounce != NULL) {
+		emu_putbounce(sc, bounce);
+	}
 	return result;
 }
 
@@ -401,6 +494,390 @@ emu_trunc(struct emu_softc *sc, uint32_t handle, off_t len)
 	return result;
 }
 
+/*
+ * Read up to LEN bytes at OFFSET from a hardware-level file handle,
+ * leaving them in e_iobuf; the number read (less than LEN only at
+ * EOF) is returned in GOT. The caller must hold e_lock and copy the
+ * data out before releasing it.
+ */
+static
+int
+emu_readraw(struct emu_softc *sc, uint32_t handle, uint32_t offset,
+	    uint32_t len, uint32_t *got)
+{
+	int result;
+
+	KASSERT(lock_do_i_hold(sc->e_lock));
+	KASSERT(len <= EMU_MAXIO);
+
+	emu_wreg(sc, REG_HANDLE, handle);
+	emu_wreg(sc, REG_IOLEN, len);
+	emu_wreg(sc, REG_OFFSET, offset);
+	emu_wreg(sc, REG_OPER, EMU_OP_READ);
+	result = emu_waitdone(sc);
+	if (result) {
+		return result;
+	}
+
+	membar_load_load();
+	*got = emu_rreg(sc, REG_IOLEN);
+	return 0;
+}
+
+//
+////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////
+//
+// Caches
+//
+// Three things are cached, all per filesystem and all protected by
+// the device's e_lock:
+//
+//    - file data, in EMUFS_PAGESIZE pieces (struct emufs_page). A
+//      miss reads as many following pages as are also missing, up
+//      to a whole e_iobuf, in one trip. Writes and truncates drop
+//      the pages they touch.
+//
+//    - file sizes, for VOP_STAT, in the vnode. Writes and truncates
+//      keep them up to date. (File types are fixed when the vnode
+//      is loaded, so they need no cache.)
+//
+//    - lookup results, positive and negative (struct emufs_name).
+//      Besides saving the trip, this matters because every host
+//      open makes a new handle and so a new vnode, whose data cache
+//      starts out empty; reusing the vnode keeps it warm. We don't
+//      set FS_CACHENAMES, so the VFS name cache, whose entries never
+//      expire, stays out of the way and this is the only one.
+//
+// Once a lookup expires, the next one opens the file again and so
+// gets another vnode, and there's no telling from the host which
+// vnodes are the same file. So writes and truncates also drop the
+// cached pages and sizes of every other vnode; otherwise those could
+// keep serving what was there before.
+//
+// Everything cached is used only for emufs_cachetime seconds after
+// it was fetched.
+//
+
+/* Default for emufs_cachetime */
+#define EMUFS_CACHETIME  2
+
+static unsigned emufs_cachetime = EMUFS_CACHETIME;
+
+unsigned
+emufs_getcachetime(void)
+{
+	return emufs_cachetime;
+}
+
+void
+emufs_setcachetime(unsigned seconds)
+{
+	emufs_cachetime = seconds;
+}
+
+/*
+ * Is something fetched at time THEN still usable?
+ */
+static
+bool
+emufs_fresh(const struct timespec *then)
+{
+	struct timespec now, age;
+
+	if (emufs_cachetime == 0) {
+		return false;
+	}
+	gettime(&now);
+	timespec_sub(&now, then, &age);
+	return age.tv_sec >= 0 && (unsigned)age.tv_sec < emufs_cachetime;
+}
+
+/*
+ * Find the cache entry for page PAGENO of EV, fresh or not.
+ */
+static
+struct emufs_page *
+emufs_page_find(struct emufs_fs *ef, struct emufs_vnode *ev,
+		uint32_t pageno)
+{
+	unsigned i;
+
+	for (i=0; i<EMUFS_NPAGES; i++) {
+		if (ef->ef_pages[i].ep_vn == ev &&
+		    ef->ef_pages[i].ep_pageno == pageno) {
+			return &ef->ef_pages[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Get a page to fill: an unused one if there is one (allocating its
+ * memory if need be), otherwise the least recently used. Returns
+ * NULL if there's nothing to use and no memory for more.
+ */
+static
+struct emufs_page *
+emufs_page_alloc(struct emufs_fs *ef)
+{
+	struct emufs_page *ep, *victim, *empty;
+	unsigned i;
+
+	victim = empty = NULL;
+	for (i=0; i<EMUFS_NPAGES; i++) {
+		ep = &ef->ef_pages[i];
+		if (ep->ep_vn == NULL) {
+			if (ep->ep_data != NULL) {
+				return ep;
+			}
+			if (empty == NULL) {
+				empty = ep;
+			}
+		}
+		else if (victim == NULL ||
+			 ef->ef_pageclock - ep->ep_lastuse >
+			 ef->ef_pageclock - victim->ep_lastuse) {
+			victim = ep;
+		}
+	}
+
+	if (empty != NULL) {
+		empty->ep_data = kmalloc(EMUFS_PAGESIZE);
+		if (empty->ep_data != NULL) {
+			return empty;
+		}
+	}
+	if (victim != NULL) {
+		victim->ep_vn = NULL;
+	}
+	return victim;
+}
+
+/*
+ * Drop EV's cached pages from FIRST through LAST, and also its last
+ * page (the short one, if cached), since a write or truncate may
+ * have moved EOF.
+ */
+static
+void
+emufs_page_invalidate(struct emufs_fs *ef, struct emufs_vnode *ev,
+		      uint32_t first, uint32_t last)
+{
+	struct emufs_page *ep;
+	unsigned i;
+
+	for (i=0; i<EMUFS_NPAGES; i++) {
+		ep = &ef->ef_pages[i];
+		if (ep->ep_vn != ev) {
+			continue;
+		}
+		if ((ep->ep_pageno >= first && ep->ep_pageno <= last) ||
+		    ep->ep_len < EMUFS_PAGESIZE) {
+			ep->ep_vn = NULL;
+		}
+	}
+}
+
+/*
+ * Drop the cached pages and sizes of every vnode other than EV, after
+ * EV's file was changed. (See above for why.)
+ */
+static
+void
+emufs_cache_dropothers(struct emufs_fs *ef, struct emufs_vnode *ev)
+{
+	struct emufs_vnode *evx;
+	unsigned i, num;
+
+	KASSERT(lock_do_i_hold(ef->ef_emu->e_lock));
+
+	for (i=0; i<EMUFS_NPAGES; i++) {
+		if (ef->ef_pages[i].ep_vn != ev) {
+			ef->ef_pages[i].ep_vn = NULL;
+		}
+	}
+	num = vnodearray_num(ef->ef_vnodes);
+	for (i=0; i<num; i++) {
+		evx = vnodearray_get(ef->ef_vnodes, i)->vn_data;
+		if (evx != ev) {
+			evx->ev_sizevalid = false;
+		}
+	}
+}
+
+/*
+ * Get page PAGENO of EV, from the host if it's not cached or no
+ * longer fresh. Fails with ENOMEM if there's no page to put it in.
+ */
+static
+int
+emufs_page_get(struct emufs_fs *ef, struct emufs_vnode *ev,
+	       uint32_t pageno, struct emufs_page **ret)
+{
+	struct emu_softc *sc = ev->ev_emu;
+	struct emufs_page *ep, *first;
+	struct timespec now;
+	uint32_t n, i, got, len;
+	int result;
+
+	KASSERT(lock_do_i_hold(sc->e_lock));
+
+	ep = emufs_page_find(ef, ev, pageno);
+	if (ep != NULL && emufs_fresh(&ep->ep_time)) {
+		ep->ep_lastuse = ++ef->ef_pageclock;
+		*ret = ep;
+		return 0;
+	}
+
+	/* Read it along with any following pages that are also missing */
+	for (n=1; n < EMU_MAXIO / EMUFS_PAGESIZE; n++) {
+		ep = emufs_page_find(ef, ev, pageno + n);
+		if (ep != NULL && emufs_fresh(&ep->ep_time)) {
+			break;
+		}
+	}
+
+	result = emu_readraw(sc, ev->ev_handle, pageno * EMUFS_PAGESIZE,
+			     n * EMUFS_PAGESIZE, &got);
+	if (result) {
+		return result;
+	}
+	gettime(&now);
+
+	/* The first page goes in even if it's empty, to record EOF */
+	first = NULL;
+	for (i=0; i<n && (i == 0 || i * EMUFS_PAGESIZE < got); i++) {
+		ep = emufs_page_find(ef, ev, pageno + i);
+		if (ep == NULL) {
+			ep = emufs_page_alloc(ef);
+			if (ep == NULL) {
+				break;
+			}
+		}
+		len = got > i * EMUFS_PAGESIZE ? got - i * EMUFS_PAGESIZE : 0;
+		if (len > EMUFS_PAGESIZE) {
+			len = EMUFS_PAGESIZE;
+		}
+		memcpy(ep->ep_data, (char *)sc->e_iobuf + i * EMUFS_PAGESIZE,
+		       len);
+		ep->ep_vn = ev;
+		ep->ep_pageno = pageno + i;
+		ep->ep_len = len;
+		ep->ep_time = now;
+		ep->ep_lastuse = ++ef->ef_pageclock;
+		if (i == 0) {
+			first = ep;
+		}
+	}
+
+	if (first == NULL) {
+		return ENOMEM;
+	}
+	*ret = first;
+	return 0;
+}
+
+/*
+ * Find the cached lookup of NAME in DIR, fresh or not.
+ */
+static
+struct emufs_name *
+emufs_name_find(struct emufs_fs *ef, struct emufs_vnode *dir,
+		const char *name)
+{
+	unsigned i;
+
+	for (i=0; i<EMUFS_NNAMES; i++) {
+		if (ef->ef_names[i].en_dir == dir &&
+		    !strcmp(ef->ef_names[i].en_name, name)) {
+			return &ef->ef_names[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Remember that NAME in DIR is VN (NULL for "no such file").
+ */
+static
+void
+emufs_name_enter(struct emufs_fs *ef, struct emufs_vnode *dir,
+		 const char *name, struct emufs_vnode *vn)
+{
+	struct emufs_name *en;
+	unsigned i;
+
+	KASSERT(lock_do_i_hold(ef->ef_emu->e_lock));
+
+	if (emufs_cachetime == 0 || strlen(name) > EMUFS_NAMELEN) {
+		return;
+	}
+
+	en = emufs_name_find(ef, dir, name);
+	for (i=0; en == NULL && i<EMUFS_NNAMES; i++) {
+		/* Take an unused or stale entry if we come to one */
+		if (ef->ef_names[i].en_dir == NULL ||
+		    !emufs_fresh(&ef->ef_names[i].en_time)) {
+			en = &ef->ef_names[i];
+		}
+	}
+	if (en == NULL) {
+		en = &ef->ef_names[ef->ef_namenext];
+		ef->ef_namenext = (ef->ef_namenext + 1) % EMUFS_NNAMES;
+	}
+
+	en->en_dir = dir;
+	en->en_vn = vn;
+	gettime(&en->en_time);
+	strcpy(en->en_name, name);
+}
+
+/*
+ * Forget everything about EV, which is going away.
+ */
+static
+void
+emufs_cache_forget(struct emufs_fs *ef, struct emufs_vnode *ev)
+{
+	unsigned i;
+
+	KASSERT(lock_do_i_hold(ef->ef_emu->e_lock));
+
+	for (i=0; i<EMUFS_NNAMES; i++) {
+		if (ef->ef_names[i].en_dir == ev ||
+		    ef->ef_names[i].en_vn == ev) {
+			ef->ef_names[i].en_dir = NULL;
+		}
+	}
+	for (i=0; i<EMUFS_NPAGES; i++) {
+		if (ef->ef_pages[i].ep_vn == ev) {
+			ef->ef_pages[i].ep_vn = NULL;
+		}
+	}
+}
+
+/*
+ * Set up the caches when the filesystem is created.
+ */
+static
+void
+emufs_cache_init(struct emufs_fs *ef)
+{
+	unsigned i;
+
+	for (i=0; i<EMUFS_NPAGES; i++) {
+		ef->ef_pages[i].ep_vn = NULL;
+		ef->ef_pages[i].ep_data = NULL;
+	}
+	ef->ef_pageclock = 0;
+	for (i=0; i<EMUFS_NNAMES; i++) {
+		ef->ef_names[i].en_dir = NULL;
+	}
+	ef->ef_namenext = 0;
+}
+
 //
 ////////////////////////////////////////////////////////////
 
@@ -524,6 +1001,7 @@ emufs_reclaim(struct vnode *v)
 	}
 
 	vnodearray_remove(ef->ef_vnodes, ix);
+	emufs_cache_forget(ef, ev);
 	vnode_cleanup(&ev->ev_v);
 
 	lock_release(ef->ef_emu->e_lock);
@@ -533,6 +1011,75 @@ emufs_reclaim(struct vnode *v)
 	return 0;
 }
 
+/*
+ * VOP_READ, through the page cache. As in emu_doread, the copy out to
+ * user memory happens after releasing e_lock, through one of the
+ * device's bounce buffers.
+ */
+static
+int
+emufs_cachedread(struct vnode *v, struct uio *uio)
+{
+	struct emufs_vnode *ev = v->vn_data;
+	struct emufs_fs *ef = v->vn_fs->fs_data;
+	struct emufs_page *ep;
+	uint32_t pageno, pageoff, amt;
+	char *bounce;
+	bool eof;
+	int result;
+
+	bounce = NULL;
+	if (uio->uio_segflg != UIO_SYSSPACE) {
+		bounce = emu_getbounce(ev->ev_emu);
+	}
+
+	result = 0;
+	while (uio->uio_resid > 0) {
+		if (uio->uio_offset > (off_t)0xffffffff) {
+			/* beyond the largest size the file can have */
+			break;
+		}
+		pageno = uio->uio_offset / EMUFS_PAGESIZE;
+		pageoff = uio->uio_offset % EMUFS_PAGESIZE;
+
+		lock_acquire(ev->ev_emu->e_lock);
+
+		result = emufs_page_get(ef, ev, pageno, &ep);
+		if (result) {
+			lock_release(ev->ev_emu->e_lock);
+			break;
+		}
+
+		eof = ep->ep_len < EMUFS_PAGESIZE;
+		if (pageoff >= ep->ep_len) {
+			lock_release(ev->ev_emu->e_lock);
+			break;
+		}
+		amt = ep->ep_len - pageoff;
+		if (amt > uio->uio_resid) {
+			amt = uio->uio_resid;
+		}
+		if (bounce == NULL) {
+			result = uiomove(ep->ep_data + pageoff, amt, uio);
+			lock_release(ev->ev_emu->e_lock);
+		}
+		else {
+			memcpy(bounce, ep->ep_data + pageoff, amt);
+			lock_release(ev->ev_emu->e_lock);
+			result = uiomove(bounce, amt, uio);
+		}
+
+		if (result || eof) {
+			break;
+		}
+	}
+
+	if (bounce != NULL) {
+		emu_putbounce(ev->ev_emu, bounce);
+	}
+	return result;
+}
+
 /*
  * VOP_READ
  */
@@ -547,6 +1094,14 @@ emufs_read(struct vnode *v, struct uio *uio)
 
 	KASSERT(uio->uio_rw==UIO_READ);
 
+	if (emufs_cachetime > 0) {
+		result = emufs_cachedread(v, uio);
+		if (result != ENOMEM) {
+			return result;
+		}
+		/* No memory for the cache; just read it */
+	}
+
 	while (uio->uio_resid > 0) {
 		amt = uio->uio_resid;
 		if (amt > EMU_MAXIO) {
@@ -597,12 +1152,16 @@ int
 emufs_write(struct vnode *v, struct uio *uio)
 {
 	struct emufs_vnode *ev = v->vn_data;
+	struct emufs_fs *ef = v->vn_fs->fs_data;
 	uint32_t amt;
 	size_t oldresid;
+	off_t start;
 	int result;
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
+	start = uio->uio_offset;
+	result = 0;
 	while (uio->uio_resid > 0) {
 		amt = uio->uio_resid;
 		if (amt > EMU_MAXIO) {
@@ -613,7 +1172,7 @@ emufs_write(struct vnode *v, struct uio *uio)
 
 		result = emu_write(ev->ev_emu, ev->ev_handle, amt, uio);
 		if (result) {
-			return result;
+			break;
 		}
 
 		if (uio->uio_resid == oldresid) {
@@ -622,7 +1181,19 @@ emufs_write(struct vnode *v, struct uio *uio)
 		}
 	}
 
-	return 0;
+	/* Drop cached copies of what we wrote, and note the new size */
+	if (uio->uio_offset > start) {
+		lock_acquire(ev->ev_emu->e_lock);
+		emufs_page_invalidate(ef, ev, start / EMUFS_PAGESIZE,
+				      (uio->uio_offset - 1) / EMUFS_PAGESIZE);
+		emufs_cache_dropothers(ef, ev);
+		if (ev->ev_sizevalid && uio->uio_offset > ev->ev_size) {
+			ev->ev_size = uio->uio_offset;
+		}
+		lock_release(ev->ev_emu->e_lock);
+	}
+
+	return result;
 }
 
 /*
@@ -651,13 +1222,31 @@ int
 emufs_stat(struct vnode *v, struct stat *statbuf)
 {
 	struct emufs_vnode *ev = v->vn_data;
+	struct timespec now;
 	int result;
 
 	bzero(statbuf, sizeof(struct stat));
 
-	result = emu_getsize(ev->ev_emu, ev->ev_handle, &statbuf->st_size);
-	if (result) {
-		return result;
+	lock_acquire(ev->ev_emu->e_lock);
+	if (ev->ev_sizevalid && emufs_fresh(&ev->ev_sizetime)) {
+		statbuf->st_size = ev->ev_size;
+		lock_release(ev->ev_emu->e_lock);
+	}
+	else {
+		lock_release(ev->ev_emu->e_lock);
+
+		gettime(&now);
+		result = emu_getsize(ev->ev_emu, ev->ev_handle,
+				     &statbuf->st_size);
+		if (result) {
+			return result;
+		}
+
+		lock_acquire(ev->ev_emu->e_lock);
+		ev->ev_size = statbuf->st_size;
+		ev->ev_sizetime = now;
+		ev->ev_sizevalid = true;
+		lock_release(ev->ev_emu->e_lock);
 	}
 
 	result = VOP_GETTYPE(v, &statbuf->st_mode);
@@ -725,7 +1314,22 @@ int
 emufs_truncate(struct vnode *v, off_t len)
 {
 	struct emufs_vnode *ev = v->vn_data;
-	return emu_trunc(ev->ev_emu, ev->ev_handle, len);
+	struct emufs_fs *ef = v->vn_fs->fs_data;
+	int result;
+
+	result = emu_trunc(ev->ev_emu, ev->ev_handle, len);
+	if (result) {
+		return result;
+	}
+
+	lock_acquire(ev->ev_emu->e_lock);
+	emufs_page_invalidate(ef, ev, len / EMUFS_PAGESIZE, (uint32_t)-1);
+	emufs_cache_dropothers(ef, ev);
+	ev->ev_size = len;
+	gettime(&ev->ev_sizetime);
+	ev->ev_sizevalid = true;
+	lock_release(ev->ev_emu->e_lock);
+	return 0;
 }
 
 /*
@@ -755,6 +1359,10 @@ emufs_creat(struct vnode *dir, const char *name, bool excl, mode_t mode,
 		return result;
 	}
 
+	lock_acquire(ev->ev_emu->e_lock);
+	emufs_name_enter(ef, ev, name, newguy);
+	lock_release(ev->ev_emu->e_lock);
+
 	*ret = &newguy->ev_v;
 	return 0;
 }
@@ -769,12 +1377,34 @@ emufs_lookup(struct vnode *dir, char *pathname, struct vnode **ret)
 	struct emufs_vnode *ev = dir->vn_data;
 	struct emufs_fs *ef = dir->vn_fs->fs_data;
 	struct emufs_vnode *newguy;
+	struct emufs_name *en;
 	uint32_t handle;
 	int result;
 	int isdir;
 
+	lock_acquire(ev->ev_emu->e_lock);
+	en = emufs_name_find(ef, ev, pathname);
+	if (en != NULL && emufs_fresh(&en->en_time)) {
+		if (en->en_vn == NULL) {
+			lock_release(ev->ev_emu->e_lock);
+			return ENOENT;
+		}
+		/* Holding e_lock keeps it from being reclaimed */
+		newguy = en->en_vn;
+		VOP_INCREF(&newguy->ev_v);
+		lock_release(ev->ev_emu->e_lock);
+		*ret = &newguy->ev_v;
+		return 0;
+	}
+	lock_release(ev->ev_emu->e_lock);
+
 	result = emu_open(ev->ev_emu, ev->ev_handle, pathname, false, false, 0,
 			  &handle, &isdir);
+	if (result == ENOENT) {
+		lock_acquire(ev->ev_emu->e_lock);
+		emufs_name_enter(ef, ev, pathname, NULL);
+		lock_release(ev->ev_emu->e_lock);
+	}
 	if (result) {
 		return result;
 	}
@@ -785,6 +1415,10 @@ emufs_lookup(struct vnode *dir, char *pathname, struct vnode **ret)
 		return result;
 	}
 
+	lock_acquire(ev->ev_emu->e_lock);
+	emufs_name_enter(ef, ev, pathname, newguy);
+	lock_release(ev->ev_emu->e_lock);
+
 	*ret = &newguy->ev_v;
 	return 0;
 }
@@ -1081,6 +1715,7 @@ static const struct vnode_ops emufs_fileops = {
 	.vop_read = emufs_read,
 	.vop_readlink = emufs_readlink_notlink,
 	.vop_getdirentry = emufs_uio_op_notdir,
+	.vop_getdirentries = emufs_uio_op_notdir,
 	.vop_write = emufs_write,
 	.vop_ioctl = emufs_ioctl,
 	.vop_stat = emufs_stat,
@@ -1089,6 +1724,7 @@ static const struct vnode_ops emufs_fileops = {
 	.vop_fsync = emufs_fsync,
 	.vop_mmap = emufs_mmap,
 	.vop_truncate = emufs_truncate,
+	.vop_seekhole = vnode_seekhole_nohole,
 	.vop_namefile = emufs_uio_op_notdir,
 
 	.vop_creat = emufs_creat_notdir,
@@ -1115,6 +1751,7 @@ static const struct vnode_ops emufs_dirops = {
 	.vop_read = emufs_uio_op_isdir,
 	.vop_readlink = emufs_uio_op_isdir,
 	.vop_getdirentry = emufs_getdirentry,
+	.vop_getdirentries = vnode_getdirentries,
 	.vop_write = emufs_uio_op_isdir,
 	.vop_ioctl = emufs_ioctl,
 	.vop_stat = emufs_stat,
@@ -1123,6 +1760,7 @@ static const struct vnode_ops emufs_dirops = {
 	.vop_fsync = emufs_void_op_isdir,
 	.vop_mmap = emufs_void_op_isdir,
 	.vop_truncate = emufs_truncate_isdir,
+	.vop_seekhole = vopfail_seekhole_isdir,
 	.vop_namefile = emufs_namefile,
 
 	.vop_creat = emufs_creat,
@@ -1179,6 +1817,7 @@ emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 
 	ev->ev_emu = ef->ef_emu;
 	ev->ev_handle = handle;
+	ev->ev_sizevalid = false;
 
 	result = vnode_init(&ev->ev_v, isdir ? &emufs_dirops : &emufs_fileops,
 			    &ef->ef_fs, ev);
@@ -1301,9 +1940,12 @@ emufs_addtovfs(struct emu_softc *sc, const char *devname)
 
 	ef->ef_fs.fs_data = ef;
 	ef->ef_fs.fs_ops = &emufs_fsops;
+	/* No FS_CACHENAMES; we cache lookups ourselves, with a timeout */
+	ef->ef_fs.fs_flags = 0;
 
 	ef->ef_emu = sc;
 	ef->ef_root = NULL;
+	emufs_cache_init(ef);
 	ef->ef_vnodes = vnodearray_create();
 	if (ef->ef_vnodes == NULL) {
 		kfree(ef);
@@ -1338,6 +1980,7 @@ int
 config_emu(struct emu_softc *sc, int emuno)
 {
 	char name[32];
+	unsigned i;
 
 	sc->e_lock = lock_create("emufs-lock");
 	if (sc->e_lock == NULL) {
@@ -1351,7 +1994,47 @@ config_emu(struct emu_softc *sc, int emuno)
 	}
 	sc->e_iobuf = bus_map_area(sc->e_busdata, sc->e_buspos, EMU_BUFFER);
 
+	/*
+	 * Allocate the bounce buffers now, once; they're too big for
+	 * the subpage allocator to be worth getting and freeing per I/O.
+	 */
+	sc->e_bouncesem = NULL;
+	sc->e_nbounce = 0;
+	sc->e_bouncelock = lock_create("emufs-bouncelock");
+	if (sc->e_bouncelock == NULL) {
+		goto fail;
+	}
+	sc->e_bouncesem = sem_create("emufs-bouncesem", EMU_NBOUNCE);
+	if (sc->e_bouncesem == NULL) {
+		goto fail;
+	}
+	for (i=0; i<EMU_NBOUNCE; i++) {
+		sc->e_bounce[i] = kmalloc(EMU_MAXIO);
+		if (sc->e_bounce[i] == NULL) {
+			goto fail;
+		}
+		sc->e_nbounce++;
+	}
+
 	snprintf(name, sizeof(name), "emu%d", emuno);
 
 	return emufs_addtovfs(sc, name);
+
+ fail:
+	while (sc->e_nbounce > 0) {
+		kfree(sc->e_bounce[--sc->e_nbounce]);
+	}
+	if (sc->e_bouncesem != NULL) {
+		sem_destroy(sc->e_bouncesem);
+		sc->e_bouncesem = NULL;
+	}
+	if (sc->e_bouncelock != NULL) {
+		lock_destroy(sc->e_bouncelock);
+		sc->e_bouncelock = NULL;
+	}
+	sem_destroy(sc->e_sem);
+	sc->e_sem = NULL;
+	lock_destroy(sc->e_lock);
+	sc->e_lock = NULL;
+	return ENOMEM;
 }
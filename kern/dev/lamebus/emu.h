@@ -33,6 +33,7 @@
 
 #define EMU_MAXIO       16384
 #define EMU_ROOTHANDLE  0
+#define EMU_NBOUNCE     4	/* number of EMU_MAXIO bounce buffers */
 
 /*
  * The per-device data used by the emufs device driver.
@@ -51,6 +52,12 @@ struct emu_softc {
 	struct semaphore *e_sem;
 	void *e_iobuf;
 
+	/* Bounce buffers for user I/O; e_bouncesem counts the free ones */
+	struct lock *e_bouncelock;
+	struct semaphore *e_bouncesem;
+	void *e_bounce[EMU_NBOUNCE];	/* free ones are at the bottom */
+	unsigned e_nbounce;		/* number free */
+
 	/* Written by the interrupt handler */
 	uint32_t e_result;
 };
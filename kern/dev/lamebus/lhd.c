@@ -60,6 +60,10 @@
 /* Buffer (offset within slot)  */
 #define LHD_BUFFER      32768
 
+/* Request queue fairness bounds, in sectors (see below) */
+#define LHD_MAXRUN      128   /* Most one request gets in a row */
+#define LHD_MAXWAIT     4096  /* Most others get while a request waits */
+
 /*
  * Shortcut for reading a register.
  */
@@ -96,15 +100,207 @@ int lhd_code_to_errno(struct lhd_softc *lh, int code)
 }
 
 /*
- * Record that an I/O has completed: save the result and poke the
- * completion semaphore.
+ * Request queue.
+ *
+ * All I/O, including lhd_io's, goes through devop_submit requests
+ * (struct devreq, in device.h) on a per-disk queue sorted by the
+ * sector each wants next. The disk does one sector at a time. When it
+ * finishes one, the interrupt handler copies the data out of the
+ * on-card buffer, picks the next request, loads its data if it's a
+ * write, and starts it, so the disk stays busy as long as there's
+ * anything queued and no thread has to be scheduled in between.
+ *
+ * The next request is chosen C-SCAN fashion: the first one at or
+ * after lh_head, the sector after the one just done, wrapping around
+ * to the lowest sector when there's nothing further up. A request
+ * that wants the very next sector (the same request continuing, or
+ * another one starting where it left off) is therefore served
+ * without a seek, which merges adjacent requests into one sweep.
+ *
+ * Two bounds keep this fair. A request that has had LHD_MAXRUN
+ * sectors in a row goes to the back of the sweep if anyone else is
+ * waiting, so one big transfer can't hold up everyone else; and a
+ * request that has waited while LHD_MAXWAIT sectors went to others
+ * is served next regardless of where it is.
+ *
+ * The queue is protected by lh_lock, a spinlock, since the interrupt
+ * handler works on it.
+ */
+
+/* The sector a request wants next */
+#define LHD_REQSECT(req) ((req)->dr_block + (req)->dr_done / LHD_SECTSIZE)
+
+/*
+ * Add a request to the queue, keeping it sorted by sector. Requests
+ * for the same sector stay in arrival order.
+ */
+static
+void
+lhd_enqueue(struct lhd_softc *lh, struct devreq *req)
+{
+	struct devreq **pp;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	for (pp = &lh->lh_queue; *pp != NULL; pp = &(*pp)->dr_next) {
+		if (LHD_REQSECT(*pp) > LHD_REQSECT(req)) {
+			break;
+		}
+	}
+	req->dr_since = lh->lh_nserved;
+	req->dr_next = *pp;
+	*pp = req;
+}
+
+/*
+ * Take the next request off the queue, or return NULL if it's empty.
+ * SKIP, if not NULL, is a request that has used up its run; it is
+ * served only if nothing else is waiting.
+ */
+static
+struct devreq *
+lhd_dequeue(struct lhd_softc *lh, struct devreq *skip)
+{
+	struct devreq **pp, **pick, **oldest, **wrap;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	pick = oldest = wrap = NULL;
+	for (pp = &lh->lh_queue; *pp != NULL; pp = &(*pp)->dr_next) {
+		if (*pp == skip) {
+			continue;
+		}
+		if (wrap == NULL) {
+			wrap = pp;
+		}
+		if (pick == NULL && LHD_REQSECT(*pp) >= lh->lh_head) {
+			pick = pp;
+		}
+		if (oldest == NULL ||
+		    lh->lh_nserved - (*pp)->dr_since >
+		    lh->lh_nserved - (*oldest)->dr_since) {
+			oldest = pp;
+		}
+	}
+
+	if (oldest != NULL &&
+	    lh->lh_nserved - (*oldest)->dr_since > LHD_MAXWAIT) {
+		pick = oldest;
+	}
+	else if (pick == NULL) {
+		pick = wrap;
+	}
+	if (pick == NULL) {
+		/* Nobody but SKIP (if that) */
+		if (skip == NULL) {
+			return NULL;
+		}
+		for (pick = &lh->lh_queue; *pick != skip;
+		     pick = &(*pick)->dr_next) {
+			/* nothing */
+		}
+	}
+
+	skip = *pick;
+	*pick = skip->dr_next;
+	skip->dr_next = NULL;
+	return skip;
+}
+
+/*
+ * Start the disk on the next sector of the next request, if there is
+ * one. PREV is the request that just had the disk, or NULL.
+ */
+static
+void
+lhd_start(struct lhd_softc *lh, struct devreq *prev)
+{
+	struct devreq *req;
+	uint32_t statval = LHD_WORKING;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	req = lhd_dequeue(lh, lh->lh_run >= LHD_MAXRUN ? prev : NULL);
+	if (req != prev) {
+		lh->lh_run = 0;
+	}
+	lh->lh_cur = req;
+	if (req == NULL) {
+		return;
+	}
+	if (req->dr_done == 0) {
+		devstats_started(&lh->lh_dev.d_stats, req);
+	}
+
+	/*
+	 * Are we writing? If so, transfer the data to the on-card
+	 * buffer.
+	 */
+	if (req->dr_write) {
+		memcpy(lh->lh_buf, (char *)req->dr_data + req->dr_done,
+		       LHD_SECTSIZE);
+		membar_store_store();
+		statval |= LHD_ISWRITE;
+	}
+
+	/* Tell it what sector we want... */
+	lhd_wreg(lh, LHD_REG_SECT, LHD_REQSECT(req));
+
+	/* and start the operation. */
+	lhd_wreg(lh, LHD_REG_STAT, statval);
+}
+
+/*
+ * Record that an I/O has completed: finish off the sector, start the
+ * next one, and if the request is done (or failed) tell its owner.
  */
 static
 void
 lhd_iodone(struct lhd_softc *lh, int err)
 {
-	lh->lh_result = err;
-	V(lh->lh_done);
+	struct devreq *req, *finished;
+
+	spinlock_acquire(&lh->lh_lock);
+
+	req = lh->lh_cur;
+	if (req == NULL) {
+		/* Not ours (e.g. left over from before boot) */
+		spinlock_release(&lh->lh_lock);
+		return;
+	}
+
+	/*
+	 * Are we reading? If so, and if we succeeded, transfer the
+	 * data out of the on-card buffer.
+	 */
+	if (err == 0 && !req->dr_write) {
+		membar_load_load();
+		memcpy((char *)req->dr_data + req->dr_done, lh->lh_buf,
+		       LHD_SECTSIZE);
+	}
+
+	lh->lh_head = LHD_REQSECT(req) + 1;
+	lh->lh_nserved++;
+	lh->lh_run++;
+
+	finished = NULL;
+	if (err == 0) {
+		req->dr_done += LHD_SECTSIZE;
+	}
+	if (err != 0 || req->dr_done == req->dr_len) {
+		finished = req;
+		devstats_done(&lh->lh_dev.d_stats, req, err);
+	}
+	else {
+		lhd_enqueue(lh, req);
+	}
+	lhd_start(lh, req);
+
+	spinlock_release(&lh->lh_lock);
+
+	if (finished != NULL) {
+		finished->dr_callback(finished, err);
+	}
 }
 
 /*
@@ -179,8 +375,76 @@ lhd_reset(struct lhd_softc *lh)
 }
 #endif
 
+/*
+ * Start an asynchronous request.
+ */
+static
+int
+lhd_submit(struct device *d, struct devreq *req)
+{
+	struct lhd_softc *lh = d->d_data;
+	uint32_t len;
+
+	/* Don't allow I/O that isn't whole sectors. */
+	if (req->dr_len % LHD_SECTSIZE != 0) {
+		return EINVAL;
+	}
+	len = req->dr_len / LHD_SECTSIZE;
+
+	/* Don't allow I/O past the end of the disk. */
+	if (req->dr_block > lh->lh_dev.d_blocks ||
+	    len > lh->lh_dev.d_blocks - req->dr_block) {
+		return EINVAL;
+	}
+
+	req->dr_done = 0;
+	req->dr_next = NULL;
+
+	if (len == 0) {
+		req->dr_callback(req, 0);
+		return 0;
+	}
+
+	spinlock_acquire(&lh->lh_lock);
+	devstats_queued(&lh->lh_dev.d_stats, req);
+	lhd_enqueue(lh, req);
+	if (lh->lh_cur == NULL) {
+		lhd_start(lh, NULL);
+	}
+	spinlock_release(&lh->lh_lock);
+
+	return 0;
+}
+
+/*
+ * Synchronous I/O is an asynchronous request and a wait.
+ */
+struct lhd_sync {
+	struct devreq ls_req;
+	struct semaphore *ls_sem;
+	int ls_result;
+};
+
+static
+void
+lhd_syncdone(struct devreq *req, int result)
+{
+	struct lhd_sync *ls = req->dr_arg;
+
+	ls->ls_result = result;
+	V(ls->ls_sem);
+}
+
+/* Most we bounce through a kernel buffer at once */
+#define LHD_IOCHUNK     4096
+
 /*
  * I/O function (for both reads and writes)
+ *
+ * A kernel uio with one buffer (which is what the filesystem sends)
+ * is transferred directly. Anything else goes through lh_bounce,
+ * since the transfer happens in the interrupt handler; there's only
+ * the one, allocated at attach time, so such transfers take turns.
  */
 static
 int
@@ -192,8 +456,11 @@ lhd_io(struct device *d, struct uio *uio)
 	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
 	uint32_t len = uio->uio_resid / LHD_SECTSIZE;
 	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
-	uint32_t i;
-	uint32_t statval = LHD_WORKING;
+	struct lhd_sync ls;
+	struct iovec *iov;
+	bool direct;
+	size_t amt;
+	char *bounce;
 	int result;
 
 	/* Don't allow I/O that isn't sector-aligned. */
@@ -202,72 +469,85 @@ lhd_io(struct device *d, struct uio *uio)
 	}
 
 	/* Don't allow I/O past the end of the disk. */
-	/* XXX this check can overflow */
-	if (sector+len > lh->lh_dev.d_blocks) {
+	if (sector > lh->lh_dev.d_blocks ||
+	    len > lh->lh_dev.d_blocks - sector) {
 		return EINVAL;
 	}
 
-	/* Set up the value to write into the status register. */
-	if (uio->uio_rw==UIO_WRITE) {
-		statval |= LHD_ISWRITE;
+	if (len == 0) {
+		return 0;
+	}
+
+	direct = uio->uio_segflg == UIO_SYSSPACE && uio->uio_iovcnt == 1;
+	ls.ls_sem = sem_create("lhd-io", 0);
+	if (ls.ls_sem == NULL) {
+		return ENOMEM;
+	}
+	bounce = NULL;
+	if (!direct) {
+		lock_acquire(lh->lh_bouncelock);
+		bounce = lh->lh_bounce;
 	}
 
-	/* Loop over all the sectors we were asked to do. */
-	for (i=0; i<len; i++) {
+	result = 0;
+	while (uio->uio_resid > 0) {
+		iov = uio->uio_iov;
+		amt = direct ? uio->uio_resid : LHD_IOCHUNK;
+		if (amt > uio->uio_resid) {
+			amt = uio->uio_resid;
+		}
 
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
+		ls.ls_req.dr_write = uio->uio_rw == UIO_WRITE;
+		ls.ls_req.dr_block = uio->uio_offset / LHD_SECTSIZE;
+		ls.ls_req.dr_data = direct ? iov->iov_kbase : bounce;
+		ls.ls_req.dr_len = amt;
+		ls.ls_req.dr_callback = lhd_syncdone;
+		ls.ls_req.dr_arg = &ls;
 
-		/*
-		 * Are we writing? If so, transfer the data to the
-		 * on-card buffer.
-		 */
-		if (uio->uio_rw == UIO_WRITE) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
-			membar_store_store();
+		if (!direct && uio->uio_rw == UIO_WRITE) {
+			result = uiomove(bounce, amt, uio);
 			if (result) {
-				V(lh->lh_clear);
-				return result;
+				break;
 			}
 		}
 
-		/* Tell it what sector we want... */
-		lhd_wreg(lh, LHD_REG_SECT, sector+i);
-
-		/* and start the operation. */
-		lhd_wreg(lh, LHD_REG_STAT, statval);
-
-		/* Now wait until the interrupt handler tells us we're done. */
-		P(lh->lh_done);
-
-		/* Get the result value saved by the interrupt handler. */
-		result = lh->lh_result;
-
-		/*
-		 * Are we reading? If so, and if we succeeded,
-		 * transfer the data out of the on-card buffer.
-		 */
-		if (result==0 && uio->uio_rw==UIO_READ) {
-			membar_load_load();
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+		result = lhd_submit(d, &ls.ls_req);
+		if (result) {
+			break;
 		}
-
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
-
-		/* If we failed, return the error. */
+		P(ls.ls_sem);
+		result = ls.ls_result;
 		if (result) {
-			return result;
+			break;
+		}
+
+		if (direct) {
+			/* The data's already there; just update the uio */
+			iov->iov_kbase = (char *)iov->iov_kbase + amt;
+			iov->iov_len -= amt;
+			uio->uio_offset += amt;
+			uio->uio_resid -= amt;
+		}
+		else if (uio->uio_rw == UIO_READ) {
+			result = uiomove(bounce, amt, uio);
+			if (result) {
+				break;
+			}
 		}
 	}
 
-	return 0;
+	if (!direct) {
+		lock_release(lh->lh_bouncelock);
+	}
+	sem_destroy(ls.ls_sem);
+	return result;
 }
 
 static const struct device_ops lhd_devops = {
 	.devop_eachopen = lhd_eachopen,
 	.devop_io = lhd_io,
 	.devop_ioctl = lhd_ioctl,
+	.devop_submit = lhd_submit,
 };
 
 /*
@@ -284,18 +564,25 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	/* Get a pointer to the on-chip buffer. */
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
-	/* Create the semaphores. */
-	lh->lh_clear = sem_create("lhd-clear", 1);
-	if (lh->lh_clear == NULL) {
+	/* Get the buffer for transfers that can't go direct. */
+	lh->lh_bouncelock = lock_create(name);
+	if (lh->lh_bouncelock == NULL) {
 		return ENOMEM;
 	}
-	lh->lh_done = sem_create("lhd-done", 0);
-	if (lh->lh_done == NULL) {
-		sem_destroy(lh->lh_clear);
-		lh->lh_clear = NULL;
+	lh->lh_bounce = kmalloc(LHD_IOCHUNK);
+	if (lh->lh_bounce == NULL) {
+		lock_destroy(lh->lh_bouncelock);
 		return ENOMEM;
 	}
 
+	/* Set up the request queue. */
+	spinlock_init(&lh->lh_lock);
+	lh->lh_queue = NULL;
+	lh->lh_cur = NULL;
+	lh->lh_head = 0;
+	lh->lh_run = 0;
+	lh->lh_nserved = 0;
+
 	/* Set up the VFS device structure. */
 	lh->lh_dev.d_ops = &lhd_devops;
 	lh->lh_dev.d_blocks = bus_read_register(lh->lh_busdata, lh->lh_buspos,
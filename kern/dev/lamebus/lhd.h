@@ -30,6 +30,7 @@
 #ifndef _LAMEBUS_LHD_H_
 #define _LAMEBUS_LHD_H_
 
+#include <spinlock.h>
 #include <device.h>
 
 /*
@@ -51,9 +52,18 @@ struct lhd_softc {
 	 */
 
 	void *lh_buf;			/* Pointer to on-card I/O buffer */
-	int lh_result;			/* Result from I/O operation */
-	struct semaphore *lh_clear;	/* Synchronization */
-	struct semaphore *lh_done;
+
+	/* Kernel buffer for I/O that can't go direct (see lhd_io) */
+	struct lock *lh_bouncelock;	/* Protects lh_bounce */
+	char *lh_bounce;		/* LHD_IOCHUNK bytes */
+
+	/* Request queue (see lhd.c) */
+	struct spinlock lh_lock;	/* Protects the fields below */
+	struct devreq *lh_queue;	/* Waiting requests, by sector */
+	struct devreq *lh_cur;		/* Request the disk is working on */
+	uint32_t lh_head;		/* Sector after the last one done */
+	unsigned lh_run;		/* Sectors lh_cur has had in a row */
+	unsigned lh_nserved;		/* Sectors done, for aging */
 
 	struct device lh_dev;		/* VFS device structure */
 };
@@ -322,6 +322,8 @@ semfs_getdirentry(struct vnode *dirvn, struct uio *uio)
 		dent = semfs_direntryarray_get(semfs->semfs_dents, pos);
 		result = uiomove(dent->semd_name, strlen(dent->semd_name),
 				 uio);
+		/* the offset is the entry number, not a byte count */
+		uio->uio_offset = pos + 1;
 	}
 
 	lock_release(semfs->semfs_dirlock);
@@ -657,6 +659,7 @@ static const struct vnode_ops semfs_dirops = {
 	.vop_read = vopfail_uio_isdir,
 	.vop_readlink = vopfail_uio_isdir,
 	.vop_getdirentry = semfs_getdirentry,
+	.vop_getdirentries = vnode_getdirentries,
 	.vop_write = vopfail_uio_isdir,
 	.vop_ioctl = semfs_ioctl,
 	.vop_stat = semfs_dirstat,
@@ -665,6 +668,7 @@ static const struct vnode_ops semfs_dirops = {
 	.vop_fsync = semfs_fsync,
 	.vop_mmap = vopfail_mmap_isdir,
 	.vop_truncate = vopfail_truncate_isdir,
+	.vop_seekhole = vopfail_seekhole_isdir,
 	.vop_namefile = semfs_namefile,
 
 	.vop_creat = semfs_creat,
@@ -690,6 +694,7 @@ static const struct vnode_ops semfs_semops = {
 	.vop_read = semfs_read,
 	.vop_readlink = vopfail_uio_inval,
 	.vop_getdirentry = vopfail_uio_notdir,
+	.vop_getdirentries = vopfail_uio_notdir,
 	.vop_write = semfs_write,
 	.vop_ioctl = semfs_ioctl,
 	.vop_stat = semfs_semstat,
@@ -698,6 +703,7 @@ static const struct vnode_ops semfs_semops = {
 	.vop_fsync = semfs_fsync,
 	.vop_mmap = vopfail_mmap_perm,
 	.vop_truncate = semfs_truncate,
+	.vop_seekhole = vnode_seekhole_nohole,
 	.vop_namefile = vopfail_uio_notdir,
 
 	.vop_creat = vopfail_creat_notdir,
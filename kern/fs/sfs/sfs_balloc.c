@@ -31,61 +31,342 @@
  * SFS filesystem
  *
  * Block allocation.
+ *
+ * Allocation is by goal: callers say where they would like the block
+ * (usually just after the previous block of the same file, or after
+ * the inode) and get the first free block at or after that point.
+ * Writers that know they're about to add several blocks to a file
+ * can also reserve a contiguous extent up front with sfs_breserve;
+ * sfs_balloc_data then hands out the reserved blocks in order.
+ *
+ * The freemap is protected by sfs_freemaplock. Newly allocated
+ * blocks are cleared through the buffer cache after letting go of it.
+ *
+ * On a volume with a journal, freed blocks stay marked in use (and
+ * are noted in sfs_jfreed, also under sfs_freemaplock) until the
+ * next journal commit. Otherwise one could be handed out again and
+ * written to before the change that freed it is committed, and a
+ * crash in between would leave the old owner pointing at the new
+ * contents.
  */
 #include <types.h>
 #include <lib.h>
 #include <bitmap.h>
+#include <synch.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
+/* Size of free run to look for when reserving an extent */
+#define SFS_MINEXTENT  16
+
 /*
- * Zero out a disk block.
+ * Note that the freemap bit for BLOCK has changed, so the freemap
+ * block it's in needs writing. Call with sfs_freemaplock held.
+ */
+static
+void
+sfs_freemap_touch(struct sfs_fs *sfs, daddr_t block)
+{
+	unsigned fmblock = block / SFS_BITSPERBLOCK(SFS_FS_BLOCKSIZE(sfs));
+
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+
+	if (!bitmap_isset(sfs->sfs_freemapdirtymap, fmblock)) {
+		bitmap_mark(sfs->sfs_freemapdirtymap, fmblock);
+	}
+	sfs->sfs_freemapdirty = true;
+}
+
+/*
+ * Zero out a disk block. This only zeroes its buffer; the zeros
+ * reach the disk when (and if) the buffer gets written back. META
+ * says whether the block will hold metadata.
  */
 static
 int
-sfs_clearblock(struct sfs_fs *sfs, daddr_t block)
+sfs_clearblock(struct sfs_fs *sfs, daddr_t block, bool meta)
 {
-	/* static -> automatically initialized to zero */
-	static char zeros[SFS_BLOCKSIZE];
+	struct sfs_buf *buf;
+	int result;
 
-	return sfs_writeblock(sfs, block, zeros, SFS_BLOCKSIZE);
+	result = sfs_buf_get(sfs, block, &buf);
+	if (result) {
+		return result;
+	}
+	bzero(buf->b_data, SFS_FS_BLOCKSIZE(sfs));
+	if (meta) {
+		sfs_buf_markmeta(buf);
+	}
+	else {
+		sfs_buf_markdirty(buf);
+	}
+	sfs_buf_release(buf);
+	return 0;
 }
 
 /*
- * Allocate a block.
+ * Take a free block, as close after GOAL as possible, without
+ * clearing it.
  */
+static
 int
-sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock)
+sfs_bgrab(struct sfs_fs *sfs, daddr_t goal, daddr_t *diskblock)
 {
 	int result;
 
-	result = bitmap_alloc(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_freemaplock);
+	result = bitmap_alloc_near(sfs->sfs_freemap, goal, diskblock);
 	if (result) {
+		lock_release(sfs->sfs_freemaplock);
 		return result;
 	}
-	sfs->sfs_freemapdirty = true;
+	sfs_freemap_touch(sfs, *diskblock);
+	lock_release(sfs->sfs_freemaplock);
 
 	if (*diskblock >= sfs->sfs_sb.sb_nblocks) {
 		panic("sfs: %s: balloc: invalid block %u\n",
 		      sfs->sfs_sb.sb_volname, *diskblock);
 	}
+	return 0;
+}
+
+/*
+ * Allocate a metadata block (inode, indirect block, or directory
+ * index block), as close after GOAL as possible.
+ */
+int
+sfs_balloc(struct sfs_fs *sfs, daddr_t goal, daddr_t *diskblock)
+{
+	int result;
+
+	result = sfs_bgrab(sfs, goal, diskblock);
+	if (result) {
+		return result;
+	}
 
 	/* Clear block before returning it */
-	result = sfs_clearblock(sfs, *diskblock);
+	result = sfs_clearblock(sfs, *diskblock, true);
 	if (result) {
-		bitmap_unmark(sfs->sfs_freemap, *diskblock);
+		sfs_bfree(sfs, *diskblock);
 	}
 	return result;
 }
 
+/*
+ * Find the first run of at least MINRUN free blocks at or after
+ * GOAL, wrapping around. Returns 0 if there isn't one.
+ */
+static
+daddr_t
+sfs_findrun(struct sfs_fs *sfs, daddr_t goal, unsigned minrun)
+{
+	uint32_t nblocks = sfs->sfs_sb.sb_nblocks;
+	daddr_t block, runstart;
+	unsigned runlen;
+	uint32_t i;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+
+	runstart = 0;
+	runlen = 0;
+	for (i=0; i<nblocks; i++) {
+		block = (goal + i) % nblocks;
+		if (block == 0) {
+			/* runs don't wrap */
+			runlen = 0;
+		}
+		if (bitmap_isset(sfs->sfs_freemap, block)) {
+			runlen = 0;
+			continue;
+		}
+		if (runlen == 0) {
+			runstart = block;
+		}
+		if (++runlen >= minrun) {
+			return runstart;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Allocate a run of up to WANT contiguous blocks, starting as close
+ * after GOAL as possible, but passing over holes too small for
+ * SFS_MINEXTENT blocks (or WANT, if less). If there's no such room
+ * anywhere, take the first free block. Either way the run may come
+ * out shorter than asked for. The blocks are not cleared.
+ */
+static
+int
+sfs_balloc_extent(struct sfs_fs *sfs, daddr_t goal, unsigned want,
+		  daddr_t *start, unsigned *count)
+{
+	daddr_t block;
+	unsigned n;
+	int result;
+
+	KASSERT(want > 0);
+
+	if (goal >= sfs->sfs_sb.sb_nblocks) {
+		goal = 0;
+	}
+
+	lock_acquire(sfs->sfs_freemaplock);
+	block = sfs_findrun(sfs, goal,
+			    want < SFS_MINEXTENT ? want : SFS_MINEXTENT);
+	if (block != 0) {
+		bitmap_mark(sfs->sfs_freemap, block);
+	}
+	else {
+		result = bitmap_alloc_near(sfs->sfs_freemap, goal, &block);
+		if (result) {
+			lock_release(sfs->sfs_freemaplock);
+			return result;
+		}
+	}
+	sfs_freemap_touch(sfs, block);
+
+	for (n=1; n<want && block+n < sfs->sfs_sb.sb_nblocks; n++) {
+		if (bitmap_isset(sfs->sfs_freemap, block+n)) {
+			break;
+		}
+		bitmap_mark(sfs->sfs_freemap, block+n);
+		sfs_freemap_touch(sfs, block+n);
+	}
+	lock_release(sfs->sfs_freemaplock);
+
+	*start = block;
+	*count = n;
+	return 0;
+}
+
+/*
+ * Reserve a contiguous extent of up to COUNT blocks, starting near
+ * GOAL, for data blocks about to be added to SV. Anything left over
+ * must be given back with sfs_bunreserve.
+ */
+int
+sfs_breserve(struct sfs_vnode *sv, daddr_t goal, unsigned count)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+
+	KASSERT(sv->sv_resleft == 0);
+
+	return sfs_balloc_extent(sfs, goal, count,
+				 &sv->sv_resnext, &sv->sv_resleft);
+}
+
+/*
+ * Give back any blocks still reserved for SV.
+ */
+void
+sfs_bunreserve(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+
+	if (sv->sv_resleft == 0) {
+		return;
+	}
+	lock_acquire(sfs->sfs_freemaplock);
+	while (sv->sv_resleft > 0) {
+		bitmap_unmark(sfs->sfs_freemap, sv->sv_resnext);
+		sfs_freemap_touch(sfs, sv->sv_resnext);
+		sv->sv_resnext++;
+		sv->sv_resleft--;
+	}
+	lock_release(sfs->sfs_freemaplock);
+}
+
+/*
+ * Allocate a data block for SV: the next reserved block if there is
+ * one, otherwise one near GOAL.
+ *
+ * If DOCLEAR is false the block is handed back with whatever was on
+ * disk before. The caller must then overwrite all of it, or clear
+ * whatever it doesn't write, or the old contents will show up in the
+ * file.
+ */
+int
+sfs_balloc_data(struct sfs_vnode *sv, daddr_t goal, bool doclear,
+		daddr_t *diskblock)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	daddr_t block;
+	int result;
+
+	if (sv->sv_resleft > 0) {
+		block = sv->sv_resnext;
+	}
+	else {
+		result = sfs_bgrab(sfs, goal, &block);
+		if (result) {
+			return result;
+		}
+	}
+
+	if (doclear) {
+		result = sfs_clearblock(sfs, block, false);
+		if (result) {
+			if (sv->sv_resleft == 0) {
+				sfs_bfree(sfs, block);
+			}
+			return result;
+		}
+	}
+
+	if (sv->sv_resleft > 0) {
+		sv->sv_resnext++;
+		sv->sv_resleft--;
+	}
+	*diskblock = block;
+	return 0;
+}
+
 /*
  * Free a block.
  */
 void
 sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock)
 {
-	bitmap_unmark(sfs->sfs_freemap, diskblock);
-	sfs->sfs_freemapdirty = true;
+	/* Don't bother writing back whatever was cached for it */
+	sfs_buf_invalidate(sfs, diskblock);
+
+	lock_acquire(sfs->sfs_freemaplock);
+	if (SFS_JOURNALING(sfs)) {
+		/* Hold on to it until the next commit */
+		KASSERT(!bitmap_isset(sfs->sfs_jfreed, diskblock));
+		bitmap_mark(sfs->sfs_jfreed, diskblock);
+		sfs->sfs_njfreed++;
+		/* so the commit knows how much freemap it has to write */
+		sfs_freemap_touch(sfs, diskblock);
+	}
+	else {
+		bitmap_unmark(sfs->sfs_freemap, diskblock);
+		sfs_freemap_touch(sfs, diskblock);
+	}
+	lock_release(sfs->sfs_freemaplock);
+}
+
+/*
+ * Really free the blocks sfs_bfree has been holding on to. Called by
+ * the journal commit.
+ */
+void
+sfs_bfree_pending(struct sfs_fs *sfs)
+{
+	uint32_t i;
+
+	lock_acquire(sfs->sfs_freemaplock);
+	for (i=0; sfs->sfs_njfreed > 0 && i<sfs->sfs_sb.sb_nblocks; i++) {
+		if (bitmap_isset(sfs->sfs_jfreed, i)) {
+			bitmap_unmark(sfs->sfs_jfreed, i);
+			bitmap_unmark(sfs->sfs_freemap, i);
+			sfs_freemap_touch(sfs, i);
+			sfs->sfs_njfreed--;
+		}
+	}
+	KASSERT(sfs->sfs_njfreed == 0);
+	lock_release(sfs->sfs_freemaplock);
 }
 
 /*
@@ -94,10 +375,15 @@ sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock)
 int
 sfs_bused(struct sfs_fs *sfs, daddr_t diskblock)
 {
+	int ret;
+
 	if (diskblock >= sfs->sfs_sb.sb_nblocks) {
 		panic("sfs: %s: sfs_bused called on out of range block %u\n",
 		      sfs->sfs_sb.sb_volname, diskblock);
 	}
-	return bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_freemaplock);
+	ret = bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_release(sfs->sfs_freemaplock);
+	return ret;
 }
 
@@ -31,43 +31,197 @@
  * SFS filesystem
  *
  * Block mapping logic.
+ *
+ * Past the direct blocks, file blocks are mapped through three trees
+ * of indirect blocks: the single indirect block maps the next
+ * SFS_RANGE_I blocks, the double indirect block the SFS_RANGE_II
+ * after that, and the triple indirect block the SFS_RANGE_III after
+ * that. Each vnode remembers the last single indirect block it went
+ * through (sv_lastib) so runs of lookups in the same part of a file
+ * can skip walking down the tree.
+ *
+ * New blocks are placed right after the block mapped before them, if
+ * there is one, or else right after the block that points to them,
+ * so files tend to be laid out contiguously near their inodes.
  */
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <bitmap.h>
+#include <synch.h>
 #include <vfs.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
 /*
- * Look up the disk block number (from 0 up to the number of blocks on
- * the disk) given a file and the logical block number within that
- * file. If DOALLOC is set, and no such block exists, one will be
- * allocated.
+ * Get the entry INDEX of the indirect block IDBLOCK. If it's empty
+ * and DOALLOC is set, allocate a block and store it there; ISDATA
+ * says whether that's a data block or another indirect block, and
+ * DOCLEAR whether a new data block needs to be cleared.
  */
+static
 int
-sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
-	 daddr_t *diskblock)
+sfs_bmap_indirect(struct sfs_vnode *sv, daddr_t idblock, uint32_t index,
+		  bool doalloc, bool isdata, bool doclear, daddr_t *ret)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_buf *idbuf;
+	uint32_t *iddata;
+	daddr_t block;
+	int result;
+
+	/*
+	 * Load the indirect block. (If we just allocated it,
+	 * sfs_balloc left a zeroed copy in the buffer cache.)
+	 */
+	result = sfs_buf_read(sfs, idblock, &idbuf);
+	if (result) {
+		return result;
+	}
+	iddata = (uint32_t *)idbuf->b_data;
+
+	/* Get the block out of the indirect block */
+	block = iddata[index];
+
+	/* If there's no block there, allocate one */
+	if (block==0 && doalloc) {
+		daddr_t goal;
+
+		if (index > 0 && iddata[index-1] != 0) {
+			goal = iddata[index-1] + 1;
+		}
+		else {
+			goal = idblock + 1;
+		}
+		if (isdata) {
+			result = sfs_balloc_data(sv, goal, doclear, &block);
+		}
+		else {
+			result = sfs_balloc(sfs, goal, &block);
+		}
+		if (result) {
+			sfs_buf_release(idbuf);
+			return result;
+		}
+
+		/* Remember the block we allocated; the indirect block is dirty */
+		iddata[index] = block;
+		sfs_buf_markmeta(idbuf);
+	}
+	sfs_buf_release(idbuf);
+
+	*ret = block;
+	return 0;
+}
+
+/*
+ * Find the single indirect block that maps file block FILEBLOCK
+ * (which must be past the direct blocks), walking down whichever
+ * tree it's in. If DOALLOC is set, allocate any missing indirect
+ * blocks on the way; otherwise hand back 0 if one is missing.
+ */
+static
+int
+sfs_bmap_findleaf(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
+		  daddr_t *ret)
 {
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t *idptr;
+	uint32_t range;
+	daddr_t block;
+	int result;
+
+	KASSERT(fileblock >= SFS_NDIRECT);
+
 	/*
-	 * I/O buffer for handling indirect blocks.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
+	 * Figure out which tree it's in. Afterwards FILEBLOCK is the
+	 * offset within that tree and RANGE is the number of blocks
+	 * each entry of the tree's top block maps.
 	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
+	fileblock -= SFS_NDIRECT;
+	if (fileblock < SFS_RANGE_I(sfs)) {
+		idptr = &sv->sv_i.sfi_indirect;
+		range = 1;
+	}
+	else if (fileblock - SFS_RANGE_I(sfs) < SFS_RANGE_II(sfs)) {
+		fileblock -= SFS_RANGE_I(sfs);
+		idptr = &sv->sv_i.sfi_dindirect;
+		range = SFS_RANGE_I(sfs);
+	}
+	else if (fileblock - SFS_RANGE_I(sfs) - SFS_RANGE_II(sfs) <
+		 SFS_RANGE_III(sfs)) {
+		fileblock -= SFS_RANGE_I(sfs) + SFS_RANGE_II(sfs);
+		idptr = &sv->sv_i.sfi_tindirect;
+		range = SFS_RANGE_II(sfs);
+	}
+	else {
+		/* Off the end of the triple indirect block */
+		return EFBIG;
+	}
+
+	/* Get (or make) the top block of the tree */
+	block = *idptr;
+	if (block == 0) {
+		if (!doalloc) {
+			*ret = 0;
+			return 0;
+		}
+		result = sfs_balloc(sfs, SFS_INO_BLOCK(sv->sv_ino) + 1,
+				    &block);
+		if (result) {
+			return result;
+		}
+
+		/* Remember the block we just allocated; mark inode dirty */
+		*idptr = block;
+		sv->sv_dirty = true;
+	}
+
+	/* Go down until we get to a single indirect block */
+	while (range > 1) {
+		result = sfs_bmap_indirect(sv, block, fileblock / range,
+					   doalloc, false, true, &block);
+		if (result) {
+			return result;
+		}
+		if (block == 0) {
+			KASSERT(!doalloc);
+			*ret = 0;
+			return 0;
+		}
+		fileblock %= range;
+		range /= SFS_FS_DBPERIDB(sfs);
+	}
+
+	*ret = block;
+	return 0;
+}
 
+/*
+ * Look up the disk block number (from 0 up to the number of blocks on
+ * the disk) given a file and the logical block number within that
+ * file. If FLAGS includes SFS_BMAP_ALLOC, and no such block exists,
+ * one will be allocated. It is cleared first unless FLAGS also
+ * includes SFS_BMAP_NOCLEAR (see sfs_balloc_data).
+ */
+int
+sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int flags,
+	 daddr_t *diskblock)
+{
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	bool doalloc = (flags & SFS_BMAP_ALLOC) != 0;
+	bool doclear = (flags & SFS_BMAP_NOCLEAR) == 0;
 	daddr_t block;
 	daddr_t idblock;
-	uint32_t idnum, idoff;
+	uint32_t idbase;
 	int result;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	COMPILE_ASSERT(SFS_NINDIRECT == 1);
+	COMPILE_ASSERT(SFS_NDINDIRECT == 1);
+	COMPILE_ASSERT(SFS_NTINDIRECT == 1);
 
-	/* Since we're using a static buffer, we'd better be locked. */
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(!doalloc || !SFS_ISINLINE(sv));
 
 	/*
 	 * If the block we want is one of the direct blocks...
@@ -82,7 +236,15 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 		 * Do we need to allocate?
 		 */
 		if (block==0 && doalloc) {
-			result = sfs_balloc(sfs, &block);
+			daddr_t goal;
+
+			if (fileblock > 0 && sv->sv_i.sfi_direct[fileblock-1]) {
+				goal = sv->sv_i.sfi_direct[fileblock-1] + 1;
+			}
+			else {
+				goal = SFS_INO_BLOCK(sv->sv_ino) + 1;
+			}
+			result = sfs_balloc_data(sv, goal, doclear, &block);
 			if (result) {
 				return result;
 			}
@@ -105,95 +267,242 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 	}
 
 	/*
-	 * It's not a direct block; it must be in the indirect block.
-	 * Subtract off the number of direct blocks, so FILEBLOCK is
-	 * now the offset into the indirect block space.
+	 * It's not a direct block, so it's in some single indirect
+	 * block. Every tree starts SFS_NDIRECT blocks plus a multiple
+	 * of SFS_FS_DBPERIDB into the file, so this is the first block
+	 * the single indirect block maps.
 	 */
+	idbase = fileblock - (fileblock - SFS_NDIRECT) % SFS_FS_DBPERIDB(sfs);
 
-	fileblock -= SFS_NDIRECT;
+	if (sv->sv_lastib != 0 && sv->sv_lastibbase == idbase) {
+		/* Same one as last time */
+		idblock = sv->sv_lastib;
+	}
+	else {
+		result = sfs_bmap_findleaf(sv, fileblock, doalloc, &idblock);
+		if (result) {
+			return result;
+		}
+		if (idblock == 0) {
+			/*
+			 * There's no indirect block allocated. We weren't
+			 * asked to allocate anything, so pretend the
+			 * indirect block was filled with all zeros.
+			 */
+			*diskblock = 0;
+			return 0;
+		}
+		sv->sv_lastib = idblock;
+		sv->sv_lastibbase = idbase;
+	}
 
-	/* Get the indirect block number and offset w/i that indirect block */
-	idnum = fileblock / SFS_DBPERIDB;
-	idoff = fileblock % SFS_DBPERIDB;
+	result = sfs_bmap_indirect(sv, idblock, fileblock - idbase,
+				   doalloc, true, doclear, &block);
+	if (result) {
+		return result;
+	}
 
-	/*
-	 * We only have one indirect block. If the offset we were asked for
-	 * is too large, we can't handle it, so fail.
-	 */
-	if (idnum >= SFS_NINDIRECT) {
-		return EFBIG;
+	/* Hand back the result and return. */
+	if (block != 0 && !sfs_bused(sfs, block)) {
+		panic("sfs: %s: Data block %u (block %u of file %u) "
+		      "marked free\n", sfs->sfs_sb.sb_volname,
+		      block, fileblock, sv->sv_ino);
 	}
+	*diskblock = block;
+	return 0;
+}
 
-	/* Get the disk block number of the indirect block. */
-	idblock = sv->sv_i.sfi_indirect;
+/*
+ * Search the tree under the indirect block IDBLOCK for sfs_bmap_find.
+ * BASEBLOCK is the first file block the tree maps, and RANGE is how
+ * many blocks each of its entries maps. Starting from *FILEBLOCK,
+ * look for a hole (if HOLE is set) or a mapped block (if not). If one
+ * turns up, set *FOUND and leave *FILEBLOCK there; otherwise move
+ * *FILEBLOCK to the end of the tree. Missing subtrees are taken (or
+ * skipped) whole without reading anything.
+ */
+static
+int
+sfs_bmap_findindirect(struct sfs_fs *sfs, daddr_t idblock,
+		      uint32_t baseblock, uint32_t range, bool hole,
+		      uint32_t *fileblock, bool *found)
+{
+	struct sfs_buf *idbuf;
+	uint32_t *iddata;
+	uint32_t j, entrybase, treeend;
+	int result = 0;
 
-	if (idblock==0 && !doalloc) {
-		/*
-		 * There's no indirect block allocated. We weren't
-		 * asked to allocate anything, so pretend the indirect
-		 * block was filled with all zeros.
-		 */
-		*diskblock = 0;
+	treeend = baseblock + range * SFS_FS_DBPERIDB(sfs);
+	if (*fileblock >= treeend) {
 		return 0;
 	}
-	else if (idblock==0) {
-		/*
-		 * There's no indirect block allocated, but we need to
-		 * allocate a block whose number needs to be stored in
-		 * the indirect block. Thus, we need to allocate an
-		 * indirect block.
-		 */
-		result = sfs_balloc(sfs, &idblock);
-		if (result) {
-			return result;
-		}
-
-		/* Remember the block we just allocated */
-		sv->sv_i.sfi_indirect = idblock;
+	if (*fileblock < baseblock) {
+		*fileblock = baseblock;
+	}
 
-		/* Mark the inode dirty */
-		sv->sv_dirty = true;
+	if (idblock == 0) {
+		if (hole) {
+			*found = true;
+		}
+		else {
+			*fileblock = treeend;
+		}
+		return 0;
+	}
 
-		/* Clear the indirect block buffer */
-		bzero(idbuf, sizeof(idbuf));
+	result = sfs_buf_read(sfs, idblock, &idbuf);
+	if (result) {
+		return result;
 	}
-	else {
-		/*
-		 * We already have an indirect block allocated; load it.
-		 */
-		result = sfs_readblock(sfs, idblock, idbuf, sizeof(idbuf));
-		if (result) {
-			return result;
+	iddata = (uint32_t *)idbuf->b_data;
+
+	for (j = (*fileblock - baseblock) / range;
+	     j < SFS_FS_DBPERIDB(sfs) && !*found && result == 0; j++) {
+		entrybase = baseblock + j*range;
+		if (range > 1) {
+			result = sfs_bmap_findindirect(sfs, iddata[j],
+						       entrybase,
+						       range /
+						       SFS_FS_DBPERIDB(sfs),
+						       hole, fileblock, found);
+		}
+		else if ((iddata[j] == 0) == hole) {
+			*fileblock = entrybase;
+			*found = true;
+		}
+		else {
+			*fileblock = entrybase + 1;
 		}
 	}
 
-	/* Get the block out of the indirect block buffer */
-	block = idbuf[idoff];
+	sfs_buf_release(idbuf);
+	return result;
+}
 
-	/* If there's no block there, allocate one */
-	if (block==0 && doalloc) {
-		result = sfs_balloc(sfs, &block);
-		if (result) {
-			return result;
+/*
+ * Find the first block of the file at or after FILEBLOCK that is a
+ * hole (if HOLE is set) or has a disk block (if not), for SEEK_HOLE
+ * and SEEK_DATA. Hands back SFS_MAXFILEBLOCKS if there isn't one.
+ * This only looks at the block map; blocks waiting for allocation,
+ * and the contents of inline files, are up to the caller.
+ */
+int
+sfs_bmap_find(struct sfs_vnode *sv, uint32_t fileblock, bool hole,
+	      uint32_t *ret)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	bool found = false;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	for (; fileblock < SFS_NDIRECT; fileblock++) {
+		if ((sv->sv_i.sfi_direct[fileblock] == 0) == hole) {
+			*ret = fileblock;
+			return 0;
 		}
+	}
 
-		/* Remember the block we allocated */
-		idbuf[idoff] = block;
+	result = sfs_bmap_findindirect(sfs, sv->sv_i.sfi_indirect,
+				       SFS_NDIRECT, 1,
+				       hole, &fileblock, &found);
+	if (result == 0 && !found) {
+		result = sfs_bmap_findindirect(sfs, sv->sv_i.sfi_dindirect,
+					       SFS_NDIRECT + SFS_RANGE_I(sfs),
+					       SFS_RANGE_I(sfs),
+					       hole, &fileblock, &found);
+	}
+	if (result == 0 && !found) {
+		result = sfs_bmap_findindirect(sfs, sv->sv_i.sfi_tindirect,
+					       SFS_NDIRECT + SFS_RANGE_I(sfs) +
+					       SFS_RANGE_II(sfs),
+					       SFS_RANGE_II(sfs),
+					       hole, &fileblock, &found);
+	}
+	if (result) {
+		return result;
+	}
 
-		/* The indirect block is now dirty; write it back */
-		result = sfs_writeblock(sfs, idblock, idbuf, sizeof(idbuf));
-		if (result) {
-			return result;
+	*ret = found ? fileblock : SFS_MAXFILEBLOCKS(sfs);
+	return 0;
+}
+
+/*
+ * Truncate the tree under the indirect block *IDPTR to BLOCKLEN
+ * blocks. BASEBLOCK is the first file block the tree maps, and RANGE
+ * is how many blocks each of its entries maps. If the indirect block
+ * ends up empty, free it too; then *IDPTR is cleared and *DIRTYP set.
+ */
+static
+int
+sfs_itrunc_indirect(struct sfs_fs *sfs, uint32_t *idptr, uint32_t baseblock,
+		    uint32_t range, uint32_t blocklen, bool *dirtyp)
+{
+	struct sfs_buf *idbuf;
+	uint32_t *iddata;
+	uint32_t j, entrybase;
+	bool hasnonzero, iddirty;
+	int result;
+
+	if (*idptr == 0 ||
+	    blocklen >= baseblock + range * SFS_FS_DBPERIDB(sfs)) {
+		/* Nothing here, or all of it is before the new EOF */
+		return 0;
+	}
+
+	/* Read the indirect block */
+	result = sfs_buf_read(sfs, *idptr, &idbuf);
+	if (result) {
+		return result;
+	}
+	iddata = (uint32_t *)idbuf->b_data;
+
+	hasnonzero = false;
+	iddirty = false;
+	for (j=0; j<SFS_FS_DBPERIDB(sfs); j++) {
+		entrybase = baseblock + j*range;
+		if (iddata[j] == 0) {
+			continue;
+		}
+		if (range > 1) {
+			/* Recurse into the next level down */
+			result = sfs_itrunc_indirect(sfs, &iddata[j],
+						     entrybase,
+						     range /
+						     SFS_FS_DBPERIDB(sfs),
+						     blocklen, &iddirty);
+			if (result) {
+				break;
+			}
+		}
+		else if (entrybase >= blocklen) {
+			/* Discard blocks that are past the new EOF */
+			sfs_bfree(sfs, iddata[j]);
+			iddata[j] = 0;
+			iddirty = true;
+		}
+		/* Remember if we see any nonzero blocks in here */
+		if (iddata[j] != 0) {
+			hasnonzero = true;
 		}
 	}
 
-	/* Hand back the result and return. */
-	if (block != 0 && !sfs_bused(sfs, block)) {
-		panic("sfs: %s: Data block %u (block %u of file %u) "
-		      "marked free\n", sfs->sfs_sb.sb_volname,
-		      block, fileblock, sv->sv_ino);
+	if (iddirty) {
+		/* The indirect block is dirty */
+		sfs_buf_markmeta(idbuf);
+	}
+	sfs_buf_release(idbuf);
+
+	if (result) {
+		return result;
+	}
+
+	if (!hasnonzero) {
+		/* The whole indirect block is empty now; free it */
+		sfs_bfree(sfs, *idptr);
+		*idptr = 0;
+		*dirtyp = true;
 	}
-	*diskblock = block;
 	return 0;
 }
 
@@ -203,29 +512,44 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 int
 sfs_itrunc(struct sfs_vnode *sv, off_t len)
 {
-	/*
-	 * I/O buffer for handling the indirect block.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 
 	/* Length in blocks (divide rounding up) */
-	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
+	uint32_t blocklen = DIVROUNDUP(len, SFS_FS_BLOCKSIZE(sfs));
 
-	uint32_t i, j;
-	daddr_t block, idblock;
-	uint32_t baseblock, highblock;
+	char *inlinedata = (char *)sv->sv_i.sfi_waste;
+	uint32_t i;
+	daddr_t block;
 	int result;
-	int hasnonzero, iddirty;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	KASSERT(len <= SFS_MAXFILESIZE(sfs));
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
-	vfs_biglock_acquire();
+	/*
+	 * If the file is in the inode and still fits, just clear
+	 * what's cut off; if it's growing past that, move it out.
+	 */
+	if (SFS_ISINLINE(sv)) {
+		if (len <= SFS_FS_INLINEMAX(sfs)) {
+			if (len < sv->sv_i.sfi_size) {
+				bzero(inlinedata + len,
+				      sv->sv_i.sfi_size - len);
+			}
+			sv->sv_i.sfi_size = len;
+			sv->sv_dirty = true;
+			return 0;
+		}
+		result = sfs_inline_evict(sv);
+		if (result) {
+			return result;
+		}
+	}
+
+	/* Indirect blocks may go away; forget the one we remembered */
+	sv->sv_lastib = 0;
+
+	/* Blocks not allocated yet just get dropped */
+	sfs_da_truncate(sv, blocklen);
 
 	/*
 	 * Go through the direct blocks. Discard any that are
@@ -240,64 +564,158 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 		}
 	}
 
-	/* Indirect block number */
-	idblock = sv->sv_i.sfi_indirect;
+	/* Then the single, double, and triple indirect trees */
+	result = sfs_itrunc_indirect(sfs, &sv->sv_i.sfi_indirect,
+				     SFS_NDIRECT, 1,
+				     blocklen, &sv->sv_dirty);
+	if (result == 0) {
+		result = sfs_itrunc_indirect(sfs, &sv->sv_i.sfi_dindirect,
+					     SFS_NDIRECT + SFS_RANGE_I(sfs),
+					     SFS_RANGE_I(sfs),
+					     blocklen, &sv->sv_dirty);
+	}
+	if (result == 0) {
+		result = sfs_itrunc_indirect(sfs, &sv->sv_i.sfi_tindirect,
+					     SFS_NDIRECT + SFS_RANGE_I(sfs) +
+					     SFS_RANGE_II(sfs),
+					     SFS_RANGE_II(sfs),
+					     blocklen, &sv->sv_dirty);
+	}
+	if (result) {
+		return result;
+	}
+
+	/* Set the file size */
+	sv->sv_i.sfi_size = len;
+
+	/* An emptied file can go back to keeping its data in the inode */
+	if (len == 0 && sv->sv_i.sfi_type == SFS_TYPE_FILE) {
+		KASSERT(sv->sv_dacount == 0);
+		sv->sv_i.sfi_flags |= SFS_INODE_INLINE;
+	}
+
+	/* Mark the inode dirty */
+	sv->sv_dirty = true;
 
-	/* The lowest block in the indirect block */
-	baseblock = SFS_NDIRECT;
+	return 0;
+}
 
-	/* The highest block in the indirect block */
-	highblock = baseblock + SFS_DBPERIDB - 1;
+/*
+ * Write back one block of a file for fsync, if it's dirty and allowed
+ * to go, and remember which freemap block its bit is in.
+ */
+int
+sfs_bmap_syncblock(struct sfs_fs *sfs, daddr_t block,
+		   struct bitmap *fmblocks, bool *pinned)
+{
+	unsigned fmblock;
+	int result;
 
-	if (blocklen < highblock && idblock != 0) {
-		/* We're past the proposed EOF; may need to free stuff */
+	result = sfs_buf_flush(sfs, block);
+	if (result) {
+		return result;
+	}
+	if (sfs_buf_ispinned(sfs, block)) {
+		*pinned = true;
+	}
 
-		/* Read the indirect block */
-		result = sfs_readblock(sfs, idblock, idbuf, sizeof(idbuf));
-		if (result) {
-			vfs_biglock_release();
-			return result;
-		}
+	fmblock = block / SFS_BITSPERBLOCK(SFS_FS_BLOCKSIZE(sfs));
+	if (!bitmap_isset(fmblocks, fmblock)) {
+		bitmap_mark(fmblocks, fmblock);
+	}
+	return 0;
+}
 
-		hasnonzero = 0;
-		iddirty = 0;
-		for (j=0; j<SFS_DBPERIDB; j++) {
-			/* Discard any blocks that are past the new EOF */
-			if (blocklen < baseblock+j && idbuf[j] != 0) {
-				sfs_bfree(sfs, idbuf[j]);
-				idbuf[j] = 0;
-				iddirty = 1;
-			}
-			/* Remember if we see any nonzero blocks in here */
-			if (idbuf[j]!=0) {
-				hasnonzero=1;
-			}
-		}
+/*
+ * Write back the tree under the indirect block IDBLOCK, which has
+ * LEVELS more levels of indirect blocks below it: first the blocks
+ * it maps, then the indirect block itself, so it never points at
+ * anything that isn't on disk yet.
+ */
+static
+int
+sfs_bmap_syncindirect(struct sfs_fs *sfs, daddr_t idblock, unsigned levels,
+		      struct bitmap *fmblocks, bool *pinned)
+{
+	struct sfs_buf *idbuf;
+	uint32_t *iddata;
+	uint32_t j;
+	int result = 0;
 
-		if (!hasnonzero) {
-			/* The whole indirect block is empty now; free it */
-			sfs_bfree(sfs, idblock);
-			sv->sv_i.sfi_indirect = 0;
-			sv->sv_dirty = true;
+	if (idblock == 0) {
+		return 0;
+	}
+
+	result = sfs_buf_read(sfs, idblock, &idbuf);
+	if (result) {
+		return result;
+	}
+	iddata = (uint32_t *)idbuf->b_data;
+
+	for (j=0; j<SFS_FS_DBPERIDB(sfs) && result == 0; j++) {
+		if (iddata[j] == 0) {
+			continue;
 		}
-		else if (iddirty) {
-			/* The indirect block is dirty; write it back */
-			result = sfs_writeblock(sfs, idblock, idbuf,
-						sizeof(idbuf));
-			if (result) {
-				vfs_biglock_release();
-				return result;
-			}
+		if (levels > 0) {
+			result = sfs_bmap_syncindirect(sfs, iddata[j],
+						       levels - 1,
+						       fmblocks, pinned);
+		}
+		else {
+			result = sfs_bmap_syncblock(sfs, iddata[j],
+						    fmblocks, pinned);
 		}
 	}
+	sfs_buf_release(idbuf);
+	if (result) {
+		return result;
+	}
 
-	/* Set the file size */
-	sv->sv_i.sfi_size = len;
+	return sfs_bmap_syncblock(sfs, idblock, fmblocks, pinned);
+}
 
-	/* Mark the inode dirty */
-	sv->sv_dirty = true;
+/*
+ * Called for fsync(). Write back whatever of the file's own blocks,
+ * data and indirect, is dirty in the buffer cache, without touching
+ * anybody else's. Each block's freemap block is marked in FMBLOCKS
+ * (which has a bit per freemap block) so the caller can write back
+ * just those; *PINNED is set if some of the indirect blocks can only
+ * go to disk with a journal commit.
+ *
+ * Blocks still waiting for allocation aren't in the cache yet;
+ * sfs_sync_inode should be called first to give them their places.
+ */
+int
+sfs_bmap_sync(struct sfs_vnode *sv, struct bitmap *fmblocks, bool *pinned)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t i;
+	int result;
 
-	vfs_biglock_release();
-	return 0;
-}
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(sv->sv_dacount == 0);
 
+	for (i=0; i<SFS_NDIRECT; i++) {
+		if (sv->sv_i.sfi_direct[i] == 0) {
+			continue;
+		}
+		result = sfs_bmap_syncblock(sfs, sv->sv_i.sfi_direct[i],
+					    fmblocks, pinned);
+		if (result) {
+			return result;
+		}
+	}
+
+	result = sfs_bmap_syncindirect(sfs, sv->sv_i.sfi_indirect, 0,
+				       fmblocks, pinned);
+	if (result) {
+		return result;
+	}
+	result = sfs_bmap_syncindirect(sfs, sv->sv_i.sfi_dindirect, 1,
+				       fmblocks, pinned);
+	if (result) {
+		return result;
+	}
+	return sfs_bmap_syncindirect(sfs, sv->sv_i.sfi_tindirect, 2,
+				     fmblocks, pinned);
+}
@@ -0,0 +1,981 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009, 2014
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * SFS filesystem
+ *
+ * Buffer cache.
+ *
+ * Every block SFS reads or writes (file data, inodes, indirect
+ * blocks, directory blocks) goes through a per-volume cache of
+ * block-sized buffers. Buffers are found by hashing the block number
+ * and are kept on an LRU list; when the cache is full the least
+ * recently used buffer nobody is holding is recycled, being written
+ * back first if it's dirty. Dirty buffers are otherwise written back
+ * by sfs_buf_sync, which is called from sync; one block at a time by
+ * sfs_buf_flush, which fsync uses to write out just one file; and by
+ * the background flusher (sfs_flush.c) once they have been dirty for
+ * a while. If a writer gets too far ahead of the flusher, it is made to
+ * write some buffers back itself (sfs_buf_throttle).
+ *
+ * Buffers are never given back to kmalloc while the volume is
+ * mounted: one that's thrown away (sfs_buf_invalidate) goes on a
+ * free list and is used for the next block that isn't cached. With
+ * 2K or 4K blocks each buffer's data is a page of its own, and pages
+ * don't go back to the VM system, so freeing them would leak them.
+ *
+ * The superblock and the free block bitmap have their own in-memory
+ * copies in struct sfs_fs and do not use the cache.
+ *
+ * Buffers holding metadata (inodes, indirect blocks, directories and
+ * their indexes) are marked dirty with sfs_buf_markmeta instead of
+ * sfs_buf_markdirty. On a volume with a journal those may only reach
+ * their home locations through a journal commit, so they are skipped
+ * by eviction and write-back until sfs_journal.c takes them with
+ * sfs_buf_holdmeta and hands them back with sfs_buf_metadone.
+ *
+ * The cache structure is protected by sfs_buflock. The contents of a
+ * held buffer are protected by whoever holds it (see the locking
+ * notes in sfs.h).
+ *
+ * sfs_buflock is not held across disk I/O, so that misses and
+ * write-backs on different blocks can be in the device queue at the
+ * same time. Instead a buffer being read or written is marked b_busy
+ * and held by whoever is doing the I/O until it finishes; anyone who
+ * needs it to be idle waits on sfs_bufcv. A buffer being read in is
+ * not valid yet, so getting it waits for the read. A buffer being
+ * written back is marked clean before the write starts, so if it's
+ * changed in the meantime it just becomes dirty again and nothing is
+ * forgotten; but a second write of it has to wait for the first, so
+ * the older contents can't land on disk last.
+ *
+ * Read-ahead uses the same mechanism: it queues several reads with
+ * the device at once (sfs_buf_startread) and finishes each one with
+ * sfs_buf_readdone.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <vfs.h>
+#include <sfs.h>
+#include "sfsprivate.h"
+
+/* Number of hash chains. (Prime, to spread out the block numbers.) */
+#define SFS_BUFHASHSIZE  61
+
+/* Number of buffers to keep per volume. */
+#define SFS_MAXBUFS      128
+
+/*
+ * Writers are throttled when more than SFS_DIRTYHIGH buffers are
+ * dirty, until no more than SFS_DIRTYLOW are.
+ */
+#define SFS_DIRTYHIGH    (SFS_MAXBUFS * 3 / 4)
+#define SFS_DIRTYLOW     (SFS_MAXBUFS / 2)
+
+////////////////////////////////////////////////////////////
+//
+// Hash table and LRU list
+
+static
+unsigned
+sfs_buf_hash(daddr_t block)
+{
+	return block % SFS_BUFHASHSIZE;
+}
+
+/*
+ * Find a buffer in the hash table. Returns NULL if it isn't there.
+ */
+static
+struct sfs_buf *
+sfs_buf_lookup(struct sfs_fs *sfs, daddr_t block)
+{
+	struct sfs_buf *buf;
+
+	for (buf = sfs->sfs_bufhash[sfs_buf_hash(block)];
+	     buf != NULL;
+	     buf = buf->b_hashnext) {
+		if (buf->b_block == block) {
+			return buf;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+sfs_buf_hashinsert(struct sfs_fs *sfs, struct sfs_buf *buf)
+{
+	unsigned h = sfs_buf_hash(buf->b_block);
+
+	buf->b_hashnext = sfs->sfs_bufhash[h];
+	sfs->sfs_bufhash[h] = buf;
+}
+
+static
+void
+sfs_buf_hashremove(struct sfs_fs *sfs, struct sfs_buf *buf)
+{
+	struct sfs_buf **pp;
+
+	for (pp = &sfs->sfs_bufhash[sfs_buf_hash(buf->b_block)];
+	     *pp != NULL;
+	     pp = &(*pp)->b_hashnext) {
+		if (*pp == buf) {
+			*pp = buf->b_hashnext;
+			buf->b_hashnext = NULL;
+			return;
+		}
+	}
+	panic("sfs: %s: buffer for block %u not in hash table\n",
+	      sfs->sfs_sb.sb_volname, buf->b_block);
+}
+
+static
+void
+sfs_buf_lruremove(struct sfs_fs *sfs, struct sfs_buf *buf)
+{
+	if (buf->b_lruprev != NULL) {
+		buf->b_lruprev->b_lrunext = buf->b_lrunext;
+	}
+	else {
+		KASSERT(sfs->sfs_lruhead == buf);
+		sfs->sfs_lruhead = buf->b_lrunext;
+	}
+	if (buf->b_lrunext != NULL) {
+		buf->b_lrunext->b_lruprev = buf->b_lruprev;
+	}
+	else {
+		KASSERT(sfs->sfs_lrutail == buf);
+		sfs->sfs_lrutail = buf->b_lruprev;
+	}
+	buf->b_lrunext = buf->b_lruprev = NULL;
+}
+
+static
+void
+sfs_buf_lruinsert(struct sfs_fs *sfs, struct sfs_buf *buf)
+{
+	buf->b_lruprev = NULL;
+	buf->b_lrunext = sfs->sfs_lruhead;
+	if (sfs->sfs_lruhead != NULL) {
+		sfs->sfs_lruhead->b_lruprev = buf;
+	}
+	else {
+		sfs->sfs_lrutail = buf;
+	}
+	sfs->sfs_lruhead = buf;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Buffer management
+
+/*
+ * Check if a buffer must wait for a journal commit to be written.
+ */
+static
+bool
+sfs_buf_pinned(struct sfs_fs *sfs, struct sfs_buf *buf)
+{
+	return buf->b_dirty && buf->b_meta && SFS_JOURNALING(sfs);
+}
+
+/*
+ * Mark a buffer clean. Call with sfs_buflock held.
+ */
+static
+void
+sfs_buf_clean(struct sfs_fs *sfs, struct sfs_buf *buf)
+{
+	KASSERT(lock_do_i_hold(sfs->sfs_buflock));
+	KASSERT(buf->b_dirty);
+
+	buf->b_dirty = false;
+	buf->b_inodes = 0;
+	KASSERT(sfs->sfs_ndirty > 0);
+	sfs->sfs_ndirty--;
+	if (buf->b_meta) {
+		buf->b_meta = false;
+		KASSERT(sfs->sfs_nmeta > 0);
+		sfs->sfs_nmeta--;
+	}
+}
+
+/*
+ * Write a buffer back to disk if it's dirty (and not waiting for a
+ * journal commit). Call with sfs_buflock held; it's released while
+ * the write is in progress, but the buffer is held so it stays put.
+ */
+static
+int
+sfs_buf_writeout(struct sfs_fs *sfs, struct sfs_buf *buf)
+{
+	unsigned dirtytime;
+	uint32_t inodes;
+	bool meta;
+	int result;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_buflock));
+
+	buf->b_refcount++;
+	while (buf->b_busy) {
+		cv_wait(sfs->sfs_bufcv, sfs->sfs_buflock);
+	}
+
+	result = 0;
+	if (buf->b_dirty && !sfs_buf_pinned(sfs, buf)) {
+		KASSERT(buf->b_valid);
+		dirtytime = buf->b_dirtytime;
+		inodes = buf->b_inodes;
+		meta = buf->b_meta;
+		sfs_buf_clean(sfs, buf);
+		buf->b_busy = true;
+		lock_release(sfs->sfs_buflock);
+
+		result = sfs_writeblock(sfs, buf->b_block, buf->b_data,
+					SFS_FS_BLOCKSIZE(sfs));
+
+		lock_acquire(sfs->sfs_buflock);
+		buf->b_busy = false;
+		if (result) {
+			/* Still needs writing */
+			if (!buf->b_dirty) {
+				buf->b_dirty = true;
+				buf->b_dirtytime = dirtytime;
+				sfs->sfs_ndirty++;
+			}
+			if (meta && !buf->b_meta) {
+				buf->b_meta = true;
+				sfs->sfs_nmeta++;
+			}
+			buf->b_inodes |= inodes;
+		}
+		cv_broadcast(sfs->sfs_bufcv, sfs->sfs_buflock);
+	}
+
+	buf->b_refcount--;
+	return result;
+}
+
+/*
+ * Find the least recently used buffer nobody's holding. Returns NULL
+ * if every buffer is in use.
+ */
+static
+struct sfs_buf *
+sfs_buf_victim(struct sfs_fs *sfs)
+{
+	struct sfs_buf *buf;
+
+	for (buf = sfs->sfs_lrutail; buf != NULL; buf = buf->b_lruprev) {
+		if (buf->b_refcount == 0 && !sfs_buf_pinned(sfs, buf)) {
+			KASSERT(!buf->b_busy);
+			return buf;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Find or make the buffer for a disk block, and hold it. Call with
+ * sfs_buflock held.
+ */
+static
+int
+sfs_buf_doget(struct sfs_fs *sfs, daddr_t block, struct sfs_buf **ret)
+{
+	struct sfs_buf *buf;
+	int result;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_buflock));
+
+ again:
+	buf = sfs_buf_lookup(sfs, block);
+	if (buf != NULL) {
+		/* Cache hit; move it to the front of the LRU list */
+		sfs_buf_lruremove(sfs, buf);
+		sfs_buf_lruinsert(sfs, buf);
+		buf->b_refcount++;
+		/* If it's still being read in, wait for that */
+		while (buf->b_busy && !buf->b_valid) {
+			cv_wait(sfs->sfs_bufcv, sfs->sfs_buflock);
+		}
+		*ret = buf;
+		return 0;
+	}
+
+	buf = NULL;
+	if (sfs->sfs_nbufs >= SFS_MAXBUFS) {
+		buf = sfs_buf_victim(sfs);
+		if (buf != NULL && buf->b_dirty) {
+			/*
+			 * Write it back first. That lets go of
+			 * sfs_buflock, so someone else may have
+			 * reused it, or brought in our block, by
+			 * the time it's done; start over.
+			 */
+			result = sfs_buf_writeout(sfs, buf);
+			if (result) {
+				return result;
+			}
+			goto again;
+		}
+		if (buf != NULL) {
+			sfs_buf_hashremove(sfs, buf);
+			sfs_buf_lruremove(sfs, buf);
+		}
+	}
+	if (buf == NULL && sfs->sfs_buffree != NULL) {
+		buf = sfs->sfs_buffree;
+		sfs->sfs_buffree = buf->b_lrunext;
+		sfs->sfs_nbufs++;
+	}
+	if (buf == NULL) {
+		/*
+		 * Either the cache isn't full yet, or every buffer in
+		 * it is held (or waiting for a journal commit). In the
+		 * latter case we go over the limit rather than fail;
+		 * the extra buffer gets recycled like the others later.
+		 */
+		buf = kmalloc(sizeof(struct sfs_buf));
+		if (buf == NULL) {
+			return ENOMEM;
+		}
+		buf->b_data = kmalloc(SFS_FS_BLOCKSIZE(sfs));
+		if (buf->b_data == NULL) {
+			kfree(buf);
+			return ENOMEM;
+		}
+		sfs->sfs_nbufs++;
+	}
+
+	buf->b_fs = sfs;
+	buf->b_block = block;
+	buf->b_valid = false;
+	buf->b_dirty = false;
+	buf->b_meta = false;
+	buf->b_busy = false;
+	buf->b_inodes = 0;
+	buf->b_refcount = 1;
+	sfs_buf_hashinsert(sfs, buf);
+	sfs_buf_lruinsert(sfs, buf);
+
+	*ret = buf;
+	return 0;
+}
+
+/*
+ * Read a held buffer in from disk if it isn't valid. Call with
+ * sfs_buflock held; it's released while the read is in progress.
+ * On failure the buffer is let go of.
+ */
+static
+int
+sfs_buf_fill(struct sfs_fs *sfs, struct sfs_buf *buf)
+{
+	int result;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_buflock));
+	KASSERT(buf->b_refcount > 0);
+
+	while (buf->b_busy) {
+		cv_wait(sfs->sfs_bufcv, sfs->sfs_buflock);
+	}
+	if (!buf->b_valid) {
+		buf->b_busy = true;
+		lock_release(sfs->sfs_buflock);
+
+		result = sfs_readblock(sfs, buf->b_block, buf->b_data,
+				       SFS_FS_BLOCKSIZE(sfs));
+
+		lock_acquire(sfs->sfs_buflock);
+		buf->b_busy = false;
+		cv_broadcast(sfs->sfs_bufcv, sfs->sfs_buflock);
+		if (result) {
+			buf->b_refcount--;
+			return result;
+		}
+		buf->b_valid = true;
+	}
+	return 0;
+}
+
+/*
+ * Get the buffer for a disk block, without reading it. If the block
+ * was not already cached, b_valid is false and the caller is expected
+ * to fill in all of b_data and call sfs_buf_markdirty.
+ *
+ * The buffer is held (and so cannot be recycled) until the caller
+ * calls sfs_buf_release.
+ */
+int
+sfs_buf_get(struct sfs_fs *sfs, daddr_t block, struct sfs_buf **ret)
+{
+	int result;
+
+	lock_acquire(sfs->sfs_buflock);
+	result = sfs_buf_doget(sfs, block, ret);
+	lock_release(sfs->sfs_buflock);
+	return result;
+}
+
+/*
+ * Get the buffer for a disk block, reading it in if necessary.
+ */
+int
+sfs_buf_read(struct sfs_fs *sfs, daddr_t block, struct sfs_buf **ret)
+{
+	struct sfs_buf *buf;
+	int result;
+
+	lock_acquire(sfs->sfs_buflock);
+	result = sfs_buf_doget(sfs, block, &buf);
+	if (result == 0) {
+		result = sfs_buf_fill(sfs, buf);
+	}
+	lock_release(sfs->sfs_buflock);
+	if (result) {
+		return result;
+	}
+
+	*ret = buf;
+	return 0;
+}
+
+/*
+ * Note that the contents of a held buffer have been changed.
+ */
+void
+sfs_buf_markdirty(struct sfs_buf *buf)
+{
+	struct sfs_fs *sfs = buf->b_fs;
+
+	lock_acquire(sfs->sfs_buflock);
+	KASSERT(buf->b_refcount > 0);
+	buf->b_valid = true;
+	if (!buf->b_dirty) {
+		buf->b_dirty = true;
+		buf->b_dirtytime = sfs_flushclock;
+		sfs->sfs_ndirty++;
+	}
+	lock_release(sfs->sfs_buflock);
+}
+
+/*
+ * Same as sfs_buf_markdirty, for a buffer holding metadata.
+ */
+void
+sfs_buf_markmeta(struct sfs_buf *buf)
+{
+	struct sfs_fs *sfs = buf->b_fs;
+
+	lock_acquire(sfs->sfs_buflock);
+	KASSERT(buf->b_refcount > 0);
+	buf->b_valid = true;
+	if (!buf->b_dirty) {
+		buf->b_dirty = true;
+		buf->b_dirtytime = sfs_flushclock;
+		sfs->sfs_ndirty++;
+	}
+	if (!buf->b_meta) {
+		buf->b_meta = true;
+		sfs->sfs_nmeta++;
+	}
+	lock_release(sfs->sfs_buflock);
+}
+
+/*
+ * Same as sfs_buf_markmeta, for an inode block, noting which inode
+ * in it changed so sfs_buf_inodepinned can tell them apart.
+ */
+void
+sfs_buf_markinode(struct sfs_buf *buf, unsigned slot)
+{
+	struct sfs_fs *sfs = buf->b_fs;
+
+	COMPILE_ASSERT(SFS_MAXBLOCKSIZE / SFS_MININODESIZE <= 32);
+	KASSERT(slot < SFS_FS_INOPERBLOCK(sfs));
+
+	sfs_buf_markmeta(buf);
+	lock_acquire(sfs->sfs_buflock);
+	buf->b_inodes |= (uint32_t)1 << slot;
+	lock_release(sfs->sfs_buflock);
+}
+
+/*
+ * Let go of a buffer from sfs_buf_get or sfs_buf_read.
+ */
+void
+sfs_buf_release(struct sfs_buf *buf)
+{
+	struct sfs_fs *sfs = buf->b_fs;
+
+	lock_acquire(sfs->sfs_buflock);
+	KASSERT(buf->b_refcount > 0);
+	buf->b_refcount--;
+	lock_release(sfs->sfs_buflock);
+}
+
+/*
+ * Throw away any cached copy of a block; called when the block is
+ * freed, so there's no point writing it back.
+ */
+void
+sfs_buf_invalidate(struct sfs_fs *sfs, daddr_t block)
+{
+	struct sfs_buf *buf;
+
+	lock_acquire(sfs->sfs_buflock);
+	buf = sfs_buf_lookup(sfs, block);
+	while (buf != NULL && buf->b_busy) {
+		/* let the read finish, or it'll mark the buffer valid */
+		cv_wait(sfs->sfs_bufcv, sfs->sfs_buflock);
+		buf = sfs_buf_lookup(sfs, block);
+	}
+	if (buf == NULL) {
+		lock_release(sfs->sfs_buflock);
+		return;
+	}
+	if (buf->b_dirty) {
+		sfs_buf_clean(sfs, buf);
+	}
+	if (buf->b_refcount > 0) {
+		/* Someone's still looking at it; just forget the contents */
+		buf->b_valid = false;
+		lock_release(sfs->sfs_buflock);
+		return;
+	}
+	sfs_buf_hashremove(sfs, buf);
+	sfs_buf_lruremove(sfs, buf);
+	buf->b_lrunext = sfs->sfs_buffree;
+	sfs->sfs_buffree = buf;
+	sfs->sfs_nbufs--;
+	lock_release(sfs->sfs_buflock);
+}
+
+/*
+ * Read a block into the cache, if it isn't there already, without
+ * keeping hold of it. This is for read-ahead.
+ */
+int
+sfs_buf_prefetch(struct sfs_fs *sfs, daddr_t block)
+{
+	struct sfs_buf *buf;
+	int result;
+
+	lock_acquire(sfs->sfs_buflock);
+	if (sfs_buf_lookup(sfs, block) != NULL) {
+		lock_release(sfs->sfs_buflock);
+		return 0;
+	}
+	result = sfs_buf_doget(sfs, block, &buf);
+	if (result == 0) {
+		result = sfs_buf_fill(sfs, buf);
+	}
+	if (result == 0) {
+		buf->b_refcount--;
+	}
+	lock_release(sfs->sfs_buflock);
+	return result;
+}
+
+/*
+ * Set up to read a block into the cache asynchronously, for
+ * read-ahead. If the block isn't cached, hands back a held buffer
+ * marked busy, whose b_data the caller arranges to have read into,
+ * and then calls sfs_buf_readdone. If it's already cached, or there's
+ * no buffer to be had, hands back NULL.
+ */
+void
+sfs_buf_startread(struct sfs_fs *sfs, daddr_t block, struct sfs_buf **ret)
+{
+	struct sfs_buf *buf;
+
+	*ret = NULL;
+	lock_acquire(sfs->sfs_buflock);
+	if (sfs_buf_lookup(sfs, block) == NULL &&
+	    sfs_buf_doget(sfs, block, &buf) == 0) {
+		/*
+		 * sfs_buf_doget may have had to let go of the lock to
+		 * make room, so the block might have turned up in the
+		 * meantime; if so, leave it alone.
+		 */
+		if (buf->b_valid || buf->b_refcount > 1) {
+			buf->b_refcount--;
+		}
+		else {
+			buf->b_busy = true;
+			*ret = buf;
+		}
+	}
+	lock_release(sfs->sfs_buflock);
+}
+
+/*
+ * Finish a read started by sfs_buf_startread. RESULT is the outcome;
+ * on failure the buffer stays invalid and will be read again by
+ * whoever next wants it.
+ */
+void
+sfs_buf_readdone(struct sfs_buf *buf, int result)
+{
+	struct sfs_fs *sfs = buf->b_fs;
+
+	lock_acquire(sfs->sfs_buflock);
+	KASSERT(buf->b_busy);
+	KASSERT(buf->b_refcount > 0);
+	if (result == 0) {
+		buf->b_valid = true;
+	}
+	buf->b_busy = false;
+	buf->b_refcount--;
+	cv_broadcast(sfs->sfs_bufcv, sfs->sfs_buflock);
+	lock_release(sfs->sfs_buflock);
+}
+
+/*
+ * Write back up to MAX buffers that have been dirty for at least AGE
+ * ticks of sfs_flushclock, in increasing block order so the disk sees
+ * them as one sweep. Call with sfs_buflock held. (It's let go of
+ * during each write, which is why the list is scanned afresh each
+ * time around.)
+ */
+static
+int
+sfs_buf_dowriteback(struct sfs_fs *sfs, unsigned age, unsigned max)
+{
+	struct sfs_buf *buf, *next;
+	daddr_t last;
+	bool any;
+	unsigned done;
+	int result;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_buflock));
+
+	/* Each time around, write the lowest dirty block above LAST. */
+	last = 0;
+	any = false;
+	for (done = 0; done < max; done++) {
+		next = NULL;
+		for (buf = sfs->sfs_lruhead; buf != NULL;
+		     buf = buf->b_lrunext) {
+			if (!buf->b_dirty || (any && buf->b_block <= last)) {
+				continue;
+			}
+			if (sfs_buf_pinned(sfs, buf)) {
+				continue;
+			}
+			if (sfs_flushclock - buf->b_dirtytime < age) {
+				continue;
+			}
+			if (next == NULL || buf->b_block < next->b_block) {
+				next = buf;
+			}
+		}
+		if (next == NULL) {
+			break;
+		}
+		last = next->b_block;
+		result = sfs_buf_writeout(sfs, next);
+		if (result) {
+			return result;
+		}
+		any = true;
+	}
+	return 0;
+}
+
+/*
+ * Write back up to MAX buffers that have been dirty for AGE ticks.
+ */
+int
+sfs_buf_writeback(struct sfs_fs *sfs, unsigned age, unsigned max)
+{
+	int result;
+
+	lock_acquire(sfs->sfs_buflock);
+	result = sfs_buf_dowriteback(sfs, age, max);
+	lock_release(sfs->sfs_buflock);
+	return result;
+}
+
+/*
+ * Wait until any writes someone else started have finished. Call with
+ * sfs_buflock held.
+ */
+static
+void
+sfs_buf_waitwrites(struct sfs_fs *sfs)
+{
+	struct sfs_buf *buf;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_buflock));
+
+ again:
+	for (buf = sfs->sfs_lruhead; buf != NULL; buf = buf->b_lrunext) {
+		if (buf->b_busy && buf->b_valid) {
+			buf->b_refcount++;
+			while (buf->b_busy) {
+				cv_wait(sfs->sfs_bufcv, sfs->sfs_buflock);
+			}
+			buf->b_refcount--;
+			goto again;
+		}
+	}
+}
+
+/*
+ * Write back all dirty buffers, except metadata waiting for a journal
+ * commit.
+ */
+int
+sfs_buf_sync(struct sfs_fs *sfs)
+{
+	int result;
+
+	lock_acquire(sfs->sfs_buflock);
+	result = sfs_buf_dowriteback(sfs, 0, sfs->sfs_nbufs);
+	if (result == 0) {
+		sfs_buf_waitwrites(sfs);
+	}
+	lock_release(sfs->sfs_buflock);
+	return result;
+}
+
+/*
+ * Called before writing to a file. If too much is dirty, make the
+ * writer wait for some of it to go to disk rather than let it run
+ * further ahead of the flusher.
+ */
+int
+sfs_buf_throttle(struct sfs_fs *sfs)
+{
+	int result = 0;
+
+	lock_acquire(sfs->sfs_buflock);
+	if (sfs->sfs_ndirty > SFS_DIRTYHIGH) {
+		result = sfs_buf_dowriteback(sfs, 0,
+					     sfs->sfs_ndirty - SFS_DIRTYLOW);
+	}
+	lock_release(sfs->sfs_buflock);
+	return result;
+}
+
+/*
+ * Write back the cached copy of BLOCK now, if there is one and it's
+ * dirty.
+ */
+int
+sfs_buf_flush(struct sfs_fs *sfs, daddr_t block)
+{
+	struct sfs_buf *buf;
+	int result = 0;
+
+	lock_acquire(sfs->sfs_buflock);
+	buf = sfs_buf_lookup(sfs, block);
+	if (buf != NULL && !sfs_buf_pinned(sfs, buf)) {
+		result = sfs_buf_writeout(sfs, buf);
+	}
+	lock_release(sfs->sfs_buflock);
+	return result;
+}
+
+/*
+ * Check if the cached copy of BLOCK, if there is one, is dirty
+ * metadata that can only go to disk with the next journal commit.
+ */
+bool
+sfs_buf_ispinned(struct sfs_fs *sfs, daddr_t block)
+{
+	struct sfs_buf *buf;
+	bool ret;
+
+	lock_acquire(sfs->sfs_buflock);
+	buf = sfs_buf_lookup(sfs, block);
+	ret = buf != NULL && sfs_buf_pinned(sfs, buf);
+	lock_release(sfs->sfs_buflock);
+	return ret;
+}
+
+/*
+ * Same as sfs_buf_ispinned, for the inode in slot SLOT of inode block
+ * BLOCK: it only counts if that inode is one of the ones changed.
+ */
+bool
+sfs_buf_inodepinned(struct sfs_fs *sfs, daddr_t block, unsigned slot)
+{
+	struct sfs_buf *buf;
+	bool ret;
+
+	lock_acquire(sfs->sfs_buflock);
+	buf = sfs_buf_lookup(sfs, block);
+	ret = buf != NULL && sfs_buf_pinned(sfs, buf) &&
+		(buf->b_inodes & ((uint32_t)1 << slot)) != 0;
+	lock_release(sfs->sfs_buflock);
+	return ret;
+}
+
+/*
+ * Hold all the dirty metadata buffers, for a journal commit. Hands
+ * back a kmalloc'd array of them in increasing block order, or NULL
+ * if there aren't any.
+ */
+int
+sfs_buf_holdmeta(struct sfs_fs *sfs, struct sfs_buf ***ret, unsigned *count)
+{
+	struct sfs_buf **bufs, *buf;
+	unsigned num, i;
+
+	lock_acquire(sfs->sfs_buflock);
+	if (sfs->sfs_nmeta == 0) {
+		lock_release(sfs->sfs_buflock);
+		*ret = NULL;
+		*count = 0;
+		return 0;
+	}
+	bufs = kmalloc(sfs->sfs_nmeta * sizeof(struct sfs_buf *));
+	if (bufs == NULL) {
+		lock_release(sfs->sfs_buflock);
+		return ENOMEM;
+	}
+
+	num = 0;
+	for (buf = sfs->sfs_lruhead; buf != NULL; buf = buf->b_lrunext) {
+		if (!buf->b_dirty || !buf->b_meta) {
+			continue;
+		}
+		KASSERT(num < sfs->sfs_nmeta);
+		buf->b_refcount++;
+		/* insertion sort; there aren't many */
+		for (i = num; i > 0 && bufs[i-1]->b_block > buf->b_block; i--) {
+			bufs[i] = bufs[i-1];
+		}
+		bufs[i] = buf;
+		num++;
+	}
+	KASSERT(num == sfs->sfs_nmeta);
+	lock_release(sfs->sfs_buflock);
+
+	*ret = bufs;
+	*count = num;
+	return 0;
+}
+
+/*
+ * Called by the journal code once a buffer from sfs_buf_holdmeta has
+ * been written home; marks it clean and lets go of it.
+ */
+void
+sfs_buf_metadone(struct sfs_buf *buf)
+{
+	struct sfs_fs *sfs = buf->b_fs;
+
+	lock_acquire(sfs->sfs_buflock);
+	KASSERT(buf->b_refcount > 0);
+	if (buf->b_dirty) {
+		sfs_buf_clean(sfs, buf);
+	}
+	buf->b_refcount--;
+	lock_release(sfs->sfs_buflock);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Setup and teardown
+
+/*
+ * Set up an empty cache for a volume.
+ */
+int
+sfs_bufcache_init(struct sfs_fs *sfs)
+{
+	unsigned i;
+
+	sfs->sfs_buflock = lock_create("sfs_buflock");
+	if (sfs->sfs_buflock == NULL) {
+		return ENOMEM;
+	}
+	sfs->sfs_bufcv = cv_create("sfs_bufcv");
+	if (sfs->sfs_bufcv == NULL) {
+		lock_destroy(sfs->sfs_buflock);
+		return ENOMEM;
+	}
+	sfs->sfs_bufhash = kmalloc(SFS_BUFHASHSIZE * sizeof(struct sfs_buf *));
+	if (sfs->sfs_bufhash == NULL) {
+		cv_destroy(sfs->sfs_bufcv);
+		lock_destroy(sfs->sfs_buflock);
+		return ENOMEM;
+	}
+	for (i=0; i<SFS_BUFHASHSIZE; i++) {
+		sfs->sfs_bufhash[i] = NULL;
+	}
+	sfs->sfs_lruhead = NULL;
+	sfs->sfs_lrutail = NULL;
+	sfs->sfs_nbufs = 0;
+	sfs->sfs_buffree = NULL;
+	sfs->sfs_ndirty = 0;
+	sfs->sfs_nmeta = 0;
+	return 0;
+}
+
+/*
+ * Free all the buffers. The cache must already have been synced.
+ */
+void
+sfs_bufcache_cleanup(struct sfs_fs *sfs)
+{
+	struct sfs_buf *buf;
+
+	while (sfs->sfs_lruhead != NULL) {
+		buf = sfs->sfs_lruhead;
+		KASSERT(buf->b_refcount == 0);
+		KASSERT(buf->b_dirty == false);
+		KASSERT(buf->b_busy == false);
+		sfs_buf_lruremove(sfs, buf);
+		kfree(buf->b_data);
+		kfree(buf);
+		sfs->sfs_nbufs--;
+	}
+	while (sfs->sfs_buffree != NULL) {
+		buf = sfs->sfs_buffree;
+		sfs->sfs_buffree = buf->b_lrunext;
+		kfree(buf->b_data);
+		kfree(buf);
+	}
+	KASSERT(sfs->sfs_nbufs == 0);
+	KASSERT(sfs->sfs_ndirty == 0);
+	KASSERT(sfs->sfs_nmeta == 0);
+	kfree(sfs->sfs_bufhash);
+	sfs->sfs_bufhash = NULL;
+	cv_destroy(sfs->sfs_bufcv);
+	lock_destroy(sfs->sfs_buflock);
+}
@@ -34,8 +34,13 @@
  */
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/dirent.h>
+#include <stat.h>
 #include <lib.h>
+#include <synch.h>
+#include <uio.h>
 #include <vfs.h>
+#include <vnode.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
@@ -95,22 +100,525 @@ sfs_dir_nentries(struct sfs_vnode *sv)
 	return size / sizeof(struct sfs_direntry);
 }
 
+////////////////////////////////////////////////////////////
+//
+// Directory index (see kern/sfs.h)
+
+/*
+ * Hash a name: 32-bit FNV-1a.
+ */
+static
+uint32_t
+sfs_dirhash_name(const char *name)
+{
+	uint32_t h = 2166136261U;
+
+	while (*name) {
+		h ^= (unsigned char)*name++;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+/*
+ * Add (HASH, SLOT) to the index whose root is in ROOTBUF.
+ */
+static
+int
+sfs_dirhash_insert(struct sfs_vnode *sv, struct sfs_buf *rootbuf,
+		   uint32_t hash, uint32_t slot)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_dirhash *root = (struct sfs_dirhash *)rootbuf->b_data;
+	struct sfs_dirhash_block *dhb;
+	struct sfs_buf *buf;
+	uint32_t *chain;
+	daddr_t block;
+	int result;
+
+	chain = &root->dh_buckets[hash % root->dh_nbuckets];
+
+	/* Look for a bucket block in the chain with room */
+	for (block = *chain; block != 0; block = dhb->dhb_next) {
+		result = sfs_buf_read(sfs, block, &buf);
+		if (result) {
+			return result;
+		}
+		dhb = (struct sfs_dirhash_block *)buf->b_data;
+		if (dhb->dhb_count < SFS_DIRHASH_PERBLOCK) {
+			break;
+		}
+		sfs_buf_release(buf);
+	}
+
+	if (block == 0) {
+		/* None; add a new (zeroed) one at the head of the chain */
+		result = sfs_balloc(sfs, rootbuf->b_block + 1, &block);
+		if (result) {
+			return result;
+		}
+		result = sfs_buf_read(sfs, block, &buf);
+		if (result) {
+			sfs_bfree(sfs, block);
+			return result;
+		}
+		dhb = (struct sfs_dirhash_block *)buf->b_data;
+		dhb->dhb_next = *chain;
+		*chain = block;
+		sfs_buf_markmeta(rootbuf);
+	}
+
+	dhb->dhb_entries[dhb->dhb_count].dhe_hash = hash;
+	dhb->dhb_entries[dhb->dhb_count].dhe_slot = slot;
+	dhb->dhb_count++;
+	sfs_buf_markmeta(buf);
+	sfs_buf_release(buf);
+	return 0;
+}
+
+/*
+ * Remove (HASH, SLOT) from the index whose root is in ROOTBUF.
+ * Bucket blocks that become empty are freed.
+ */
+static
+int
+sfs_dirhash_remove(struct sfs_vnode *sv, struct sfs_buf *rootbuf,
+		   uint32_t hash, uint32_t slot)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_dirhash *root = (struct sfs_dirhash *)rootbuf->b_data;
+	struct sfs_dirhash_block *dhb;
+	struct sfs_buf *buf, *prevbuf;
+	daddr_t block;
+	uint32_t i;
+	int result;
+
+	prevbuf = NULL;
+	block = root->dh_buckets[hash % root->dh_nbuckets];
+	while (block != 0) {
+		result = sfs_buf_read(sfs, block, &buf);
+		if (result) {
+			goto done;
+		}
+		dhb = (struct sfs_dirhash_block *)buf->b_data;
+		for (i=0; i<dhb->dhb_count; i++) {
+			if (dhb->dhb_entries[i].dhe_hash == hash &&
+			    dhb->dhb_entries[i].dhe_slot == slot) {
+				break;
+			}
+		}
+		if (i < dhb->dhb_count) {
+			break;
+		}
+		if (prevbuf != NULL) {
+			sfs_buf_release(prevbuf);
+		}
+		prevbuf = buf;
+		block = dhb->dhb_next;
+	}
+	if (block == 0) {
+		panic("sfs: %s: directory %u: slot %u missing from index\n",
+		      sfs->sfs_sb.sb_volname, sv->sv_ino, slot);
+	}
+
+	/* Move the last entry into the hole */
+	dhb->dhb_count--;
+	dhb->dhb_entries[i] = dhb->dhb_entries[dhb->dhb_count];
+	sfs_buf_markmeta(buf);
+
+	if (dhb->dhb_count == 0) {
+		/* Unlink the empty block from the chain and free it */
+		if (prevbuf == NULL) {
+			root->dh_buckets[hash % root->dh_nbuckets] =
+				dhb->dhb_next;
+			sfs_buf_markmeta(rootbuf);
+		}
+		else {
+			((struct sfs_dirhash_block *)prevbuf->b_data)
+				->dhb_next = dhb->dhb_next;
+			sfs_buf_markmeta(prevbuf);
+		}
+		sfs_buf_release(buf);
+		sfs_bfree(sfs, block);
+	}
+	else {
+		sfs_buf_release(buf);
+	}
+	result = 0;
+
+ done:
+	if (prevbuf != NULL) {
+		sfs_buf_release(prevbuf);
+	}
+	return result;
+}
+
+/*
+ * Free all the bucket blocks of the index whose root is in ROOTBUF,
+ * and empty the hash table.
+ */
+static
+int
+sfs_dirhash_freechains(struct sfs_fs *sfs, struct sfs_buf *rootbuf)
+{
+	struct sfs_dirhash *root = (struct sfs_dirhash *)rootbuf->b_data;
+	struct sfs_buf *buf;
+	daddr_t block, next;
+	uint32_t i;
+	int result;
+
+	for (i=0; i<root->dh_nbuckets; i++) {
+		block = root->dh_buckets[i];
+		while (block != 0) {
+			result = sfs_buf_read(sfs, block, &buf);
+			if (result) {
+				return result;
+			}
+			next = ((struct sfs_dirhash_block *)buf->b_data)
+				->dhb_next;
+			sfs_buf_release(buf);
+			sfs_bfree(sfs, block);
+			block = next;
+		}
+		root->dh_buckets[i] = 0;
+	}
+	sfs_buf_markmeta(rootbuf);
+	return 0;
+}
+
+/*
+ * Build (or rebuild) the index for a directory from its entries.
+ * Hands back the root block, held.
+ */
+static
+int
+sfs_dirhash_build(struct sfs_vnode *sv, struct sfs_buf **ret)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_dirhash *root;
+	struct sfs_direntry tsd;
+	struct sfs_buf *rootbuf;
+	daddr_t rootblock;
+	int nentries, i, result;
+
+	rootblock = sv->sv_i.sfi_dirindex;
+	if (rootblock == 0) {
+		result = sfs_balloc(sfs, SFS_INO_BLOCK(sv->sv_ino) + 1,
+				    &rootblock);
+		if (result) {
+			return result;
+		}
+		result = sfs_buf_read(sfs, rootblock, &rootbuf);
+		if (result) {
+			sfs_bfree(sfs, rootblock);
+			return result;
+		}
+		root = (struct sfs_dirhash *)rootbuf->b_data;
+		root->dh_nbuckets = SFS_DIRHASH_NBUCKETS;
+	}
+	else {
+		/* Stale; throw away what's there */
+		result = sfs_buf_read(sfs, rootblock, &rootbuf);
+		if (result) {
+			return result;
+		}
+		root = (struct sfs_dirhash *)rootbuf->b_data;
+		if (root->dh_nbuckets == 0 ||
+		    root->dh_nbuckets > SFS_DIRHASH_NBUCKETS) {
+			panic("sfs: %s: directory %u: index has %u buckets\n",
+			      sfs->sfs_sb.sb_volname, sv->sv_ino,
+			      root->dh_nbuckets);
+		}
+		result = sfs_dirhash_freechains(sfs, rootbuf);
+		if (result) {
+			sfs_buf_release(rootbuf);
+			return result;
+		}
+	}
+
+	nentries = sfs_dir_nentries(sv);
+	root->dh_magic = 0;
+	root->dh_freehint = nentries;
+	sfs_buf_markmeta(rootbuf);
+
+	if (sv->sv_i.sfi_dirindex != rootblock) {
+		sv->sv_i.sfi_dirindex = rootblock;
+		sv->sv_dirty = true;
+	}
+
+	for (i=0; i<nentries; i++) {
+		result = sfs_readdir(sv, i, &tsd);
+		if (result) {
+			sfs_buf_release(rootbuf);
+			return result;
+		}
+		if (tsd.sfd_ino == SFS_NOINO) {
+			if ((uint32_t)i < root->dh_freehint) {
+				root->dh_freehint = i;
+			}
+			continue;
+		}
+		tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
+		result = sfs_dirhash_insert(sv, rootbuf,
+					    sfs_dirhash_name(tsd.sfd_name), i);
+		if (result) {
+			sfs_buf_release(rootbuf);
+			return result;
+		}
+	}
+
+	/* Only now is it valid */
+	root->dh_magic = SFS_DIRHASH_MAGIC;
+	sfs_buf_markmeta(rootbuf);
+
+	*ret = rootbuf;
+	return 0;
+}
+
+/*
+ * Get the root block of a directory's index, held, building or
+ * rebuilding the index first if needed. If the directory has no
+ * index and DOCREATE is false, hands back NULL.
+ */
+static
+int
+sfs_dirhash_getroot(struct sfs_vnode *sv, bool docreate,
+		    struct sfs_buf **ret)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_buf *rootbuf;
+	int result;
+
+	if (sv->sv_i.sfi_dirindex == 0) {
+		if (!docreate) {
+			*ret = NULL;
+			return 0;
+		}
+		return sfs_dirhash_build(sv, ret);
+	}
+
+	result = sfs_buf_read(sfs, sv->sv_i.sfi_dirindex, &rootbuf);
+	if (result) {
+		return result;
+	}
+	if (((struct sfs_dirhash *)rootbuf->b_data)->dh_magic !=
+	    SFS_DIRHASH_MAGIC) {
+		sfs_buf_release(rootbuf);
+		return sfs_dirhash_build(sv, ret);
+	}
+	*ret = rootbuf;
+	return 0;
+}
+
+/*
+ * Look up NAME through the index whose root is in ROOTBUF.
+ */
+static
+int
+sfs_dirhash_lookup(struct sfs_vnode *sv, struct sfs_buf *rootbuf,
+		   const char *name, uint32_t *ino, int *slot)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_dirhash *root = (struct sfs_dirhash *)rootbuf->b_data;
+	struct sfs_dirhash_block *dhb;
+	struct sfs_direntry tsd;
+	struct sfs_buf *buf;
+	uint32_t hash, i;
+	daddr_t block;
+	int result;
+
+	hash = sfs_dirhash_name(name);
+	block = root->dh_buckets[hash % root->dh_nbuckets];
+	while (block != 0) {
+		result = sfs_buf_read(sfs, block, &buf);
+		if (result) {
+			return result;
+		}
+		dhb = (struct sfs_dirhash_block *)buf->b_data;
+		for (i=0; i<dhb->dhb_count; i++) {
+			if (dhb->dhb_entries[i].dhe_hash != hash) {
+				continue;
+			}
+			/* Check the actual name; hashes can collide */
+			result = sfs_readdir(sv, dhb->dhb_entries[i].dhe_slot,
+					     &tsd);
+			if (result) {
+				sfs_buf_release(buf);
+				return result;
+			}
+			tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
+			if (tsd.sfd_ino != SFS_NOINO &&
+			    !strcmp(tsd.sfd_name, name)) {
+				if (slot != NULL) {
+					*slot = dhb->dhb_entries[i].dhe_slot;
+				}
+				if (ino != NULL) {
+					*ino = tsd.sfd_ino;
+				}
+				sfs_buf_release(buf);
+				return 0;
+			}
+		}
+		block = dhb->dhb_next;
+		sfs_buf_release(buf);
+	}
+	return ENOENT;
+}
+
+/*
+ * Find a free slot, starting from the index's free hint. Hands back
+ * the slot past the end if there are none.
+ */
+static
+int
+sfs_dirhash_findfree(struct sfs_vnode *sv, struct sfs_buf *rootbuf,
+		     int *emptyslot)
+{
+	struct sfs_dirhash *root = (struct sfs_dirhash *)rootbuf->b_data;
+	struct sfs_direntry tsd;
+	int nentries, i, result;
+
+	nentries = sfs_dir_nentries(sv);
+	for (i=root->dh_freehint; i<nentries; i++) {
+		result = sfs_readdir(sv, i, &tsd);
+		if (result) {
+			return result;
+		}
+		if (tsd.sfd_ino == SFS_NOINO) {
+			break;
+		}
+	}
+	*emptyslot = i;
+	return 0;
+}
+
+/*
+ * Discard a directory's index; called when the directory is being
+ * erased.
+ */
+int
+sfs_dir_dropindex(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_buf *rootbuf;
+	int result;
+
+	if (sv->sv_i.sfi_dirindex == 0) {
+		return 0;
+	}
+	result = sfs_buf_read(sfs, sv->sv_i.sfi_dirindex, &rootbuf);
+	if (result) {
+		return result;
+	}
+	result = sfs_dirhash_freechains(sfs, rootbuf);
+	sfs_buf_release(rootbuf);
+	if (result) {
+		return result;
+	}
+	sfs_bfree(sfs, sv->sv_i.sfi_dirindex);
+	sv->sv_i.sfi_dirindex = 0;
+	sv->sv_dirty = true;
+	return 0;
+}
+
+/*
+ * Write back whatever of a directory's index is dirty, for fsync:
+ * the bucket blocks, then the root block that points to them. See
+ * sfs_bmap_sync for FMBLOCKS and PINNED.
+ */
+int
+sfs_dir_syncindex(struct sfs_vnode *sv, struct bitmap *fmblocks,
+		  bool *pinned)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_buf *rootbuf, *buf;
+	struct sfs_dirhash *root;
+	daddr_t block, next;
+	uint32_t i;
+	int result = 0;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (sv->sv_i.sfi_dirindex == 0) {
+		return 0;
+	}
+	result = sfs_buf_read(sfs, sv->sv_i.sfi_dirindex, &rootbuf);
+	if (result) {
+		return result;
+	}
+	root = (struct sfs_dirhash *)rootbuf->b_data;
+
+	/* The chains are valid even if the index is stale */
+	for (i=0; i<root->dh_nbuckets && result == 0; i++) {
+		block = root->dh_buckets[i];
+		while (block != 0) {
+			result = sfs_buf_read(sfs, block, &buf);
+			if (result) {
+				break;
+			}
+			next = ((struct sfs_dirhash_block *)buf->b_data)
+				->dhb_next;
+			sfs_buf_release(buf);
+			result = sfs_bmap_syncblock(sfs, block, fmblocks,
+						    pinned);
+			if (result) {
+				break;
+			}
+			block = next;
+		}
+	}
+	sfs_buf_release(rootbuf);
+	if (result) {
+		return result;
+	}
+
+	return sfs_bmap_syncblock(sfs, sv->sv_i.sfi_dirindex, fmblocks,
+				  pinned);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Directory operations
+
 /*
  * Search a directory for a particular filename in a directory, and
  * return its inode number, its slot, and/or the slot number of an
  * empty directory slot if one is found.
+ *
+ * If the directory is indexed, this uses the index. Otherwise it
+ * scans the slots, stopping at the name if it's found.
  */
 int
 sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 		uint32_t *ino, int *slot, int *emptyslot)
 {
 	struct sfs_direntry tsd;
-	int found, nentries, i, result;
+	struct sfs_buf *rootbuf;
+	int nentries, i, result;
+
+	result = sfs_dirhash_getroot(sv, false, &rootbuf);
+	if (result) {
+		return result;
+	}
+	if (rootbuf != NULL) {
+		result = sfs_dirhash_lookup(sv, rootbuf, name, ino, slot);
+		if (result == ENOENT && emptyslot != NULL) {
+			int ret = sfs_dirhash_findfree(sv, rootbuf, emptyslot);
+			if (ret) {
+				result = ret;
+			}
+			else if (*emptyslot == sfs_dir_nentries(sv)) {
+				/* no free slot; same as linear case */
+				*emptyslot = -1;
+			}
+		}
+		sfs_buf_release(rootbuf);
+		return result;
+	}
 
 	nentries = sfs_dir_nentries(sv);
 
 	/* For each slot... */
-	found = 0;
 	for (i=0; i<nentries; i++) {
 
 		/* Read the entry from that slot */
@@ -128,27 +636,26 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 			/* Ensure null termination, just in case */
 			tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
 			if (!strcmp(tsd.sfd_name, name)) {
-
-				/* Each name may legally appear only once... */
-				KASSERT(found==0);
-
-				found = 1;
+				/* Each name may legally appear only once */
 				if (slot != NULL) {
 					*slot = i;
 				}
 				if (ino != NULL) {
 					*ino = tsd.sfd_ino;
 				}
+				return 0;
 			}
 		}
 	}
 
-	return found ? 0 : ENOENT;
+	return ENOENT;
 }
 
 /*
  * Create a link in a directory to the specified inode by number, with
  * the specified name, and optionally hand back the slot.
+ *
+ * This creates the directory's index if it doesn't have one yet.
  */
 int
 sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
@@ -156,37 +663,67 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 	int emptyslot = -1;
 	int result;
 	struct sfs_direntry sd;
+	struct sfs_buf *rootbuf;
+	struct sfs_dirhash *root;
+	uint32_t hash;
+
+	if (strlen(name)+1 > sizeof(sd.sfd_name)) {
+		return ENAMETOOLONG;
+	}
+
+	result = sfs_dirhash_getroot(sv, true, &rootbuf);
+	if (result) {
+		return result;
+	}
+	root = (struct sfs_dirhash *)rootbuf->b_data;
 
 	/* Look up the name. We want to make sure it *doesn't* exist. */
 	result = sfs_dir_findname(sv, name, NULL, NULL, &emptyslot);
 	if (result!=0 && result!=ENOENT) {
+		sfs_buf_release(rootbuf);
 		return result;
 	}
 	if (result==0) {
+		sfs_buf_release(rootbuf);
 		return EEXIST;
 	}
 
-	if (strlen(name)+1 > sizeof(sd.sfd_name)) {
-		return ENAMETOOLONG;
-	}
-
 	/* If we didn't get an empty slot, add the entry at the end. */
 	if (emptyslot < 0) {
 		emptyslot = sfs_dir_nentries(sv);
 	}
 
+	/* Index it first, so if we run out of space nothing's changed. */
+	hash = sfs_dirhash_name(name);
+	result = sfs_dirhash_insert(sv, rootbuf, hash, emptyslot);
+	if (result) {
+		sfs_buf_release(rootbuf);
+		return result;
+	}
+
 	/* Set up the entry. */
 	bzero(&sd, sizeof(sd));
 	sd.sfd_ino = ino;
 	strcpy(sd.sfd_name, name);
 
+	/* Write the entry. */
+	result = sfs_writedir(sv, emptyslot, &sd);
+	if (result) {
+		sfs_dirhash_remove(sv, rootbuf, hash, emptyslot);
+		sfs_buf_release(rootbuf);
+		return result;
+	}
+
+	/* Slots below the new one were already full */
+	root->dh_freehint = emptyslot + 1;
+	sfs_buf_markmeta(rootbuf);
+	sfs_buf_release(rootbuf);
+
 	/* Hand back the slot, if so requested. */
 	if (slot) {
 		*slot = emptyslot;
 	}
-
-	/* Write the entry. */
-	return sfs_writedir(sv, emptyslot, &sd);
+	return 0;
 }
 
 /*
@@ -196,13 +733,132 @@ int
 sfs_dir_unlink(struct sfs_vnode *sv, int slot)
 {
 	struct sfs_direntry sd;
+	struct sfs_buf *rootbuf;
+	struct sfs_dirhash *root;
+	uint32_t hash = 0;
+	int result;
+
+	result = sfs_dirhash_getroot(sv, false, &rootbuf);
+	if (result) {
+		return result;
+	}
+
+	if (rootbuf != NULL) {
+		/* Get the name so we can find it in the index */
+		result = sfs_readdir(sv, slot, &sd);
+		if (result) {
+			sfs_buf_release(rootbuf);
+			return result;
+		}
+		sd.sfd_name[sizeof(sd.sfd_name)-1] = 0;
+		hash = sfs_dirhash_name(sd.sfd_name);
+	}
 
 	/* Initialize a suitable directory entry... */
 	bzero(&sd, sizeof(sd));
 	sd.sfd_ino = SFS_NOINO;
 
 	/* ... and write it */
-	return sfs_writedir(sv, slot, &sd);
+	result = sfs_writedir(sv, slot, &sd);
+	if (result || rootbuf == NULL) {
+		if (rootbuf != NULL) {
+			sfs_buf_release(rootbuf);
+		}
+		return result;
+	}
+
+	/* Now drop it from the index */
+	root = (struct sfs_dirhash *)rootbuf->b_data;
+	result = sfs_dirhash_remove(sv, rootbuf, hash, slot);
+	if ((uint32_t)slot < root->dh_freehint) {
+		root->dh_freehint = slot;
+		sfs_buf_markmeta(rootbuf);
+	}
+	sfs_buf_release(rootbuf);
+	return result;
+}
+
+/*
+ * Read directory entries, for getdirentry (MANY false: one name) and
+ * getdirentries (MANY true: as many struct dirents as fit). The
+ * offset in the uio is the slot to start at; empty slots are skipped
+ * and the offset is left at the first slot not returned.
+ *
+ * Call with the vnode locked.
+ */
+int
+sfs_dir_getentries(struct sfs_vnode *sv, struct uio *uio, bool many)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_direntry tsd;
+	unsigned type;
+	mode_t mode;
+	size_t len;
+	int slot, nentries;
+	bool any;
+	int result;
+
+	KASSERT(uio->uio_rw == UIO_READ);
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (uio->uio_offset < 0) {
+		return EINVAL;
+	}
+
+	nentries = sfs_dir_nentries(sv);
+	slot = uio->uio_offset < nentries ? uio->uio_offset : nentries;
+	any = false;
+	for (; slot < nentries; slot++) {
+		result = sfs_readdir(sv, slot, &tsd);
+		if (result) {
+			return result;
+		}
+		if (tsd.sfd_ino == SFS_NOINO) {
+			continue;
+		}
+		tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
+		len = strlen(tsd.sfd_name);
+
+		if (!many) {
+			result = uiomove(tsd.sfd_name, len, uio);
+			if (result) {
+				return result;
+			}
+			slot++;
+			break;
+		}
+
+		if (_DIRENT_RECLEN(len) > uio->uio_resid) {
+			if (!any) {
+				return EINVAL;
+			}
+			break;
+		}
+		result = sfs_inode_gettype(sfs, tsd.sfd_ino, &type);
+		if (result) {
+			return result;
+		}
+		switch (type) {
+		    case SFS_TYPE_FILE:
+			mode = S_IFREG;
+			break;
+		    case SFS_TYPE_DIR:
+			mode = S_IFDIR;
+			break;
+		    default:
+			mode = 0;
+			break;
+		}
+		result = vnode_putdirent(uio, tsd.sfd_ino, mode,
+					 tsd.sfd_name, len);
+		if (result) {
+			return result;
+		}
+		any = true;
+	}
+
+	uio->uio_offset = slot;
+	return 0;
 }
 
 /*
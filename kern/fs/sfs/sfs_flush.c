@@ -0,0 +1,280 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009, 2014
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * SFS filesystem
+ *
+ * Background write-back.
+ *
+ * Left alone, dirty buffers, inodes, the free block bitmap and the
+ * superblock would only reach the disk at sync, fsync or unmount,
+ * all at once. Instead a kernel thread wakes up once a second and,
+ * for each mounted volume:
+ *
+ *    - every sfs_flushage seconds, starts a round of copying dirty
+ *      inodes (and file blocks still waiting for disk space) into the
+ *      buffer cache, SFS_SYNCBATCH of them per pass (see
+ *      sfs_sync_someinodes); at the end of the round it writes out
+ *      the freemap and superblock if they're dirty, or on a volume
+ *      with a journal, commits everything;
+ *
+ *    - writes back up to SFS_FLUSHBATCH buffers that have been dirty
+ *      for at least sfs_flushage seconds.
+ *
+ * So nothing stays dirty in memory for much more than twice the age
+ * (plus however long a round takes), and the writing is spread out
+ * in small batches rather than arriving in one burst. Writers that
+ * dirty buffers faster than this keeps up with are throttled in
+ * sfs_buf_throttle.
+ *
+ * Time is counted in passes of the thread (sfs_flushclock), which is
+ * cheap to read and good enough for this purpose.
+ *
+ * There is one thread shared by all SFS volumes, started by the first
+ * mount. The list of volumes is protected by sfs_flushlock, which the
+ * thread does not hold while working on a volume; instead it records
+ * the volume in sfs_flushbusy, and unmount waits for that to change
+ * before the volume goes away. The volume's own locks cover the rest,
+ * as for fsync. (sfs_flushclock is read without the lock when buffers
+ * are marked dirty, and sfs_flushage, which is set under the big VFS
+ * lock, is read without it by the thread; a stale value just makes
+ * something get written a second early or late.)
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <synch.h>
+#include <thread.h>
+#include <vfs.h>
+#include <sfs.h>
+#include "sfsprivate.h"
+
+/* Maximum number of buffers written per volume per pass. */
+#define SFS_FLUSHBATCH  8
+
+/* Default age, in seconds, at which dirty data is written back. */
+#define SFS_FLUSHAGE    5
+
+unsigned sfs_flushclock;                /* passes of the flusher */
+static unsigned sfs_flushage = SFS_FLUSHAGE;
+static struct lock *sfs_flushlock;
+static struct cv *sfs_flushcv;
+static struct sfs_fs *sfs_flushlist;    /* mounted volumes */
+static struct sfs_fs *sfs_flushbusy;    /* volume being written back */
+
+/*
+ * Write back whatever's due on one volume.
+ */
+static
+int
+sfs_flush_volume(struct sfs_fs *sfs, unsigned age)
+{
+	int result;
+
+	if (sfs->sfs_metanext > 0 ||
+	    sfs_flushclock - sfs->sfs_metatime >= age) {
+		result = sfs_sync_someinodes(sfs, &sfs->sfs_metanext);
+		if (result) {
+			return result;
+		}
+		if (sfs->sfs_metanext > 0) {
+			/* Not through them all yet; carry on next pass */
+			goto writeback;
+		}
+		if (SFS_JOURNALING(sfs)) {
+			result = sfs_journal_commit(sfs);
+			if (result) {
+				return result;
+			}
+		}
+		else {
+			result = sfs_sync_freemap(sfs);
+			if (result) {
+				return result;
+			}
+			result = sfs_sync_superblock(sfs);
+			if (result) {
+				return result;
+			}
+		}
+		sfs->sfs_metatime = sfs_flushclock;
+	}
+
+ writeback:
+	return sfs_buf_writeback(sfs, age, SFS_FLUSHBATCH);
+}
+
+/*
+ * The flusher thread.
+ */
+static
+void
+sfs_flush_thread(void *data1, unsigned long data2)
+{
+	struct sfs_fs *sfs;
+	unsigned age;
+	int result;
+
+	(void)data1;
+	(void)data2;
+
+	while (1) {
+		clocksleep(1);
+
+		lock_acquire(sfs_flushlock);
+		sfs_flushclock++;
+		age = sfs_flushage;
+		while (1) {
+			/*
+			 * Find a volume we haven't done this pass. Start
+			 * from the top each time, since the list may have
+			 * changed while we didn't hold the lock.
+			 */
+			for (sfs = sfs_flushlist; sfs != NULL;
+			     sfs = sfs->sfs_flushnext) {
+				if (sfs->sfs_flushpass != sfs_flushclock) {
+					break;
+				}
+			}
+			if (sfs == NULL) {
+				break;
+			}
+			sfs->sfs_flushpass = sfs_flushclock;
+			sfs_flushbusy = sfs;
+			lock_release(sfs_flushlock);
+
+			result = sfs_flush_volume(sfs, age);
+			if (result) {
+				/* Leave it dirty; we'll try again later */
+				kprintf("sfs: %s: write-back failed: %s\n",
+					sfs->sfs_sb.sb_volname,
+					strerror(result));
+			}
+
+			lock_acquire(sfs_flushlock);
+			sfs_flushbusy = NULL;
+			cv_broadcast(sfs_flushcv, sfs_flushlock);
+		}
+		lock_release(sfs_flushlock);
+	}
+}
+
+/*
+ * Start the thread, if not done already.
+ */
+int
+sfs_flush_init(void)
+{
+	int result;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	if (sfs_flushlock != NULL) {
+		return 0;
+	}
+
+	sfs_flushlock = lock_create("sfs_flush");
+	if (sfs_flushlock == NULL) {
+		return ENOMEM;
+	}
+	sfs_flushcv = cv_create("sfs_flush");
+	if (sfs_flushcv == NULL) {
+		lock_destroy(sfs_flushlock);
+		sfs_flushlock = NULL;
+		return ENOMEM;
+	}
+	sfs_flushbusy = NULL;
+
+	result = thread_fork("sfs flusher", NULL, sfs_flush_thread, NULL, 0);
+	if (result) {
+		cv_destroy(sfs_flushcv);
+		lock_destroy(sfs_flushlock);
+		sfs_flushcv = NULL;
+		sfs_flushlock = NULL;
+		return result;
+	}
+	return 0;
+}
+
+/*
+ * Add a newly mounted volume to the list.
+ */
+void
+sfs_flush_register(struct sfs_fs *sfs)
+{
+	lock_acquire(sfs_flushlock);
+	sfs->sfs_flushpass = sfs_flushclock;
+	sfs->sfs_flushnext = sfs_flushlist;
+	sfs_flushlist = sfs;
+	lock_release(sfs_flushlock);
+}
+
+/*
+ * Take a volume that's being unmounted off the list, and wait for the
+ * thread to finish with it if it's in the middle of writing it back.
+ */
+void
+sfs_flush_unregister(struct sfs_fs *sfs)
+{
+	struct sfs_fs **pp;
+
+	lock_acquire(sfs_flushlock);
+	for (pp = &sfs_flushlist; *pp != NULL; pp = &(*pp)->sfs_flushnext) {
+		if (*pp == sfs) {
+			*pp = sfs->sfs_flushnext;
+			sfs->sfs_flushnext = NULL;
+			break;
+		}
+	}
+	while (sfs_flushbusy == sfs) {
+		cv_wait(sfs_flushcv, sfs_flushlock);
+	}
+	lock_release(sfs_flushlock);
+}
+
+/*
+ * Get and set the write-back age. With an age of 0, everything dirty
+ * is written back (SFS_FLUSHBATCH buffers at a time) as soon as the
+ * flusher gets to it.
+ */
+unsigned
+sfs_getflushage(void)
+{
+	return sfs_flushage;
+}
+
+void
+sfs_setflushage(unsigned seconds)
+{
+	vfs_biglock_acquire();
+	sfs_flushage = seconds;
+	vfs_biglock_release();
+}
@@ -38,6 +38,7 @@
 #include <lib.h>
 #include <array.h>
 #include <bitmap.h>
+#include <synch.h>
 #include <uio.h>
 #include <vfs.h>
 #include <device.h>
@@ -45,27 +46,24 @@
 #include "sfsprivate.h"
 
 
-/* Shortcuts for the size macros in kern/sfs.h */
-#define SFS_FS_NBLOCKS(sfs)        ((sfs)->sfs_sb.sb_nblocks)
-#define SFS_FS_FREEMAPBITS(sfs)    SFS_FREEMAPBITS(SFS_FS_NBLOCKS(sfs))
-#define SFS_FS_FREEMAPBLOCKS(sfs)  SFS_FREEMAPBLOCKS(SFS_FS_NBLOCKS(sfs))
-
 /*
  * Routine for doing I/O (reads or writes) on the free block bitmap.
- * We always do the whole bitmap at once; writing individual sectors
- * might or might not be a worthwhile optimization.
+ * Reads do the whole bitmap at once. Writes only do the blocks of it
+ * marked in sfs_freemapdirtymap, since usually only one or two of
+ * them have changed since the last sync.
  *
- * The free block bitmap consists of SFS_FREEMAPBLOCKS 512-byte
- * sectors of bits, one bit for each sector on the filesystem. The
- * number of blocks in the bitmap is thus rounded up to the nearest
- * multiple of 512*8 = 4096. (This rounded number is SFS_FREEMAPBITS.)
- * This means that the bitmap will (in general) contain space for some
- * number of invalid sectors that are actually beyond the end of the
- * disk device. This is ok. These sectors are supposed to be marked
- * "in use" by mksfs and never get marked "free".
+ * The free block bitmap consists of SFS_FREEMAPBLOCKS blocks of
+ * bits, one bit for each block on the filesystem. The number of
+ * blocks in the bitmap is thus rounded up to the nearest multiple of
+ * the number of bits in a block (4096 with 512-byte blocks). (This
+ * rounded number is SFS_FREEMAPBITS.) This means that the bitmap will
+ * (in general) contain space for some number of invalid blocks that
+ * are actually beyond the end of the disk device. This is ok. These
+ * blocks are supposed to be marked "in use" by mksfs and never get
+ * marked "free".
  *
- * The sectors used by the superblock and the bitmap itself are
- * likewise marked in use by mksfs.
+ * The blocks used by the superblock, the bitmap itself, and the
+ * journal (if any) are likewise marked in use by mksfs.
  */
 static
 int
@@ -85,16 +83,22 @@ sfs_freemapio(struct sfs_fs *sfs, enum uio_rw rw)
 	for (j=0; j<freemapblocks; j++) {
 
 		/* Get a pointer to its data */
-		void *ptr = freemapdata + j*SFS_BLOCKSIZE;
+		void *ptr = freemapdata + j*SFS_FS_BLOCKSIZE(sfs);
 
-		/* and read or write it. The freemap starts at sector 2. */
+		/* and read or write it. The freemap starts at block 2. */
 		if (rw == UIO_READ) {
 			result = sfs_readblock(sfs, SFS_FREEMAP_START+j, ptr,
-					       SFS_BLOCKSIZE);
+					       SFS_FS_BLOCKSIZE(sfs));
 		}
-		else {
+		else if (bitmap_isset(sfs->sfs_freemapdirtymap, j)) {
 			result = sfs_writeblock(sfs, SFS_FREEMAP_START+j, ptr,
-						SFS_BLOCKSIZE);
+						SFS_FS_BLOCKSIZE(sfs));
+			if (result == 0) {
+				bitmap_unmark(sfs->sfs_freemapdirtymap, j);
+			}
+		}
+		else {
+			result = 0;
 		}
 
 		/* If we failed, stop. */
@@ -112,54 +116,95 @@ static
 int
 sfs_sync_vnodes(struct sfs_fs *sfs)
 {
-	unsigned i, num;
+	int result;
 
-	/* Go over the array of loaded vnodes, syncing as we go. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	for (i=0; i<num; i++) {
-		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
-		VOP_FSYNC(v);
+	/* Copy all the loaded inodes into the cache. */
+	result = sfs_sync_inodes(sfs);
+	if (result) {
+		return result;
 	}
-	return 0;
+
+	/* Now write back the inodes and everything else in the cache. */
+	return sfs_buf_sync(sfs);
 }
 
 /*
  * Sync routine for the freemap.
  */
-static
 int
 sfs_sync_freemap(struct sfs_fs *sfs)
 {
 	int result;
 
+	lock_acquire(sfs->sfs_freemaplock);
 	if (sfs->sfs_freemapdirty) {
 		result = sfs_freemapio(sfs, UIO_WRITE);
 		if (result) {
+			lock_release(sfs->sfs_freemaplock);
 			return result;
 		}
 		sfs->sfs_freemapdirty = false;
 	}
+	lock_release(sfs->sfs_freemaplock);
 
 	return 0;
 }
 
+/*
+ * Write back just the freemap blocks marked in FMBLOCKS, if they need
+ * it. For fsync, which only cares about the bits for one file's
+ * blocks. With a journal the freemap only goes to disk with a commit.
+ */
+int
+sfs_sync_freemapblocks(struct sfs_fs *sfs, struct bitmap *fmblocks)
+{
+	uint32_t j, freemapblocks;
+	char *freemapdata;
+	int result;
+
+	KASSERT(!SFS_JOURNALING(sfs));
+
+	freemapblocks = SFS_FS_FREEMAPBLOCKS(sfs);
+
+	lock_acquire(sfs->sfs_freemaplock);
+	freemapdata = bitmap_getdata(sfs->sfs_freemap);
+	for (j=0; j<freemapblocks; j++) {
+		if (!bitmap_isset(fmblocks, j) ||
+		    !bitmap_isset(sfs->sfs_freemapdirtymap, j)) {
+			continue;
+		}
+		result = sfs_writeblock(sfs, SFS_FREEMAP_START+j,
+					freemapdata + j*SFS_FS_BLOCKSIZE(sfs),
+					SFS_FS_BLOCKSIZE(sfs));
+		if (result) {
+			lock_release(sfs->sfs_freemaplock);
+			return result;
+		}
+		bitmap_unmark(sfs->sfs_freemapdirtymap, j);
+	}
+	lock_release(sfs->sfs_freemaplock);
+	return 0;
+}
+
 /*
  * Sync routine for the superblock.
  */
-static
 int
 sfs_sync_superblock(struct sfs_fs *sfs)
 {
 	int result;
 
+	lock_acquire(sfs->sfs_freemaplock);
 	if (sfs->sfs_superdirty) {
 		result = sfs_writeblock(sfs, SFS_SUPER_BLOCK, &sfs->sfs_sb,
 					sizeof(sfs->sfs_sb));
 		if (result) {
+			lock_release(sfs->sfs_freemaplock);
 			return result;
 		}
 		sfs->sfs_superdirty = false;
 	}
+	lock_release(sfs->sfs_freemaplock);
 	return 0;
 }
 
@@ -208,13 +253,20 @@ sfs_sync(struct fs *fs)
 
 	sfs = fs->fs_data;
 
-	/* If any vnodes need to be written, write them. */
+	/* If any vnodes or cached blocks need to be written, write them. */
 	result = sfs_sync_vnodes(sfs);
 	if (result) {
 		vfs_biglock_release();
 		return result;
 	}
 
+	/* With a journal, the metadata all goes through it. */
+	if (SFS_JOURNALING(sfs)) {
+		result = sfs_journal_commit(sfs);
+		vfs_biglock_release();
+		return result;
+	}
+
 	/* If the free block map needs to be written, write it. */
 	result = sfs_sync_freemap(sfs);
 	if (result) {
@@ -262,7 +314,23 @@ sfs_fs_destroy(struct sfs_fs *sfs)
 	if (sfs->sfs_freemap != NULL) {
 		bitmap_destroy(sfs->sfs_freemap);
 	}
+	if (sfs->sfs_freemapdirtymap != NULL) {
+		bitmap_destroy(sfs->sfs_freemapdirtymap);
+	}
+	if (sfs->sfs_jfreed != NULL) {
+		bitmap_destroy(sfs->sfs_jfreed);
+	}
+	sfs_journal_cleanup(sfs);
+	sfs_da_cleanup(sfs);
+	lock_destroy(sfs->sfs_dalock);
+	sfs_bufcache_cleanup(sfs);
+	cv_destroy(sfs->sfs_jcv);
+	lock_destroy(sfs->sfs_jlock);
+	kfree(sfs->sfs_vnhash);
 	vnodearray_destroy(sfs->sfs_vnodes);
+	lock_destroy(sfs->sfs_freemaplock);
+	lock_destroy(sfs->sfs_inolock);
+	lock_destroy(sfs->sfs_vnlock);
 	KASSERT(sfs->sfs_device == NULL);
 	kfree(sfs);
 }
@@ -280,15 +348,29 @@ sfs_unmount(struct fs *fs)
 
 	vfs_biglock_acquire();
 
+	/*
+	 * Get the flusher to let go of us first; while it's writing
+	 * back it holds references to vnodes.
+	 */
+	sfs_flush_unregister(sfs);
+
 	/* Do we have any files open? If so, can't unmount. */
+	lock_acquire(sfs->sfs_vnlock);
 	if (vnodearray_num(sfs->sfs_vnodes) > 0) {
+		lock_release(sfs->sfs_vnlock);
+		sfs_flush_register(sfs);
 		vfs_biglock_release();
 		return EBUSY;
 	}
+	lock_release(sfs->sfs_vnlock);
 
 	/* We should have just had sfs_sync called. */
 	KASSERT(sfs->sfs_superdirty == false);
 	KASSERT(sfs->sfs_freemapdirty == false);
+	KASSERT(sfs->sfs_njfreed == 0);
+
+	/* Make sure the read-ahead thread forgets about us too */
+	sfs_readahead_purge(sfs);
 
 	/* The vfs layer takes care of the device for us */
 	sfs->sfs_device = NULL;
@@ -321,6 +403,7 @@ struct sfs_fs *
 sfs_fs_create(void)
 {
 	struct sfs_fs *sfs;
+	unsigned i;
 
 	/*
 	 * Make sure our on-disk structures aren't messed up
@@ -328,6 +411,9 @@ sfs_fs_create(void)
 	COMPILE_ASSERT(sizeof(struct sfs_superblock)==SFS_BLOCKSIZE);
 	COMPILE_ASSERT(sizeof(struct sfs_dinode)==SFS_BLOCKSIZE);
 	COMPILE_ASSERT(SFS_BLOCKSIZE % sizeof(struct sfs_direntry) == 0);
+	COMPILE_ASSERT(sizeof(struct sfs_jheader)==SFS_BLOCKSIZE);
+	COMPILE_ASSERT(sizeof(struct sfs_jdesc)==SFS_BLOCKSIZE);
+	COMPILE_ASSERT(sizeof(struct sfs_jcommit)==SFS_BLOCKSIZE);
 
 	/* Allocate object */
 	sfs = kmalloc(sizeof(struct sfs_fs));
@@ -342,26 +428,107 @@ sfs_fs_create(void)
 	/* abstract vfs-level fs */
 	sfs->sfs_absfs.fs_data = sfs;
 	sfs->sfs_absfs.fs_ops = &sfs_fsops;
+	sfs->sfs_absfs.fs_flags = FS_CACHENAMES;
 
 	/* superblock */
 	/* (ignore sfs_super, we'll read in over it shortly) */
 	sfs->sfs_superdirty = false;
+	/* (this is enough to read the superblock with) */
+	sfs->sfs_blocksize = SFS_BLOCKSIZE;
+	sfs->sfs_inodesize = SFS_BLOCKSIZE;
 
 	/* device we mount on */
 	sfs->sfs_device = NULL;
 
 	/* vnode table */
+	sfs->sfs_vnlock = lock_create("sfs_vnlock");
+	if (sfs->sfs_vnlock == NULL) {
+		goto cleanup_object;
+	}
 	sfs->sfs_vnodes = vnodearray_create();
 	if (sfs->sfs_vnodes == NULL) {
-		goto cleanup_object;
+		goto cleanup_vnlock;
+	}
+	sfs->sfs_vnhash = kmalloc(SFS_VNHASHSIZE * sizeof(struct sfs_vnode *));
+	if (sfs->sfs_vnhash == NULL) {
+		goto cleanup_vnodes;
+	}
+	for (i=0; i<SFS_VNHASHSIZE; i++) {
+		sfs->sfs_vnhash[i] = NULL;
 	}
+	sfs->sfs_vngen = 0;
+
+	/* inode allocation */
+	sfs->sfs_inolock = lock_create("sfs_inolock");
+	if (sfs->sfs_inolock == NULL) {
+		goto cleanup_vnhash;
+	}
+	sfs->sfs_inohint = SFS_ROOTDIR_INO;
 
 	/* freemap */
+	sfs->sfs_freemaplock = lock_create("sfs_freemaplock");
+	if (sfs->sfs_freemaplock == NULL) {
+		goto cleanup_inolock;
+	}
 	sfs->sfs_freemap = NULL;
 	sfs->sfs_freemapdirty = false;
+	sfs->sfs_freemapdirtymap = NULL;
+
+	/* buffer cache */
+	if (sfs_bufcache_init(sfs)) {
+		goto cleanup_freemaplock;
+	}
+
+	/* journal */
+	sfs->sfs_jlock = lock_create("sfs_jlock");
+	if (sfs->sfs_jlock == NULL) {
+		goto cleanup_bufcache;
+	}
+	sfs->sfs_jcv = cv_create("sfs_jcv");
+	if (sfs->sfs_jcv == NULL) {
+		goto cleanup_jlock;
+	}
+	sfs->sfs_jactive = 0;
+	sfs->sfs_jcommitting = false;
+	sfs->sfs_jused = 0;
+	sfs->sfs_jseq = 0;
+	sfs->sfs_jfreed = NULL;
+	sfs->sfs_njfreed = 0;
+	sfs->sfs_jscratch = NULL;
+	sfs->sfs_jhomes = NULL;
+	sfs->sfs_jdatas = NULL;
+
+	/* delayed allocation */
+	sfs->sfs_dalock = lock_create("sfs_dalock");
+	if (sfs->sfs_dalock == NULL) {
+		goto cleanup_jcv;
+	}
+	sfs->sfs_dafree = NULL;
+
+	/* background flusher */
+	sfs->sfs_flushnext = NULL;
+	sfs->sfs_flushpass = 0;
+	sfs->sfs_metatime = sfs_flushclock;
+	sfs->sfs_metanext = 0;
 
 	return sfs;
 
+cleanup_jcv:
+	cv_destroy(sfs->sfs_jcv);
+cleanup_jlock:
+	lock_destroy(sfs->sfs_jlock);
+cleanup_bufcache:
+	sfs_bufcache_cleanup(sfs);
+cleanup_freemaplock:
+	lock_destroy(sfs->sfs_freemaplock);
+cleanup_inolock:
+	lock_destroy(sfs->sfs_inolock);
+cleanup_vnhash:
+	kfree(sfs->sfs_vnhash);
+cleanup_vnodes:
+	vnodearray_destroy(sfs->sfs_vnodes);
+cleanup_vnlock:
+	lock_destroy(sfs->sfs_vnlock);
 cleanup_object:
 	kfree(sfs);
 fail:
@@ -396,10 +563,9 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/*
 	 * We can't mount on devices with the wrong sector size.
 	 *
-	 * (Note: for all intents and purposes here, "sector" and
-	 * "block" are interchangeable terms. Technically a filesystem
-	 * block may be composed of several hardware sectors, but we
-	 * don't do that in sfs.)
+	 * (Note: a filesystem block is one or more hardware sectors,
+	 * according to the block size in the superblock. The superblock
+	 * itself is always the first sector.)
 	 */
 	if (dev->d_blocksize != SFS_BLOCKSIZE) {
 		vfs_biglock_release();
@@ -408,6 +574,18 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 		return ENXIO;
 	}
 
+	/* Start the read-ahead and flusher threads if this is the first mount */
+	result = sfs_readahead_init();
+	if (result) {
+		vfs_biglock_release();
+		return result;
+	}
+	result = sfs_flush_init();
+	if (result) {
+		vfs_biglock_release();
+		return result;
+	}
+
 	sfs = sfs_fs_create();
 	if (sfs == NULL) {
 		vfs_biglock_release();
@@ -440,14 +618,58 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 		return EINVAL;
 	}
 
-	if (sfs->sfs_sb.sb_nblocks > dev->d_blocks) {
-		kprintf("sfs: warning - fs has %u blocks, device has %u\n",
-			sfs->sfs_sb.sb_nblocks, dev->d_blocks);
-	}
-
 	/* Ensure null termination of the volume name */
 	sfs->sfs_sb.sb_volname[sizeof(sfs->sfs_sb.sb_volname)-1] = 0;
 
+	/* Zero means the original 512-byte blocks */
+	if (sfs->sfs_sb.sb_blocksize != 0) {
+		sfs->sfs_blocksize = sfs->sfs_sb.sb_blocksize;
+	}
+	if (sfs->sfs_blocksize < SFS_BLOCKSIZE ||
+	    sfs->sfs_blocksize > SFS_MAXBLOCKSIZE ||
+	    (sfs->sfs_blocksize & (sfs->sfs_blocksize - 1)) != 0) {
+		kprintf("sfs: %s: Unsupported block size %u\n",
+			sfs->sfs_sb.sb_volname, sfs->sfs_blocksize);
+		sfs->sfs_device = NULL;
+		sfs_fs_destroy(sfs);
+		vfs_biglock_release();
+		return EINVAL;
+	}
+
+	/* Zero means each inode has its own block */
+	if (sfs->sfs_sb.sb_inodesize != 0) {
+		sfs->sfs_inodesize = sfs->sfs_sb.sb_inodesize;
+		if (sfs->sfs_inodesize < SFS_MININODESIZE ||
+		    sfs->sfs_inodesize > SFS_BLOCKSIZE ||
+		    (sfs->sfs_inodesize & (sfs->sfs_inodesize - 1)) != 0 ||
+		    sfs->sfs_sb.sb_nblocks > SFS_INO_MAXBLOCKS) {
+			kprintf("sfs: %s: Unsupported inode size %u\n",
+				sfs->sfs_sb.sb_volname,
+				sfs->sfs_inodesize);
+			sfs->sfs_device = NULL;
+			sfs_fs_destroy(sfs);
+			vfs_biglock_release();
+			return EINVAL;
+		}
+	}
+
+	if ((uint64_t)sfs->sfs_sb.sb_nblocks * sfs->sfs_blocksize >
+	    (uint64_t)dev->d_blocks * dev->d_blocksize) {
+		kprintf("sfs: warning - fs has %u blocks of %u bytes, "
+			"device has %u of %zu\n",
+			sfs->sfs_sb.sb_nblocks, sfs->sfs_blocksize,
+			dev->d_blocks, dev->d_blocksize);
+	}
+
+	/* Finish anything left in the journal */
+	result = sfs_journal_load(sfs);
+	if (result) {
+		sfs->sfs_device = NULL;
+		sfs_fs_destroy(sfs);
+		vfs_biglock_release();
+		return result;
+	}
+
 	/* Load free block bitmap */
 	sfs->sfs_freemap = bitmap_create(SFS_FS_FREEMAPBITS(sfs));
 	if (sfs->sfs_freemap == NULL) {
@@ -456,6 +678,13 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 		vfs_biglock_release();
 		return ENOMEM;
 	}
+	sfs->sfs_freemapdirtymap = bitmap_create(SFS_FS_FREEMAPBLOCKS(sfs));
+	if (sfs->sfs_freemapdirtymap == NULL) {
+		sfs->sfs_device = NULL;
+		sfs_fs_destroy(sfs);
+		vfs_biglock_release();
+		return ENOMEM;
+	}
 	result = sfs_freemapio(sfs, UIO_READ);
 	if (result) {
 		sfs->sfs_device = NULL;
@@ -464,6 +693,9 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 		return result;
 	}
 
+	/* Let the flusher find us */
+	sfs_flush_register(sfs);
+
 	/* Hand back the abstract fs */
 	*ret = &sfs->sfs_absfs;
 
@@ -35,31 +35,407 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <array.h>
+#include <synch.h>
 #include <vfs.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
+/* Most inodes sfs_sync_someinodes does at once. */
+#define SFS_SYNCBATCH  16
+
+
+/*
+ * Find a loaded vnode by inode number. Returns NULL if it isn't
+ * loaded.
+ */
+static
+struct sfs_vnode *
+sfs_vnhash_find(struct sfs_fs *sfs, uint32_t ino)
+{
+	struct sfs_vnode *sv;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	for (sv = sfs->sfs_vnhash[ino % SFS_VNHASHSIZE];
+	     sv != NULL;
+	     sv = sv->sv_hashnext) {
+		if (sv->sv_ino == ino) {
+			return sv;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Remove a vnode from the hash table.
+ */
+static
+void
+sfs_vnhash_remove(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	struct sfs_vnode **pp;
+
+	/* (see sfs_loadvnode) */
+	sfs->sfs_vngen++;
+
+	for (pp = &sfs->sfs_vnhash[sv->sv_ino % SFS_VNHASHSIZE];
+	     *pp != NULL;
+	     pp = &(*pp)->sv_hashnext) {
+		if (*pp == sv) {
+			*pp = sv->sv_hashnext;
+			sv->sv_hashnext = NULL;
+			return;
+		}
+	}
+	panic("sfs: %s: reclaim vnode %u not in vnode pool\n",
+	      sfs->sfs_sb.sb_volname, sv->sv_ino);
+}
+
+/*
+ * Return where inode INO is in BUF, the buffer for its block.
+ */
+static
+void *
+sfs_inode_ptr(struct sfs_fs *sfs, struct sfs_buf *buf, uint32_t ino)
+{
+	KASSERT(buf->b_block == SFS_INO_BLOCK(ino));
+	return buf->b_data + SFS_INO_SLOT(ino) * sfs->sfs_inodesize;
+}
 
 /*
- * Write an on-disk inode structure back out to disk.
+ * Allocate an inode as close after GOAL as possible, and set its type
+ * to TYPE on disk so nobody else takes it.
+ *
+ * If inodes are packed several to a block, first look for a free slot
+ * in GOAL's block (normally the directory's own inode block) and then
+ * in the block we last allocated from, so that files created together
+ * have their inodes together and loading them takes one read. Only if
+ * neither has room is a new inode block allocated.
  */
+static
 int
-sfs_sync_inode(struct sfs_vnode *sv)
+sfs_ialloc(struct sfs_fs *sfs, int type, daddr_t goal, uint32_t *ret)
 {
-	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_buf *buf;
+	struct sfs_dinode *sfi;
+	daddr_t tries[2], block;
+	unsigned i, slot, nslots;
+	int result;
+
+	nslots = SFS_FS_INOPERBLOCK(sfs);
+	goal = SFS_INO_BLOCK(goal);
+	if (nslots == 1) {
+		/* The inode number is the block number */
+		result = sfs_balloc(sfs, goal, &block);
+		if (result) {
+			return result;
+		}
+		*ret = block;
+		return 0;
+	}
+
+	lock_acquire(sfs->sfs_inolock);
+
+	tries[0] = goal;
+	tries[1] = sfs->sfs_inohint;
+	for (i=0; i<2; i++) {
+		block = tries[i];
+		if (block == 0 || (i == 1 && block == tries[0])) {
+			continue;
+		}
+		result = sfs_buf_read(sfs, block, &buf);
+		if (result) {
+			lock_release(sfs->sfs_inolock);
+			return result;
+		}
+		for (slot=0; slot<nslots; slot++) {
+			sfi = sfs_inode_ptr(sfs, buf, SFS_MKINO(block, slot));
+			if (sfi->sfi_type == SFS_TYPE_INVAL) {
+				goto found;
+			}
+		}
+		sfs_buf_release(buf);
+	}
+
+	/* No room; start a new inode block (sfs_balloc zeroes it) */
+	result = sfs_balloc(sfs, goal, &block);
+	if (result) {
+		lock_release(sfs->sfs_inolock);
+		return result;
+	}
+	result = sfs_buf_read(sfs, block, &buf);
+	if (result) {
+		sfs_bfree(sfs, block);
+		lock_release(sfs->sfs_inolock);
+		return result;
+	}
+	slot = 0;
+	sfi = sfs_inode_ptr(sfs, buf, SFS_MKINO(block, slot));
+
+ found:
+	sfi->sfi_type = type;
+	sfs_buf_markinode(buf, slot);
+	sfs_buf_release(buf);
+	sfs->sfs_inohint = block;
+	lock_release(sfs->sfs_inolock);
+
+	*ret = SFS_MKINO(block, slot);
+	return 0;
+}
+
+/*
+ * Free inode INO, whose contents have already been released. If it
+ * shares its block with other inodes, clear its slot, and free the
+ * block only if that was the last inode in it.
+ */
+static
+void
+sfs_ifree(struct sfs_fs *sfs, uint32_t ino)
+{
+	struct sfs_buf *buf;
+	struct sfs_dinode *sfi;
+	daddr_t block;
+	unsigned slot, nslots;
+	int result;
+
+	nslots = SFS_FS_INOPERBLOCK(sfs);
+	block = SFS_INO_BLOCK(ino);
+	if (nslots == 1) {
+		sfs_bfree(sfs, block);
+		return;
+	}
+
+	lock_acquire(sfs->sfs_inolock);
+	result = sfs_buf_read(sfs, block, &buf);
+	if (result) {
+		/* Can't get at the block; leave the slot to sfsck */
+		kprintf("sfs: %s: Cannot free inode %u: %s\n",
+			sfs->sfs_sb.sb_volname, ino, strerror(result));
+		lock_release(sfs->sfs_inolock);
+		return;
+	}
+	bzero(sfs_inode_ptr(sfs, buf, ino), sfs->sfs_inodesize);
+	sfs_buf_markinode(buf, SFS_INO_SLOT(ino));
+
+	for (slot=0; slot<nslots; slot++) {
+		sfi = sfs_inode_ptr(sfs, buf, SFS_MKINO(block, slot));
+		if (sfi->sfi_type != SFS_TYPE_INVAL) {
+			break;
+		}
+	}
+	sfs_buf_release(buf);
+
+	if (slot == nslots) {
+		sfs_bfree(sfs, block);
+		if (sfs->sfs_inohint == block) {
+			sfs->sfs_inohint = 0;
+		}
+	}
+	else if (sfs->sfs_inohint == 0) {
+		sfs->sfs_inohint = block;
+	}
+	lock_release(sfs->sfs_inolock);
+}
+
+/*
+ * Copy an in-memory inode into its buffer if it's been changed.
+ */
+static
+int
+sfs_push_inode(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	struct sfs_buf *buf;
 	int result;
 
 	if (sv->sv_dirty) {
-		result = sfs_writeblock(sfs, sv->sv_ino, &sv->sv_i,
-					sizeof(sv->sv_i));
+		/*
+		 * If the inode fills its whole block there's no need
+		 * to read it; otherwise the other slots must be kept.
+		 */
+		if (SFS_FS_INOPERBLOCK(sfs) == 1) {
+			result = sfs_buf_get(sfs, sv->sv_ino, &buf);
+		}
+		else {
+			result = sfs_buf_read(sfs, SFS_INO_BLOCK(sv->sv_ino),
+					      &buf);
+		}
 		if (result) {
 			return result;
 		}
+		memcpy(sfs_inode_ptr(sfs, buf, sv->sv_ino), &sv->sv_i,
+		       sfs->sfs_inodesize);
+		sfs_buf_markinode(buf, SFS_INO_SLOT(sv->sv_ino));
+		sfs_buf_release(buf);
 		sv->sv_dirty = false;
 	}
 	return 0;
 }
 
+/*
+ * Write an on-disk inode structure back out to its buffer. It goes to
+ * disk when the buffer cache is synced. Any file blocks still waiting
+ * for allocation get theirs first, since that changes the inode.
+ */
+int
+sfs_sync_inode(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	result = sfs_da_flush(sv);
+	if (result) {
+		return result;
+	}
+	return sfs_push_inode(sfs, sv);
+}
+
+/*
+ * Copy every loaded inode that needs it into the buffer cache. We
+ * can't hold sfs_vnlock while locking the vnodes, so take a reference
+ * to each one first; that keeps them from going away underneath us.
+ */
+int
+sfs_sync_inodes(struct sfs_fs *sfs)
+{
+	struct vnode **vns;
+	struct sfs_vnode *sv;
+	unsigned i, num;
+	int result, ret = 0;
+
+	lock_acquire(sfs->sfs_vnlock);
+	num = vnodearray_num(sfs->sfs_vnodes);
+	if (num == 0) {
+		lock_release(sfs->sfs_vnlock);
+		return 0;
+	}
+	vns = kmalloc(num * sizeof(struct vnode *));
+	if (vns == NULL) {
+		lock_release(sfs->sfs_vnlock);
+		return ENOMEM;
+	}
+	for (i=0; i<num; i++) {
+		vns[i] = vnodearray_get(sfs->sfs_vnodes, i);
+		VOP_INCREF(vns[i]);
+	}
+	lock_release(sfs->sfs_vnlock);
+
+	for (i=0; i<num; i++) {
+		sv = vns[i]->vn_data;
+		if (ret == 0) {
+			sfs_trans_begin(sfs);
+			lock_acquire(sv->sv_lock);
+			result = sfs_sync_inode(sv);
+			lock_release(sv->sv_lock);
+			sfs_trans_end(sfs);
+			if (result) {
+				ret = result;
+			}
+		}
+		VOP_DECREF(vns[i]);
+	}
+	kfree(vns);
+	return ret;
+}
+
+/*
+ * Like sfs_sync_inodes, but only up to SFS_SYNCBATCH inodes that need
+ * it, starting at index *NEXT in sfs_vnodes, for the background
+ * flusher to go through them a few at a time. *NEXT is left where to
+ * carry on, or 0 once the end of the table is reached. (Reclaim moves
+ * entries around in the table, so one can be missed in a round; that
+ * only delays it to the next.)
+ */
+int
+sfs_sync_someinodes(struct sfs_fs *sfs, unsigned *next)
+{
+	struct vnode *vns[SFS_SYNCBATCH];
+	struct sfs_vnode *sv;
+	unsigned i, num, n;
+	int result, ret = 0;
+
+	lock_acquire(sfs->sfs_vnlock);
+	num = vnodearray_num(sfs->sfs_vnodes);
+	n = 0;
+	for (i = *next; i < num && n < SFS_SYNCBATCH; i++) {
+		sv = vnodearray_get(sfs->sfs_vnodes, i)->vn_data;
+		/* unlocked peek; a miss gets caught next round */
+		if (!sv->sv_dirty && sv->sv_dacount == 0) {
+			continue;
+		}
+		vns[n] = &sv->sv_absvn;
+		VOP_INCREF(vns[n]);
+		n++;
+	}
+	*next = (i < num) ? i : 0;
+	lock_release(sfs->sfs_vnlock);
+
+	for (i=0; i<n; i++) {
+		sv = vns[i]->vn_data;
+		if (ret == 0) {
+			sfs_trans_begin(sfs);
+			lock_acquire(sv->sv_lock);
+			result = sfs_sync_inode(sv);
+			lock_release(sv->sv_lock);
+			sfs_trans_end(sfs);
+			if (result) {
+				ret = result;
+			}
+		}
+		VOP_DECREF(vns[i]);
+	}
+	return ret;
+}
+
+/*
+ * Copy every loaded inode that's been changed into the buffer cache,
+ * leaving any blocks waiting for allocation where they are. This is
+ * for the journal commit, which has already waited for every
+ * transaction to finish and so can look at the inodes without
+ * locking them.
+ */
+int
+sfs_push_inodes(struct sfs_fs *sfs)
+{
+	struct vnode *v;
+	unsigned i, num;
+	int result;
+
+	lock_acquire(sfs->sfs_vnlock);
+	num = vnodearray_num(sfs->sfs_vnodes);
+	for (i=0; i<num; i++) {
+		v = vnodearray_get(sfs->sfs_vnodes, i);
+		result = sfs_push_inode(sfs, v->vn_data);
+		if (result) {
+			lock_release(sfs->sfs_vnlock);
+			return result;
+		}
+	}
+	lock_release(sfs->sfs_vnlock);
+	return 0;
+}
+
+/*
+ * Check whether someone has picked up a vnode we were asked to
+ * reclaim. If so, consume the reference VOP_DECREF gave us.
+ */
+static
+bool
+sfs_reclaim_busy(struct vnode *v)
+{
+	spinlock_acquire(&v->vn_countlock);
+	if (v->vn_refcount != 1) {
+		KASSERT(v->vn_refcount>1);
+		v->vn_refcount--;
+		spinlock_release(&v->vn_countlock);
+		return true;
+	}
+	spinlock_release(&v->vn_countlock);
+	return false;
+}
+
 /*
  * Called when the vnode refcount (in-memory usage count) hits zero.
  *
@@ -70,34 +446,39 @@ sfs_reclaim(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
-	unsigned ix, i, num;
+	struct vnode *lastv;
+	unsigned ix, num;
 	int result;
 
-	vfs_biglock_acquire();
+	sfs_trans_begin(sfs);
+	lock_acquire(sv->sv_lock);
 
 	/*
 	 * Make sure someone else hasn't picked up the vnode since the
-	 * decision was made to reclaim it. (You must also synchronize
-	 * this with sfs_loadvnode.)
+	 * decision was made to reclaim it. sfs_loadvnode only does
+	 * that while holding sfs_vnlock.
 	 */
-	spinlock_acquire(&v->vn_countlock);
-	if (v->vn_refcount != 1) {
-
-		/* consume the reference VOP_DECREF gave us */
-		KASSERT(v->vn_refcount>1);
-		v->vn_refcount--;
-
-		spinlock_release(&v->vn_countlock);
-		vfs_biglock_release();
+	lock_acquire(sfs->sfs_vnlock);
+	if (sfs_reclaim_busy(v)) {
+		lock_release(sfs->sfs_vnlock);
+		lock_release(sv->sv_lock);
+		sfs_trans_end(sfs);
 		return EBUSY;
 	}
-	spinlock_release(&v->vn_countlock);
+	lock_release(sfs->sfs_vnlock);
 
 	/* If there are no on-disk references to the file either, erase it. */
 	if (sv->sv_i.sfi_linkcount == 0) {
+		result = sfs_dir_dropindex(sv);
+		if (result) {
+			lock_release(sv->sv_lock);
+			sfs_trans_end(sfs);
+			return result;
+		}
 		result = sfs_itrunc(sv, 0);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sv->sv_lock);
+			sfs_trans_end(sfs);
 			return result;
 		}
 	}
@@ -105,35 +486,52 @@ sfs_reclaim(struct vnode *v)
 	/* Sync the inode to disk */
 	result = sfs_sync_inode(sv);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_trans_end(sfs);
 		return result;
 	}
+	KASSERT(sv->sv_dacount == 0);
+
+	/*
+	 * We let go of sfs_vnlock to do the I/O, so check again. If
+	 * we're still the only holder, nobody can find the vnode once
+	 * it's out of the tables.
+	 */
+	lock_acquire(sfs->sfs_vnlock);
+	if (sfs_reclaim_busy(v)) {
+		lock_release(sfs->sfs_vnlock);
+		lock_release(sv->sv_lock);
+		sfs_trans_end(sfs);
+		return EBUSY;
+	}
 
 	/* If there are no on-disk references, discard the inode */
 	if (sv->sv_i.sfi_linkcount==0) {
-		sfs_bfree(sfs, sv->sv_ino);
+		sfs_ifree(sfs, sv->sv_ino);
 	}
 
-	/* Remove the vnode structure from the table in the struct sfs_fs. */
+	/*
+	 * Remove the vnode structure from the tables in the struct
+	 * sfs_fs. To avoid shuffling the array, move the last entry
+	 * into our slot.
+	 */
+	sfs_vnhash_remove(sfs, sv);
 	num = vnodearray_num(sfs->sfs_vnodes);
-	ix = num;
-	for (i=0; i<num; i++) {
-		struct vnode *v2 = vnodearray_get(sfs->sfs_vnodes, i);
-		struct sfs_vnode *sv2 = v2->vn_data;
-		if (sv2 == sv) {
-			ix = i;
-			break;
-		}
-	}
-	if (ix == num) {
-		panic("sfs: %s: reclaim vnode %u not in vnode pool\n",
-		      sfs->sfs_sb.sb_volname, sv->sv_ino);
-	}
-	vnodearray_remove(sfs->sfs_vnodes, ix);
+	ix = sv->sv_vnindex;
+	KASSERT(ix < num && vnodearray_get(sfs->sfs_vnodes, ix) == v);
+	lastv = vnodearray_get(sfs->sfs_vnodes, num - 1);
+	vnodearray_set(sfs->sfs_vnodes, ix, lastv);
+	((struct sfs_vnode *)lastv->vn_data)->sv_vnindex = ix;
+	result = vnodearray_setsize(sfs->sfs_vnodes, num - 1);
+	/* shrinking an array cannot fail */
+	KASSERT(result == 0);
+
+	lock_release(sfs->sfs_vnlock);
+	lock_release(sv->sv_lock);
+	sfs_trans_end(sfs);
 
 	vnode_cleanup(&sv->sv_absvn);
-
-	vfs_biglock_release();
+	lock_destroy(sv->sv_lock);
 
 	/* Release the storage for the vnode structure itself. */
 	kfree(sv);
@@ -145,42 +543,44 @@ sfs_reclaim(struct vnode *v)
 /*
  * Function to load a inode into memory as a vnode, or dig up one
  * that's already resident.
+ *
+ * sfs_vnlock isn't held while reading the inode, so someone else can
+ * load the same one meanwhile; whoever gets it into the table first
+ * wins. What we read can also be out of date if someone else loaded
+ * it, changed it, and reclaimed it (writing it back) in the meantime;
+ * sfs_vngen changes when that happens, and then we read it again.
  */
 int
 sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		 struct sfs_vnode **ret)
 {
-	struct vnode *v;
-	struct sfs_vnode *sv;
+	struct sfs_vnode *sv, *other;
+	struct sfs_buf *buf;
 	const struct vnode_ops *ops;
-	unsigned i, num;
+	unsigned gen;
 	int result;
 
-	/* Look in the vnodes table */
-	num = vnodearray_num(sfs->sfs_vnodes);
-
-	/* Linear search. Is this too slow? You decide. */
-	for (i=0; i<num; i++) {
-		v = vnodearray_get(sfs->sfs_vnodes, i);
-		sv = v->vn_data;
+	lock_acquire(sfs->sfs_vnlock);
 
+	/* Look in the vnodes table */
+	sv = sfs_vnhash_find(sfs, ino);
+	if (sv != NULL) {
 		/* Every inode in memory must be in an allocated block */
-		if (!sfs_bused(sfs, sv->sv_ino)) {
+		if (!sfs_bused(sfs, SFS_INO_BLOCK(sv->sv_ino))) {
 			panic("sfs: %s: Found inode %u in unallocated block\n",
 			      sfs->sfs_sb.sb_volname, sv->sv_ino);
 		}
 
-		if (sv->sv_ino==ino) {
-			/* Found */
-
-			/* forcetype is only allowed when creating objects */
-			KASSERT(forcetype==SFS_TYPE_INVAL);
+		/* forcetype is only allowed when creating objects */
+		KASSERT(forcetype==SFS_TYPE_INVAL);
 
-			VOP_INCREF(&sv->sv_absvn);
-			*ret = sv;
-			return 0;
-		}
+		VOP_INCREF(&sv->sv_absvn);
+		lock_release(sfs->sfs_vnlock);
+		*ret = sv;
+		return 0;
 	}
+	gen = sfs->sfs_vngen;
+	lock_release(sfs->sfs_vnlock);
 
 	/* Didn't have it loaded; load it */
 
@@ -188,19 +588,33 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	if (sv==NULL) {
 		return ENOMEM;
 	}
+	sv->sv_lock = lock_create("sfs vnode");
+	if (sv->sv_lock == NULL) {
+		kfree(sv);
+		return ENOMEM;
+	}
 
 	/* Must be in an allocated block */
-	if (!sfs_bused(sfs, ino)) {
+	if (!sfs_bused(sfs, SFS_INO_BLOCK(ino)) ||
+	    SFS_INO_SLOT(ino) >= SFS_FS_INOPERBLOCK(sfs)) {
 		panic("sfs: %s: Tried to load inode %u from "
 		      "unallocated block\n", sfs->sfs_sb.sb_volname, ino);
 	}
 
-	/* Read the block the inode is in */
-	result = sfs_readblock(sfs, ino, &sv->sv_i, sizeof(sv->sv_i));
+ reread:
+	/*
+	 * Read the block the inode is in. If it's shared, the rest of
+	 * it stays in the buffer cache for its neighbors.
+	 */
+	result = sfs_buf_read(sfs, SFS_INO_BLOCK(ino), &buf);
 	if (result) {
+		lock_destroy(sv->sv_lock);
 		kfree(sv);
 		return result;
 	}
+	bzero(&sv->sv_i, sizeof(sv->sv_i));
+	memcpy(&sv->sv_i, sfs_inode_ptr(sfs, buf, ino), sfs->sfs_inodesize);
+	sfs_buf_release(buf);
 
 	/* Not dirty yet */
 	sv->sv_dirty = false;
@@ -208,10 +622,12 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/*
 	 * FORCETYPE is set if we're creating a new file, because the
 	 * block on disk will have been zeroed out by sfs_balloc and
-	 * thus the type recorded there will be SFS_TYPE_INVAL.
+	 * thus the type recorded there will be SFS_TYPE_INVAL. (A
+	 * packed inode has had its type set already by sfs_ialloc.)
 	 */
 	if (forcetype != SFS_TYPE_INVAL) {
-		KASSERT(sv->sv_i.sfi_type == SFS_TYPE_INVAL);
+		KASSERT(sv->sv_i.sfi_type == SFS_TYPE_INVAL ||
+			sv->sv_i.sfi_type == forcetype);
 		sv->sv_i.sfi_type = forcetype;
 		sv->sv_dirty = true;
 	}
@@ -232,23 +648,61 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		      ino, sv->sv_i.sfi_type);
 	}
 
+	lock_acquire(sfs->sfs_vnlock);
+
+	/* Did someone else get there first? */
+	other = sfs_vnhash_find(sfs, ino);
+	if (other != NULL) {
+		KASSERT(forcetype==SFS_TYPE_INVAL);
+		VOP_INCREF(&other->sv_absvn);
+		lock_release(sfs->sfs_vnlock);
+		lock_destroy(sv->sv_lock);
+		kfree(sv);
+		*ret = other;
+		return 0;
+	}
+	if (sfs->sfs_vngen != gen) {
+		/* What we read may be stale */
+		gen = sfs->sfs_vngen;
+		lock_release(sfs->sfs_vnlock);
+		goto reread;
+	}
+
 	/* Call the common vnode initializer */
 	result = vnode_init(&sv->sv_absvn, ops, &sfs->sfs_absfs, sv);
 	if (result) {
+		lock_release(sfs->sfs_vnlock);
+		lock_destroy(sv->sv_lock);
 		kfree(sv);
 		return result;
 	}
 
 	/* Set the other fields in our vnode structure */
 	sv->sv_ino = ino;
-
-	/* Add it to our table */
-	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_absvn, NULL);
+	sv->sv_ranext = 0;
+	sv->sv_rawindow = 0;
+	sv->sv_rahigh = 0;
+	sv->sv_lastib = 0;
+	sv->sv_lastibbase = 0;
+	sv->sv_resnext = 0;
+	sv->sv_resleft = 0;
+	sv->sv_dabase = 0;
+	sv->sv_dacount = 0;
+
+	/* Add it to our tables */
+	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_absvn,
+				&sv->sv_vnindex);
 	if (result) {
+		lock_release(sfs->sfs_vnlock);
 		vnode_cleanup(&sv->sv_absvn);
+		lock_destroy(sv->sv_lock);
 		kfree(sv);
 		return result;
 	}
+	sv->sv_hashnext = sfs->sfs_vnhash[ino % SFS_VNHASHSIZE];
+	sfs->sfs_vnhash[ino % SFS_VNHASHSIZE] = sv;
+
+	lock_release(sfs->sfs_vnlock);
 
 	/* Hand it back */
 	*ret = sv;
@@ -256,20 +710,56 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 }
 
 /*
- * Create a new filesystem object and hand back its vnode.
+ * Get the SFS_TYPE_* of inode INO without loading a vnode for it, for
+ * directory listings. A loaded vnode is authoritative; otherwise the
+ * type is read from the inode block (which, with packed inodes, a
+ * listing of files created together mostly finds in the cache). The
+ * type of an inode in use never changes, so it doesn't matter if
+ * someone loads it after we let go of sfs_vnlock.
  */
 int
-sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
+sfs_inode_gettype(struct sfs_fs *sfs, uint32_t ino, unsigned *ret)
+{
+	struct sfs_vnode *sv;
+	struct sfs_buf *buf;
+	struct sfs_dinode *sfi;
+	int result;
+
+	lock_acquire(sfs->sfs_vnlock);
+	sv = sfs_vnhash_find(sfs, ino);
+	if (sv != NULL) {
+		*ret = sv->sv_i.sfi_type;
+		lock_release(sfs->sfs_vnlock);
+		return 0;
+	}
+	lock_release(sfs->sfs_vnlock);
+
+	result = sfs_buf_read(sfs, SFS_INO_BLOCK(ino), &buf);
+	if (result) {
+		return result;
+	}
+	sfi = sfs_inode_ptr(sfs, buf, ino);
+	*ret = sfi->sfi_type;
+	sfs_buf_release(buf);
+	return 0;
+}
+
+/*
+ * Create a new filesystem object and hand back its vnode. The inode
+ * goes as close to GOAL (normally the directory's inode) as possible.
+ */
+int
+sfs_makeobj(struct sfs_fs *sfs, int type, daddr_t goal,
+	    struct sfs_vnode **ret)
 {
 	uint32_t ino;
 	int result;
 
 	/*
-	 * First, get an inode. (Each inode is a block, and the inode
-	 * number is the block number, so just get a block.)
+	 * First, get an inode.
 	 */
 
-	result = sfs_balloc(sfs, &ino);
+	result = sfs_ialloc(sfs, type, goal, &ino);
 	if (result) {
 		return result;
 	}
@@ -280,7 +770,7 @@ sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
 
 	result = sfs_loadvnode(sfs, ino, type, ret);
 	if (result) {
-		sfs_bfree(sfs, ino);
+		sfs_ifree(sfs, ino);
 	}
 	return result;
 }
@@ -296,25 +786,21 @@ sfs_getroot(struct fs *fs, struct vnode **ret)
 	struct sfs_vnode *sv;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = sfs_loadvnode(sfs, SFS_ROOTDIR_INO, SFS_TYPE_INVAL, &sv);
 	if (result) {
 		kprintf("sfs: %s: getroot: Cannot load root vnode\n",
 			sfs->sfs_sb.sb_volname);
-		vfs_biglock_release();
 		return result;
 	}
 
+	/* (The type never changes once loaded, so no lock needed) */
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
 		kprintf("sfs: %s: getroot: not directory (type %u)\n",
 			sfs->sfs_sb.sb_volname, sv->sv_i.sfi_type);
-		vfs_biglock_release();
+		VOP_DECREF(&sv->sv_absvn);
 		return EINVAL;
 	}
 
-	vfs_biglock_release();
-
 	*ret = &sv->sv_absvn;
 	return 0;
 }
@@ -35,6 +35,7 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <synch.h>
 #include <uio.h>
 #include <vfs.h>
 #include <device.h>
@@ -62,11 +63,9 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 	int result;
 	int tries=0;
 
-	KASSERT(vfs_biglock_do_i_hold());
-
 	DEBUG(DB_SFS, "sfs: %s %llu\n",
 	      uio->uio_rw == UIO_READ ? "read" : "write",
-	      uio->uio_offset / SFS_BLOCKSIZE);
+	      uio->uio_offset / SFS_FS_BLOCKSIZE(sfs));
 
  retry:
 	result = DEVOP_IO(sfs->sfs_device, uio);
@@ -84,7 +83,7 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 			tries++;
 			kprintf("sfs: %s: block %llu I/O error, retrying\n",
 				sfs->sfs_sb.sb_volname,
-				uio->uio_offset / SFS_BLOCKSIZE);
+				uio->uio_offset / SFS_FS_BLOCKSIZE(sfs));
 			goto retry;
 		}
 		else if (tries < 10) {
@@ -95,14 +94,17 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 			kprintf("sfs: %s: block %llu I/O error, giving up "
 				"after %d retries\n",
 				sfs->sfs_sb.sb_volname,
-				uio->uio_offset / SFS_BLOCKSIZE, tries);
+				uio->uio_offset / SFS_FS_BLOCKSIZE(sfs),
+				tries);
 		}
 	}
 	return result;
 }
 
 /*
- * Read a block.
+ * Read a block. LEN is normally the block size; it may also be
+ * SFS_BLOCKSIZE to read just the start of the block, for the
+ * superblock and the other structures that size.
  */
 int
 sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
@@ -110,14 +112,14 @@ sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 	struct iovec iov;
 	struct uio ku;
 
-	KASSERT(len == SFS_BLOCKSIZE);
+	KASSERT(len == SFS_FS_BLOCKSIZE(sfs) || len == SFS_BLOCKSIZE);
 
-	SFSUIO(&iov, &ku, data, block, UIO_READ);
+	SFSUIO(sfs, &iov, &ku, data, len, block, UIO_READ);
 	return sfs_rwblock(sfs, &ku);
 }
 
 /*
- * Write a block.
+ * Write a block. LEN is as for sfs_readblock.
  */
 int
 sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
@@ -125,9 +127,9 @@ sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 	struct iovec iov;
 	struct uio ku;
 
-	KASSERT(len == SFS_BLOCKSIZE);
+	KASSERT(len == SFS_FS_BLOCKSIZE(sfs) || len == SFS_BLOCKSIZE);
 
-	SFSUIO(&iov, &ku, data, block, UIO_WRITE);
+	SFSUIO(sfs, &iov, &ku, data, len, block, UIO_WRITE);
 	return sfs_rwblock(sfs, &ku);
 }
 
@@ -135,153 +137,489 @@ sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 //
 // File-level I/O
 
+/* Read-ahead window, in blocks: initial size and limit */
+#define SFS_RAMIN   4
+#define SFS_RAMAX   32
+
 /*
- * Do I/O to a block of a file that doesn't cover the whole block.  We
- * need to read in the original block first, even if we're writing, so
- * we don't clobber the portion of the block we're not intending to
- * write over.
+ * Read-ahead. Called after a successful read of the file blocks from
+ * FIRSTBLOCK up to (not including) ENDBLOCK. If this read picked up
+ * where the last one left off, queue the next window's worth of
+ * blocks to be read into the cache in the background, and double the
+ * window for next time. Any other access pattern resets the window.
  *
- * SKIPSTART is the number of bytes to skip past at the beginning of
- * the sector; LEN is the number of bytes to actually read or write.
- * UIO is the area to do the I/O into.
+ * Blocks already queued by an earlier call are not queued again.
  */
 static
-int
-sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
-	      uint32_t skipstart, uint32_t len)
+void
+sfs_readahead_check(struct sfs_vnode *sv, uint32_t firstblock,
+		    uint32_t endblock)
 {
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t fileblocks, block, stop;
+	daddr_t diskblock;
+
 	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
+	 * A read that ended partway through a block leaves the next
+	 * one starting in that same block, so accept either.
 	 */
-	static char iobuf[SFS_BLOCKSIZE];
+	if (firstblock == sv->sv_ranext || firstblock + 1 == sv->sv_ranext) {
+		if (sv->sv_rawindow == 0) {
+			sv->sv_rawindow = SFS_RAMIN;
+		}
+		else if (sv->sv_rawindow < SFS_RAMAX) {
+			sv->sv_rawindow *= 2;
+		}
+	}
+	else {
+		sv->sv_rawindow = 0;
+		sv->sv_rahigh = 0;
+	}
+	sv->sv_ranext = endblock;
+
+	if (sv->sv_rawindow == 0) {
+		return;
+	}
+
+	fileblocks = DIVROUNDUP(sv->sv_i.sfi_size, SFS_FS_BLOCKSIZE(sfs));
+	block = endblock > sv->sv_rahigh ? endblock : sv->sv_rahigh;
+	stop = endblock + sv->sv_rawindow;
+	if (stop > fileblocks) {
+		stop = fileblocks;
+	}
+
+	for (; block < stop; block++) {
+		if (sfs_bmap(sv, block, 0, &diskblock)) {
+			break;
+		}
+		if (diskblock != 0) {
+			sfs_readahead(sfs, diskblock);
+		}
+	}
+	if (block > sv->sv_rahigh) {
+		sv->sv_rahigh = block;
+	}
+}
+
+////////////////////////////////////////////////////////////
+// Delayed allocation
+
+/*
+ * Blocks written at the end of a file don't get disk blocks right
+ * away. Their contents wait in memory, in the vnode (sv_dadata), as
+ * a run of up to SFS_DAMAXBLOCKS file blocks starting at sv_dabase.
+ * When the run is full, or something needs the blocks on disk (a
+ * read, fsync, sync, or reclaim), sfs_da_flush allocates one extent
+ * for the whole run and writes it out in order. An appending writer
+ * that goes in small pieces thus causes a few large sequential
+ * writes instead of many scattered ones.
+ *
+ * The file size (sfi_size) covers the waiting blocks. If we crash
+ * before they're flushed, the end of the file reads back as zeros.
+ *
+ * The memory for waiting blocks comes from a per-volume free list
+ * (sfs_dafree) and goes back to it, rather than to kfree: with 2K or
+ * 4K blocks each one is a whole page, which kfree can't give back.
+ */
+
+/*
+ * Get a block's worth of memory for a waiting block, or NULL.
+ */
+static
+char *
+sfs_da_getblock(struct sfs_fs *sfs)
+{
+	char *data;
+
+	lock_acquire(sfs->sfs_dalock);
+	data = sfs->sfs_dafree;
+	if (data != NULL) {
+		/* the next pointer is kept in the block itself */
+		sfs->sfs_dafree = *(void **)data;
+	}
+	lock_release(sfs->sfs_dalock);
+
+	if (data == NULL) {
+		data = kmalloc(SFS_FS_BLOCKSIZE(sfs));
+	}
+	return data;
+}
+
+/*
+ * Put back memory from sfs_da_getblock.
+ */
+static
+void
+sfs_da_putblock(struct sfs_fs *sfs, char *data)
+{
+	lock_acquire(sfs->sfs_dalock);
+	*(void **)data = sfs->sfs_dafree;
+	sfs->sfs_dafree = data;
+	lock_release(sfs->sfs_dalock);
+}
+
+/*
+ * Free the spare blocks, at unmount.
+ */
+void
+sfs_da_cleanup(struct sfs_fs *sfs)
+{
+	void *data;
+
+	while (sfs->sfs_dafree != NULL) {
+		data = sfs->sfs_dafree;
+		sfs->sfs_dafree = *(void **)data;
+		kfree(data);
+	}
+}
 
+/*
+ * Write LEN bytes at SKIPSTART into file block FILEBLOCK if it's (or
+ * can become) one of the blocks waiting for allocation. Sets HANDLED
+ * if so; otherwise the caller should do the write normally.
+ */
+static
+int
+sfs_da_write(struct sfs_vnode *sv, uint32_t fileblock, uint32_t skipstart,
+	     uint32_t len, struct uio *uio, bool *handled)
+{
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 	daddr_t diskblock;
-	uint32_t fileblock;
+	char *data;
 	int result;
 
-	/* Allocate missing blocks if and only if we're writing */
-	bool doalloc = (uio->uio_rw==UIO_WRITE);
+	*handled = false;
 
-	KASSERT(skipstart + len <= SFS_BLOCKSIZE);
+	if (sv->sv_dacount > 0 && fileblock >= sv->sv_dabase &&
+	    fileblock - sv->sv_dabase < sv->sv_dacount) {
+		/* Already waiting; just update it */
+		*handled = true;
+		data = sv->sv_dadata[fileblock - sv->sv_dabase];
+		return uiomove(data + skipstart, len, uio);
+	}
 
-	/* We're using a global static buffer; it had better be locked */
-	KASSERT(vfs_biglock_do_i_hold());
+	/* Only new blocks past EOF qualify */
+	if ((off_t)fileblock * SFS_FS_BLOCKSIZE(sfs) < sv->sv_i.sfi_size) {
+		return 0;
+	}
 
-	/* Compute the block offset of this block in the file */
-	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
+	/* If it doesn't extend the run we have, or that's full, flush */
+	if (sv->sv_dacount > 0 &&
+	    (fileblock != sv->sv_dabase + sv->sv_dacount ||
+	     sv->sv_dacount == SFS_DAMAXBLOCKS)) {
+		result = sfs_da_flush(sv);
+		if (result) {
+			return result;
+		}
+	}
 
-	/* Get the disk block number */
-	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
+	result = sfs_bmap(sv, fileblock, 0, &diskblock);
 	if (result) {
 		return result;
 	}
+	if (diskblock != 0) {
+		return 0;
+	}
 
-	if (diskblock == 0) {
-		/*
-		 * There was no block mapped at this point in the file.
-		 * Zero the buffer.
-		 */
-		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
+	data = sfs_da_getblock(sfs);
+	if (data == NULL) {
+		/* Just allocate it now */
+		return 0;
 	}
-	else {
-		/*
-		 * Read the block.
-		 */
-		result = sfs_readblock(sfs, diskblock, iobuf, sizeof(iobuf));
+	bzero(data, SFS_FS_BLOCKSIZE(sfs));
+
+	if (sv->sv_dacount == 0) {
+		sv->sv_dabase = fileblock;
+	}
+	sv->sv_dadata[sv->sv_dacount++] = data;
+
+	/* Even if this fails partway, keep what we got */
+	*handled = true;
+	return uiomove(data + skipstart, len, uio);
+}
+
+/*
+ * Give the blocks waiting for allocation in SV disk blocks, as one
+ * extent if possible, and write them out.
+ */
+int
+sfs_da_flush(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_buf *buf;
+	daddr_t diskblocks[SFS_DAMAXBLOCKS];
+	daddr_t prev, goal;
+	unsigned i, j;
+	int result, result2;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (sv->sv_dacount == 0) {
+		return 0;
+	}
+
+	/* Try to get one extent for the lot, right after what precedes it */
+	goal = SFS_INO_BLOCK(sv->sv_ino) + 1;
+	if (sv->sv_dabase > 0 &&
+	    sfs_bmap(sv, sv->sv_dabase - 1, 0, &prev) == 0 && prev != 0) {
+		goal = prev + 1;
+	}
+	(void)sfs_breserve(sv, goal, sv->sv_dacount);
+
+	result = 0;
+	for (i=0; i<sv->sv_dacount; i++) {
+		result = sfs_bmap(sv, sv->sv_dabase + i,
+				  SFS_BMAP_ALLOC | SFS_BMAP_NOCLEAR,
+				  &diskblocks[i]);
 		if (result) {
-			return result;
+			break;
+		}
+		result = sfs_buf_get(sfs, diskblocks[i], &buf);
+		if (result) {
+			break;
 		}
+		memcpy(buf->b_data, sv->sv_dadata[i], SFS_FS_BLOCKSIZE(sfs));
+		sfs_buf_markdirty(buf);
+		sfs_buf_release(buf);
+		sfs_da_putblock(sfs, sv->sv_dadata[i]);
 	}
+	sfs_bunreserve(sv);
 
-	/*
-	 * Now perform the requested operation into/out of the buffer.
-	 */
-	result = uiomove(iobuf+skipstart, len, uio);
-	if (result) {
-		return result;
+	/* Now write out what we did; normally that's one extent, in order */
+	for (j=0; j<i; j++) {
+		result2 = sfs_buf_flush(sfs, diskblocks[j]);
+		if (result2 && result == 0) {
+			result = result2;
+		}
 	}
 
-	/*
-	 * If it was a write, write back the modified block.
-	 */
+	/* Keep whatever we didn't get to */
+	for (j=i; j<sv->sv_dacount; j++) {
+		sv->sv_dadata[j-i] = sv->sv_dadata[j];
+	}
+	sv->sv_dabase += i;
+	sv->sv_dacount -= i;
+
+	return result;
+}
+
+/*
+ * Drop any blocks waiting for allocation at or past file block
+ * BLOCKLEN. For truncate.
+ */
+void
+sfs_da_truncate(struct sfs_vnode *sv, uint32_t blocklen)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+
+	while (sv->sv_dacount > 0 &&
+	       sv->sv_dabase + sv->sv_dacount > blocklen) {
+		sv->sv_dacount--;
+		sfs_da_putblock(sfs, sv->sv_dadata[sv->sv_dacount]);
+	}
+}
+
+////////////////////////////////////////////////////////////
+// Inline data
+
+/*
+ * A file small enough keeps its contents in the spare space at the
+ * end of its inode (see kern/sfs.h) instead of in a block of its own.
+ * Reading and writing it is then just copying to and from the
+ * in-memory inode, and it reaches the disk when the inode does. A
+ * write that would take it past SFS_FS_INLINEMAX moves the contents
+ * out to file block 0 first.
+ */
+
+/*
+ * Read or write an inline file. Reads have already been cut off at
+ * EOF; writes must fit.
+ */
+static
+int
+sfs_inline_io(struct sfs_vnode *sv, struct uio *uio)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	char *data = (char *)sv->sv_i.sfi_waste;
+	int result;
+
+	KASSERT(uio->uio_offset + uio->uio_resid <= SFS_FS_INLINEMAX(sfs));
+
+	result = uiomove(data + uio->uio_offset, uio->uio_resid, uio);
 	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_writeblock(sfs, diskblock, iobuf, sizeof(iobuf));
-		if (result) {
-			return result;
+		/* sfs_io updates the size */
+		sv->sv_dirty = true;
+	}
+	return result;
+}
+
+/*
+ * Move an inline file's contents out of the inode into file block 0,
+ * so it can grow past what fits. The block waits for allocation like
+ * any other new block at the end of a file.
+ */
+int
+sfs_inline_evict(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	char *inlinedata = (char *)sv->sv_i.sfi_waste;
+	struct sfs_buf *buf;
+	daddr_t diskblock;
+	char *data;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(SFS_ISINLINE(sv));
+	KASSERT(sv->sv_dacount == 0);
+
+	sv->sv_i.sfi_flags &= ~SFS_INODE_INLINE;
+
+	if (sv->sv_i.sfi_size > 0) {
+		data = sfs_da_getblock(sfs);
+		if (data != NULL) {
+			bzero(data, SFS_FS_BLOCKSIZE(sfs));
+			memcpy(data, inlinedata, sv->sv_i.sfi_size);
+			sv->sv_dabase = 0;
+			sv->sv_dadata[0] = data;
+			sv->sv_dacount = 1;
+		}
+		else {
+			/* No memory to wait with; allocate it now */
+			result = sfs_bmap(sv, 0, SFS_BMAP_ALLOC, &diskblock);
+			if (result == 0) {
+				result = sfs_buf_read(sfs, diskblock, &buf);
+			}
+			if (result) {
+				sv->sv_i.sfi_flags |= SFS_INODE_INLINE;
+				return result;
+			}
+			memcpy(buf->b_data, inlinedata, sv->sv_i.sfi_size);
+			sfs_buf_markdirty(buf);
+			sfs_buf_release(buf);
 		}
 	}
 
+	bzero(inlinedata, SFS_FS_INLINEMAX(sfs));
+	sv->sv_dirty = true;
 	return 0;
 }
 
+////////////////////////////////////////////////////////////
+// File data I/O
+
 /*
- * Do I/O (either read or write) of a single whole block.
+ * Do I/O to (part of) a single block of a file, through the buffer
+ * cache.
+ *
+ * SKIPSTART is the number of bytes to skip past at the beginning of
+ * the block; LEN is the number of bytes to actually read or write.
+ * UIO is the area to do the I/O into.
+ *
+ * If we're writing only part of the block, the rest of it has to be
+ * read in first so we don't clobber it. If we're writing the whole
+ * block there's no need to read it.
  */
 static
 int
-sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
+sfs_blockio(struct sfs_vnode *sv, struct uio *uio,
+	    uint32_t skipstart, uint32_t len)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_buf *buf;
 	daddr_t diskblock;
 	uint32_t fileblock;
+	size_t resid;
+	bool isnew = false;
 	int result;
-	bool doalloc = (uio->uio_rw==UIO_WRITE);
-	off_t saveoff;
-	off_t diskoff;
-	off_t saveres;
-	off_t diskres;
 
-	/* Get the block number within the file */
-	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
+	/* Overwriting a whole block? */
+	bool fullwrite = (uio->uio_rw == UIO_WRITE &&
+			  len == SFS_FS_BLOCKSIZE(sfs));
+
+	KASSERT(skipstart + len <= SFS_FS_BLOCKSIZE(sfs));
+
+	/* Compute the block offset of this block in the file */
+	fileblock = uio->uio_offset / SFS_FS_BLOCKSIZE(sfs);
+
+	/* New blocks at the end of the file wait in memory */
+	if (uio->uio_rw == UIO_WRITE) {
+		bool handled;
+
+		result = sfs_da_write(sv, fileblock, skipstart, len, uio,
+				      &handled);
+		if (result || handled) {
+			return result;
+		}
+	}
 
-	/* Look up the disk block number */
-	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
+	/* Get the disk block number */
+	result = sfs_bmap(sv, fileblock, 0, &diskblock);
 	if (result) {
 		return result;
 	}
 
+	/*
+	 * Allocate missing blocks if and only if we're writing. If
+	 * we're about to overwrite all of it, don't bother clearing it.
+	 */
+	if (diskblock == 0 && uio->uio_rw == UIO_WRITE) {
+		result = sfs_bmap(sv, fileblock, fullwrite ?
+				  SFS_BMAP_ALLOC | SFS_BMAP_NOCLEAR :
+				  SFS_BMAP_ALLOC, &diskblock);
+		if (result) {
+			return result;
+		}
+		isnew = fullwrite;
+	}
+
 	if (diskblock == 0) {
 		/*
-		 * No block - fill with zeros.
-		 *
-		 * We must be reading, or sfs_bmap would have
-		 * allocated a block for us.
+		 * There was no block mapped at this point in the file.
+		 * Read zeros. (We must be reading, or sfs_bmap would
+		 * have allocated a block for us.)
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		return uiomovezeros(SFS_BLOCKSIZE, uio);
+		return uiomovezeros(len, uio);
 	}
 
-	/*
-	 * Do the I/O directly to the uio region. Save the uio_offset,
-	 * and substitute one that makes sense to the device.
-	 */
-	saveoff = uio->uio_offset;
-	diskoff = diskblock * SFS_BLOCKSIZE;
-	uio->uio_offset = diskoff;
+	if (fullwrite) {
+		/* Overwriting all of it; don't bother reading it */
+		result = sfs_buf_get(sfs, diskblock, &buf);
+	}
+	else {
+		result = sfs_buf_read(sfs, diskblock, &buf);
+	}
+	if (result) {
+		return result;
+	}
 
 	/*
-	 * Temporarily set the residue to be one block size.
+	 * Now perform the requested operation into/out of the buffer.
 	 */
-	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
-	saveres = uio->uio_resid;
-	diskres = SFS_BLOCKSIZE;
-	uio->uio_resid = diskres;
+	resid = uio->uio_resid;
+	result = uiomove(buf->b_data + skipstart, len, uio);
 
-	result = sfs_rwblock(sfs, uio);
+	if (result && isnew && !buf->b_valid) {
+		/*
+		 * A whole-block write into a block we didn't clear
+		 * failed partway. Clear the rest so whatever was on
+		 * disk before doesn't end up in the file.
+		 */
+		bzero(buf->b_data + (resid - uio->uio_resid),
+		      SFS_FS_BLOCKSIZE(sfs) - (resid - uio->uio_resid));
+	}
 
 	/*
-	 * Now, restore the original uio_offset and uio_resid and update
-	 * them by the amount of I/O done.
+	 * If it was a write, the buffer is now dirty. The exception
+	 * is a whole-block write into an existing block we never read
+	 * that failed partway; leave that invalid so it gets reread.
 	 */
-	uio->uio_offset = (uio->uio_offset - diskoff) + saveoff;
-	uio->uio_resid = (uio->uio_resid - diskres) + saveres;
+	if (uio->uio_rw == UIO_WRITE &&
+	    (result == 0 || buf->b_valid || isnew)) {
+		sfs_buf_markdirty(buf);
+	}
 
+	sfs_buf_release(buf);
 	return result;
 }
 
@@ -291,17 +629,23 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 int
 sfs_io(struct sfs_vnode *sv, struct uio *uio)
 {
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 	uint32_t blkoff;
 	uint32_t nblocks, i;
 	int result = 0;
 	uint32_t origresid, extraresid = 0;
+	off_t startpos;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
 	origresid = uio->uio_resid;
+	startpos = uio->uio_offset;
 
 	/*
 	 * If reading, check for EOF. If we can read a partial area,
 	 * remember how much extra there was in EXTRARESID so we can
-	 * add it back to uio_resid at the end.
+	 * add it back to uio_resid at the end. Likewise for writes that
+	 * would go past the largest file we can have.
 	 */
 	if (uio->uio_rw == UIO_READ) {
 		off_t size = sv->sv_i.sfi_size;
@@ -317,26 +661,73 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 			KASSERT(uio->uio_resid > extraresid);
 			uio->uio_resid -= extraresid;
 		}
+
+		/* If any of it is still waiting for disk blocks, get them */
+		if (sv->sv_dacount > 0 &&
+		    (off_t)sv->sv_dabase * SFS_FS_BLOCKSIZE(sfs) < endpos &&
+		    (off_t)(sv->sv_dabase + sv->sv_dacount) *
+		    SFS_FS_BLOCKSIZE(sfs) > uio->uio_offset) {
+			result = sfs_da_flush(sv);
+			if (result) {
+				uio->uio_resid += extraresid;
+				return result;
+			}
+		}
+	}
+	else if (uio->uio_offset >= SFS_MAXFILESIZE(sfs)) {
+		/* Past the largest file we can have */
+		return EFBIG;
+	}
+	else {
+		off_t endpos = uio->uio_offset + uio->uio_resid;
+
+		/* Don't let writers get too far ahead of the disk */
+		result = sfs_buf_throttle(sfs);
+		if (result) {
+			return result;
+		}
+
+		if (endpos > SFS_MAXFILESIZE(sfs)) {
+			extraresid = endpos - SFS_MAXFILESIZE(sfs);
+			uio->uio_resid -= extraresid;
+		}
+	}
+
+	/*
+	 * If the file is in its inode, and will still fit there, use
+	 * that; otherwise move it out to a block first.
+	 */
+	if (SFS_ISINLINE(sv)) {
+		if (uio->uio_rw == UIO_READ ||
+		    uio->uio_offset + uio->uio_resid <=
+		    SFS_FS_INLINEMAX(sfs)) {
+			result = sfs_inline_io(sv, uio);
+			goto out;
+		}
+		result = sfs_inline_evict(sv);
+		if (result) {
+			goto out;
+		}
 	}
 
 	/*
 	 * First, do any leading partial block.
 	 */
-	blkoff = uio->uio_offset % SFS_BLOCKSIZE;
+	blkoff = uio->uio_offset % SFS_FS_BLOCKSIZE(sfs);
 	if (blkoff != 0) {
 		/* Number of bytes at beginning of block to skip */
 		uint32_t skip = blkoff;
 
 		/* Number of bytes to read/write after that point */
-		uint32_t len = SFS_BLOCKSIZE - blkoff;
+		uint32_t len = SFS_FS_BLOCKSIZE(sfs) - blkoff;
 
 		/* ...which might be less than the rest of the block */
 		if (len > uio->uio_resid) {
 			len = uio->uio_resid;
 		}
 
-		/* Call sfs_partialio() to do it. */
-		result = sfs_partialio(sv, uio, skip, len);
+		/* Call sfs_blockio() to do it. */
+		result = sfs_blockio(sv, uio, skip, len);
 		if (result) {
 			goto out;
 		}
@@ -350,10 +741,10 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	/*
 	 * Now we should be block-aligned. Do the remaining whole blocks.
 	 */
-	KASSERT(uio->uio_offset % SFS_BLOCKSIZE == 0);
-	nblocks = uio->uio_resid / SFS_BLOCKSIZE;
+	KASSERT(uio->uio_offset % SFS_FS_BLOCKSIZE(sfs) == 0);
+	nblocks = uio->uio_resid / SFS_FS_BLOCKSIZE(sfs);
 	for (i=0; i<nblocks; i++) {
-		result = sfs_blockio(sv, uio);
+		result = sfs_blockio(sv, uio, 0, SFS_FS_BLOCKSIZE(sfs));
 		if (result) {
 			goto out;
 		}
@@ -362,10 +753,10 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	/*
 	 * Now do any remaining partial block at the end.
 	 */
-	KASSERT(uio->uio_resid < SFS_BLOCKSIZE);
+	KASSERT(uio->uio_resid < SFS_FS_BLOCKSIZE(sfs));
 
 	if (uio->uio_resid > 0) {
-		result = sfs_partialio(sv, uio, 0, uio->uio_resid);
+		result = sfs_blockio(sv, uio, 0, uio->uio_resid);
 		if (result) {
 			goto out;
 		}
@@ -374,14 +765,22 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
  out:
 
 	/* If writing and we did anything, adjust file length */
-	if (uio->uio_resid != origresid &&
+	if (uio->uio_resid != origresid - extraresid &&
 	    uio->uio_rw == UIO_WRITE &&
 	    uio->uio_offset > (off_t)sv->sv_i.sfi_size) {
 		sv->sv_i.sfi_size = uio->uio_offset;
 		sv->sv_dirty = true;
 	}
 
-	/* Add in any extra amount we couldn't read because of EOF */
+	/* If reading, see if we should read ahead */
+	if (result == 0 && uio->uio_rw == UIO_READ && !SFS_ISINLINE(sv) &&
+	    uio->uio_resid != origresid - extraresid) {
+		sfs_readahead_check(sv, startpos / SFS_FS_BLOCKSIZE(sfs),
+				    DIVROUNDUP(uio->uio_offset,
+					       SFS_FS_BLOCKSIZE(sfs)));
+	}
+
+	/* Add in any extra amount we couldn't do because of EOF or size */
 	uio->uio_resid += extraresid;
 
 	/* Done */
@@ -392,21 +791,21 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 // Metadata I/O
 
 /*
- * This is much the same as sfs_partialio, but intended for use with
+ * This is much the same as sfs_blockio, but intended for use with
  * metadata (e.g. directory entries). It assumes the objects being
  * handled are smaller than whole blocks, do not cross block
  * boundaries, and originate in the kernel.
  *
- * It is separate from sfs_partialio because, although there is no
- * such code in this version of SFS, it is often desirable when doing
- * more advanced things to handle metadata and user data I/O
- * differently.
+ * It is separate from sfs_blockio because it is often desirable
+ * when doing more advanced things to handle metadata and user data
+ * I/O differently.
  */
 int
 sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 	   enum uio_rw rw)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_buf *buf;
 	off_t endpos;
 	uint32_t vnblock;
 	uint32_t blockoffset;
@@ -414,25 +813,16 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 	bool doalloc;
 	int result;
 
-	/*
-	 * I/O buffer for metadata ops.
-	 *
-	 * Note: in real life (and when you've done the fs assignment) you
-	 * would get space from the disk buffer cache for this, not use a
-	 * static area.
-	 */
-	static char metaiobuf[SFS_BLOCKSIZE];
-
-	/* We're using a global static buffer; it had better be locked */
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
 	/* Figure out which block of the vnode (directory, whatever) this is */
-	vnblock = actualpos / SFS_BLOCKSIZE;
-	blockoffset = actualpos % SFS_BLOCKSIZE;
+	vnblock = actualpos / SFS_FS_BLOCKSIZE(sfs);
+	blockoffset = actualpos % SFS_FS_BLOCKSIZE(sfs);
 
 	/* Get the disk block number */
 	doalloc = (rw == UIO_WRITE);
-	result = sfs_bmap(sv, vnblock, doalloc, &diskblock);
+	result = sfs_bmap(sv, vnblock, doalloc ? SFS_BMAP_ALLOC : 0,
+			  &diskblock);
 	if (result) {
 		return result;
 	}
@@ -446,26 +836,20 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 		return 0;
 	}
 
-	/* Read the block */
-	result = sfs_readblock(sfs, diskblock, metaiobuf, sizeof(metaiobuf));
+	/* Get the block */
+	result = sfs_buf_read(sfs, diskblock, &buf);
 	if (result) {
 		return result;
 	}
 
 	if (rw == UIO_READ) {
 		/* Copy out the selected region */
-		memcpy(data, metaiobuf + blockoffset, len);
+		memcpy(data, buf->b_data + blockoffset, len);
 	}
 	else {
 		/* Update the selected region */
-		memcpy(metaiobuf + blockoffset, data, len);
-
-		/* Write the block back */
-		result = sfs_writeblock(sfs, diskblock,
-					metaiobuf, sizeof(metaiobuf));
-		if (result) {
-			return result;
-		}
+		memcpy(buf->b_data + blockoffset, data, len);
+		sfs_buf_markmeta(buf);
 
 		/* Update the vnode size if needed */
 		endpos = actualpos + len;
@@ -475,6 +859,8 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 		}
 	}
 
+	sfs_buf_release(buf);
+
 	/* Done */
 	return 0;
 }
@@ -0,0 +1,785 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009, 2014
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * SFS filesystem
+ *
+ * Metadata journal.
+ *
+ * On a volume whose superblock names a journal (see kern/sfs.h),
+ * changed metadata only goes to its home locations after it has all
+ * been written to the journal and committed. If we crash while it's
+ * going home, the next mount (or sfsck) finds the committed
+ * transaction and writes it home again. That takes time in
+ * proportion to the size of the journal rather than the volume, and
+ * leaves the metadata as it was at the last commit that completed.
+ *
+ * Operations don't commit one by one. Each one that can change
+ * metadata runs inside a transaction (sfs_trans_begin/sfs_trans_end),
+ * which is no more than a count of operations in progress. Changes
+ * pile up in the buffer cache (where metadata buffers are held back,
+ * see sfs_buf.c), the in-memory inodes, the freemap and the
+ * superblock, and sfs_journal_commit writes out everything that has
+ * piled up as one group. It waits until no transaction is in
+ * progress, keeps new ones from starting, and then:
+ *
+ *    - writes back dirty file data, so committed metadata doesn't
+ *      point at blocks whose contents never reached the disk;
+ *    - copies changed inodes into their buffers, and really frees
+ *      the blocks freed since the last commit (sfs_bfree_pending);
+ *    - writes a descriptor, copies of the changed blocks, and a
+ *      commit record into the journal;
+ *    - writes the blocks home;
+ *    - retires the transaction by rewriting the journal header with
+ *      the next sequence number.
+ *
+ * Commits happen at sync and fsync, from the flusher every
+ * sfs_flushage seconds, and when an operation is about to start that
+ * might not fit in the journal along with what has piled up.
+ *
+ * A transaction holds at most SFS_JDESC_MAXBLOCKS blocks (fewer if
+ * the journal is small), and a commit has to go out as one journal
+ * transaction or a crash partway could leave, say, a directory entry
+ * home without the inode it names. So operations reserve room before
+ * they start. Each one may dirty at most SFS_TRANS_MAXBLOCKS blocks
+ * besides the freemap and superblock (big writes are split up to make
+ * that true; see sfs_write), and the superblock is always allowed
+ * for. sfs_trans_begin lets an operation start only if
+ *
+ *    sfs_jused + 1 + SFS_TRANS_MAXBLOCKS * (active + 1)
+ *
+ * fits, and otherwise commits first. sfs_jused is what has already
+ * piled up: dirty metadata buffers plus dirty in-memory inodes (each
+ * of which may need its own inode block), counted as each operation
+ * ends. Since everything an operation does happens before it counts,
+ * whatever isn't counted yet is covered by some active operation's
+ * reservation. The freemap isn't reserved for; if too much of it is
+ * dirty to fit, it goes in transactions of its own, in an order that
+ * a crash can't make harmful (see sfs_journal_docommit).
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <array.h>
+#include <bitmap.h>
+#include <synch.h>
+#include <vfs.h>
+#include <sfs.h>
+#include "sfsprivate.h"
+
+/* Scratch space for reading and writing the journal's own blocks */
+struct sfs_jscratch {
+	struct sfs_jdesc js_desc;
+	struct sfs_jcommit js_commit;
+	char js_data[SFS_MAXBLOCKSIZE];
+	char js_super[SFS_MAXBLOCKSIZE];	/* block-sized superblock */
+};
+
+/*
+ * Number of blocks one transaction can hold.
+ */
+static
+unsigned
+sfs_journal_max(struct sfs_fs *sfs)
+{
+	unsigned max = sfs->sfs_sb.sb_journalblocks - 3;
+
+	return max < SFS_JDESC_MAXBLOCKS ? max : SFS_JDESC_MAXBLOCKS;
+}
+
+/*
+ * Journal blocks a commit may need besides what operations reserve:
+ * the superblock. (The freemap can go separately if need be; see
+ * sfs_journal_docommit.)
+ */
+static
+unsigned
+sfs_journal_fixed(struct sfs_fs *sfs)
+{
+	(void)sfs;
+	return 1;
+}
+
+/*
+ * Add up the words of a block, for jc_sum.
+ */
+static
+uint32_t
+sfs_journal_sum(struct sfs_fs *sfs, const void *data)
+{
+	const uint32_t *words = data;
+	uint32_t sum = 0;
+	unsigned i;
+
+	for (i=0; i<SFS_FS_BLOCKSIZE(sfs) / sizeof(uint32_t); i++) {
+		sum += words[i];
+	}
+	return sum;
+}
+
+/*
+ * Write the journal header with sequence number SEQ.
+ */
+static
+int
+sfs_journal_writeheader(struct sfs_fs *sfs, struct sfs_jscratch *js,
+			uint32_t seq)
+{
+	struct sfs_jheader *jh = (struct sfs_jheader *)js->js_data;
+
+	bzero(jh, sizeof(*jh));
+	jh->jh_magic = SFS_JHEADER_MAGIC;
+	jh->jh_seq = seq;
+	return sfs_writeblock(sfs, sfs->sfs_sb.sb_journalstart, jh,
+			      SFS_BLOCKSIZE);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Mount
+
+/*
+ * Look for a committed transaction in the journal and, if there is
+ * one, write its blocks home. Sets *SUPER if one of them was the
+ * superblock.
+ */
+static
+int
+sfs_journal_replay(struct sfs_fs *sfs, struct sfs_jscratch *js, bool *super)
+{
+	struct sfs_jheader *jh = (struct sfs_jheader *)js->js_data;
+	struct sfs_jdesc *jd = &js->js_desc;
+	struct sfs_jcommit *jc = &js->js_commit;
+	daddr_t start = sfs->sfs_sb.sb_journalstart;
+	uint32_t nblocks = sfs->sfs_sb.sb_journalblocks;
+	uint32_t seq, count, sum, i;
+	daddr_t home;
+	int result;
+
+	*super = false;
+
+	result = sfs_readblock(sfs, start, jh, SFS_BLOCKSIZE);
+	if (result) {
+		return result;
+	}
+	if (jh->jh_magic != SFS_JHEADER_MAGIC) {
+		kprintf("sfs: %s: journal header invalid; resetting it\n",
+			sfs->sfs_sb.sb_volname);
+		sfs->sfs_jseq = 1;
+		return sfs_journal_writeheader(sfs, js, sfs->sfs_jseq);
+	}
+	seq = sfs->sfs_jseq = jh->jh_seq;
+
+	/* Is there a transaction, and was it committed? */
+	result = sfs_readblock(sfs, start + 1, jd, SFS_BLOCKSIZE);
+	if (result) {
+		return result;
+	}
+	count = jd->jd_count;
+	if (jd->jd_magic != SFS_JDESC_MAGIC || jd->jd_seq != seq ||
+	    count == 0 || count > sfs_journal_max(sfs)) {
+		return 0;
+	}
+	result = sfs_readblock(sfs, start + 2 + count, jc, SFS_BLOCKSIZE);
+	if (result) {
+		return result;
+	}
+	if (jc->jc_magic != SFS_JCOMMIT_MAGIC || jc->jc_seq != seq ||
+	    jc->jc_count != count) {
+		/* No; we crashed before it was done, so nothing went home */
+		return 0;
+	}
+
+	/* Check it over before believing it */
+	sum = 0;
+	for (i=0; i<count; i++) {
+		home = jd->jd_blocks[i];
+		if (home >= sfs->sfs_sb.sb_nblocks ||
+		    (home >= start && home < start + nblocks)) {
+			break;
+		}
+		result = sfs_readblock(sfs, start + 2 + i, js->js_data,
+				       SFS_FS_BLOCKSIZE(sfs));
+		if (result) {
+			return result;
+		}
+		sum += sfs_journal_sum(sfs, js->js_data);
+	}
+	if (i < count || sum != jc->jc_sum) {
+		kprintf("sfs: %s: journal transaction %u is corrupt; "
+			"discarding it\n", sfs->sfs_sb.sb_volname, seq);
+		sfs->sfs_jseq++;
+		return sfs_journal_writeheader(sfs, js, sfs->sfs_jseq);
+	}
+
+	kprintf("sfs: %s: replaying journal transaction %u (%u blocks)\n",
+		sfs->sfs_sb.sb_volname, seq, count);
+	for (i=0; i<count; i++) {
+		result = sfs_readblock(sfs, start + 2 + i, js->js_data,
+				       SFS_FS_BLOCKSIZE(sfs));
+		if (result) {
+			return result;
+		}
+		result = sfs_writeblock(sfs, jd->jd_blocks[i], js->js_data,
+					SFS_FS_BLOCKSIZE(sfs));
+		if (result) {
+			return result;
+		}
+		if (jd->jd_blocks[i] == SFS_SUPER_BLOCK) {
+			*super = true;
+		}
+	}
+
+	sfs->sfs_jseq++;
+	return sfs_journal_writeheader(sfs, js, sfs->sfs_jseq);
+}
+
+/*
+ * Set up the journal at mount time, after the superblock has been
+ * read and before the freemap is, finishing whatever transaction was
+ * left committed in it.
+ */
+int
+sfs_journal_load(struct sfs_fs *sfs)
+{
+	struct sfs_superblock *sb = &sfs->sfs_sb;
+	bool super;
+	int result;
+
+	if (sb->sb_journalblocks == 0) {
+		return 0;
+	}
+
+	if (sb->sb_journalblocks < 3 ||
+	    sb->sb_journalstart < SFS_FREEMAP_START +
+	    SFS_FS_FREEMAPBLOCKS(sfs) ||
+	    sb->sb_journalstart >= sb->sb_nblocks ||
+	    sb->sb_journalblocks > sb->sb_nblocks - sb->sb_journalstart) {
+		kprintf("sfs: %s: invalid journal location %u+%u; "
+			"not using it\n", sb->sb_volname,
+			sb->sb_journalstart, sb->sb_journalblocks);
+		sb->sb_journalstart = 0;
+		sb->sb_journalblocks = 0;
+		return 0;
+	}
+
+	/*
+	 * Get everything a commit needs now, once; the scratch space
+	 * is several pages, and every commit at once would be a lot
+	 * of allocating and freeing.
+	 */
+	sfs->sfs_jscratch = kmalloc(sizeof(struct sfs_jscratch));
+	sfs->sfs_jhomes = kmalloc(SFS_JDESC_MAXBLOCKS * sizeof(daddr_t));
+	sfs->sfs_jdatas = kmalloc(SFS_JDESC_MAXBLOCKS * sizeof(void *));
+	if (sfs->sfs_jscratch == NULL || sfs->sfs_jhomes == NULL ||
+	    sfs->sfs_jdatas == NULL) {
+		sfs_journal_cleanup(sfs);
+		return ENOMEM;
+	}
+
+	result = sfs_journal_replay(sfs, sfs->sfs_jscratch, &super);
+	if (result) {
+		return result;
+	}
+
+	if (super) {
+		/* We just wrote it, so it should be fine */
+		result = sfs_readblock(sfs, SFS_SUPER_BLOCK, sb, sizeof(*sb));
+		if (result) {
+			return result;
+		}
+		KASSERT(sb->sb_magic == SFS_MAGIC);
+		KASSERT(sb->sb_journalblocks != 0);
+		sb->sb_volname[sizeof(sb->sb_volname)-1] = 0;
+	}
+
+	/*
+	 * Every commit has to fit in one transaction (see above), so
+	 * there has to be room for at least a couple of operations.
+	 */
+	if (sfs_journal_max(sfs) <
+	    sfs_journal_fixed(sfs) + 2 * SFS_TRANS_MAXBLOCKS) {
+		kprintf("sfs: %s: journal too small (%u blocks); "
+			"not using it\n", sb->sb_volname,
+			sb->sb_journalblocks);
+		sb->sb_journalstart = 0;
+		sb->sb_journalblocks = 0;
+		sfs_journal_cleanup(sfs);
+		return 0;
+	}
+
+	sfs->sfs_jfreed = bitmap_create(sb->sb_nblocks);
+	if (sfs->sfs_jfreed == NULL) {
+		return ENOMEM;
+	}
+	return 0;
+}
+
+/*
+ * Free what sfs_journal_load allocated for commits, at unmount.
+ */
+void
+sfs_journal_cleanup(struct sfs_fs *sfs)
+{
+	kfree(sfs->sfs_jscratch);
+	kfree(sfs->sfs_jhomes);
+	kfree(sfs->sfs_jdatas);
+	sfs->sfs_jscratch = NULL;
+	sfs->sfs_jhomes = NULL;
+	sfs->sfs_jdatas = NULL;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Transactions
+
+/*
+ * Count the journal blocks what has piled up so far would need,
+ * besides the freemap and superblock, and remember it in sfs_jused.
+ * Called as each transaction ends. Within one commit's worth the
+ * count only grows, so keep the largest seen; a count that's stale
+ * by the time we store it must not replace a newer one.
+ */
+static
+void
+sfs_journal_count(struct sfs_fs *sfs)
+{
+	struct sfs_vnode *sv;
+	unsigned num, i, used;
+
+	used = 0;
+	lock_acquire(sfs->sfs_vnlock);
+	num = vnodearray_num(sfs->sfs_vnodes);
+	for (i=0; i<num; i++) {
+		sv = vnodearray_get(sfs->sfs_vnodes, i)->vn_data;
+		/* (unlocked peek; anyone changing it is covered) */
+		if (sv->sv_dirty) {
+			used++;
+		}
+	}
+	lock_release(sfs->sfs_vnlock);
+
+	lock_acquire(sfs->sfs_buflock);
+	used += sfs->sfs_nmeta;
+	lock_release(sfs->sfs_buflock);
+
+	lock_acquire(sfs->sfs_jlock);
+	if (used > sfs->sfs_jused) {
+		sfs->sfs_jused = used;
+	}
+	lock_release(sfs->sfs_jlock);
+}
+
+/*
+ * Check if one more operation can start and still be sure to fit in
+ * the next commit. Call with sfs_jlock held.
+ */
+static
+bool
+sfs_trans_fits(struct sfs_fs *sfs)
+{
+	KASSERT(lock_do_i_hold(sfs->sfs_jlock));
+
+	return sfs->sfs_jused + sfs_journal_fixed(sfs) +
+		SFS_TRANS_MAXBLOCKS * (sfs->sfs_jactive + 1)
+		<= sfs_journal_max(sfs);
+}
+
+/*
+ * Start an operation that may change metadata. If it might not fit
+ * in the journal along with what's already waiting, commit first.
+ */
+void
+sfs_trans_begin(struct sfs_fs *sfs)
+{
+	int result;
+
+	if (!SFS_JOURNALING(sfs)) {
+		return;
+	}
+
+	lock_acquire(sfs->sfs_jlock);
+	while (1) {
+		while (sfs->sfs_jcommitting) {
+			cv_wait(sfs->sfs_jcv, sfs->sfs_jlock);
+		}
+		if (sfs_trans_fits(sfs)) {
+			break;
+		}
+		lock_release(sfs->sfs_jlock);
+		result = sfs_journal_commit(sfs);
+		lock_acquire(sfs->sfs_jlock);
+		if (result) {
+			/*
+			 * Nothing better to do than go ahead; the
+			 * next commit will find out whether it fits.
+			 */
+			kprintf("sfs: %s: journal commit failed: %s\n",
+				sfs->sfs_sb.sb_volname, strerror(result));
+			while (sfs->sfs_jcommitting) {
+				cv_wait(sfs->sfs_jcv, sfs->sfs_jlock);
+			}
+			break;
+		}
+	}
+	sfs->sfs_jactive++;
+	lock_release(sfs->sfs_jlock);
+}
+
+/*
+ * Finish an operation started with sfs_trans_begin. Call without
+ * holding any vnode lock.
+ */
+void
+sfs_trans_end(struct sfs_fs *sfs)
+{
+	if (!SFS_JOURNALING(sfs)) {
+		return;
+	}
+
+	/* Count what we did before we stop being reserved for */
+	sfs_journal_count(sfs);
+
+	lock_acquire(sfs->sfs_jlock);
+	KASSERT(sfs->sfs_jactive > 0);
+	sfs->sfs_jactive--;
+	if (sfs->sfs_jactive == 0 && sfs->sfs_jcommitting) {
+		cv_broadcast(sfs->sfs_jcv, sfs->sfs_jlock);
+	}
+	lock_release(sfs->sfs_jlock);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Commit
+
+/*
+ * Write a transaction of COUNT blocks to the journal, then write the
+ * blocks home and retire it.
+ */
+static
+int
+sfs_journal_write(struct sfs_fs *sfs, struct sfs_jscratch *js,
+		  daddr_t *homes, void **datas, unsigned count)
+{
+	daddr_t start = sfs->sfs_sb.sb_journalstart;
+	uint32_t sum;
+	unsigned i;
+	int result;
+
+	KASSERT(count > 0 && count <= sfs_journal_max(sfs));
+
+	/* The descriptor */
+	bzero(&js->js_desc, sizeof(js->js_desc));
+	js->js_desc.jd_magic = SFS_JDESC_MAGIC;
+	js->js_desc.jd_seq = sfs->sfs_jseq;
+	js->js_desc.jd_count = count;
+	for (i=0; i<count; i++) {
+		js->js_desc.jd_blocks[i] = homes[i];
+	}
+	result = sfs_writeblock(sfs, start + 1, &js->js_desc, SFS_BLOCKSIZE);
+	if (result) {
+		return result;
+	}
+
+	/* The copies */
+	sum = 0;
+	for (i=0; i<count; i++) {
+		result = sfs_writeblock(sfs, start + 2 + i, datas[i],
+					SFS_FS_BLOCKSIZE(sfs));
+		if (result) {
+			return result;
+		}
+		sum += sfs_journal_sum(sfs, datas[i]);
+	}
+
+	/* The commit record; once this is on disk, the transaction counts */
+	bzero(&js->js_commit, sizeof(js->js_commit));
+	js->js_commit.jc_magic = SFS_JCOMMIT_MAGIC;
+	js->js_commit.jc_seq = sfs->sfs_jseq;
+	js->js_commit.jc_count = count;
+	js->js_commit.jc_sum = sum;
+	result = sfs_writeblock(sfs, start + 2 + count, &js->js_commit,
+				SFS_BLOCKSIZE);
+	if (result) {
+		return result;
+	}
+
+	/* Now the blocks can go home */
+	for (i=0; i<count; i++) {
+		result = sfs_writeblock(sfs, homes[i], datas[i],
+					SFS_FS_BLOCKSIZE(sfs));
+		if (result) {
+			return result;
+		}
+	}
+
+	/* and the transaction isn't needed any more. */
+	result = sfs_journal_writeheader(sfs, js, sfs->sfs_jseq + 1);
+	if (result) {
+		return result;
+	}
+	sfs->sfs_jseq++;
+	return 0;
+}
+
+/*
+ * Write the dirty freemap blocks out through the journal on their
+ * own, as many transactions as it takes, and mark them clean. For a
+ * commit too big to go as one transaction; see sfs_journal_docommit.
+ */
+static
+int
+sfs_journal_writefreemap(struct sfs_fs *sfs)
+{
+	daddr_t *homes = sfs->sfs_jhomes;
+	void **datas = sfs->sfs_jdatas;
+	char *freemapdata;
+	unsigned freemapblocks, max, num, first, j;
+	int result;
+
+	freemapblocks = SFS_FS_FREEMAPBLOCKS(sfs);
+	max = sfs_journal_max(sfs);
+	freemapdata = bitmap_getdata(sfs->sfs_freemap);
+
+	/* As in sfs_journal_docommit, nothing can change it meanwhile */
+	for (first = 0; first < freemapblocks; first = j) {
+		num = 0;
+		lock_acquire(sfs->sfs_freemaplock);
+		for (j = first; j < freemapblocks && num < max; j++) {
+			if (bitmap_isset(sfs->sfs_freemapdirtymap, j)) {
+				homes[num] = SFS_FREEMAP_START + j;
+				datas[num] = freemapdata +
+					j*SFS_FS_BLOCKSIZE(sfs);
+				num++;
+			}
+		}
+		lock_release(sfs->sfs_freemaplock);
+		if (num == 0) {
+			continue;
+		}
+
+		result = sfs_journal_write(sfs, sfs->sfs_jscratch,
+					   homes, datas, num);
+		if (result) {
+			return result;
+		}
+
+		lock_acquire(sfs->sfs_freemaplock);
+		while (num > 0) {
+			num--;
+			bitmap_unmark(sfs->sfs_freemapdirtymap,
+				      homes[num] - SFS_FREEMAP_START);
+		}
+		lock_release(sfs->sfs_freemaplock);
+	}
+	return 0;
+}
+
+/*
+ * Do the work of sfs_journal_commit, once nothing else is going on.
+ *
+ * Normally everything goes as one transaction. The freemap isn't
+ * reserved for by operations, though (on a big volume there can be
+ * more freemap blocks than fit in a transaction at all), so if the
+ * dirty ones don't fit along with everything else, they go in
+ * transactions of their own: first the blocks with new allocations
+ * in them, before anything that points at those blocks; then the
+ * rest of the metadata; and then, once nothing points at them any
+ * more, the blocks freed since the last commit. A crash partway
+ * through can then leave blocks marked in use that nothing uses,
+ * which sfsck cleans up, but never the other way around.
+ */
+static
+int
+sfs_journal_docommit(struct sfs_fs *sfs)
+{
+	struct sfs_jscratch *js = sfs->sfs_jscratch;
+	struct sfs_buf **bufs = NULL;
+	daddr_t *homes = sfs->sfs_jhomes;
+	void **datas = sfs->sfs_jdatas;
+	char *freemapdata;
+	unsigned nbufs = 0, nfreemap, freemapblocks, max, num, i, j;
+	bool split;
+	int result;
+
+	/* File data first */
+	result = sfs_buf_sync(sfs);
+	if (result) {
+		return result;
+	}
+
+	/* Gather up everything else */
+	result = sfs_push_inodes(sfs);
+	if (result) {
+		return result;
+	}
+	result = sfs_buf_holdmeta(sfs, &bufs, &nbufs);
+	if (result) {
+		return result;
+	}
+
+	freemapblocks = SFS_FS_FREEMAPBLOCKS(sfs);
+	max = sfs_journal_max(sfs);
+
+	/*
+	 * Nothing can change the superblock or freemap while we're
+	 * committing, so it's safe to let go of the lock and write
+	 * from them directly.
+	 *
+	 * sfs_trans_begin made sure everything but the freemap fits
+	 * in one transaction; splitting that would lose the
+	 * all-or-nothing property the journal is for. (Freed blocks'
+	 * freemap blocks were already marked dirty by sfs_bfree.)
+	 */
+	lock_acquire(sfs->sfs_freemaplock);
+	num = (sfs->sfs_superdirty ? 1 : 0) + nbufs;
+	nfreemap = 0;
+	for (j=0; j<freemapblocks; j++) {
+		if (bitmap_isset(sfs->sfs_freemapdirtymap, j)) {
+			nfreemap++;
+		}
+	}
+	lock_release(sfs->sfs_freemaplock);
+	if (num > max) {
+		panic("sfs: %s: commit of %u blocks doesn't fit in the "
+		      "journal (%u)\n", sfs->sfs_sb.sb_volname, num, max);
+	}
+	split = num + nfreemap > max;
+
+	if (split) {
+		/* New allocations, not yet the frees */
+		result = sfs_journal_writefreemap(sfs);
+		if (result) {
+			goto out;
+		}
+	}
+	sfs_bfree_pending(sfs);
+
+	num = 0;
+	lock_acquire(sfs->sfs_freemaplock);
+	if (sfs->sfs_superdirty) {
+		/* The rest of its block is zero */
+		bzero(js->js_super, SFS_FS_BLOCKSIZE(sfs));
+		memcpy(js->js_super, &sfs->sfs_sb, sizeof(sfs->sfs_sb));
+		homes[num] = SFS_SUPER_BLOCK;
+		datas[num] = js->js_super;
+		num++;
+	}
+	freemapdata = bitmap_getdata(sfs->sfs_freemap);
+	for (j=0; !split && j<freemapblocks; j++) {
+		if (bitmap_isset(sfs->sfs_freemapdirtymap, j)) {
+			homes[num] = SFS_FREEMAP_START + j;
+			datas[num] = freemapdata + j*SFS_FS_BLOCKSIZE(sfs);
+			num++;
+		}
+	}
+	lock_release(sfs->sfs_freemaplock);
+	for (i=0; i<nbufs; i++) {
+		homes[num] = bufs[i]->b_block;
+		datas[num] = bufs[i]->b_data;
+		num++;
+	}
+	KASSERT(num <= max);
+
+	if (num > 0) {
+		result = sfs_journal_write(sfs, js, homes, datas, num);
+		if (result) {
+			goto out;
+		}
+	}
+
+	if (split) {
+		/* Now the frees */
+		result = sfs_journal_writefreemap(sfs);
+		if (result) {
+			goto out;
+		}
+	}
+
+	/* It's all home; mark it clean */
+	lock_acquire(sfs->sfs_freemaplock);
+	sfs->sfs_superdirty = false;
+	for (j=0; j<freemapblocks; j++) {
+		if (bitmap_isset(sfs->sfs_freemapdirtymap, j)) {
+			bitmap_unmark(sfs->sfs_freemapdirtymap, j);
+		}
+	}
+	sfs->sfs_freemapdirty = false;
+	lock_release(sfs->sfs_freemaplock);
+
+	/* Nothing else can have piled up; we were the only one going */
+	lock_acquire(sfs->sfs_jlock);
+	sfs->sfs_jused = 0;
+	lock_release(sfs->sfs_jlock);
+
+ out:
+	for (i=0; i<nbufs; i++) {
+		if (result == 0) {
+			sfs_buf_metadone(bufs[i]);
+		}
+		else {
+			sfs_buf_release(bufs[i]);
+		}
+	}
+	kfree(bufs);
+	return result;
+}
+
+/*
+ * Commit everything that's piled up since the last commit. Call
+ * without holding any vnode lock or being inside a transaction.
+ */
+int
+sfs_journal_commit(struct sfs_fs *sfs)
+{
+	int result;
+
+	KASSERT(SFS_JOURNALING(sfs));
+
+	lock_acquire(sfs->sfs_jlock);
+	while (sfs->sfs_jcommitting) {
+		cv_wait(sfs->sfs_jcv, sfs->sfs_jlock);
+	}
+	sfs->sfs_jcommitting = true;
+	while (sfs->sfs_jactive > 0) {
+		cv_wait(sfs->sfs_jcv, sfs->sfs_jlock);
+	}
+	lock_release(sfs->sfs_jlock);
+
+	result = sfs_journal_docommit(sfs);
+
+	lock_acquire(sfs->sfs_jlock);
+	sfs->sfs_jcommitting = false;
+	cv_broadcast(sfs->sfs_jcv, sfs->sfs_jlock);
+	lock_release(sfs->sfs_jlock);
+
+	return result;
+}
@@ -0,0 +1,254 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * SFS filesystem
+ *
+ * Creating a new volume from inside the kernel, for devices (like
+ * RAM disks) that come into being after boot. This lays out exactly
+ * what mksfs does with its default options; see
+ * userland/sbin/mksfs/mksfs.c.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <limits.h>
+#include <lib.h>
+#include <uio.h>
+#include <device.h>
+#include <sfs.h>
+
+/* Bytes per inode (mksfs's default) */
+#define MKFS_INODESIZE   256
+
+/* Journal size, and the smallest volume (in journals) that gets one */
+#define MKFS_JOURNALBLOCKS  128
+#define MKFS_JOURNALMINFS   8
+
+/*
+ * Where things go on the new volume.
+ */
+struct sfs_mkfs {
+	struct device *mk_dev;
+	uint32_t mk_blocksize;
+	uint32_t mk_nblocks;
+	uint32_t mk_freemapblocks;
+	uint32_t mk_rootindex;
+	uint32_t mk_journalstart;
+	uint32_t mk_journalblocks;
+	char *mk_buf;			/* one block */
+};
+
+/*
+ * Write mk_buf to BLOCK and clear it again.
+ */
+static
+int
+sfs_mkfs_write(struct sfs_mkfs *mk, uint32_t block)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	uio_kinit(&iov, &ku, mk->mk_buf, mk->mk_blocksize,
+		  (off_t)block * mk->mk_blocksize, UIO_WRITE);
+	result = DEVOP_IO(mk->mk_dev, &ku);
+	bzero(mk->mk_buf, mk->mk_blocksize);
+	return result;
+}
+
+/*
+ * Is BLOCK in use on the new volume? Everything from the superblock
+ * through the journal is, as is everything past the end (whose
+ * bits are only there to fill out the last freemap block).
+ */
+static
+bool
+sfs_mkfs_inuse(struct sfs_mkfs *mk, uint32_t block)
+{
+	uint32_t metaend;
+
+	metaend = mk->mk_rootindex + 1;
+	if (mk->mk_journalblocks > 0) {
+		metaend = mk->mk_journalstart + mk->mk_journalblocks;
+	}
+	return block < metaend || block >= mk->mk_nblocks;
+}
+
+static
+int
+sfs_mkfs_writefreemap(struct sfs_mkfs *mk)
+{
+	uint32_t i, bit, block, bitsperblock;
+	int result;
+
+	bitsperblock = SFS_BITSPERBLOCK(mk->mk_blocksize);
+	for (i=0; i<mk->mk_freemapblocks; i++) {
+		for (bit=0; bit<bitsperblock; bit++) {
+			block = i * bitsperblock + bit;
+			if (sfs_mkfs_inuse(mk, block)) {
+				mk->mk_buf[bit / CHAR_BIT] |=
+					1 << (bit % CHAR_BIT);
+			}
+		}
+		result = sfs_mkfs_write(mk, SFS_FREEMAP_START + i);
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+static
+int
+sfs_mkfs_writesuper(struct sfs_mkfs *mk, const char *volname)
+{
+	struct sfs_superblock *sb = (struct sfs_superblock *)mk->mk_buf;
+
+	sb->sb_magic = SFS_MAGIC;
+	sb->sb_nblocks = mk->mk_nblocks;
+	strcpy(sb->sb_volname, volname);
+	sb->sb_journalstart = mk->mk_journalstart;
+	sb->sb_journalblocks = mk->mk_journalblocks;
+	sb->sb_blocksize = mk->mk_blocksize;
+	sb->sb_inodesize = MKFS_INODESIZE;
+	return sfs_mkfs_write(mk, SFS_SUPER_BLOCK);
+}
+
+/*
+ * The root directory: its inode (slot 0 of the first inode block;
+ * the other slots start free) and an empty index.
+ */
+static
+int
+sfs_mkfs_writerootdir(struct sfs_mkfs *mk)
+{
+	struct sfs_dinode *sfi = (struct sfs_dinode *)mk->mk_buf;
+	struct sfs_dirhash *dh = (struct sfs_dirhash *)mk->mk_buf;
+	int result;
+
+	sfi->sfi_size = 0;
+	sfi->sfi_type = SFS_TYPE_DIR;
+	sfi->sfi_linkcount = 1;
+	sfi->sfi_dirindex = mk->mk_rootindex;
+	result = sfs_mkfs_write(mk, SFS_ROOTDIR_INO);
+	if (result) {
+		return result;
+	}
+
+	dh->dh_magic = SFS_DIRHASH_MAGIC;
+	dh->dh_nbuckets = SFS_DIRHASH_NBUCKETS;
+	dh->dh_freehint = 0;
+	return sfs_mkfs_write(mk, mk->mk_rootindex);
+}
+
+/*
+ * An empty journal: a header and a descriptor block that doesn't
+ * match it, so there's nothing to replay.
+ */
+static
+int
+sfs_mkfs_writejournal(struct sfs_mkfs *mk)
+{
+	struct sfs_jheader *jh = (struct sfs_jheader *)mk->mk_buf;
+	int result;
+
+	if (mk->mk_journalblocks == 0) {
+		return 0;
+	}
+
+	jh->jh_magic = SFS_JHEADER_MAGIC;
+	jh->jh_seq = 1;
+	result = sfs_mkfs_write(mk, mk->mk_journalstart);
+	if (result) {
+		return result;
+	}
+	return sfs_mkfs_write(mk, mk->mk_journalstart + 1);
+}
+
+/*
+ * Make a new, empty SFS volume called VOLNAME on DEV, with the given
+ * block size.
+ */
+int
+sfs_mkfs(struct device *dev, const char *volname, uint32_t blocksize)
+{
+	struct sfs_mkfs mk;
+	int result;
+
+	if (blocksize < SFS_BLOCKSIZE || blocksize > SFS_MAXBLOCKSIZE ||
+	    (blocksize & (blocksize - 1)) != 0) {
+		return EINVAL;
+	}
+	if (dev->d_blocksize != SFS_BLOCKSIZE) {
+		return ENXIO;
+	}
+	if (strlen(volname) >= SFS_VOLNAME_SIZE ||
+	    strchr(volname, ':') != NULL || strchr(volname, '/') != NULL) {
+		return EINVAL;
+	}
+
+	mk.mk_dev = dev;
+	mk.mk_blocksize = blocksize;
+	mk.mk_nblocks = dev->d_blocks / (blocksize / SFS_BLOCKSIZE);
+	if (mk.mk_nblocks > SFS_INO_MAXBLOCKS) {
+		return EFBIG;
+	}
+	mk.mk_freemapblocks = SFS_FREEMAPBLOCKS(mk.mk_nblocks, blocksize);
+	mk.mk_rootindex = SFS_FREEMAP_START + mk.mk_freemapblocks;
+	if (mk.mk_rootindex >= mk.mk_nblocks) {
+		return ENOSPC;
+	}
+	mk.mk_journalstart = 0;
+	mk.mk_journalblocks = 0;
+	if (mk.mk_nblocks >= MKFS_JOURNALBLOCKS * MKFS_JOURNALMINFS) {
+		mk.mk_journalstart = mk.mk_rootindex + 1;
+		mk.mk_journalblocks = MKFS_JOURNALBLOCKS;
+	}
+
+	mk.mk_buf = kmalloc(blocksize);
+	if (mk.mk_buf == NULL) {
+		return ENOMEM;
+	}
+	bzero(mk.mk_buf, blocksize);
+
+	result = sfs_mkfs_writesuper(&mk, volname);
+	if (result == 0) {
+		result = sfs_mkfs_writefreemap(&mk);
+	}
+	if (result == 0) {
+		result = sfs_mkfs_writerootdir(&mk);
+	}
+	if (result == 0) {
+		result = sfs_mkfs_writejournal(&mk);
+	}
+
+	kfree(mk.mk_buf);
+	return result;
+}
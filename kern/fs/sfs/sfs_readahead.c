@@ -0,0 +1,331 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009, 2014
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * SFS filesystem
+ *
+ * Read-ahead.
+ *
+ * When sfs_io sees a file being read sequentially it hands the disk
+ * blocks it expects to be asked for next to sfs_readahead, which
+ * queues them for a kernel thread that reads them into the buffer
+ * cache. The reader can then get on with copying out what it has
+ * while the disk fetches the next blocks, instead of each block
+ * costing a separate trip around the platter.
+ *
+ * There is one queue and one thread shared by all SFS volumes. They
+ * are set up by the first mount and stay around thereafter.
+ *
+ * If the device takes asynchronous requests (devop_submit), the
+ * thread hands it a batch of blocks at once and marks each buffer
+ * valid as its read completes, so the disk goes straight from one to
+ * the next and the buffer cache isn't locked while it does.
+ *
+ * Locking: the queue is protected by sfs_ralock. While the thread
+ * is reading a block it records the volume in sfs_rabusy, so an
+ * unmount can wait for it to finish after purging its entries,
+ * rather than leave the thread holding a pointer to the dead volume.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <thread.h>
+#include <vfs.h>
+#include <device.h>
+#include <sfs.h>
+#include "sfsprivate.h"
+
+/* Number of blocks that can be waiting to be read ahead. */
+#define SFS_RAQUEUESIZE  64
+
+/* Most blocks the thread has the device reading at once. */
+#define SFS_RABATCH      8
+
+struct sfs_rareq {
+	struct sfs_fs *rr_sfs;          /* volume */
+	daddr_t rr_block;               /* block to read */
+};
+
+static struct lock *sfs_ralock;
+static struct cv *sfs_racv;
+static struct sfs_rareq sfs_raqueue[SFS_RAQUEUESIZE];
+static unsigned sfs_rahead;             /* next entry to read */
+static unsigned sfs_racount;            /* number of entries queued */
+static struct sfs_fs *sfs_rabusy;       /* volume being read from */
+
+/* An asynchronous read in progress */
+struct sfs_raio {
+	struct devreq ri_req;           /* the device request */
+	struct sfs_buf *ri_buf;         /* buffer being read into */
+	volatile bool ri_done;          /* set on completion */
+	int ri_result;                  /* result, once done */
+};
+
+static struct sfs_raio sfs_raio[SFS_RABATCH];
+static struct semaphore *sfs_rasem;     /* counts completions */
+
+/*
+ * Take the next entry off the queue. Call with sfs_ralock held.
+ */
+static
+bool
+sfs_readahead_pop(struct sfs_rareq *ret)
+{
+	KASSERT(lock_do_i_hold(sfs_ralock));
+
+	if (sfs_racount == 0) {
+		return false;
+	}
+	*ret = sfs_raqueue[sfs_rahead];
+	sfs_rahead = (sfs_rahead + 1) % SFS_RAQUEUESIZE;
+	sfs_racount--;
+	return true;
+}
+
+/*
+ * Completion callback for an asynchronous read. This is called from
+ * the device's interrupt handler, so just note it and wake the thread.
+ */
+static
+void
+sfs_readahead_done(struct devreq *req, int result)
+{
+	struct sfs_raio *ri = req->dr_arg;
+
+	ri->ri_result = result;
+	ri->ri_done = true;
+	V(sfs_rasem);
+}
+
+/*
+ * Read a batch of N blocks of a volume into the cache.
+ */
+static
+void
+sfs_readahead_batch(struct sfs_fs *sfs, const daddr_t *blocks, unsigned n)
+{
+	struct device *dev = sfs->sfs_device;
+	struct sfs_raio *ri;
+	unsigned i, inflight, spb;
+
+	KASSERT(n <= SFS_RABATCH);
+
+	if (dev->d_ops->devop_submit == NULL) {
+		/* Errors here don't matter; the reader will retry */
+		for (i=0; i<n; i++) {
+			(void)sfs_buf_prefetch(sfs, blocks[i]);
+		}
+		return;
+	}
+
+	/* Start them all */
+	spb = SFS_FS_BLOCKSIZE(sfs) / dev->d_blocksize;
+	inflight = 0;
+	for (i=0; i<n; i++) {
+		ri = &sfs_raio[i];
+		sfs_buf_startread(sfs, blocks[i], &ri->ri_buf);
+		if (ri->ri_buf == NULL) {
+			/* already cached */
+			continue;
+		}
+		ri->ri_done = false;
+		ri->ri_req.dr_write = false;
+		ri->ri_req.dr_block = blocks[i] * spb;
+		ri->ri_req.dr_data = ri->ri_buf->b_data;
+		ri->ri_req.dr_len = SFS_FS_BLOCKSIZE(sfs);
+		ri->ri_req.dr_callback = sfs_readahead_done;
+		ri->ri_req.dr_arg = ri;
+		if (DEVOP_SUBMIT(dev, &ri->ri_req)) {
+			sfs_buf_readdone(ri->ri_buf, EINVAL);
+			ri->ri_buf = NULL;
+			continue;
+		}
+		inflight++;
+	}
+
+	/* Collect them in whatever order the device finishes them */
+	while (inflight > 0) {
+		P(sfs_rasem);
+		for (i=0; i<n; i++) {
+			ri = &sfs_raio[i];
+			if (ri->ri_buf != NULL && ri->ri_done) {
+				/* Errors don't matter; the reader will retry */
+				sfs_buf_readdone(ri->ri_buf, ri->ri_result);
+				ri->ri_buf = NULL;
+				inflight--;
+				break;
+			}
+		}
+	}
+}
+
+/*
+ * The read-ahead thread.
+ */
+static
+void
+sfs_readahead_thread(void *data1, unsigned long data2)
+{
+	struct sfs_rareq req;
+	daddr_t blocks[SFS_RABATCH];
+	unsigned n;
+
+	(void)data1;
+	(void)data2;
+
+	lock_acquire(sfs_ralock);
+	while (1) {
+		while (sfs_racount == 0) {
+			cv_wait(sfs_racv, sfs_ralock);
+		}
+
+		/* Take as many as we can for the same volume */
+		sfs_readahead_pop(&req);
+		blocks[0] = req.rr_block;
+		n = 1;
+		while (n < SFS_RABATCH && sfs_racount > 0 &&
+		       sfs_raqueue[sfs_rahead].rr_sfs == req.rr_sfs) {
+			blocks[n++] = sfs_raqueue[sfs_rahead].rr_block;
+			sfs_readahead_pop(&req);
+		}
+		sfs_rabusy = req.rr_sfs;
+		lock_release(sfs_ralock);
+
+		sfs_readahead_batch(req.rr_sfs, blocks, n);
+
+		lock_acquire(sfs_ralock);
+		sfs_rabusy = NULL;
+		cv_broadcast(sfs_racv, sfs_ralock);
+	}
+}
+
+/*
+ * Set up the queue and start the thread, if not done already.
+ */
+int
+sfs_readahead_init(void)
+{
+	int result;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	if (sfs_ralock != NULL) {
+		return 0;
+	}
+
+	sfs_ralock = lock_create("sfs_readahead");
+	if (sfs_ralock == NULL) {
+		return ENOMEM;
+	}
+	sfs_racv = cv_create("sfs_readahead");
+	if (sfs_racv == NULL) {
+		lock_destroy(sfs_ralock);
+		sfs_ralock = NULL;
+		return ENOMEM;
+	}
+	sfs_rasem = sem_create("sfs_readahead", 0);
+	if (sfs_rasem == NULL) {
+		cv_destroy(sfs_racv);
+		lock_destroy(sfs_ralock);
+		sfs_racv = NULL;
+		sfs_ralock = NULL;
+		return ENOMEM;
+	}
+	sfs_rahead = 0;
+	sfs_racount = 0;
+	sfs_rabusy = NULL;
+
+	result = thread_fork("sfs readahead", NULL, sfs_readahead_thread,
+			     NULL, 0);
+	if (result) {
+		sem_destroy(sfs_rasem);
+		cv_destroy(sfs_racv);
+		lock_destroy(sfs_ralock);
+		sfs_rasem = NULL;
+		sfs_racv = NULL;
+		sfs_ralock = NULL;
+		return result;
+	}
+	return 0;
+}
+
+/*
+ * Queue a block to be read into the cache. If the queue is full the
+ * request is dropped; it's only a hint.
+ */
+void
+sfs_readahead(struct sfs_fs *sfs, daddr_t block)
+{
+	unsigned ix;
+
+	lock_acquire(sfs_ralock);
+	if (sfs_racount < SFS_RAQUEUESIZE) {
+		ix = (sfs_rahead + sfs_racount) % SFS_RAQUEUESIZE;
+		sfs_raqueue[ix].rr_sfs = sfs;
+		sfs_raqueue[ix].rr_block = block;
+		sfs_racount++;
+		/* broadcast, as sfs_readahead_purge may be waiting too */
+		cv_broadcast(sfs_racv, sfs_ralock);
+	}
+	lock_release(sfs_ralock);
+}
+
+/*
+ * Remove any queued blocks for a volume that's going away, and wait
+ * for the thread to finish with it if it's in the middle of a read.
+ */
+void
+sfs_readahead_purge(struct sfs_fs *sfs)
+{
+	struct sfs_rareq req;
+	unsigned i, n;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	if (sfs_ralock == NULL) {
+		return;
+	}
+
+	lock_acquire(sfs_ralock);
+	n = sfs_racount;
+	for (i=0; i<n; i++) {
+		sfs_readahead_pop(&req);
+		if (req.rr_sfs != sfs) {
+			/* Not ours; put it back on the end */
+			sfs_raqueue[(sfs_rahead + sfs_racount) %
+				    SFS_RAQUEUESIZE] = req;
+			sfs_racount++;
+		}
+	}
+	while (sfs_rabusy == sfs) {
+		cv_wait(sfs_racv, sfs_ralock);
+	}
+	lock_release(sfs_ralock);
+}
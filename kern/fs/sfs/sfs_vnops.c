@@ -37,6 +37,8 @@
 #include <kern/fcntl.h>
 #include <stat.h>
 #include <lib.h>
+#include <bitmap.h>
+#include <synch.h>
 #include <uio.h>
 #include <vfs.h>
 #include <sfs.h>
@@ -98,32 +100,94 @@ int
 sfs_read(struct vnode *v, struct uio *uio)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
 	int result;
 
 	KASSERT(uio->uio_rw==UIO_READ);
 
-	vfs_biglock_acquire();
+	sfs_trans_begin(sfs);
+	lock_acquire(sv->sv_lock);
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
+	sfs_trans_end(sfs);
+
+	return result;
+}
+
+/*
+ * Called for getdirentry() and getdirentries(). sfs_dir_getentries()
+ * does the work.
+ */
+static
+int
+sfs_getentries(struct vnode *v, struct uio *uio, bool many)
+{
+	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	int result;
+
+	sfs_trans_begin(sfs);
+	lock_acquire(sv->sv_lock);
+	result = sfs_dir_getentries(sv, uio, many);
+	lock_release(sv->sv_lock);
+	sfs_trans_end(sfs);
 
 	return result;
 }
 
+static
+int
+sfs_getdirentry(struct vnode *v, struct uio *uio)
+{
+	return sfs_getentries(v, uio, false);
+}
+
+static
+int
+sfs_getdirentries(struct vnode *v, struct uio *uio)
+{
+	return sfs_getentries(v, uio, true);
+}
+
 /*
  * Called for write(). sfs_io() does the work.
+ *
+ * On a volume with a journal, a big write is done as a series of
+ * transactions of at most SFS_TRANS_WRITEBLOCKS blocks each, so that
+ * none of them changes more metadata than it reserved room for in
+ * the journal. (Hiding the rest of the uio from sfs_io for a while
+ * is the same trick sfs_io plays at EOF.)
  */
 static
 int
 sfs_write(struct vnode *v, struct uio *uio)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	size_t chunk, extraresid;
+	bool more;
 	int result;
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
-	vfs_biglock_acquire();
-	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	chunk = SFS_TRANS_WRITEBLOCKS * SFS_FS_BLOCKSIZE(sfs);
+	do {
+		extraresid = 0;
+		if (SFS_JOURNALING(sfs) && uio->uio_resid > chunk) {
+			extraresid = uio->uio_resid - chunk;
+			uio->uio_resid = chunk;
+		}
+
+		sfs_trans_begin(sfs);
+		lock_acquire(sv->sv_lock);
+		result = sfs_io(sv, uio);
+		lock_release(sv->sv_lock);
+		sfs_trans_end(sfs);
+
+		/* If it didn't all go (max file size), stop there */
+		more = result == 0 && uio->uio_resid == 0 && extraresid > 0;
+		uio->uio_resid += extraresid;
+	} while (more);
 
 	return result;
 }
@@ -154,6 +218,7 @@ int
 sfs_stat(struct vnode *v, struct stat *statbuf)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
 	int result;
 
 	/* Fill in the stat structure */
@@ -164,12 +229,16 @@ sfs_stat(struct vnode *v, struct stat *statbuf)
 		return result;
 	}
 
+	lock_acquire(sv->sv_lock);
 	statbuf->st_size = sv->sv_i.sfi_size;
 	statbuf->st_nlink = sv->sv_i.sfi_linkcount;
+	lock_release(sv->sv_lock);
 
 	/* We don't support this yet */
 	statbuf->st_blocks = 0;
 
+	statbuf->st_blksize = SFS_FS_BLOCKSIZE(sfs);
+
 	/* Fill in other fields as desired/possible... */
 
 	return 0;
@@ -177,6 +246,9 @@ sfs_stat(struct vnode *v, struct stat *statbuf)
 
 /*
  * Return the type of the file (types as per kern/stat.h)
+ *
+ * The type never changes once the vnode is loaded, so this doesn't
+ * need to lock anything.
  */
 static
 int
@@ -185,16 +257,12 @@ sfs_gettype(struct vnode *v, uint32_t *ret)
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
 
-	vfs_biglock_acquire();
-
 	switch (sv->sv_i.sfi_type) {
 	case SFS_TYPE_FILE:
 		*ret = S_IFREG;
-		vfs_biglock_release();
 		return 0;
 	case SFS_TYPE_DIR:
 		*ret = S_IFDIR;
-		vfs_biglock_release();
 		return 0;
 	}
 	panic("sfs: %s: gettype: Invalid inode type (inode %u, type %u)\n",
@@ -214,21 +282,70 @@ sfs_isseekable(struct vnode *v)
 }
 
 /*
- * Called for fsync(), and also on filesystem unmount, global sync(),
- * and some other cases.
+ * Called for fsync() and fdatasync().
+ *
+ * Only this file goes to disk: its blocks still waiting for
+ * allocation get their places, then whatever of its data, indirect,
+ * and (for a directory) index blocks is dirty is written back, then
+ * the freemap blocks holding their bits, and last the inode, so that
+ * after a crash the inode never points at anything that didn't make
+ * it. Other files' dirty blocks, including the directory entry of a
+ * new file, are left to sync and the flusher, or to an fsync of the
+ * directory.
+ *
+ * With a journal the inode, indirect blocks, and freemap can only go
+ * to disk with a commit. If none of this file's are waiting for one
+ * (say it was only overwritten in place) we skip it; otherwise we
+ * commit, which takes everything else pending along.
  */
 static
 int
 sfs_fsync(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	struct bitmap *fmblocks;
+	daddr_t inoblock;
+	bool pinned = false;
 	int result;
 
-	vfs_biglock_acquire();
+	fmblocks = bitmap_create(SFS_FS_FREEMAPBLOCKS(sfs));
+	if (fmblocks == NULL) {
+		return ENOMEM;
+	}
+
+	sfs_trans_begin(sfs);
+	lock_acquire(sv->sv_lock);
+	inoblock = SFS_INO_BLOCK(sv->sv_ino);
 	result = sfs_sync_inode(sv);
-	vfs_biglock_release();
+	if (result == 0) {
+		result = sfs_bmap_sync(sv, fmblocks, &pinned);
+	}
+	if (result == 0 && sv->sv_i.sfi_type == SFS_TYPE_DIR) {
+		result = sfs_dir_syncindex(sv, fmblocks, &pinned);
+	}
+	if (result == 0 && !SFS_JOURNALING(sfs)) {
+		result = sfs_sync_freemapblocks(sfs, fmblocks);
+	}
+	if (result == 0) {
+		result = sfs_buf_flush(sfs, inoblock);
+	}
+	/* Other inodes in the block waiting for a commit don't count */
+	if (result == 0 &&
+	    sfs_buf_inodepinned(sfs, inoblock, SFS_INO_SLOT(sv->sv_ino))) {
+		pinned = true;
+	}
+	lock_release(sv->sv_lock);
+	sfs_trans_end(sfs);
+	bitmap_destroy(fmblocks);
+	if (result) {
+		return result;
+	}
 
-	return result;
+	if (pinned) {
+		return sfs_journal_commit(sfs);
+	}
+	return 0;
 }
 
 /*
@@ -250,8 +367,81 @@ int
 sfs_truncate(struct vnode *v, off_t len)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	int result;
 
-	return sfs_itrunc(sv, len);
+	if (len > SFS_MAXFILESIZE(sfs)) {
+		return EFBIG;
+	}
+	sfs_trans_begin(sfs);
+	lock_acquire(sv->sv_lock);
+	result = sfs_itrunc(sv, len);
+	lock_release(sv->sv_lock);
+	sfs_trans_end(sfs);
+	return result;
+}
+
+/*
+ * Find the next hole or data at or after POS, for lseek's SEEK_HOLE
+ * and SEEK_DATA. The block map says where the holes are, except that
+ * blocks waiting for allocation are data and an inline file is all
+ * data.
+ */
+static
+int
+sfs_seekhole(struct vnode *v, off_t pos, bool hole, off_t *ret)
+{
+	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	uint32_t posblock, block, daend;
+	off_t size, found;
+	int result = 0;
+
+	lock_acquire(sv->sv_lock);
+	size = sv->sv_i.sfi_size;
+	if (pos >= size) {
+		lock_release(sv->sv_lock);
+		return ENXIO;
+	}
+	if (SFS_ISINLINE(sv)) {
+		*ret = hole ? size : pos;
+		lock_release(sv->sv_lock);
+		return 0;
+	}
+
+	posblock = pos / SFS_FS_BLOCKSIZE(sfs);
+	daend = sv->sv_dabase + sv->sv_dacount;
+
+	result = sfs_bmap_find(sv, posblock, hole, &block);
+	if (result == 0 && sv->sv_dacount > 0) {
+		if (hole && block >= sv->sv_dabase && block < daend) {
+			/* That's not a hole yet; look past them */
+			result = sfs_bmap_find(sv, daend, true, &block);
+		}
+		else if (!hole && daend > posblock && sv->sv_dabase < block) {
+			/* Those come first */
+			block = sv->sv_dabase > posblock ?
+				sv->sv_dabase : posblock;
+		}
+	}
+	lock_release(sv->sv_lock);
+	if (result) {
+		return result;
+	}
+
+	found = (off_t)block * SFS_FS_BLOCKSIZE(sfs);
+	if (found < pos) {
+		found = pos;
+	}
+	if (found >= size) {
+		/* The rest is hole, through to EOF */
+		if (!hole) {
+			return ENXIO;
+		}
+		found = size;
+	}
+	*ret = found;
+	return 0;
 }
 
 /*
@@ -285,42 +475,40 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 {
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
 	struct sfs_vnode *sv = v->vn_data;
-	struct sfs_vnode *newguy;
+	struct sfs_vnode *newguy, *dropme = NULL;
 	uint32_t ino;
 	int result;
 
 	vfs_biglock_acquire();
+	sfs_trans_begin(sfs);
+	lock_acquire(sv->sv_lock);
 
 	/* Look up the name */
 	result = sfs_dir_findname(sv, name, &ino, NULL, NULL);
 	if (result!=0 && result!=ENOENT) {
-		vfs_biglock_release();
-		return result;
+		goto out;
 	}
 
 	/* If it exists and we didn't want it to, fail */
 	if (result==0 && excl) {
-		vfs_biglock_release();
-		return EEXIST;
+		result = EEXIST;
+		goto out;
 	}
 
 	if (result==0) {
 		/* We got something; load its vnode and return */
 		result = sfs_loadvnode(sfs, ino, SFS_TYPE_INVAL, &newguy);
 		if (result) {
-			vfs_biglock_release();
-			return result;
+			goto out;
 		}
 		*ret = &newguy->sv_absvn;
-		vfs_biglock_release();
-		return 0;
+		goto out;
 	}
 
 	/* Didn't exist - create it */
-	result = sfs_makeobj(sfs, SFS_TYPE_FILE, &newguy);
+	result = sfs_makeobj(sfs, SFS_TYPE_FILE, sv->sv_ino, &newguy);
 	if (result) {
-		vfs_biglock_release();
-		return result;
+		goto out;
 	}
 
 	/* We don't currently support file permissions; ignore MODE */
@@ -329,21 +517,33 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	/* Link it into the directory */
 	result = sfs_dir_link(sv, name, newguy->sv_ino, NULL);
 	if (result) {
-		VOP_DECREF(&newguy->sv_absvn);
-		vfs_biglock_release();
-		return result;
+		/* (not inside the transaction; see sfs.h) */
+		dropme = newguy;
+		goto out;
 	}
 
-	/* Update the linkcount of the new file */
+	/*
+	 * Update the linkcount of the new file. Its contents start out
+	 * in the inode.
+	 */
+	lock_acquire(newguy->sv_lock);
 	newguy->sv_i.sfi_linkcount++;
+	newguy->sv_i.sfi_flags |= SFS_INODE_INLINE;
 
 	/* and consequently mark it dirty. */
 	newguy->sv_dirty = true;
+	lock_release(newguy->sv_lock);
 
 	*ret = &newguy->sv_absvn;
 
+ out:
+	lock_release(sv->sv_lock);
+	sfs_trans_end(sfs);
+	if (dropme != NULL) {
+		VOP_DECREF(&dropme->sv_absvn);
+	}
 	vfs_biglock_release();
-	return 0;
+	return result;
 }
 
 /*
@@ -357,31 +557,34 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 {
 	struct sfs_vnode *sv = dir->vn_data;
 	struct sfs_vnode *f = file->vn_data;
+	struct sfs_fs *sfs = dir->vn_fs->fs_data;
 	int result;
 
 	KASSERT(file->vn_fs == dir->vn_fs);
 
-	vfs_biglock_acquire();
-
 	/* Hard links to directories aren't allowed. */
 	if (f->sv_i.sfi_type == SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return EINVAL;
 	}
 
+	vfs_biglock_acquire();
+	sfs_trans_begin(sfs);
+	lock_acquire(sv->sv_lock);
+
 	/* Create the link */
 	result = sfs_dir_link(sv, name, f->sv_ino, NULL);
-	if (result) {
-		vfs_biglock_release();
-		return result;
+	if (result == 0) {
+		/* and update the link count, marking the inode dirty */
+		lock_acquire(f->sv_lock);
+		f->sv_i.sfi_linkcount++;
+		f->sv_dirty = true;
+		lock_release(f->sv_lock);
 	}
 
-	/* and update the link count, marking the inode dirty */
-	f->sv_i.sfi_linkcount++;
-	f->sv_dirty = true;
-
+	lock_release(sv->sv_lock);
+	sfs_trans_end(sfs);
 	vfs_biglock_release();
-	return 0;
+	return result;
 }
 
 /*
@@ -392,15 +595,20 @@ int
 sfs_remove(struct vnode *dir, const char *name)
 {
 	struct sfs_vnode *sv = dir->vn_data;
+	struct sfs_fs *sfs = dir->vn_fs->fs_data;
 	struct sfs_vnode *victim;
 	int slot;
 	int result;
 
 	vfs_biglock_acquire();
+	sfs_trans_begin(sfs);
+	lock_acquire(sv->sv_lock);
 
 	/* Look for the file and fetch a vnode for it. */
 	result = sfs_lookonce(sv, name, &victim, &slot);
 	if (result) {
+		lock_release(sv->sv_lock);
+		sfs_trans_end(sfs);
 		vfs_biglock_release();
 		return result;
 	}
@@ -409,11 +617,16 @@ sfs_remove(struct vnode *dir, const char *name)
 	result = sfs_dir_unlink(sv, slot);
 	if (result==0) {
 		/* If we succeeded, decrement the link count. */
+		lock_acquire(victim->sv_lock);
 		KASSERT(victim->sv_i.sfi_linkcount > 0);
 		victim->sv_i.sfi_linkcount--;
 		victim->sv_dirty = true;
+		lock_release(victim->sv_lock);
 	}
 
+	lock_release(sv->sv_lock);
+	sfs_trans_end(sfs);
+
 	/* Discard the reference that sfs_lookonce got us */
 	VOP_DECREF(&victim->sv_absvn);
 
@@ -421,6 +634,20 @@ sfs_remove(struct vnode *dir, const char *name)
 	return result;
 }
 
+/*
+ * Adjust the link count of a file being renamed.
+ */
+static
+void
+sfs_rename_adjlink(struct sfs_vnode *sv, int delta)
+{
+	lock_acquire(sv->sv_lock);
+	KASSERT(delta > 0 || sv->sv_i.sfi_linkcount > 0);
+	sv->sv_i.sfi_linkcount += delta;
+	sv->sv_dirty = true;
+	lock_release(sv->sv_lock);
+}
+
 /*
  * Rename a file.
  *
@@ -438,14 +665,18 @@ sfs_rename(struct vnode *d1, const char *n1,
 	int slot1, slot2;
 	int result, result2;
 
-	vfs_biglock_acquire();
-
 	KASSERT(d1==d2);
 	KASSERT(sv->sv_ino == SFS_ROOTDIR_INO);
 
+	vfs_biglock_acquire();
+	sfs_trans_begin(sfs);
+	lock_acquire(sv->sv_lock);
+
 	/* Look up the old name of the file and get its inode and slot number*/
 	result = sfs_lookonce(sv, n1, &g1, &slot1);
 	if (result) {
+		lock_release(sv->sv_lock);
+		sfs_trans_end(sfs);
 		vfs_biglock_release();
 		return result;
 	}
@@ -467,8 +698,7 @@ sfs_rename(struct vnode *d1, const char *n1,
 	}
 
 	/* Increment the link count, and mark inode dirty */
-	g1->sv_i.sfi_linkcount++;
-	g1->sv_dirty = true;
+	sfs_rename_adjlink(g1, 1);
 
 	/* Unlink the old slot */
 	result = sfs_dir_unlink(sv, slot1);
@@ -480,9 +710,10 @@ sfs_rename(struct vnode *d1, const char *n1,
 	 * Decrement the link count again, and mark the inode dirty again,
 	 * in case it's been synced behind our back.
 	 */
-	KASSERT(g1->sv_i.sfi_linkcount>0);
-	g1->sv_i.sfi_linkcount--;
-	g1->sv_dirty = true;
+	sfs_rename_adjlink(g1, -1);
+
+	lock_release(sv->sv_lock);
+	sfs_trans_end(sfs);
 
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_absvn);
@@ -503,8 +734,10 @@ sfs_rename(struct vnode *d1, const char *n1,
 		panic("sfs: %s: rename: Cannot recover\n",
 		      sfs->sfs_sb.sb_volname);
 	}
-	g1->sv_i.sfi_linkcount--;
+	sfs_rename_adjlink(g1, -1);
  puke:
+	lock_release(sv->sv_lock);
+	sfs_trans_end(sfs);
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_absvn);
 	vfs_biglock_release();
@@ -516,7 +749,8 @@ sfs_rename(struct vnode *d1, const char *n1,
  * directory it's in as a vnode.
  *
  * Since we don't support subdirectories, this is very easy -
- * return the root dir and copy the path.
+ * return the root dir and copy the path. (The type never changes,
+ * so there's nothing to lock.)
  */
 static
 int
@@ -525,15 +759,11 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
-
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
 
 	if (strlen(path)+1 > buflen) {
-		vfs_biglock_release();
 		return ENAMETOOLONG;
 	}
 	strcpy(buf, path);
@@ -541,7 +771,6 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 	VOP_INCREF(&sv->sv_absvn);
 	*ret = &sv->sv_absvn;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -556,26 +785,29 @@ int
 sfs_lookup(struct vnode *v, char *path, struct vnode **ret)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
 	struct sfs_vnode *final;
 	int result;
 
-	vfs_biglock_acquire();
-
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
 
+	vfs_biglock_acquire();
+
+	/* (lookups can rebuild a stale directory index) */
+	sfs_trans_begin(sfs);
+	lock_acquire(sv->sv_lock);
+
 	result = sfs_lookonce(sv, path, &final, NULL);
-	if (result) {
-		vfs_biglock_release();
-		return result;
+	if (result == 0) {
+		*ret = &final->sv_absvn;
 	}
 
-	*ret = &final->sv_absvn;
-
+	lock_release(sv->sv_lock);
+	sfs_trans_end(sfs);
 	vfs_biglock_release();
-	return 0;
+	return result;
 }
 
 ////////////////////////////////////////////////////////////
@@ -593,6 +825,7 @@ const struct vnode_ops sfs_fileops = {
 	.vop_read = sfs_read,
 	.vop_readlink = vopfail_uio_notdir,
 	.vop_getdirentry = vopfail_uio_notdir,
+	.vop_getdirentries = vopfail_uio_notdir,
 	.vop_write = sfs_write,
 	.vop_ioctl = sfs_ioctl,
 	.vop_stat = sfs_stat,
@@ -601,6 +834,7 @@ const struct vnode_ops sfs_fileops = {
 	.vop_fsync = sfs_fsync,
 	.vop_mmap = sfs_mmap,
 	.vop_truncate = sfs_truncate,
+	.vop_seekhole = sfs_seekhole,
 	.vop_namefile = vopfail_uio_notdir,
 
 	.vop_creat = vopfail_creat_notdir,
@@ -626,7 +860,8 @@ const struct vnode_ops sfs_dirops = {
 
 	.vop_read = vopfail_uio_isdir,
 	.vop_readlink = vopfail_uio_inval,
-	.vop_getdirentry = vopfail_uio_nosys,
+	.vop_getdirentry = sfs_getdirentry,
+	.vop_getdirentries = sfs_getdirentries,
 	.vop_write = vopfail_uio_isdir,
 	.vop_ioctl = sfs_ioctl,
 	.vop_stat = sfs_stat,
@@ -635,6 +870,7 @@ const struct vnode_ops sfs_dirops = {
 	.vop_fsync = sfs_fsync,
 	.vop_mmap = vopfail_mmap_isdir,
 	.vop_truncate = vopfail_truncate_isdir,
+	.vop_seekhole = vopfail_seekhole_isdir,
 	.vop_namefile = sfs_namefile,
 
 	.vop_creat = sfs_creat,
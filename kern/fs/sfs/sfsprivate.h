@@ -37,20 +37,111 @@
 extern const struct vnode_ops sfs_fileops;
 extern const struct vnode_ops sfs_dirops;
 
+/* Number of chains in the loaded-vnode hash table (sfs_vnhash) */
+#define SFS_VNHASHSIZE  67
+
+/* Shortcuts for the size macros in kern/sfs.h */
+#define SFS_FS_BLOCKSIZE(sfs)      ((sfs)->sfs_blocksize)
+#define SFS_FS_DBPERIDB(sfs)       SFS_DBPERIDB(SFS_FS_BLOCKSIZE(sfs))
+#define SFS_FS_NBLOCKS(sfs)        ((sfs)->sfs_sb.sb_nblocks)
+#define SFS_FS_FREEMAPBITS(sfs) \
+	SFS_FREEMAPBITS(SFS_FS_NBLOCKS(sfs), SFS_FS_BLOCKSIZE(sfs))
+#define SFS_FS_FREEMAPBLOCKS(sfs) \
+	SFS_FREEMAPBLOCKS(SFS_FS_NBLOCKS(sfs), SFS_FS_BLOCKSIZE(sfs))
+
+/* Inodes per inode block; 1 means the inode has the whole block */
+#define SFS_FS_INOPERBLOCK(sfs) \
+	((sfs)->sfs_sb.sb_inodesize == 0 ? 1 : \
+	 SFS_FS_BLOCKSIZE(sfs) / (sfs)->sfs_inodesize)
+
+/* Largest file whose contents can be kept in the inode */
+#define SFS_FS_INLINEMAX(sfs)      SFS_INLINEMAX((sfs)->sfs_inodesize)
+
+/* True if a file's contents are in its inode (see kern/sfs.h) */
+#define SFS_ISINLINE(sv) (((sv)->sv_i.sfi_flags & SFS_INODE_INLINE) != 0)
+
+/* Number of file blocks mapped by each kind of block pointer */
+#define SFS_RANGE_I(sfs)     SFS_FS_DBPERIDB(sfs)
+#define SFS_RANGE_II(sfs)    (SFS_RANGE_I(sfs) * SFS_FS_DBPERIDB(sfs))
+#define SFS_RANGE_III(sfs)   (SFS_RANGE_II(sfs) * SFS_FS_DBPERIDB(sfs))
+
+/* Largest file the inode can map, in blocks */
+#define SFS_MAXFILEBLOCKS(sfs) (SFS_NDIRECT + \
+				SFS_NINDIRECT * SFS_RANGE_I(sfs) + \
+				SFS_NDINDIRECT * SFS_RANGE_II(sfs) + \
+				SFS_NTINDIRECT * SFS_RANGE_III(sfs))
+
+/* Largest file, in bytes: what the inode can map, if sfi_size can hold it */
+#define SFS_MAXFILESIZE(sfs) \
+	((off_t)SFS_MAXFILEBLOCKS(sfs) * SFS_FS_BLOCKSIZE(sfs) > 0xffffffff ? \
+	 (off_t)0xffffffff : \
+	 (off_t)SFS_MAXFILEBLOCKS(sfs) * SFS_FS_BLOCKSIZE(sfs))
+
+/* Flags for sfs_bmap */
+#define SFS_BMAP_ALLOC    1     /* allocate the block if it's missing */
+#define SFS_BMAP_NOCLEAR  2     /* ...and the caller will overwrite it */
+
+/* True if the volume has a metadata journal */
+#define SFS_JOURNALING(sfs) ((sfs)->sfs_sb.sb_journalblocks != 0)
+
+/*
+ * Most metadata blocks one transaction may dirty, not counting the
+ * freemap and superblock (see sfs_journal.c). Writes are broken into
+ * transactions of at most SFS_TRANS_WRITEBLOCKS file blocks so they
+ * stay within it.
+ */
+#define SFS_TRANS_MAXBLOCKS    32
+#define SFS_TRANS_WRITEBLOCKS  64
+
 /* Macro for initializing a uio structure */
-#define SFSUIO(iov, uio, ptr, block, rw) \
-    uio_kinit(iov, uio, ptr, SFS_BLOCKSIZE, ((off_t)(block))*SFS_BLOCKSIZE, rw)
+#define SFSUIO(sfs, iov, uio, ptr, len, block, rw) \
+    uio_kinit(iov, uio, ptr, len, ((off_t)(block))*SFS_FS_BLOCKSIZE(sfs), rw)
 
 
+/* Functions in sfs_buf.c */
+int sfs_bufcache_init(struct sfs_fs *sfs);
+void sfs_bufcache_cleanup(struct sfs_fs *sfs);
+int sfs_buf_get(struct sfs_fs *sfs, daddr_t block, struct sfs_buf **ret);
+int sfs_buf_read(struct sfs_fs *sfs, daddr_t block, struct sfs_buf **ret);
+void sfs_buf_markdirty(struct sfs_buf *buf);
+void sfs_buf_markmeta(struct sfs_buf *buf);
+void sfs_buf_markinode(struct sfs_buf *buf, unsigned slot);
+void sfs_buf_release(struct sfs_buf *buf);
+void sfs_buf_invalidate(struct sfs_fs *sfs, daddr_t block);
+int sfs_buf_prefetch(struct sfs_fs *sfs, daddr_t block);
+void sfs_buf_startread(struct sfs_fs *sfs, daddr_t block,
+		struct sfs_buf **ret);
+void sfs_buf_readdone(struct sfs_buf *buf, int result);
+int sfs_buf_writeback(struct sfs_fs *sfs, unsigned age, unsigned max);
+int sfs_buf_sync(struct sfs_fs *sfs);
+int sfs_buf_throttle(struct sfs_fs *sfs);
+int sfs_buf_flush(struct sfs_fs *sfs, daddr_t block);
+bool sfs_buf_ispinned(struct sfs_fs *sfs, daddr_t block);
+bool sfs_buf_inodepinned(struct sfs_fs *sfs, daddr_t block, unsigned slot);
+int sfs_buf_holdmeta(struct sfs_fs *sfs, struct sfs_buf ***ret,
+		unsigned *count);
+void sfs_buf_metadone(struct sfs_buf *buf);
+
 /* Functions in sfs_balloc.c */
-int sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock);
+int sfs_balloc(struct sfs_fs *sfs, daddr_t goal, daddr_t *diskblock);
+int sfs_balloc_data(struct sfs_vnode *sv, daddr_t goal, bool doclear,
+		daddr_t *diskblock);
+int sfs_breserve(struct sfs_vnode *sv, daddr_t goal, unsigned count);
+void sfs_bunreserve(struct sfs_vnode *sv);
 void sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock);
+void sfs_bfree_pending(struct sfs_fs *sfs);
 int sfs_bused(struct sfs_fs *sfs, daddr_t diskblock);
 
 /* Functions in sfs_bmap.c */
-int sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
+int sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int flags,
 		daddr_t *diskblock);
 int sfs_itrunc(struct sfs_vnode *sv, off_t len);
+int sfs_bmap_find(struct sfs_vnode *sv, uint32_t fileblock, bool hole,
+		uint32_t *ret);
+int sfs_bmap_syncblock(struct sfs_fs *sfs, daddr_t block,
+		struct bitmap *fmblocks, bool *pinned);
+int sfs_bmap_sync(struct sfs_vnode *sv, struct bitmap *fmblocks,
+		bool *pinned);
 
 /* Functions in sfs_dir.c */
 int sfs_dir_findname(struct sfs_vnode *sv, const char *name,
@@ -58,22 +149,58 @@ int sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 int sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino,
 		int *slot);
 int sfs_dir_unlink(struct sfs_vnode *sv, int slot);
+int sfs_dir_dropindex(struct sfs_vnode *sv);
+int sfs_dir_syncindex(struct sfs_vnode *sv, struct bitmap *fmblocks,
+		bool *pinned);
+int sfs_dir_getentries(struct sfs_vnode *sv, struct uio *uio, bool many);
 int sfs_lookonce(struct sfs_vnode *sv, const char *name,
 		struct sfs_vnode **ret,
 		int *slot);
 
 /* Functions in sfs_inode.c */
 int sfs_sync_inode(struct sfs_vnode *sv);
+int sfs_sync_inodes(struct sfs_fs *sfs);
+int sfs_sync_someinodes(struct sfs_fs *sfs, unsigned *next);
+int sfs_push_inodes(struct sfs_fs *sfs);
 int sfs_reclaim(struct vnode *v);
 int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		struct sfs_vnode **ret);
-int sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret);
+int sfs_inode_gettype(struct sfs_fs *sfs, uint32_t ino, unsigned *ret);
+int sfs_makeobj(struct sfs_fs *sfs, int type, daddr_t goal,
+		struct sfs_vnode **ret);
 int sfs_getroot(struct fs *fs, struct vnode **ret);
 
+/* Functions in sfs_fsops.c */
+int sfs_sync_freemap(struct sfs_fs *sfs);
+int sfs_sync_freemapblocks(struct sfs_fs *sfs, struct bitmap *fmblocks);
+int sfs_sync_superblock(struct sfs_fs *sfs);
+
+/* Functions in sfs_journal.c */
+int sfs_journal_load(struct sfs_fs *sfs);
+void sfs_journal_cleanup(struct sfs_fs *sfs);
+void sfs_trans_begin(struct sfs_fs *sfs);
+void sfs_trans_end(struct sfs_fs *sfs);
+int sfs_journal_commit(struct sfs_fs *sfs);
+
+/* Functions in sfs_flush.c */
+extern unsigned sfs_flushclock;
+int sfs_flush_init(void);
+void sfs_flush_register(struct sfs_fs *sfs);
+void sfs_flush_unregister(struct sfs_fs *sfs);
+
+/* Functions in sfs_readahead.c */
+int sfs_readahead_init(void);
+void sfs_readahead(struct sfs_fs *sfs, daddr_t block);
+void sfs_readahead_purge(struct sfs_fs *sfs);
+
 /* Functions in sfs_io.c */
 int sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len);
 int sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len);
 int sfs_io(struct sfs_vnode *sv, struct uio *uio);
+int sfs_da_flush(struct sfs_vnode *sv);
+void sfs_da_truncate(struct sfs_vnode *sv, uint32_t blocklen);
+void sfs_da_cleanup(struct sfs_fs *sfs);
+int sfs_inline_evict(struct sfs_vnode *sv);
 int sfs_metaio(struct sfs_vnode *sv, off_t pos, void *data, size_t len,
 	       enum uio_rw rw);
 
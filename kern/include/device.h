@@ -34,6 +34,7 @@
  * Devices.
  */
 
+#include <devstats.h>
 
 struct uio;  /* in <uio.h> */
 
@@ -49,6 +50,37 @@ struct device {
 	dev_t d_devnumber;	/* serial number for this device */
 
 	void *d_data;		/* device-specific data */
+
+	struct devstats d_stats;	/* I/O statistics */
+};
+
+/*
+ * Asynchronous block request, for devop_submit.
+ *
+ * The caller fills in the first group of fields and submits the
+ * request; the driver queues it and calls dr_callback when the whole
+ * transfer is done or has failed. The callback is usually made from
+ * the device's interrupt handler, so it must not sleep; waking a
+ * thread with V() is the normal thing to do. The request and the
+ * buffer belong to the driver until then.
+ */
+struct devreq {
+	/* Set by the caller */
+	bool dr_write;			/* true to write, false to read */
+	daddr_t dr_block;		/* first block, in d_blocksize units */
+	void *dr_data;			/* kernel buffer */
+	size_t dr_len;			/* bytes; a multiple of d_blocksize */
+	void (*dr_callback)(struct devreq *, int result);
+	void *dr_arg;			/* for the callback's use */
+
+	/* For the driver's use */
+	size_t dr_done;			/* bytes transferred so far */
+	unsigned dr_since;		/* when queued */
+	struct devreq *dr_next;		/* queue link */
+
+	/* For devstats */
+	uint64_t dr_qtime;		/* when submitted */
+	uint64_t dr_stime;		/* when first started */
 };
 
 /*
@@ -56,11 +88,16 @@ struct device {
  *      devop_eachopen - called on each open call to allow denying the open
  *      devop_io - for both reads and writes (the uio indicates the direction)
  *      devop_ioctl - miscellaneous control operations
+ *      devop_submit - start an asynchronous block request (see above);
+ *                     NULL for devices that don't do them. Fails
+ *                     (without calling the callback) only for requests
+ *                     that are malformed or out of range.
  */
 struct device_ops {
 	int (*devop_eachopen)(struct device *, int flags_from_open);
 	int (*devop_io)(struct device *, struct uio *);
 	int (*devop_ioctl)(struct device *, int op, userptr_t data);
+	int (*devop_submit)(struct device *, struct devreq *);
 };
 
 /*
@@ -69,6 +106,7 @@ struct device_ops {
 #define DEVOP_EACHOPEN(d, f)	((d)->d_ops->devop_eachopen(d, f))
 #define DEVOP_IO(d, u)		((d)->d_ops->devop_io(d, u))
 #define DEVOP_IOCTL(d, op, p)	((d)->d_ops->devop_ioctl(d, op, p))
+#define DEVOP_SUBMIT(d, r)	((d)->d_ops->devop_submit(d, r))
 
 
 /* Create vnode for a vfs-level device. */
@@ -80,6 +118,10 @@ void dev_uncreate_vnode(struct vnode *vn);
 /* Initialization functions for builtin vfs-level devices. */
 void devnull_create(void);
 
+/* Make a RAM disk of KBYTES kilobytes (named ramN; see ramdisk.c). */
+int ramdisk_create(unsigned kbytes, char *name, size_t namelen,
+		   struct device **ret);
+
 /* Function that kicks off device probe and attach. */
 void dev_bootstrap(void);
 
@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _DEVSTATS_H_
+#define _DEVSTATS_H_
+
+/*
+ * Block device I/O statistics.
+ *
+ * Each struct device carries a struct devstats (set up by
+ * vfs_adddev). Drivers that queue requests call devstats_queued when
+ * a request is submitted, devstats_started when the disk first starts
+ * on it, and devstats_done when it completes; these may be called
+ * from interrupt handlers. Times are in microseconds.
+ *
+ * The queue wait and service time histograms have power-of-two
+ * buckets: bucket N counts times less than 2^(N+1) microseconds, and
+ * the last bucket counts everything longer.
+ */
+
+#include <spinlock.h>
+
+struct devreq;  /* in <device.h> */
+
+#define DEVSTATS_NBUCKETS  24	/* up to about 16 seconds */
+
+struct devstats {
+	struct spinlock ds_lock;
+
+	uint64_t ds_ops[2];		/* requests, [0] read [1] write */
+	uint64_t ds_bytes[2];		/* bytes, likewise */
+	uint64_t ds_errors;		/* requests that failed */
+
+	uint64_t ds_waitsum;		/* total queue wait */
+	uint64_t ds_waitmax;
+	uint64_t ds_svcsum;		/* total service time */
+	uint64_t ds_svcmax;
+	uint32_t ds_waithist[DEVSTATS_NBUCKETS];
+	uint32_t ds_svchist[DEVSTATS_NBUCKETS];
+
+	unsigned ds_depth;		/* requests outstanding now */
+	unsigned ds_maxdepth;
+	uint64_t ds_depthtime;		/* integral of ds_depth over time */
+	uint64_t ds_busytime;		/* time with ds_depth > 0 */
+	uint64_t ds_lastchange;		/* when ds_depth last changed */
+	uint64_t ds_since;		/* when last reset */
+};
+
+void devstats_init(struct devstats *ds);
+void devstats_cleanup(struct devstats *ds);
+void devstats_reset(struct devstats *ds);
+
+void devstats_queued(struct devstats *ds, struct devreq *req);
+void devstats_started(struct devstats *ds, struct devreq *req);
+void devstats_done(struct devstats *ds, struct devreq *req, int result);
+
+/* Print (to the console) or reset the stats of every block device. */
+void devstats_printall(void);
+void devstats_resetall(void);
+
+/* Create the "devstats:" device, which reads as the same report. */
+void devstats_create(void);
+
+
+#endif /* _DEVSTATS_H_ */
@@ -34,9 +34,18 @@
 /*
  * Get abstract structure definitions
  */
+#include <kern/time.h>
 #include <fs.h>
 #include <vnode.h>
 
+/*
+ * Cache sizes (see emu.c)
+ */
+#define EMUFS_PAGESIZE  4096	/* size of a cached piece of a file */
+#define EMUFS_NPAGES    32	/* number of them */
+#define EMUFS_NNAMES    64	/* number of cached lookups */
+#define EMUFS_NAMELEN   31	/* longest name we'll cache */
+
 /*
  * Our structures
  */
@@ -45,6 +54,29 @@ struct emufs_vnode {
 	struct vnode ev_v;		/* abstract vnode structure */
 	struct emu_softc *ev_emu;	/* device */
 	uint32_t ev_handle;		/* file handle */
+
+	/* Cached attributes; protected by e_lock */
+	bool ev_sizevalid;		/* ev_size is set */
+	off_t ev_size;			/* file size */
+	struct timespec ev_sizetime;	/* when ev_size was fetched */
+};
+
+/* A cached page of file data */
+struct emufs_page {
+	struct emufs_vnode *ep_vn;	/* file; NULL if unused */
+	uint32_t ep_pageno;		/* page number within the file */
+	uint32_t ep_len;		/* bytes valid (short only at EOF) */
+	struct timespec ep_time;	/* when it was read */
+	unsigned ep_lastuse;		/* ef_pageclock when last used */
+	char *ep_data;			/* EMUFS_PAGESIZE bytes, or NULL */
+};
+
+/* A cached lookup result */
+struct emufs_name {
+	struct emufs_vnode *en_dir;	/* directory; NULL if unused */
+	struct emufs_vnode *en_vn;	/* result; NULL for "no such file" */
+	struct timespec en_time;	/* when it was looked up */
+	char en_name[EMUFS_NAMELEN+1];	/* the name */
 };
 
 struct emufs_fs {
@@ -52,7 +84,21 @@ struct emufs_fs {
 	struct emu_softc *ef_emu;	/* device */
 	struct emufs_vnode *ef_root;	/* root vnode */
 	struct vnodearray *ef_vnodes;	/* table of loaded vnodes */
+
+	/* Caches; protected by e_lock */
+	struct emufs_page ef_pages[EMUFS_NPAGES];
+	unsigned ef_pageclock;		/* for LRU replacement of pages */
+	struct emufs_name ef_names[EMUFS_NNAMES];
+	unsigned ef_namenext;		/* next name entry to replace */
 };
 
+/*
+ * Get and set how long (in seconds) cached data, sizes, and lookups
+ * may be used before going back to the host for them. 0 turns the
+ * caches off.
+ */
+unsigned emufs_getcachetime(void);
+void emufs_setcachetime(unsigned seconds);
+
 
 #endif /* _EMUFS_H_ */
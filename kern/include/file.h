@@ -32,6 +32,7 @@ struct open_file
 	int am;			/* the access mode of this file */
 	int rc;			/* the reference count of this file */
 	off_t os;		/* read offset within the file */
+	struct lock *lk;	/* held from reading os until it's stored back */
 };
 
 /* global open file table */
@@ -37,13 +37,25 @@ struct vnode; /* in vnode.h */
  * Abstract file system. (Or device accessible as a file.)
  *
  * fs_data is a pointer to filesystem-specific data.
+ *
+ * fs_flags holds FS_* flags describing what the VFS layer may do on
+ * the filesystem's behalf:
+ *
+ *      FS_CACHENAMES   - name lookups may be cached (vfscache.c).
+ *                        Only set this if every change to the
+ *                        namespace goes through the VFS layer;
+ *                        not, for example, for a filesystem whose
+ *                        files can be changed from outside.
  */
 
 struct fs {
 	void *fs_data;
 	const struct fs_ops *fs_ops;
+	unsigned fs_flags;
 };
 
+#define FS_CACHENAMES	0x1
+
 /*
  * Abstraction operations on a file system:
  *
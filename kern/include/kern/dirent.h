@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _KERN_DIRENT_H_
+#define _KERN_DIRENT_H_
+
+/*
+ * Directory entry records, as returned by getdirentries().
+ *
+ * getdirentries() packs as many of these as fit into the caller's
+ * buffer. Each record starts on a 4-byte boundary; d_reclen is the
+ * distance to the next one. The name is NUL-terminated and
+ * d_namlen does not count the NUL.
+ *
+ * d_type is the file type from kern/stattypes.h shifted right by 12
+ * bits (so _S_IFDIR >> 12 for a directory). Filesystems that can't
+ * cheaply tell the type, or the inode number, set the field to 0.
+ */
+struct dirent {
+	__u32 d_ino;		/* inode number, or 0 if unknown */
+	__u16 d_reclen;		/* length of this record in bytes */
+	__u8 d_type;		/* file type, or 0 if unknown */
+	__u8 d_namlen;		/* length of d_name, less the NUL */
+	char d_name[];		/* name, NUL-terminated */
+};
+
+/* Size of the record for a name of length NAMLEN */
+#define _DIRENT_RECLEN(namlen) \
+	((sizeof(struct dirent) + (namlen) + 1 + 3) & ~(unsigned)3)
+
+
+#endif /* _KERN_DIRENT_H_ */
@@ -37,30 +37,64 @@
  */
 
 #define SFS_MAGIC         0xabadf001    /* magic number identifying us */
-#define SFS_BLOCKSIZE     512           /* size of our blocks */
+#define SFS_BLOCKSIZE     512           /* smallest/default block size */
+#define SFS_MAXBLOCKSIZE  4096          /* largest block size */
+#define SFS_MININODESIZE  128           /* smallest packed inode size */
 #define SFS_VOLNAME_SIZE  32            /* max length of volume name */
 #define SFS_NDIRECT       15            /* # of direct blocks in inode */
 #define SFS_NINDIRECT     1             /* # of indirect blocks in inode */
-#define SFS_NDINDIRECT    0             /* # of 2x indirect blocks in inode */
-#define SFS_NTINDIRECT    0             /* # of 3x indirect blocks in inode */
-#define SFS_DBPERIDB      128           /* # direct blks per indirect blk */
+#define SFS_NDINDIRECT    1             /* # of 2x indirect blocks in inode */
+#define SFS_NTINDIRECT    1             /* # of 3x indirect blocks in inode */
 #define SFS_NAMELEN       60            /* max length of filename */
 #define SFS_SUPER_BLOCK   0             /* block the superblock lives in */
 #define SFS_FREEMAP_START 2             /* 1st block of the freemap */
 #define SFS_NOINO         0             /* inode # for free dir entry */
 #define SFS_ROOTDIR_INO   1             /* loc'n of the root dir inode */
 
+/*
+ * The block size of a volume is sb_blocksize, a power of two from
+ * SFS_BLOCKSIZE to SFS_MAXBLOCKSIZE. (Zero means SFS_BLOCKSIZE, for
+ * volumes made before it could be chosen.) Block numbers everywhere
+ * count blocks of that size. The superblock, inodes, directory index
+ * blocks, and the journal's header, descriptor, and commit blocks are
+ * SFS_BLOCKSIZE bytes however big the blocks are; they occupy the
+ * start of their block and the rest of it is zero.
+ */
+
+/* # direct blks per indirect blk, for block size BS */
+#define SFS_DBPERIDB(bs)  ((bs) / sizeof(uint32_t))
+
 /* Number of bits in a block */
-#define SFS_BITSPERBLOCK (SFS_BLOCKSIZE * CHAR_BIT)
+#define SFS_BITSPERBLOCK(bs) ((bs) * CHAR_BIT)
 
 /* Utility macro */
-#define SFS_ROUNDUP(a,b)       ((((a)+(b)-1)/(b))*b)
+#define SFS_ROUNDUP(a,b)       ((((a)+(b)-1)/(b))*(b))
 
 /* Size of free block bitmap (in bits) */
-#define SFS_FREEMAPBITS(nblocks) SFS_ROUNDUP(nblocks, SFS_BITSPERBLOCK)
+#define SFS_FREEMAPBITS(nblocks, bs) SFS_ROUNDUP(nblocks, SFS_BITSPERBLOCK(bs))
 
 /* Size of free block bitmap (in blocks) */
-#define SFS_FREEMAPBLOCKS(nblocks)  (SFS_FREEMAPBITS(nblocks)/SFS_BITSPERBLOCK)
+#define SFS_FREEMAPBLOCKS(nblocks, bs) \
+	(SFS_FREEMAPBITS(nblocks, bs) / SFS_BITSPERBLOCK(bs))
+
+/*
+ * Inodes are normally a block each, and the inode number is the block
+ * number. If sb_inodesize is nonzero, it is a power of two from
+ * SFS_MININODESIZE to SFS_BLOCKSIZE, and each inode block holds
+ * sb_blocksize / sb_inodesize inodes packed one after another; each
+ * holds the first sb_inodesize bytes of struct sfs_dinode (the rest
+ * of sfi_waste being taken as zero). A slot whose sfi_type is
+ * SFS_TYPE_INVAL is free, and an inode block is freed when its last
+ * inode is. The inode number then carries the slot number in its top
+ * bits, so slot 0 of a block is still numbered by the block, and the
+ * volume must have fewer than SFS_INO_MAXBLOCKS blocks.
+ */
+#define SFS_INO_SLOTSHIFT  27
+#define SFS_INO_MAXBLOCKS  ((uint32_t)1 << SFS_INO_SLOTSHIFT)
+#define SFS_INO_BLOCK(ino) ((ino) & (SFS_INO_MAXBLOCKS - 1))
+#define SFS_INO_SLOT(ino)  ((ino) >> SFS_INO_SLOTSHIFT)
+#define SFS_MKINO(block, slot) \
+	(((uint32_t)(slot) << SFS_INO_SLOTSHIFT) | (block))
 
 /* File types for sfi_type */
 #define SFS_TYPE_INVAL    0       /* Should not appear on disk */
@@ -74,7 +108,11 @@ struct sfs_superblock {
 	uint32_t sb_magic;		/* Magic number; should be SFS_MAGIC */
 	uint32_t sb_nblocks;			/* Number of blocks in fs */
 	char sb_volname[SFS_VOLNAME_SIZE];	/* Name of this volume */
-	uint32_t reserved[118];			/* unused, set to 0 */
+	uint32_t sb_journalstart;		/* First block of journal */
+	uint32_t sb_journalblocks;		/* Journal size (0 = none) */
+	uint32_t sb_blocksize;			/* Block size in bytes */
+	uint32_t sb_inodesize;			/* Bytes per inode (0 = block) */
+	uint32_t reserved[114];			/* unused, set to 0 */
 };
 
 /*
@@ -86,9 +124,28 @@ struct sfs_dinode {
 	uint16_t sfi_linkcount;			/* # hard links to this file */
 	uint32_t sfi_direct[SFS_NDIRECT];	/* Direct blocks */
 	uint32_t sfi_indirect;			/* Indirect block */
-	uint32_t sfi_waste[128-3-SFS_NDIRECT];	/* unused space, set to 0 */
+	uint32_t sfi_dindirect;			/* Double indirect block */
+	uint32_t sfi_tindirect;			/* Triple indirect block */
+	uint32_t sfi_dirindex;			/* Directory index root block */
+	uint32_t sfi_flags;			/* SFS_INODE_* flags below */
+	uint32_t sfi_waste[128-7-SFS_NDIRECT];	/* unused space, set to 0 */
 };
 
+/*
+ * Inode flags.
+ *
+ * SFS_INODE_INLINE means a regular file's contents are kept in the
+ * inode itself, in the space sfi_waste occupies: the first sfi_size
+ * bytes of it, with the rest zero. Such a file has no blocks, and
+ * sfi_size is at most SFS_INLINEMAX(inode size). New files start out
+ * this way and are moved to blocks when they outgrow it.
+ */
+#define SFS_INODE_INLINE  0x1
+
+/* Bytes of an inode of SIZE bytes (on disk) available for file data */
+#define SFS_INODE_HDRSIZE ((7 + SFS_NDIRECT) * sizeof(uint32_t))
+#define SFS_INLINEMAX(size) ((size) - SFS_INODE_HDRSIZE)
+
 /*
  * On-disk directory entry
  */
@@ -97,5 +154,95 @@ struct sfs_direntry {
 	char sfd_name[SFS_NAMELEN];		/* Filename */
 };
 
+/*
+ * On-disk directory index
+ *
+ * A directory's entries are always the array of sfs_direntry slots
+ * in its data blocks, and anything that just reads the directory can
+ * ignore the index. If sfi_dirindex is nonzero it names a root block
+ * (struct sfs_dirhash) holding a hash table of chains of bucket
+ * blocks (struct sfs_dirhash_block). Each in-use slot appears in
+ * exactly one bucket, in the chain for its name hash modulo
+ * dh_nbuckets. The hash is 32-bit FNV-1a over the bytes of the name.
+ *
+ * dh_freehint is a slot number below which there are no free slots.
+ *
+ * If dh_magic is not SFS_DIRHASH_MAGIC the index contents are stale
+ * (sfsck does this when it changes an indexed directory) and the
+ * kernel rebuilds it, reusing the root block, the next time the
+ * directory is used. The bucket pointers must still be valid.
+ */
+#define SFS_DIRHASH_MAGIC     0x0d1bdea5  /* valid index root block */
+#define SFS_DIRHASH_NBUCKETS  125         /* # of chains in root block */
+#define SFS_DIRHASH_PERBLOCK  63          /* # of entries in bucket blk */
+
+struct sfs_dirhash {
+	uint32_t dh_magic;			/* SFS_DIRHASH_MAGIC */
+	uint32_t dh_nbuckets;			/* Number of chains */
+	uint32_t dh_freehint;			/* No free slots below here */
+	uint32_t dh_buckets[SFS_DIRHASH_NBUCKETS]; /* First block of chain */
+};
+
+struct sfs_dirhash_entry {
+	uint32_t dhe_hash;			/* Hash of the name */
+	uint32_t dhe_slot;			/* Directory slot holding it */
+};
+
+struct sfs_dirhash_block {
+	uint32_t dhb_next;			/* Next block in chain, or 0 */
+	uint32_t dhb_count;			/* Number of entries in use */
+	struct sfs_dirhash_entry dhb_entries[SFS_DIRHASH_PERBLOCK];
+};
+
+/*
+ * On-disk metadata journal
+ *
+ * If sb_journalblocks is nonzero, that many blocks starting at
+ * sb_journalstart are marked in use in the freemap and hold a
+ * write-ahead log of metadata updates (inodes, indirect blocks,
+ * directory and directory index blocks, freemap blocks, and the
+ * superblock). File data is not logged.
+ *
+ * The first block is a header (struct sfs_jheader). At most one
+ * transaction is in the journal at a time: a descriptor block
+ * (struct sfs_jdesc) listing the home locations of jd_count blocks
+ * at the header's +1, copies of those blocks at +2 onwards, and a
+ * commit block (struct sfs_jcommit) right after the copies. All
+ * three carry the header's sequence number. The transaction counts
+ * only if the commit block is present with a matching sequence
+ * number, count, and checksum; in that case the copies are written
+ * to their home locations when the volume is next mounted (or
+ * checked). Once they are home the header is rewritten with the
+ * next sequence number, which retires the transaction.
+ *
+ * jc_sum is the (32-bit, wrapping) sum of all the words of the
+ * copies, as numbers in the volume's byte order.
+ */
+#define SFS_JHEADER_MAGIC     0x5f5a1ead  /* journal header block */
+#define SFS_JDESC_MAGIC       0x5f5a1dec  /* transaction descriptor */
+#define SFS_JCOMMIT_MAGIC     0x5f5a1c0d  /* transaction commit record */
+#define SFS_JDESC_MAXBLOCKS   125         /* # of block numbers in desc */
+
+struct sfs_jheader {
+	uint32_t jh_magic;			/* SFS_JHEADER_MAGIC */
+	uint32_t jh_seq;			/* Next transaction number */
+	uint32_t jh_waste[126];			/* unused space, set to 0 */
+};
+
+struct sfs_jdesc {
+	uint32_t jd_magic;			/* SFS_JDESC_MAGIC */
+	uint32_t jd_seq;			/* Transaction number */
+	uint32_t jd_count;			/* Number of blocks */
+	uint32_t jd_blocks[SFS_JDESC_MAXBLOCKS]; /* Home locations */
+};
+
+struct sfs_jcommit {
+	uint32_t jc_magic;			/* SFS_JCOMMIT_MAGIC */
+	uint32_t jc_seq;			/* Transaction number */
+	uint32_t jc_count;			/* Number of blocks */
+	uint32_t jc_sum;			/* Checksum of the copies */
+	uint32_t jc_waste[124];			/* unused space, set to 0 */
+};
+
 
 #endif /* _KERN_SFS_H_ */
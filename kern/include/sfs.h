@@ -48,6 +48,52 @@
  */
 #include <kern/sfs.h>
 
+/* Max number of new file blocks kept in memory awaiting allocation */
+#define SFS_DAMAXBLOCKS  32
+
+/*
+ * Locking.
+ *
+ * Each vnode has a lock (sv_lock) covering the in-memory inode and
+ * everything hanging off it: the file's blocks, its indirect blocks,
+ * blocks awaiting allocation, and for the directory, its entries and
+ * index. Each volume has a lock for the table of loaded vnodes
+ * (sfs_vnlock), one for allocating and freeing inodes (sfs_inolock),
+ * one for the freemap and superblock (sfs_freemaplock), and one for
+ * the buffer cache structure (sfs_buflock, which is not held across
+ * I/O). The contents of a held buffer belong to whoever holds the
+ * lock for the vnode the block belongs to; an inode block holding
+ * several inodes is shared that way slot by slot, and which slots
+ * are in use belongs to sfs_inolock.
+ *
+ * Reads, writes, truncates, fsync and stat only take these locks.
+ * Operations on names (lookup, create, link, remove, rename), sync,
+ * mount and unmount also hold the big VFS lock, which keeps them from
+ * having to worry about each other.
+ *
+ * On a volume with a journal, everything that can change metadata
+ * (reads too, since they may allocate blocks that were waiting for
+ * it) runs inside a transaction, sfs_trans_begin to sfs_trans_end,
+ * so that a journal commit can wait for a moment when nothing is
+ * half done (see sfs_journal.c). A transaction is begun before
+ * taking any vnode lock, and nothing inside one may drop a vnode
+ * reference, since that can start a reclaim, which needs its own.
+ *
+ * The order is:
+ *
+ *     vfs_biglock
+ *       transaction (sfs_jlock is only held briefly, and last)
+ *         directory sv_lock
+ *         file sv_lock
+ *           sfs_vnlock
+ *             sfs_inolock
+ *               sfs_freemaplock
+ *               sfs_buflock
+ *
+ * The freemap and buffer cache locks are never held together. The
+ * read-ahead queue lock (sfs_readahead.c) is taken last of all.
+ */
+
 /*
  * In-memory inode
  */
@@ -56,19 +102,88 @@ struct sfs_vnode {
 	struct sfs_dinode sv_i;		/* copy of on-disk inode */
 	uint32_t sv_ino;                /* inode number */
 	bool sv_dirty;                  /* true if sv_i modified */
+	struct lock *sv_lock;           /* protects everything here */
+	uint32_t sv_ranext;             /* next block if reading sequentially */
+	uint32_t sv_rawindow;           /* read-ahead window (blocks) */
+	uint32_t sv_rahigh;             /* read-ahead queued up to here */
+	struct sfs_vnode *sv_hashnext;  /* next in sfs_vnhash chain */
+	unsigned sv_vnindex;            /* our index in sfs_vnodes */
+	daddr_t sv_lastib;              /* last single indirect block used */
+	uint32_t sv_lastibbase;         /* first file block it maps */
+	daddr_t sv_resnext;             /* next block reserved for writing */
+	unsigned sv_resleft;            /* number of blocks still reserved */
+	uint32_t sv_dabase;             /* first block awaiting allocation */
+	unsigned sv_dacount;            /* number of blocks awaiting it */
+	char *sv_dadata[SFS_DAMAXBLOCKS]; /* their contents */
 };
 
+/*
+ * In-memory copy of a disk block (buffer cache entry, see sfs_buf.c)
+ */
+struct sfs_buf {
+	struct sfs_fs *b_fs;            /* volume it belongs to */
+	daddr_t b_block;                /* disk block number */
+	bool b_valid;                   /* true if b_data matches disk/us */
+	bool b_dirty;                   /* true if b_data needs writing */
+	bool b_meta;                    /* true if it's dirty metadata */
+	bool b_busy;                    /* true while I/O is in progress */
+	uint32_t b_inodes;              /* inode slots changed (bitmask) */
+	unsigned b_refcount;            /* number of sfs_buf_get holders */
+	unsigned b_dirtytime;           /* sfs_flushclock when dirtied */
+	struct sfs_buf *b_hashnext;     /* next buffer in hash chain */
+	struct sfs_buf *b_lrunext;      /* next (less recently used) */
+	struct sfs_buf *b_lruprev;      /* previous (more recently used) */
+	char *b_data;                   /* the block contents */
+};
+
+struct sfs_jscratch;		/* Opaque; see sfs_journal.c */
+
 /*
  * In-memory info for a whole fs volume
  */
 struct sfs_fs {
 	struct fs sfs_absfs;            /* abstract filesystem structure */
 	struct sfs_superblock sfs_sb;	/* copy of on-disk superblock */
+	uint32_t sfs_blocksize;         /* block size (from sb_blocksize) */
+	uint32_t sfs_inodesize;         /* bytes per inode on disk */
 	bool sfs_superdirty;            /* true if superblock modified */
 	struct device *sfs_device;      /* device mounted on */
+	struct lock *sfs_vnlock;        /* protects sfs_vnodes/sfs_vnhash */
 	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
+	struct sfs_vnode **sfs_vnhash;  /* same vnodes, hashed by inode number */
+	unsigned sfs_vngen;             /* bumped when a vnode leaves them */
+	struct lock *sfs_inolock;       /* protects inode slots/sfs_inohint */
+	daddr_t sfs_inohint;            /* inode block to allocate from next */
+	struct lock *sfs_freemaplock;   /* protects freemap and superblock */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
 	bool sfs_freemapdirty;          /* true if freemap modified */
+	struct bitmap *sfs_freemapdirtymap; /* freemap blocks to write */
+	struct lock *sfs_buflock;       /* protects the buffer cache */
+	struct cv *sfs_bufcv;           /* wait here for b_busy buffers */
+	struct sfs_buf **sfs_bufhash;   /* buffer cache hash table */
+	struct sfs_buf *sfs_lruhead;    /* most recently used buffer */
+	struct sfs_buf *sfs_lrutail;    /* least recently used buffer */
+	unsigned sfs_nbufs;             /* buffers currently in the cache */
+	struct sfs_buf *sfs_buffree;    /* spare buffers, via b_lrunext */
+	unsigned sfs_ndirty;            /* buffers currently dirty */
+	unsigned sfs_nmeta;             /* ...of which hold metadata */
+	struct lock *sfs_jlock;         /* protects sfs_jactive/committing */
+	struct cv *sfs_jcv;             /* for waiting on them to change */
+	unsigned sfs_jactive;           /* transactions in progress */
+	bool sfs_jcommitting;           /* a commit is waiting or running */
+	unsigned sfs_jused;             /* journal blocks known to be needed */
+	uint32_t sfs_jseq;              /* next journal transaction number */
+	struct bitmap *sfs_jfreed;      /* blocks freed since last commit */
+	unsigned sfs_njfreed;           /* number of them */
+	struct lock *sfs_dalock;        /* protects sfs_dafree */
+	void *sfs_dafree;               /* spare blocks for sv_dadata */
+	struct sfs_jscratch *sfs_jscratch; /* commit scratch space */
+	daddr_t *sfs_jhomes;            /* commit's blocks' home locations */
+	void **sfs_jdatas;              /* ...and contents */
+	struct sfs_fs *sfs_flushnext;   /* next volume on sfs_flushlist */
+	unsigned sfs_flushpass;         /* last flusher pass to visit us */
+	unsigned sfs_metatime;          /* sfs_flushclock at last inode push */
+	unsigned sfs_metanext;          /* where that got to, if unfinished */
 };
 
 /*
@@ -76,5 +191,17 @@ struct sfs_fs {
  */
 int sfs_mount(const char *device);
 
+/*
+ * Make a new, empty volume on a device, as mksfs would.
+ */
+int sfs_mkfs(struct device *dev, const char *volname, uint32_t blocksize);
+
+/*
+ * Get and set how long (in seconds) dirty data may sit in memory
+ * before the background flusher writes it back.
+ */
+unsigned sfs_getflushage(void);
+void sfs_setflushage(unsigned seconds);
+
 
 #endif /* _SFS_H_ */
@@ -67,6 +67,10 @@ int sys_read(int fd, userptr_t buf, size_t buflen, int *sz);
 int sys_dup2(int oldfd, int newfd, int *fd_ret);
 int sys_close(int fd);
 int sys_lseek(int fd, off_t pos, int whence, off_t *npos); 
+int sys_fsync(int fd);
+int sys_fdatasync(int fd);
+int sys_getdirentry(int fd, userptr_t buf, size_t buflen, int *sz);
+int sys_getdirentries(int fd, userptr_t buf, size_t buflen, int *sz);
 int sys___time(userptr_t user_seconds, userptr_t user_nanoseconds);
 int sys_execv(userptr_t progname, userptr_t *args);
 
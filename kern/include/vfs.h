@@ -81,6 +81,24 @@ int vfs_lookup(char *path, struct vnode **result);
 int vfs_lookparent(char *path, struct vnode **result,
 		   char *buf, size_t buflen);
 
+/*
+ * Name lookup cache (vfscache.c).
+ *
+ *    vfs_dcache_lookup - Like VOP_LOOKUP on a single pathname component,
+ *                        but answered from the cache when possible.
+ *                        Only filesystems with FS_CACHENAMES set
+ *                        are cached.
+ *                        Failures other than ENOENT are not cached.
+ *    vfs_dcache_remove - Forget NAME in DIR. Must be called after any
+ *                        operation that changes what NAME refers to.
+ *    vfs_dcache_purge  - Forget everything on filesystem FS (or on all
+ *                        filesystems, if FS is NULL).
+ */
+
+int vfs_dcache_lookup(struct vnode *dir, char *name, struct vnode **result);
+void vfs_dcache_remove(struct vnode *dir, const char *name);
+void vfs_dcache_purge(struct fs *fs);
+
 /*
  * VFS layer high-level operations on pathnames
  * Because lookup may destroy pathnames, these all may too.
@@ -120,6 +138,9 @@ int vfs_getcwd(struct uio *buf);
  *    vfs_bootstrap - Call during system initialization to allocate
  *                    structures.
  *
+ *    vfs_dcache_bootstrap - Set up the name lookup cache. Called by
+ *                    vfs_bootstrap.
+ *
  *    vfs_setbootfs - Set the filesystem that paths beginning with a
  *                    slash are sent to. If not set, these paths fail
  *                    with ENOENT. The argument should be the device
@@ -147,6 +168,8 @@ int vfs_getcwd(struct uio *buf);
  *                    gizmos like Linux procfs or BSD kernfs, not for
  *                    mounting filesystems on disk devices.
  *
+ *    vfs_eachdev   - Call FUNC on each device added with vfs_adddev.
+ *
  *    vfs_mount     - Attempt to mount a filesystem on a device. The
  *                    device named by DEVNAME will be looked up and
  *                    passed, along with DATA, to the supplied function
@@ -167,12 +190,16 @@ int vfs_getcwd(struct uio *buf);
  */
 
 void vfs_bootstrap(void);
+void vfs_dcache_bootstrap(void);
 
 int vfs_setbootfs(const char *fsname);
 void vfs_clearbootfs(void);
 
 int vfs_adddev(const char *devname, struct device *dev, int mountable);
 int vfs_addfs(const char *devname, struct fs *fs);
+void vfs_eachdev(void (*func)(const char *devname, struct device *dev,
+			      void *data),
+		 void *data);
 
 int vfs_mount(const char *devname, void *data,
 	      int (*mountfunc)(void *data,
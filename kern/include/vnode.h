@@ -98,6 +98,17 @@ struct vnode {
  *                      handled in the normal fashion.
  *                      On non-directory objects, return ENOTDIR.
  *
+ *    vop_getdirentries - Like vop_getdirentry, but copy out as many
+ *                      entries as fit in the uio, each as a struct
+ *                      dirent (see kern/dirent.h) with the inode
+ *                      number and type if the filesystem knows them.
+ *                      An entry that doesn't fit is left for the next
+ *                      call; if not even the first one fits, return
+ *                      EINVAL. Filesystems that can't do better can
+ *                      use vnode_getdirentries, which is built on
+ *                      vop_getdirentry.
+ *                      On non-directory objects, return ENOTDIR.
+ *
  *    vop_write       - Write data from uio to file at offset specified
  *                      in the uio, updating uio_resid to reflect the
  *                      amount written, and updating uio_offset to match.
@@ -127,6 +138,16 @@ struct vnode {
  *    vop_truncate    - Forcibly set size of file to the length passed
  *                      in, discarding any excess blocks.
  *
+ *    vop_seekhole    - For lseek's SEEK_DATA and SEEK_HOLE. Find the
+ *                      first offset at or after POS that's in a hole
+ *                      (if HOLE is true) or holds data (if not), and
+ *                      return it in RESULT. There is always a hole
+ *                      at EOF. Fails with ENXIO if POS is at or past
+ *                      EOF, or if looking for data and there's none.
+ *                      Objects that don't keep track of holes can use
+ *                      vnode_seekhole_nohole, which treats the whole
+ *                      object as data.
+ *
  *    vop_namefile    - Compute pathname relative to filesystem root
  *                      of the file and copy to the specified
  *                      uio. Need not work on objects that are not
@@ -187,6 +208,7 @@ struct vnode_ops {
 	int (*vop_read)(struct vnode *file, struct uio *uio);
 	int (*vop_readlink)(struct vnode *link, struct uio *uio);
 	int (*vop_getdirentry)(struct vnode *dir, struct uio *uio);
+	int (*vop_getdirentries)(struct vnode *dir, struct uio *uio);
 	int (*vop_write)(struct vnode *file, struct uio *uio);
 	int (*vop_ioctl)(struct vnode *object, int op, userptr_t data);
 	int (*vop_stat)(struct vnode *object, struct stat *statbuf);
@@ -195,6 +217,8 @@ struct vnode_ops {
 	int (*vop_fsync)(struct vnode *object);
 	int (*vop_mmap)(struct vnode *file /* add stuff */);
 	int (*vop_truncate)(struct vnode *file, off_t len);
+	int (*vop_seekhole)(struct vnode *file, off_t pos, bool hole,
+			    off_t *result);
 	int (*vop_namefile)(struct vnode *file, struct uio *uio);
 
 
@@ -231,6 +255,7 @@ struct vnode_ops {
 #define VOP_READ(vn, uio)               (__VOP(vn, read)(vn, uio))
 #define VOP_READLINK(vn, uio)           (__VOP(vn, readlink)(vn, uio))
 #define VOP_GETDIRENTRY(vn, uio)        (__VOP(vn,getdirentry)(vn, uio))
+#define VOP_GETDIRENTRIES(vn, uio)      (__VOP(vn,getdirentries)(vn, uio))
 #define VOP_WRITE(vn, uio)              (__VOP(vn, write)(vn, uio))
 #define VOP_IOCTL(vn, code, buf)        (__VOP(vn, ioctl)(vn,code,buf))
 #define VOP_STAT(vn, ptr) 	        (__VOP(vn, stat)(vn, ptr))
@@ -239,6 +264,8 @@ struct vnode_ops {
 #define VOP_FSYNC(vn)                   (__VOP(vn, fsync)(vn))
 #define VOP_MMAP(vn /*add stuff */)     (__VOP(vn, mmap)(vn /*add stuff */))
 #define VOP_TRUNCATE(vn, pos)           (__VOP(vn, truncate)(vn, pos))
+#define VOP_SEEKHOLE(vn, pos, hole, res) \
+	(__VOP(vn, seekhole)(vn, pos, hole, res))
 #define VOP_NAMEFILE(vn, uio)           (__VOP(vn, namefile)(vn, uio))
 
 #define VOP_CREAT(vn,nm,excl,mode,res)  (__VOP(vn, creat)(vn,nm,excl,mode,res))
@@ -279,6 +306,25 @@ int vnode_init(struct vnode *, const struct vnode_ops *ops,
  */
 void vnode_cleanup(struct vnode *);
 
+/*
+ * Common implementation of vop_seekhole for objects with no holes.
+ */
+int vnode_seekhole_nohole(struct vnode *vn, off_t pos, bool hole,
+			  off_t *result);
+
+/*
+ * Common implementation of vop_getdirentries, one vop_getdirentry
+ * call per entry. The inode numbers and types come back as 0.
+ */
+int vnode_getdirentries(struct vnode *dir, struct uio *uio);
+
+/*
+ * Copy out one directory entry in a vop_getdirentries call. The
+ * caller must check first that _DIRENT_RECLEN(namelen) bytes fit.
+ */
+int vnode_putdirent(struct uio *uio, uint32_t ino, mode_t type,
+		    const char *name, size_t namelen);
+
 /*
  * Common stubs for vnode functions that just fail, in various ways.
  */
@@ -290,6 +336,8 @@ int vopfail_mmap_isdir(struct vnode *vn /* add stuff */);
 int vopfail_mmap_perm(struct vnode *vn /* add stuff */);
 int vopfail_mmap_nosys(struct vnode *vn /* add stuff */);
 int vopfail_truncate_isdir(struct vnode *vn, off_t pos);
+int vopfail_seekhole_isdir(struct vnode *vn, off_t pos, bool hole,
+			   off_t *result);
 int vopfail_creat_notdir(struct vnode *vn, const char *name, bool excl,
 			 mode_t mode, struct vnode **result);
 int vopfail_symlink_notdir(struct vnode *vn, const char *contents,
@@ -120,6 +120,42 @@ bitmap_alloc(struct bitmap *b, unsigned *index)
         return ENOSPC;
 }
 
+/*
+ * Like bitmap_alloc, but take the first cleared bit at or after
+ * START, wrapping around to the beginning if there isn't one.
+ */
+int
+bitmap_alloc_near(struct bitmap *b, unsigned start, unsigned *index)
+{
+        unsigned maxix = DIVROUNDUP(b->nbits, BITS_PER_WORD);
+        unsigned ix, n;
+        unsigned offset;
+
+        if (start >= b->nbits) {
+                start = 0;
+        }
+
+        /* Try the rest of START's word first, then each word after it */
+        offset = start % BITS_PER_WORD;
+        for (n=0; n<=maxix; n++) {
+                ix = (start / BITS_PER_WORD + n) % maxix;
+                if (b->v[ix]!=WORD_ALLBITS) {
+                        for (; offset < BITS_PER_WORD; offset++) {
+                                WORD_TYPE mask = ((WORD_TYPE)1) << offset;
+
+                                if ((b->v[ix] & mask)==0) {
+                                        b->v[ix] |= mask;
+                                        *index = (ix*BITS_PER_WORD)+offset;
+                                        KASSERT(*index < b->nbits);
+                                        return 0;
+                                }
+                        }
+                }
+                offset = 0;
+        }
+        return ENOSPC;
+}
+
 static
 inline
 void
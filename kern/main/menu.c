@@ -41,12 +41,16 @@
 #include <proc.h>
 #include <pid.h>
 #include <vfs.h>
+#include <device.h>
+#include <devstats.h>
 #include <sfs.h>
+#include <emufs.h>
 #include <syscall.h>
 #include <current.h>
 #include <test.h>
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-emu.h"
 
 /*
  * In-kernel menu and command dispatcher.
@@ -244,6 +248,51 @@ cmd_sync(int nargs, char **args)
 	return 0;
 }
 
+#if OPT_SFS
+/*
+ * Command for showing or setting how long SFS lets dirty data sit in
+ * memory before writing it back.
+ */
+static
+int
+cmd_fsage(int nargs, char **args)
+{
+	if (nargs == 1) {
+		kprintf("SFS write-back age: %u seconds\n", sfs_getflushage());
+		return 0;
+	}
+	if (nargs != 2 || atoi(args[1]) < 0) {
+		kprintf("Usage: fsage [seconds]\n");
+		return EINVAL;
+	}
+	sfs_setflushage(atoi(args[1]));
+	return 0;
+}
+#endif
+
+#if OPT_EMU
+/*
+ * Command for showing or setting how long emufs uses cached data
+ * before going back to the host for it.
+ */
+static
+int
+cmd_emucache(int nargs, char **args)
+{
+	if (nargs == 1) {
+		kprintf("emufs cache time: %u seconds\n",
+			emufs_getcachetime());
+		return 0;
+	}
+	if (nargs != 2 || atoi(args[1]) < 0) {
+		kprintf("Usage: emucache [seconds]\n");
+		return EINVAL;
+	}
+	emufs_setcachetime(atoi(args[1]));
+	return 0;
+}
+#endif
+
 /*
  * Command for dropping to the debugger.
  */
@@ -408,6 +457,56 @@ cmd_mount(int nargs, char **args)
 	return EINVAL;
 }
 
+/*
+ * Command for making a RAM disk, and (if a volume name is given)
+ * putting an empty SFS volume on it.
+ */
+static
+int
+cmd_ramdisk(int nargs, char **args)
+{
+	char name[16];
+	struct device *dev;
+	unsigned blocksize;
+	int result;
+
+	if (nargs < 2 || nargs > 4 || atoi(args[1]) <= 0) {
+		kprintf("Usage: ramdisk kbytes [volname [blocksize]]\n");
+		return EINVAL;
+	}
+#if !OPT_SFS
+	if (nargs > 2) {
+		kprintf("ramdisk: No SFS in this kernel\n");
+		return EINVAL;
+	}
+#endif
+
+	result = ramdisk_create(atoi(args[1]), name, sizeof(name), &dev);
+	if (result) {
+		kprintf("ramdisk: %s\n", strerror(result));
+		return result;
+	}
+	kprintf("%s: %u KB RAM disk\n", name,
+		(unsigned)(dev->d_blocks * dev->d_blocksize / 1024));
+
+#if OPT_SFS
+	if (nargs > 2) {
+		blocksize = nargs > 3 ? atoi(args[3]) : SFS_BLOCKSIZE;
+		result = sfs_mkfs(dev, args[2], blocksize);
+		if (result) {
+			kprintf("%s: mkfs: %s\n", name, strerror(result));
+			return result;
+		}
+		kprintf("%s: SFS volume %s, %u-byte blocks; "
+			"mount sfs %s to use it\n",
+			name, args[2], blocksize, name);
+	}
+#else
+	(void)blocksize;
+#endif
+	return 0;
+}
+
 static
 int
 cmd_unmount(int nargs, char **args)
@@ -470,6 +569,25 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+/*
+ * Command for printing (or resetting) the disk I/O statistics.
+ */
+static
+int
+cmd_devstats(int nargs, char **args)
+{
+	if (nargs == 1) {
+		devstats_printall();
+		return 0;
+	}
+	if (nargs != 2 || strcmp(args[1], "reset")) {
+		kprintf("Usage: devstats [reset]\n");
+		return EINVAL;
+	}
+	devstats_resetall();
+	return 0;
+}
+
 static
 int
 cmd_kheapgeneration(int nargs, char **args)
@@ -533,11 +651,18 @@ static const char *opsmenu[] = {
 	"[p]       Other program             ",
 	"[mount]   Mount a filesystem        ",
 	"[unmount] Unmount a filesystem      ",
+	"[ramdisk] Make a RAM disk           ",
 	"[bootfs]  Set \"boot\" filesystem     ",
 	"[pf]      Print a file              ",
 	"[cd]      Change directory          ",
 	"[pwd]     Print current directory   ",
 	"[sync]    Sync filesystems          ",
+#if OPT_SFS
+	"[fsage]   Set SFS write-back age    ",
+#endif
+#if OPT_EMU
+	"[emucache] Set emufs cache time     ",
+#endif
 	"[debug]   Drop to debugger          ",
 	"[panic]   Intentional panic         ",
 	"[deadlock] Intentional deadlock     ",
@@ -604,6 +729,7 @@ static const char *mainmenu[] = {
 	"[kh] Kernel heap stats              ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+	"[devstats] Disk I/O stats           ",
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -639,11 +765,18 @@ static struct {
 	{ "p",		cmd_prog },
 	{ "mount",	cmd_mount },
 	{ "unmount",	cmd_unmount },
+	{ "ramdisk",	cmd_ramdisk },
 	{ "bootfs",	cmd_bootfs },
 	{ "pf",		printfile },
 	{ "cd",		cmd_chdir },
 	{ "pwd",	cmd_pwd },
 	{ "sync",	cmd_sync },
+#if OPT_SFS
+	{ "fsage",	cmd_fsage },
+#endif
+#if OPT_EMU
+	{ "emucache",	cmd_emucache },
+#endif
 	{ "debug",	cmd_debug },
 	{ "panic",	cmd_panic },
 	{ "deadlock",	cmd_deadlock },
@@ -655,6 +788,7 @@ static struct {
 	{ "kh",         cmd_kheapstats },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "devstats",   cmd_devstats },
 
 	/* base system tests */
 	{ "at",		arraytest },
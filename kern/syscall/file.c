@@ -69,6 +69,13 @@ file_open(char *filename, int flags, mode_t mode, int *fd_ret)
 		lock_release(of_t->oft_l);
 		return ENOMEM;
 	}
+	of_entry->lk = lock_create("open_file");
+	if (of_entry->lk == NULL) {
+		kfree(of_entry);
+		vfs_close(vn);
+		lock_release(of_t->oft_l);
+		return ENOMEM;
+	}
 
 	/* initialise file descriptor entry */
 	fd_t->fd_entries[fd] = of;
@@ -125,27 +132,31 @@ file_read(int fd, userptr_t buf, size_t buflen, int *sz)
 		return EBADF;
 	}
 
-	/* get open file vnode for reading from */
-	struct vnode *vn = of->vn;
+	/*
+	 * let go of the open file table while reading. our descriptor's
+	 * reference keeps the open file around, and its own lock keeps
+	 * anyone else sharing it (after a fork) off the seek pointer
+	 * until we've stored the new one.
+	 */
+	lock_release(of_t->oft_l);
+	lock_acquire(of->lk);
 
 	/* initialize a uio with the read flag set, pointing into our buffer */
 	uio_uinit(&iovec_tmp, &uio_tmp, buf, buflen, of->os, UIO_READ);
 
 	/* read from vnode into our uio object */
-	result = VOP_READ(vn, &uio_tmp);
+	result = VOP_READ(of->vn, &uio_tmp);
 	if (result) {
-		lock_release(of_t->oft_l);
+		lock_release(of->lk);
 		return result;
 	}
 
 	/* set the amount of bytes read */
-	*sz = uio_tmp.uio_offset - of->os;
+	*sz = buflen - uio_tmp.uio_resid;
 
 	/* update the seek pointer in the open file */
 	of->os = uio_tmp.uio_offset;
-
-	/* release the lock of the file because we are done */
-	lock_release(of_t->oft_l);
+	lock_release(of->lk);
 
 	return 0;
 }
@@ -182,27 +193,26 @@ file_write(int fd, userptr_t buf, size_t nbytes, int *sz)
 		return EBADF;
 	}
 
-	/* get open file vnode for writing to */
-	struct vnode *vn = of->vn;
+	/* let go of the open file table while writing, as in file_read */
+	lock_release(of_t->oft_l);
+	lock_acquire(of->lk);
 
 	/* initialize a uio with the write flag set, pointing into our buffer */
 	uio_uinit(&iovec_tmp, &uio_tmp, buf, nbytes, of->os, UIO_WRITE);
 
 	/* write into vnode from our uio object */
-	result = VOP_WRITE(vn, &uio_tmp);
+	result = VOP_WRITE(of->vn, &uio_tmp);
 	if (result) {
-		lock_release(of_t->oft_l);
+		lock_release(of->lk);
 		return result;
 	}
 
 	/* find the number of bytes written */
-	*sz = uio_tmp.uio_offset - of->os;
+	*sz = nbytes - uio_tmp.uio_resid;
 
 	/* update the seek pointer in the open file */
 	of->os = uio_tmp.uio_offset;
-
-	/* release the lock on the file */
-	lock_release(of_t->oft_l);
+	lock_release(of->lk);
 
 	return 0;
 }
@@ -249,6 +259,7 @@ file_close(int fd)
 	if (of->rc == 1) {
 		/* free memory */
 		vfs_close(of->vn);
+		lock_destroy(of->lk);
 		kfree(of);
 		of_t->openfiles[of_entry] = NULL;
 	}
@@ -36,6 +36,8 @@
 #include <synch.h>
 #include <current.h>
 #include <vnode.h>
+#include <uio.h>
+#include <kern/fcntl.h>
 #include <kern/seek.h>
 #include <kern/stat.h>
 
@@ -91,6 +93,89 @@ sys_read(int fd, userptr_t buf, size_t buflen, int *sz)
 	return file_read(fd, buf, buflen, sz);
 }
 
+/*
+ * Read directory entries for sys_getdirentry (one name) and
+ * sys_getdirentries (as many struct dirents as fit). The seek
+ * pointer is whatever the filesystem makes of it, so the amount
+ * returned comes from the residual count rather than the offset.
+ */
+static
+int
+file_getdir(int fd, userptr_t buf, size_t buflen, bool many, int *sz)
+{
+	struct vnode *vn;
+	struct iovec iov;
+	struct uio uio;
+	int result;
+
+	/* check to see if the file descriptor is sensible */
+	if (fd < 0 || fd >= OPEN_MAX) {
+		return EBADF;
+	}
+
+	/* get the file index */
+	int of_index = curproc->fd_t->fd_entries[fd];
+
+	/* check if fd is closed */
+	if (of_index == FILE_CLOSED) {
+		return EBADF;
+	}
+
+	lock_acquire(of_t->oft_l);
+	struct open_file *of = of_t->openfiles[of_index];
+
+	/* directories are never open for writing, but check anyway */
+	if ((of->am & O_ACCMODE) == O_WRONLY) {
+		lock_release(of_t->oft_l);
+		return EBADF;
+	}
+
+	/* as in file_read, hold the open file rather than the table */
+	lock_release(of_t->oft_l);
+	lock_acquire(of->lk);
+	vn = of->vn;
+	uio_uinit(&iov, &uio, buf, buflen, of->os, UIO_READ);
+
+	if (many) {
+		result = VOP_GETDIRENTRIES(vn, &uio);
+	}
+	else {
+		result = VOP_GETDIRENTRY(vn, &uio);
+	}
+	if (result) {
+		lock_release(of->lk);
+		return result;
+	}
+
+	*sz = buflen - uio.uio_resid;
+
+	of->os = uio.uio_offset;
+	lock_release(of->lk);
+	return 0;
+}
+
+/*
+ * sys_getdirentry
+ * read the next name from a directory
+ */
+int
+sys_getdirentry(int fd, userptr_t buf, size_t buflen, int *sz)
+{
+	return file_getdir(fd, buf, buflen, false, sz);
+}
+
+/*
+ * sys_getdirentries
+ * read as many directory entries as fit in buf, as struct dirents
+ * with inode numbers and types, so listing a directory takes a few
+ * calls rather than one per name
+ */
+int
+sys_getdirentries(int fd, userptr_t buf, size_t buflen, int *sz)
+{
+	return file_getdir(fd, buf, buflen, true, sz);
+}
+
 /*
  * sys_dup2
  * this syscall duplicates one file descriptor to another
@@ -169,7 +254,8 @@ sys_lseek(int fd, off_t pos, int whence, off_t * npos)
 	}
 
 	/* check to see if whence is a legit value */
-	if (whence != SEEK_SET && whence != SEEK_CUR && whence != SEEK_END) {
+	if (whence != SEEK_SET && whence != SEEK_CUR && whence != SEEK_END &&
+	    whence != SEEK_DATA && whence != SEEK_HOLE) {
 		return EINVAL;
 	}
 
@@ -187,9 +273,13 @@ sys_lseek(int fd, off_t pos, int whence, off_t * npos)
 	/* get the actual file from the open file table */
 	struct open_file *of = of_t->openfiles[of_index];
 
+	/* as in file_read, hold the open file rather than the table */
+	lock_release(of_t->oft_l);
+	lock_acquire(of->lk);
+
 	/* check if the file is a device */
 	if (!VOP_ISSEEKABLE(of->vn)) {
-		lock_release(of_t->oft_l);
+		lock_release(of->lk);
 		return ESPIPE;
 	}
 
@@ -207,25 +297,99 @@ sys_lseek(int fd, off_t pos, int whence, off_t * npos)
 	case SEEK_END:
 		result = VOP_STAT(of->vn, &of_stat);
 		if (result) {
-			lock_release(of_t->oft_l);
+			lock_release(of->lk);
 			return result;
 		}
 		of->os = pos + of_stat.st_size;
 		break;
+	case SEEK_DATA:
+	case SEEK_HOLE:
+		/* ask the file system where the next data or hole is */
+		if (pos < 0) {
+			lock_release(of->lk);
+			return ENXIO;
+		}
+		result = VOP_SEEKHOLE(of->vn, pos, whence == SEEK_HOLE,
+				      &of->os);
+		if (result) {
+			lock_release(of->lk);
+			return result;
+		}
+		break;
 	}
 
 	/* the seek would have been negative */
 	if (of->os < 0) {
 		of->os = og_pos;
-		lock_release(of_t->oft_l);
+		lock_release(of->lk);
 		return EINVAL;
 	}
 
 	/* assign new position */
 	*npos = of->os;
 
-	/* release the table */
-	lock_release(of_t->oft_l);
+	/* release the open file */
+	lock_release(of->lk);
 
 	return 0;
 }
+
+/*
+ * Flush an open file to stable storage, for sys_fsync and
+ * sys_fdatasync. Hold a reference to the vnode instead of the open
+ * file table while the disk is busy, so other processes aren't
+ * held up.
+ */
+static
+int
+file_sync(int fd)
+{
+	struct vnode *vn;
+	int result;
+
+	/* check to see if the file descriptor is sensible */
+	if (fd < 0 || fd >= OPEN_MAX) {
+		return EBADF;
+	}
+
+	/* get the file index */
+	int of_index = curproc->fd_t->fd_entries[fd];
+
+	/* check if fd is closed */
+	if (of_index == FILE_CLOSED) {
+		return EBADF;
+	}
+
+	/* get the vnode out of the open file table */
+	lock_acquire(of_t->oft_l);
+	vn = of_t->openfiles[of_index]->vn;
+	VOP_INCREF(vn);
+	lock_release(of_t->oft_l);
+
+	result = VOP_FSYNC(vn);
+	VOP_DECREF(vn);
+	return result;
+}
+
+/*
+ * sys_fsync
+ * write a file's dirty data and metadata to disk
+ */
+int
+sys_fsync(int fd)
+{
+	return file_sync(fd);
+}
+
+/*
+ * sys_fdatasync
+ * write a file's dirty data to disk, and whatever metadata is needed
+ * to read it back. None of our filesystems keep timestamps or other
+ * inode fields that fdatasync would be allowed to skip, so this is
+ * the same as fsync.
+ */
+int
+sys_fdatasync(int fd)
+{
+	return file_sync(fd);
+}
@@ -0,0 +1,555 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Block device I/O statistics, and the "devstats:" device that
+ * reports them.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <stdarg.h>
+#include <lib.h>
+#include <clock.h>
+#include <uio.h>
+#include <vfs.h>
+#include <device.h>
+#include <devstats.h>
+
+/*
+ * Most space one device's report can take. (Keep it under a page, so
+ * the buffer comes from the subpage allocator and really gets freed.)
+ */
+#define DEVSTATS_REPORTMAX  1536
+
+/*
+ * Current time in microseconds.
+ */
+static
+uint64_t
+devstats_now(void)
+{
+	struct timespec ts;
+
+	gettime(&ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Histogram bucket for a time.
+ */
+static
+unsigned
+devstats_bucket(uint64_t us)
+{
+	unsigned b;
+
+	for (b = 0; b < DEVSTATS_NBUCKETS - 1; b++) {
+		if (us < ((uint64_t)2 << b)) {
+			break;
+		}
+	}
+	return b;
+}
+
+/*
+ * Account for the time since the queue depth last changed, then
+ * change it by DELTA.
+ */
+static
+void
+devstats_depthchange(struct devstats *ds, uint64_t now, int delta)
+{
+	uint64_t elapsed;
+
+	KASSERT(spinlock_do_i_hold(&ds->ds_lock));
+
+	elapsed = now > ds->ds_lastchange ? now - ds->ds_lastchange : 0;
+	ds->ds_depthtime += ds->ds_depth * elapsed;
+	if (ds->ds_depth > 0) {
+		ds->ds_busytime += elapsed;
+	}
+	ds->ds_lastchange = now;
+
+	KASSERT(delta >= 0 || ds->ds_depth > 0);
+	ds->ds_depth += delta;
+	if (ds->ds_depth > ds->ds_maxdepth) {
+		ds->ds_maxdepth = ds->ds_depth;
+	}
+}
+
+/*
+ * Zero the counters. Requests that are outstanding stay counted in
+ * the queue depth.
+ *
+ * This is called (via vfs_adddev) before the clock may have been
+ * attached, so the starting time is filled in by the first request.
+ */
+static
+void
+devstats_zero(struct devstats *ds, uint64_t now)
+{
+	unsigned i;
+
+	for (i = 0; i < 2; i++) {
+		ds->ds_ops[i] = 0;
+		ds->ds_bytes[i] = 0;
+	}
+	ds->ds_errors = 0;
+	ds->ds_waitsum = ds->ds_waitmax = 0;
+	ds->ds_svcsum = ds->ds_svcmax = 0;
+	for (i = 0; i < DEVSTATS_NBUCKETS; i++) {
+		ds->ds_waithist[i] = 0;
+		ds->ds_svchist[i] = 0;
+	}
+	ds->ds_maxdepth = ds->ds_depth;
+	ds->ds_depthtime = 0;
+	ds->ds_busytime = 0;
+	ds->ds_lastchange = now;
+	ds->ds_since = now;
+}
+
+void
+devstats_init(struct devstats *ds)
+{
+	spinlock_init(&ds->ds_lock);
+	ds->ds_depth = 0;
+	devstats_zero(ds, 0);
+}
+
+void
+devstats_cleanup(struct devstats *ds)
+{
+	KASSERT(ds->ds_depth == 0);
+	spinlock_cleanup(&ds->ds_lock);
+}
+
+void
+devstats_reset(struct devstats *ds)
+{
+	uint64_t now;
+
+	now = devstats_now();
+	spinlock_acquire(&ds->ds_lock);
+	devstats_zero(ds, now);
+	spinlock_release(&ds->ds_lock);
+}
+
+/*
+ * A request has been submitted.
+ */
+void
+devstats_queued(struct devstats *ds, struct devreq *req)
+{
+	uint64_t now;
+
+	now = devstats_now();
+	req->dr_qtime = now;
+	req->dr_stime = now;
+
+	spinlock_acquire(&ds->ds_lock);
+	if (ds->ds_since == 0) {
+		ds->ds_since = ds->ds_lastchange = now;
+	}
+	devstats_depthchange(ds, now, 1);
+	spinlock_release(&ds->ds_lock);
+}
+
+/*
+ * The device has started work on a request.
+ */
+void
+devstats_started(struct devstats *ds, struct devreq *req)
+{
+	uint64_t wait;
+
+	req->dr_stime = devstats_now();
+	wait = req->dr_stime > req->dr_qtime ?
+		req->dr_stime - req->dr_qtime : 0;
+
+	spinlock_acquire(&ds->ds_lock);
+	ds->ds_waitsum += wait;
+	if (wait > ds->ds_waitmax) {
+		ds->ds_waitmax = wait;
+	}
+	ds->ds_waithist[devstats_bucket(wait)]++;
+	spinlock_release(&ds->ds_lock);
+}
+
+/*
+ * A request has finished (or failed).
+ */
+void
+devstats_done(struct devstats *ds, struct devreq *req, int result)
+{
+	uint64_t now, svc;
+	unsigned dir;
+
+	now = devstats_now();
+	svc = now > req->dr_stime ? now - req->dr_stime : 0;
+	dir = req->dr_write ? 1 : 0;
+
+	spinlock_acquire(&ds->ds_lock);
+	devstats_depthchange(ds, now, -1);
+	ds->ds_ops[dir]++;
+	ds->ds_bytes[dir] += req->dr_done;
+	if (result) {
+		ds->ds_errors++;
+	}
+	ds->ds_svcsum += svc;
+	if (svc > ds->ds_svcmax) {
+		ds->ds_svcmax = svc;
+	}
+	ds->ds_svchist[devstats_bucket(svc)]++;
+	spinlock_release(&ds->ds_lock);
+}
+
+////////////////////////////////////////////////////////////
+// Reports
+
+/*
+ * Output buffer for a report. Output past the end is dropped.
+ */
+struct devstats_out {
+	char *do_buf;
+	size_t do_len;
+	size_t do_pos;
+};
+
+static
+void
+devstats_printf(struct devstats_out *out, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (out->do_pos + 1 >= out->do_len) {
+		return;
+	}
+	va_start(ap, fmt);
+	vsnprintf(out->do_buf + out->do_pos, out->do_len - out->do_pos,
+		  fmt, ap);
+	va_end(ap);
+	out->do_pos += strlen(out->do_buf + out->do_pos);
+}
+
+/*
+ * Print X / Y to PLACES decimal places (0 if Y is 0).
+ */
+static
+void
+devstats_printratio(struct devstats_out *out, uint64_t x, uint64_t y,
+		    unsigned places)
+{
+	uint64_t scale, val;
+	unsigned i;
+
+	for (scale = 1, i = 0; i < places; i++) {
+		scale *= 10;
+	}
+	val = y == 0 ? 0 : x * scale / y;
+	devstats_printf(out, "%llu", (unsigned long long)(val / scale));
+	if (places > 0) {
+		devstats_printf(out, ".");
+	}
+	for (scale /= 10; scale > 0; scale /= 10) {
+		devstats_printf(out, "%u", (unsigned)(val / scale % 10));
+	}
+}
+
+/*
+ * Write the report for one device.
+ */
+static
+void
+devstats_format(struct devstats_out *out, const char *name,
+		struct devstats *ds)
+{
+	struct devstats snap;
+	uint64_t now, elapsed;
+	unsigned i, lo, hi;
+
+	now = devstats_now();
+	spinlock_acquire(&ds->ds_lock);
+	if (ds->ds_since != 0) {
+		devstats_depthchange(ds, now, 0);
+	}
+	snap = *ds;
+	spinlock_release(&ds->ds_lock);
+
+	elapsed = snap.ds_since != 0 && now > snap.ds_since ?
+		now - snap.ds_since : 0;
+
+	devstats_printf(out, "%s: %llu reads, %llu bytes; "
+			"%llu writes, %llu bytes; %llu errors\n", name,
+			(unsigned long long)snap.ds_ops[0],
+			(unsigned long long)snap.ds_bytes[0],
+			(unsigned long long)snap.ds_ops[1],
+			(unsigned long long)snap.ds_bytes[1],
+			(unsigned long long)snap.ds_errors);
+
+	devstats_printf(out, "    over ");
+	devstats_printratio(out, elapsed, 1000000, 3);
+	devstats_printf(out, " s: read ");
+	devstats_printratio(out, snap.ds_bytes[0] * 1000000 / 1024,
+			    elapsed, 1);
+	devstats_printf(out, " KB/s, write ");
+	devstats_printratio(out, snap.ds_bytes[1] * 1000000 / 1024,
+			    elapsed, 1);
+	devstats_printf(out, " KB/s, ");
+	devstats_printratio(out, snap.ds_busytime * 100, elapsed, 1);
+	devstats_printf(out, "%% busy\n");
+
+	devstats_printf(out, "    queue depth: now %u, max %u, average ",
+			snap.ds_depth, snap.ds_maxdepth);
+	devstats_printratio(out, snap.ds_depthtime, elapsed, 2);
+	devstats_printf(out, "\n");
+
+	devstats_printf(out, "    wait: mean ");
+	devstats_printratio(out, snap.ds_waitsum,
+			    snap.ds_ops[0] + snap.ds_ops[1], 0);
+	devstats_printf(out, " us, max %llu us; service: mean ",
+			(unsigned long long)snap.ds_waitmax);
+	devstats_printratio(out, snap.ds_svcsum,
+			    snap.ds_ops[0] + snap.ds_ops[1], 0);
+	devstats_printf(out, " us, max %llu us\n",
+			(unsigned long long)snap.ds_svcmax);
+
+	/* Histogram rows from the first to the last nonempty bucket */
+	lo = DEVSTATS_NBUCKETS;
+	hi = 0;
+	for (i = 0; i < DEVSTATS_NBUCKETS; i++) {
+		if (snap.ds_waithist[i] != 0 || snap.ds_svchist[i] != 0) {
+			if (lo == DEVSTATS_NBUCKETS) {
+				lo = i;
+			}
+			hi = i;
+		}
+	}
+	if (lo == DEVSTATS_NBUCKETS) {
+		return;
+	}
+	devstats_printf(out, "    %-14s %8s %8s\n", "time (us)",
+			"wait", "service");
+	for (i = lo; i <= hi; i++) {
+		if (i == DEVSTATS_NBUCKETS - 1) {
+			devstats_printf(out, "    >= %-11lu", 1UL << i);
+		}
+		else {
+			devstats_printf(out, "    < %-12lu", 2UL << i);
+		}
+		devstats_printf(out, " %8u %8u\n",
+				snap.ds_waithist[i], snap.ds_svchist[i]);
+	}
+}
+
+/*
+ * Only block devices have anything to report.
+ */
+static
+bool
+devstats_isblockdev(struct device *dev)
+{
+	return dev->d_blocks > 0;
+}
+
+static
+void
+devstats_printone(const char *name, struct device *dev, void *data)
+{
+	struct devstats_out *out = data;
+
+	if (!devstats_isblockdev(dev)) {
+		return;
+	}
+	out->do_pos = 0;
+	out->do_buf[0] = 0;
+	devstats_format(out, name, &dev->d_stats);
+	kprintf("%s", out->do_buf);
+}
+
+void
+devstats_printall(void)
+{
+	struct devstats_out out;
+
+	out.do_buf = kmalloc(DEVSTATS_REPORTMAX);
+	if (out.do_buf == NULL) {
+		kprintf("devstats: Out of memory\n");
+		return;
+	}
+	out.do_len = DEVSTATS_REPORTMAX;
+	vfs_eachdev(devstats_printone, &out);
+	kfree(out.do_buf);
+}
+
+static
+void
+devstats_resetone(const char *name, struct device *dev, void *data)
+{
+	(void)name;
+	(void)data;
+
+	if (devstats_isblockdev(dev)) {
+		devstats_reset(&dev->d_stats);
+	}
+}
+
+void
+devstats_resetall(void)
+{
+	vfs_eachdev(devstats_resetone, NULL);
+}
+
+////////////////////////////////////////////////////////////
+// The devstats: device
+
+/*
+ * State for devstats_io: each device's report is formatted in turn
+ * into ds_out and whatever part of it falls inside the read is copied
+ * out, so only one report has to be held at a time.
+ */
+struct devstats_stream {
+	struct devstats_out ds_out;
+	struct uio *ds_uio;
+	off_t ds_pos;			/* where ds_out goes in the output */
+	int ds_result;
+};
+
+static
+void
+devstats_streamone(const char *name, struct device *dev, void *data)
+{
+	struct devstats_stream *st = data;
+	struct uio *uio = st->ds_uio;
+	off_t end;
+
+	if (!devstats_isblockdev(dev) || st->ds_result != 0 ||
+	    uio->uio_resid == 0) {
+		return;
+	}
+	st->ds_out.do_pos = 0;
+	st->ds_out.do_buf[0] = 0;
+	devstats_format(&st->ds_out, name, &dev->d_stats);
+
+	end = st->ds_pos + st->ds_out.do_pos;
+	if (uio->uio_offset >= st->ds_pos && uio->uio_offset < end) {
+		st->ds_result = uiomove(st->ds_out.do_buf +
+					(uio->uio_offset - st->ds_pos),
+					end - uio->uio_offset, uio);
+	}
+	st->ds_pos = end;
+}
+
+static
+int
+devstats_eachopen(struct device *dev, int openflags)
+{
+	(void)dev;
+	(void)openflags;
+
+	return 0;
+}
+
+/*
+ * Reading returns the report for all block devices, as of the read;
+ * writing anything resets the counters.
+ */
+static
+int
+devstats_io(struct device *dev, struct uio *uio)
+{
+	struct devstats_stream st;
+
+	(void)dev;
+
+	if (uio->uio_rw == UIO_WRITE) {
+		devstats_resetall();
+		uio->uio_resid = 0;
+		return 0;
+	}
+
+	st.ds_out.do_buf = kmalloc(DEVSTATS_REPORTMAX);
+	if (st.ds_out.do_buf == NULL) {
+		return ENOMEM;
+	}
+	st.ds_out.do_len = DEVSTATS_REPORTMAX;
+	st.ds_uio = uio;
+	st.ds_pos = 0;
+	st.ds_result = 0;
+	vfs_eachdev(devstats_streamone, &st);
+
+	kfree(st.ds_out.do_buf);
+	return st.ds_result;
+}
+
+static
+int
+devstats_ioctl(struct device *dev, int op, userptr_t data)
+{
+	(void)dev;
+	(void)op;
+	(void)data;
+
+	return EINVAL;
+}
+
+static const struct device_ops devstats_devops = {
+	.devop_eachopen = devstats_eachopen,
+	.devop_io = devstats_io,
+	.devop_ioctl = devstats_ioctl,
+};
+
+/*
+ * Function to create and attach devstats:
+ */
+void
+devstats_create(void)
+{
+	int result;
+	struct device *dev;
+
+	dev = kmalloc(sizeof(*dev));
+	if (dev == NULL) {
+		panic("Could not add devstats device: out of memory\n");
+	}
+
+	dev->d_ops = &devstats_devops;
+
+	dev->d_blocks = 0;
+	dev->d_blocksize = 1;
+
+	dev->d_devnumber = 0; /* assigned by vfs_adddev */
+
+	dev->d_data = NULL;
+
+	result = vfs_adddev("devstats", dev, 0);
+	if (result) {
+		panic("Could not add devstats device: %s\n", strerror(result));
+	}
+}
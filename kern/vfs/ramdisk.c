@@ -0,0 +1,278 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * RAM disk: a block device whose contents are kernel memory.
+ *
+ * It has no seek or rotation delay, so timings on a filesystem
+ * mounted on it measure the filesystem's own costs, and it's a fast
+ * place for scratch files. The contents are lost at shutdown.
+ *
+ * The memory is allocated a page at a time rather than in one piece,
+ * so a big RAM disk doesn't need that much contiguous memory.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <vm.h>
+#include <vfs.h>
+#include <device.h>
+
+/* Sector size (the same as a real disk's, so SFS can use it) */
+#define RAMDISK_SECTSIZE  512
+
+struct ramdisk {
+	struct device rd_dev;
+	char **rd_pages;		/* the contents, PAGE_SIZE each */
+	unsigned rd_npages;
+};
+
+/* Number of RAM disks made so far, for naming them */
+static unsigned ramdisk_count;
+
+/*
+ * Check that a transfer is whole sectors and on the disk.
+ */
+static
+int
+ramdisk_check(struct ramdisk *rd, off_t pos, size_t len)
+{
+	off_t size;
+
+	if (pos % RAMDISK_SECTSIZE != 0 || len % RAMDISK_SECTSIZE != 0) {
+		return EINVAL;
+	}
+	size = (off_t)rd->rd_dev.d_blocks * RAMDISK_SECTSIZE;
+	if (pos < 0 || pos > size || (off_t)len > size - pos) {
+		return EINVAL;
+	}
+	return 0;
+}
+
+static
+int
+ramdisk_eachopen(struct device *d, int openflags)
+{
+	(void)d;
+	(void)openflags;
+
+	return 0;
+}
+
+static
+int
+ramdisk_ioctl(struct device *d, int op, userptr_t data)
+{
+	(void)d;
+	(void)op;
+	(void)data;
+
+	return EIOCTL;
+}
+
+/*
+ * I/O function (for both reads and writes).
+ */
+static
+int
+ramdisk_io(struct device *d, struct uio *uio)
+{
+	struct ramdisk *rd = d->d_data;
+	struct devreq stats;
+	size_t start, amt, pageoff;
+	unsigned page;
+	int result;
+
+	result = ramdisk_check(rd, uio->uio_offset, uio->uio_resid);
+	if (result) {
+		return result;
+	}
+	if (uio->uio_resid == 0) {
+		return 0;
+	}
+
+	/* Only the fields devstats uses */
+	stats.dr_write = uio->uio_rw == UIO_WRITE;
+	devstats_queued(&d->d_stats, &stats);
+	devstats_started(&d->d_stats, &stats);
+
+	start = uio->uio_resid;
+	while (uio->uio_resid > 0) {
+		page = uio->uio_offset / PAGE_SIZE;
+		pageoff = uio->uio_offset % PAGE_SIZE;
+		amt = PAGE_SIZE - pageoff;
+		if (amt > uio->uio_resid) {
+			amt = uio->uio_resid;
+		}
+		result = uiomove(rd->rd_pages[page] + pageoff, amt, uio);
+		if (result) {
+			break;
+		}
+	}
+
+	stats.dr_done = start - uio->uio_resid;
+	devstats_done(&d->d_stats, &stats, result);
+	return result;
+}
+
+/*
+ * Asynchronous request. There's nothing to wait for, so it's done
+ * (and the callback made) before this returns.
+ */
+static
+int
+ramdisk_submit(struct device *d, struct devreq *req)
+{
+	struct ramdisk *rd = d->d_data;
+	size_t amt, pageoff;
+	off_t pos;
+	char *data;
+	int result;
+
+	pos = (off_t)req->dr_block * RAMDISK_SECTSIZE;
+	result = ramdisk_check(rd, pos, req->dr_len);
+	if (result) {
+		return result;
+	}
+
+	req->dr_done = 0;
+	req->dr_next = NULL;
+	if (req->dr_len == 0) {
+		req->dr_callback(req, 0);
+		return 0;
+	}
+
+	devstats_queued(&d->d_stats, req);
+	devstats_started(&d->d_stats, req);
+
+	while (req->dr_done < req->dr_len) {
+		data = rd->rd_pages[pos / PAGE_SIZE];
+		pageoff = pos % PAGE_SIZE;
+		amt = PAGE_SIZE - pageoff;
+		if (amt > req->dr_len - req->dr_done) {
+			amt = req->dr_len - req->dr_done;
+		}
+		if (req->dr_write) {
+			memcpy(data + pageoff,
+			       (char *)req->dr_data + req->dr_done, amt);
+		}
+		else {
+			memcpy((char *)req->dr_data + req->dr_done,
+			       data + pageoff, amt);
+		}
+		req->dr_done += amt;
+		pos += amt;
+	}
+
+	devstats_done(&d->d_stats, req, 0);
+	req->dr_callback(req, 0);
+	return 0;
+}
+
+static const struct device_ops ramdisk_devops = {
+	.devop_eachopen = ramdisk_eachopen,
+	.devop_io = ramdisk_io,
+	.devop_ioctl = ramdisk_ioctl,
+	.devop_submit = ramdisk_submit,
+};
+
+/*
+ * Free a RAM disk that didn't get attached.
+ */
+static
+void
+ramdisk_destroy(struct ramdisk *rd)
+{
+	unsigned i;
+
+	for (i=0; i<rd->rd_npages; i++) {
+		kfree(rd->rd_pages[i]);
+	}
+	kfree(rd->rd_pages);
+	kfree(rd);
+}
+
+/*
+ * Make a zero-filled RAM disk of KBYTES kilobytes (rounded up to a
+ * whole page) and add it to the device list as a mountable device
+ * named ramN. The name is returned in NAME (of size NAMELEN), and
+ * the device in RET.
+ */
+int
+ramdisk_create(unsigned kbytes, char *name, size_t namelen,
+	       struct device **ret)
+{
+	struct ramdisk *rd;
+	unsigned npages, i;
+	int result;
+
+	npages = (kbytes + PAGE_SIZE / 1024 - 1) / (PAGE_SIZE / 1024);
+	if (npages == 0) {
+		return EINVAL;
+	}
+
+	rd = kmalloc(sizeof(*rd));
+	if (rd == NULL) {
+		return ENOMEM;
+	}
+	rd->rd_npages = 0;
+	rd->rd_pages = kmalloc(npages * sizeof(rd->rd_pages[0]));
+	if (rd->rd_pages == NULL) {
+		kfree(rd);
+		return ENOMEM;
+	}
+	for (i=0; i<npages; i++) {
+		rd->rd_pages[i] = kmalloc(PAGE_SIZE);
+		if (rd->rd_pages[i] == NULL) {
+			ramdisk_destroy(rd);
+			return ENOMEM;
+		}
+		rd->rd_npages++;
+		bzero(rd->rd_pages[i], PAGE_SIZE);
+	}
+
+	rd->rd_dev.d_ops = &ramdisk_devops;
+	rd->rd_dev.d_blocks = npages * (PAGE_SIZE / RAMDISK_SECTSIZE);
+	rd->rd_dev.d_blocksize = RAMDISK_SECTSIZE;
+	rd->rd_dev.d_devnumber = 0; /* assigned by vfs_adddev */
+	rd->rd_dev.d_data = rd;
+
+	snprintf(name, namelen, "ram%u", ramdisk_count);
+	result = vfs_adddev(name, &rd->rd_dev, 1);
+	if (result) {
+		ramdisk_destroy(rd);
+		return result;
+	}
+	ramdisk_count++;
+
+	*ret = &rd->rd_dev;
+	return 0;
+}
@@ -0,0 +1,349 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Name lookup cache.
+ *
+ * Remembers the result of looking up a single pathname component in
+ * a directory: (directory vnode, name) -> vnode, or -> "no such
+ * file" for negative entries. vfs_lookup and vfs_lookparent walk
+ * paths one component at a time through here, so resolving a hot
+ * path doesn't go to the filesystem at all.
+ *
+ * Each entry holds a reference to its directory and (if positive) to
+ * the vnode it names. The operations in vfspath.c that change names
+ * call vfs_dcache_remove afterwards; unmount calls vfs_dcache_purge
+ * first so the references don't keep the filesystem busy.
+ *
+ * Only filesystems that set FS_CACHENAMES are cached. Entries never
+ * expire, so that excludes anything (like emufs) whose files can be
+ * changed behind our back; those filesystems get every lookup, and
+ * can cache for themselves if they know how long is safe.
+ *
+ * Entries are kept in a fixed pool, hashed by (directory, name) and
+ * recycled in LRU order. Names longer than DC_NAMELEN aren't cached.
+ *
+ * Everything is protected by the big VFS lock.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <vfs.h>
+#include <fs.h>
+#include <vnode.h>
+
+#define DC_NENTRIES  128	/* number of entries */
+#define DC_HASHSIZE  61		/* number of hash chains */
+#define DC_NAMELEN   31		/* longest name we'll cache */
+
+struct dcentry {
+	struct vnode *dc_dir;		/* directory; NULL if entry unused */
+	struct vnode *dc_vn;		/* what the name refers to, or NULL */
+	unsigned dc_hash;		/* hash of dc_dir and dc_name */
+	char dc_name[DC_NAMELEN+1];	/* the name */
+	struct dcentry *dc_hashnext;	/* next in hash chain */
+	struct dcentry *dc_lrunext;	/* next (less recently used) */
+	struct dcentry *dc_lruprev;	/* previous (more recently used) */
+};
+
+static struct dcentry dc_entries[DC_NENTRIES];
+static struct dcentry *dc_hashtab[DC_HASHSIZE];
+static struct dcentry *dc_lruhead, *dc_lrutail;
+
+/*
+ * Set up the free pool; all entries start on the LRU list, unused.
+ */
+void
+vfs_dcache_bootstrap(void)
+{
+	unsigned i;
+
+	dc_lruhead = dc_lrutail = NULL;
+	for (i=0; i<DC_HASHSIZE; i++) {
+		dc_hashtab[i] = NULL;
+	}
+	for (i=0; i<DC_NENTRIES; i++) {
+		dc_entries[i].dc_dir = NULL;
+		dc_entries[i].dc_vn = NULL;
+		dc_entries[i].dc_hashnext = NULL;
+		dc_entries[i].dc_lruprev = dc_lrutail;
+		dc_entries[i].dc_lrunext = NULL;
+		if (dc_lrutail != NULL) {
+			dc_lrutail->dc_lrunext = &dc_entries[i];
+		}
+		else {
+			dc_lruhead = &dc_entries[i];
+		}
+		dc_lrutail = &dc_entries[i];
+	}
+}
+
+static
+unsigned
+dc_hashname(struct vnode *dir, const char *name)
+{
+	unsigned h = (unsigned)(uintptr_t)dir;
+
+	while (*name) {
+		h = h*33 + (unsigned char)*name++;
+	}
+	return h;
+}
+
+/*
+ * Move an entry to the front (FRONT true) or back of the LRU list.
+ */
+static
+void
+dc_lrumove(struct dcentry *dc, bool front)
+{
+	/* unlink */
+	if (dc->dc_lruprev != NULL) {
+		dc->dc_lruprev->dc_lrunext = dc->dc_lrunext;
+	}
+	else {
+		dc_lruhead = dc->dc_lrunext;
+	}
+	if (dc->dc_lrunext != NULL) {
+		dc->dc_lrunext->dc_lruprev = dc->dc_lruprev;
+	}
+	else {
+		dc_lrutail = dc->dc_lruprev;
+	}
+
+	/* relink */
+	if (front) {
+		dc->dc_lruprev = NULL;
+		dc->dc_lrunext = dc_lruhead;
+		if (dc_lruhead != NULL) {
+			dc_lruhead->dc_lruprev = dc;
+		}
+		else {
+			dc_lrutail = dc;
+		}
+		dc_lruhead = dc;
+	}
+	else {
+		dc->dc_lrunext = NULL;
+		dc->dc_lruprev = dc_lrutail;
+		if (dc_lrutail != NULL) {
+			dc_lrutail->dc_lrunext = dc;
+		}
+		else {
+			dc_lruhead = dc;
+		}
+		dc_lrutail = dc;
+	}
+}
+
+static
+struct dcentry *
+dc_find(struct vnode *dir, const char *name, unsigned hash)
+{
+	struct dcentry *dc;
+
+	for (dc = dc_hashtab[hash % DC_HASHSIZE];
+	     dc != NULL;
+	     dc = dc->dc_hashnext) {
+		if (dc->dc_hash == hash && dc->dc_dir == dir &&
+		    !strcmp(dc->dc_name, name)) {
+			return dc;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Discard an entry: take it out of the hash table, drop its
+ * references, and put it at the back of the LRU list for reuse.
+ */
+static
+void
+dc_discard(struct dcentry *dc)
+{
+	struct dcentry **pp;
+	struct vnode *dir, *vn;
+
+	KASSERT(dc->dc_dir != NULL);
+
+	for (pp = &dc_hashtab[dc->dc_hash % DC_HASHSIZE];
+	     *pp != dc;
+	     pp = &(*pp)->dc_hashnext) {
+		KASSERT(*pp != NULL);
+	}
+	*pp = dc->dc_hashnext;
+	dc->dc_hashnext = NULL;
+
+	dir = dc->dc_dir;
+	vn = dc->dc_vn;
+	dc->dc_dir = NULL;
+	dc->dc_vn = NULL;
+	dc_lrumove(dc, false);
+
+	/* These may reclaim the vnodes, so do them last */
+	if (vn != NULL) {
+		VOP_DECREF(vn);
+	}
+	VOP_DECREF(dir);
+}
+
+/*
+ * Add an entry. VN may be NULL for a negative entry.
+ */
+static
+void
+dc_enter(struct vnode *dir, const char *name, unsigned hash,
+	 struct vnode *vn)
+{
+	struct dcentry *dc;
+
+	dc = dc_find(dir, name, hash);
+	if (dc != NULL) {
+		dc_discard(dc);
+	}
+
+	/* Recycle the least recently used entry */
+	dc = dc_lrutail;
+	if (dc->dc_dir != NULL) {
+		dc_discard(dc);
+	}
+
+	VOP_INCREF(dir);
+	if (vn != NULL) {
+		VOP_INCREF(vn);
+	}
+	dc->dc_dir = dir;
+	dc->dc_vn = vn;
+	dc->dc_hash = hash;
+	strcpy(dc->dc_name, name);
+	dc->dc_hashnext = dc_hashtab[hash % DC_HASHSIZE];
+	dc_hashtab[hash % DC_HASHSIZE] = dc;
+	dc_lrumove(dc, true);
+}
+
+/*
+ * Look up a single pathname component NAME in directory DIR, using
+ * the cache if possible and VOP_LOOKUP otherwise. Same interface as
+ * VOP_LOOKUP.
+ */
+int
+vfs_dcache_lookup(struct vnode *dir, char *name, struct vnode **ret)
+{
+	struct dcentry *dc;
+	unsigned hash;
+	int result;
+
+	vfs_biglock_acquire();
+
+	if (dir->vn_fs == NULL || (dir->vn_fs->fs_flags & FS_CACHENAMES) == 0
+	    || strlen(name) > DC_NAMELEN) {
+		result = VOP_LOOKUP(dir, name, ret);
+		vfs_biglock_release();
+		return result;
+	}
+
+	hash = dc_hashname(dir, name);
+	dc = dc_find(dir, name, hash);
+	if (dc != NULL) {
+		dc_lrumove(dc, true);
+		if (dc->dc_vn == NULL) {
+			vfs_biglock_release();
+			return ENOENT;
+		}
+		VOP_INCREF(dc->dc_vn);
+		*ret = dc->dc_vn;
+		vfs_biglock_release();
+		return 0;
+	}
+
+	result = VOP_LOOKUP(dir, name, ret);
+	if (result == 0) {
+		dc_enter(dir, name, hash, *ret);
+	}
+	else if (result == ENOENT) {
+		dc_enter(dir, name, hash, NULL);
+	}
+
+	vfs_biglock_release();
+	return result;
+}
+
+/*
+ * Forget whatever is cached for NAME in DIR. If it named a
+ * directory, also forget everything cached in that directory.
+ */
+void
+vfs_dcache_remove(struct vnode *dir, const char *name)
+{
+	struct dcentry *dc;
+	struct vnode *vn;
+	unsigned i;
+
+	vfs_biglock_acquire();
+
+	dc = dc_find(dir, name, dc_hashname(dir, name));
+	if (dc != NULL) {
+		vn = dc->dc_vn;
+		if (vn != NULL) {
+			/* hold it while we look for its children */
+			VOP_INCREF(vn);
+		}
+		dc_discard(dc);
+		if (vn != NULL) {
+			for (i=0; i<DC_NENTRIES; i++) {
+				if (dc_entries[i].dc_dir == vn) {
+					dc_discard(&dc_entries[i]);
+				}
+			}
+			VOP_DECREF(vn);
+		}
+	}
+
+	vfs_biglock_release();
+}
+
+/*
+ * Forget everything cached for filesystem FS, or for all filesystems
+ * if FS is NULL.
+ */
+void
+vfs_dcache_purge(struct fs *fs)
+{
+	unsigned i;
+
+	vfs_biglock_acquire();
+	for (i=0; i<DC_NENTRIES; i++) {
+		if (dc_entries[i].dc_dir != NULL &&
+		    (fs == NULL || dc_entries[i].dc_dir->vn_fs == fs)) {
+			dc_discard(&dc_entries[i]);
+		}
+	}
+	vfs_biglock_release();
+}
@@ -114,6 +114,20 @@ vopfail_truncate_isdir(struct vnode *vn, off_t pos)
 	return EISDIR;
 }
 
+////////////////////////////////////////////////////////////
+// seekhole
+
+int
+vopfail_seekhole_isdir(struct vnode *vn, off_t pos, bool hole,
+		       off_t *result)
+{
+	(void)vn;
+	(void)pos;
+	(void)hole;
+	(void)result;
+	return EISDIR;
+}
+
 ////////////////////////////////////////////////////////////
 // creat
 
@@ -112,7 +112,10 @@ vfs_bootstrap(void)
 	}
 	vfs_biglock_depth = 0;
 
+	vfs_dcache_bootstrap();
+
 	devnull_create();
+	devstats_create();
 	semfs_bootstrap();
 }
 
@@ -451,6 +454,7 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 	if (dev != NULL) {
 		/* use index+1 as the device number, so 0 is reserved */
 		dev->d_devnumber = index+1;
+		devstats_init(&dev->d_stats);
 	}
 
 	vfs_biglock_release();
@@ -495,6 +499,32 @@ vfs_addfs(const char *devname, struct fs *fs)
 	return vfs_doadd(devname, 0, NULL, fs);
 }
 
+/*
+ * Call FUNC on each device in the named device list (not counting
+ * filesystems that have no device), in the order they were added.
+ * FUNC must not add devices.
+ */
+void
+vfs_eachdev(void (*func)(const char *devname, struct device *dev,
+			 void *data),
+	    void *data)
+{
+	struct knowndev *kd;
+	unsigned i, num;
+
+	vfs_biglock_acquire();
+
+	num = knowndevarray_num(knowndevs);
+	for (i=0; i<num; i++) {
+		kd = knowndevarray_get(knowndevs, i);
+		if (kd->kd_device != NULL) {
+			func(kd->kd_name, kd->kd_device, data);
+		}
+	}
+
+	vfs_biglock_release();
+}
+
 //////////////////////////////////////////////////
 
 /*
@@ -654,6 +684,9 @@ vfs_unmount(const char *devname)
 	KASSERT(kd->kd_rawname != NULL);
 	KASSERT(kd->kd_device != NULL);
 
+	/* drop cached names, which hold references to its vnodes */
+	vfs_dcache_purge(kd->kd_fs);
+
 	/* sync the fs */
 	result = FSOP_SYNC(kd->kd_fs);
 	if (result) {
@@ -726,6 +759,9 @@ vfs_unmountall(void)
 
 	vfs_biglock_acquire();
 
+	/* drop cached names, which hold references to vnodes */
+	vfs_dcache_purge(NULL);
+
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
 		dev = knowndevarray_get(knowndevs, i);
@@ -234,6 +234,60 @@ getdevice(char *path, char **subpath, struct vnode **startvn)
 	return 0;
 }
 
+/*
+ * Walk PATH starting from directory STARTVN, one component at a time,
+ * looking each one up through the name cache. Consumes the reference
+ * to STARTVN.
+ *
+ * If BUF is NULL, hands back the vnode PATH refers to. Otherwise
+ * stops at the last component and does VOP_LOOKPARENT on it, which
+ * hands back its directory and copies the name into BUF.
+ */
+static
+int
+lookup_walk(struct vnode *startvn, char *path, struct vnode **retval,
+	    char *buf, size_t buflen)
+{
+	struct vnode *vn, *next;
+	char *s;
+	bool last;
+	int result;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	vn = startvn;
+	while (1) {
+		/* Split off the first component; ignore repeated slashes */
+		s = strchr(path, '/');
+		if (s != NULL) {
+			*s++ = 0;
+			while (*s == '/') {
+				s++;
+			}
+		}
+		last = (s == NULL || *s == 0);
+
+		if (last && buf != NULL) {
+			result = VOP_LOOKPARENT(vn, path, retval, buf, buflen);
+			VOP_DECREF(vn);
+			return result;
+		}
+
+		result = vfs_dcache_lookup(vn, path, &next);
+		VOP_DECREF(vn);
+		if (result) {
+			return result;
+		}
+		vn = next;
+
+		if (last) {
+			*retval = vn;
+			return 0;
+		}
+		path = s;
+	}
+}
+
 /*
  * Name-to-vnode translation.
  * (In BSD, both of these are subsumed by namei().)
@@ -260,13 +314,12 @@ vfs_lookparent(char *path, struct vnode **retval,
 		 * a context where "lookparent" is the desired
 		 * operation.
 		 */
-		result = EINVAL;
-	}
-	else {
-		result = VOP_LOOKPARENT(startvn, path, retval, buf, buflen);
+		VOP_DECREF(startvn);
+		vfs_biglock_release();
+		return EINVAL;
 	}
 
-	VOP_DECREF(startvn);
+	result = lookup_walk(startvn, path, retval, buf, buflen);
 
 	vfs_biglock_release();
 	return result;
@@ -292,9 +345,8 @@ vfs_lookup(char *path, struct vnode **retval)
 		return 0;
 	}
 
-	result = VOP_LOOKUP(startvn, path, retval);
+	result = lookup_walk(startvn, path, retval, NULL, 0);
 
-	VOP_DECREF(startvn);
 	vfs_biglock_release();
 	return result;
 }
@@ -73,7 +73,16 @@ vfs_open(char *path, int openflags, mode_t mode, struct vnode **ret)
 			return result;
 		}
 
+		/*
+		 * Hold the big lock so nobody can find a stale
+		 * negative name cache entry before we remove it.
+		 */
+		vfs_biglock_acquire();
 		result = VOP_CREAT(dir, name, excl, mode, &vn);
+		if (result == 0) {
+			vfs_dcache_remove(dir, name);
+		}
+		vfs_biglock_release();
 
 		VOP_DECREF(dir);
 	}
@@ -145,7 +154,12 @@ vfs_remove(char *path)
 		return result;
 	}
 
+	vfs_biglock_acquire();
 	result = VOP_REMOVE(dir, name);
+	if (result == 0) {
+		vfs_dcache_remove(dir, name);
+	}
+	vfs_biglock_release();
 	VOP_DECREF(dir);
 
 	return result;
@@ -178,7 +192,13 @@ vfs_rename(char *oldpath, char *newpath)
 		return EXDEV;
 	}
 
+	vfs_biglock_acquire();
 	result = VOP_RENAME(olddir, oldname, newdir, newname);
+	if (result == 0) {
+		vfs_dcache_remove(olddir, oldname);
+		vfs_dcache_remove(newdir, newname);
+	}
+	vfs_biglock_release();
 
 	VOP_DECREF(newdir);
 	VOP_DECREF(olddir);
@@ -212,7 +232,12 @@ vfs_link(char *oldpath, char *newpath)
 		return EXDEV;
 	}
 
+	vfs_biglock_acquire();
 	result = VOP_LINK(newdir, newname, oldfile);
+	if (result == 0) {
+		vfs_dcache_remove(newdir, newname);
+	}
+	vfs_biglock_release();
 
 	VOP_DECREF(newdir);
 	VOP_DECREF(oldfile);
@@ -239,7 +264,12 @@ vfs_symlink(const char *contents, char *path)
 		return result;
 	}
 
+	vfs_biglock_acquire();
 	result = VOP_SYMLINK(newdir, newname, contents);
+	if (result == 0) {
+		vfs_dcache_remove(newdir, newname);
+	}
+	vfs_biglock_release();
 	VOP_DECREF(newdir);
 
 	return result;
@@ -285,7 +315,12 @@ vfs_mkdir(char *path, mode_t mode)
 		return result;
 	}
 
+	vfs_biglock_acquire();
 	result = VOP_MKDIR(parent, name, mode);
+	if (result == 0) {
+		vfs_dcache_remove(parent, name);
+	}
+	vfs_biglock_release();
 
 	VOP_DECREF(parent);
 
@@ -307,7 +342,12 @@ vfs_rmdir(char *path)
 		return result;
 	}
 
+	vfs_biglock_acquire();
 	result = VOP_RMDIR(parent, name);
+	if (result == 0) {
+		vfs_dcache_remove(parent, name);
+	}
+	vfs_biglock_release();
 
 	VOP_DECREF(parent);
 
@@ -32,10 +32,14 @@
  */
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/dirent.h>
 #include <lib.h>
+#include <limits.h>
 #include <synch.h>
 #include <vfs.h>
 #include <vnode.h>
+#include <stat.h>
+#include <uio.h>
 
 /*
  * Initialize an abstract vnode.
@@ -122,6 +126,115 @@ vnode_decref(struct vnode *vn)
 	}
 }
 
+/*
+ * vop_seekhole for objects that don't have holes: everything up to
+ * the size VOP_STAT reports is data, and the only hole is at EOF.
+ */
+int
+vnode_seekhole_nohole(struct vnode *vn, off_t pos, bool hole, off_t *result)
+{
+	struct stat st;
+	int err;
+
+	err = VOP_STAT(vn, &st);
+	if (err) {
+		return err;
+	}
+	if (pos >= st.st_size) {
+		return ENXIO;
+	}
+	*result = hole ? st.st_size : pos;
+	return 0;
+}
+
+/*
+ * Copy one struct dirent out to UIO for vop_getdirentries. TYPE is
+ * an _S_IF* value or 0. The caller has checked that the record
+ * (_DIRENT_RECLEN(namelen) bytes) fits.
+ */
+int
+vnode_putdirent(struct uio *uio, uint32_t ino, mode_t type,
+		const char *name, size_t namelen)
+{
+	struct dirent d;
+	size_t reclen;
+	int result;
+
+	KASSERT(namelen <= NAME_MAX);
+	reclen = _DIRENT_RECLEN(namelen);
+	KASSERT(reclen <= uio->uio_resid);
+
+	d.d_ino = ino;
+	d.d_reclen = reclen;
+	d.d_type = (type & _S_IFMT) >> 12;
+	d.d_namlen = namelen;
+
+	result = uiomove(&d, sizeof(d), uio);
+	if (result) {
+		return result;
+	}
+	result = uiomove((void *)name, namelen, uio);
+	if (result) {
+		return result;
+	}
+	/* the NUL and the padding */
+	return uiomovezeros(reclen - sizeof(d) - namelen, uio);
+}
+
+/*
+ * vop_getdirentries for filesystems that only have vop_getdirentry:
+ * fetch one name at a time into a kernel buffer and pack them up.
+ * This saves the caller the system calls, if not the per-entry work
+ * in the filesystem.
+ */
+int
+vnode_getdirentries(struct vnode *dir, struct uio *uio)
+{
+	char name[NAME_MAX+1];
+	struct iovec iov;
+	struct uio ku;
+	off_t pos;
+	size_t len;
+	bool any;
+	int result;
+
+	KASSERT(uio->uio_rw == UIO_READ);
+
+	pos = uio->uio_offset;
+	any = false;
+	while (1) {
+		uio_kinit(&iov, &ku, name, sizeof(name) - 1, pos, UIO_READ);
+		result = VOP_GETDIRENTRY(dir, &ku);
+		if (result) {
+			if (any) {
+				/* hand back what we have; fail next time */
+				break;
+			}
+			return result;
+		}
+		len = sizeof(name) - 1 - ku.uio_resid;
+		if (len == 0) {
+			/* EOF */
+			break;
+		}
+		if (_DIRENT_RECLEN(len) > uio->uio_resid) {
+			if (!any) {
+				return EINVAL;
+			}
+			break;
+		}
+		result = vnode_putdirent(uio, 0, 0, name, len);
+		if (result) {
+			return result;
+		}
+		pos = ku.uio_offset;
+		any = true;
+	}
+
+	uio->uio_offset = pos;
+	return 0;
+}
+
 /*
  * Check for various things being valid.
  * Called before all VOP_* calls.
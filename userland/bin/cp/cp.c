@@ -28,6 +28,7 @@
  */
 
 #include <unistd.h>
+#include <errno.h>
 #include <err.h>
 
 /*
@@ -36,6 +37,120 @@
  */
 
 
+/*
+ * Copy bytes from one open file to another, starting at the current
+ * offsets. If LEN is negative, copy until EOF; otherwise copy LEN
+ * bytes (or until EOF, if that comes first).
+ */
+static
+void
+copydata(int fromfd, const char *from, int tofd, const char *to, off_t len)
+{
+	char buf[1024];
+	int len1, wr, wrtot;
+	size_t want;
+
+	while (len != 0) {
+		want = sizeof(buf);
+		if (len > 0 && len < (off_t)want) {
+			want = len;
+		}
+
+		/*
+		 * As long as we get more than zero bytes, we haven't
+		 * hit EOF. Zero means EOF. Less than zero means an
+		 * error occurred. We may read less than we asked for,
+		 * though, in various cases for various reasons.
+		 */
+		len1 = read(fromfd, buf, want);
+		if (len1 < 0) {
+			err(1, "%s", from);
+		}
+		if (len1 == 0) {
+			break;
+		}
+
+		/*
+		 * Likewise, we may actually write less than we attempted
+		 * to. So loop until we're done.
+		 */
+		wrtot = 0;
+		while (wrtot < len1) {
+			wr = write(tofd, buf+wrtot, len1-wrtot);
+			if (wr<0) {
+				err(1, "%s", to);
+			}
+			wrtot += wr;
+		}
+
+		if (len > 0) {
+			len -= len1;
+		}
+	}
+}
+
+/*
+ * Copy the data regions of a file, skipping over holes with
+ * SEEK_DATA/SEEK_HOLE so that they come out as holes in the new
+ * file too (and so we don't read and write blocks of zeros).
+ * Returns -1 if the source can't do this, in which case nothing has
+ * been written yet and the caller should fall back to a plain copy.
+ */
+static
+int
+copysparse(int fromfd, const char *from, int tofd, const char *to)
+{
+	off_t size, pos, data, hole;
+
+	size = lseek(fromfd, 0, SEEK_END);
+	if (size < 0) {
+		return -1;
+	}
+
+	pos = 0;
+	while (pos < size) {
+		data = lseek(fromfd, pos, SEEK_DATA);
+		if (data < 0 && errno == ENXIO) {
+			/* nothing but hole from here to EOF */
+			break;
+		}
+		if (data < 0) {
+			if (pos > 0) {
+				err(1, "%s: lseek", from);
+			}
+			lseek(fromfd, 0, SEEK_SET);
+			return -1;
+		}
+		hole = lseek(fromfd, data, SEEK_HOLE);
+		if (hole < 0) {
+			err(1, "%s: lseek", from);
+		}
+
+		if (lseek(fromfd, data, SEEK_SET) < 0) {
+			err(1, "%s: lseek", from);
+		}
+		if (lseek(tofd, data, SEEK_SET) < 0) {
+			err(1, "%s: lseek", to);
+		}
+		copydata(fromfd, from, tofd, to, hole - data);
+		pos = hole;
+	}
+
+	/*
+	 * If the file ends in a hole, write the last byte so the new
+	 * file comes out the right size.
+	 */
+	if (pos < size) {
+		if (lseek(tofd, size - 1, SEEK_SET) < 0) {
+			err(1, "%s: lseek", to);
+		}
+		if (write(tofd, "", 1) < 0) {
+			err(1, "%s", to);
+		}
+	}
+	return 0;
+}
+
 /* Copy one file to another. */
 static
 void
@@ -43,8 +158,6 @@ copy(const char *from, const char *to)
 {
 	int fromfd;
 	int tofd;
-	char buf[1024];
-	int len, wr, wrtot;
 
 	/*
 	 * Open the files, and give up if they won't open
@@ -59,30 +172,11 @@ copy(const char *from, const char *to)
 	}
 
 	/*
-	 * As long as we get more than zero bytes, we haven't hit EOF.
-	 * Zero means EOF. Less than zero means an error occurred.
-	 * We may read less than we asked for, though, in various cases
-	 * for various reasons.
+	 * Skip holes if we can; otherwise (e.g. the source is a
+	 * device that can't seek) just copy the bytes until EOF.
 	 */
-	while ((len = read(fromfd, buf, sizeof(buf)))>0) {
-		/*
-		 * Likewise, we may actually write less than we attempted
-		 * to. So loop until we're done.
-		 */
-		wrtot = 0;
-		while (wrtot < len) {
-			wr = write(tofd, buf+wrtot, len-wrtot);
-			if (wr<0) {
-				err(1, "%s", to);
-			}
-			wrtot += wr;
-		}
-	}
-	/*
-	 * If we got a read error, print it and exit.
-	 */
-	if (len<0) {
-		err(1, "%s", from);
+	if (copysparse(fromfd, from, tofd, to) < 0) {
+		copydata(fromfd, from, tofd, to, -1);
 	}
 
 	if (close(fromfd) < 0) {
@@ -31,6 +31,7 @@
 #include <sys/stat.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <dirent.h>
 #include <string.h>
 #include <errno.h>
 #include <err.h>
@@ -185,6 +186,59 @@ print(const char *path)
 	printf("%s\n", file);
 }
 
+/*
+ * Reading a directory. getdirentries hands back a bufferful of
+ * entries at a time, so a big directory takes a few system calls
+ * instead of one per name.
+ */
+struct dirstate {
+	const char *path;
+	int fd;
+	char buf[4096];
+	ssize_t len, pos;
+};
+
+static
+void
+dir_open(struct dirstate *ds, const char *path)
+{
+	ds->path = path;
+	ds->fd = open(path, O_RDONLY);
+	if (ds->fd<0) {
+		err(1, "%s", path);
+	}
+	ds->len = ds->pos = 0;
+}
+
+/* Get the next entry, or NULL at the end. */
+static
+struct dirent *
+dir_next(struct dirstate *ds)
+{
+	struct dirent *d;
+
+	if (ds->pos >= ds->len) {
+		ds->len = getdirentries(ds->fd, ds->buf, sizeof(ds->buf));
+		if (ds->len<0) {
+			err(1, "%s: getdirentries", ds->path);
+		}
+		if (ds->len==0) {
+			return NULL;
+		}
+		ds->pos = 0;
+	}
+	d = (struct dirent *)(ds->buf + ds->pos);
+	ds->pos += d->d_reclen;
+	return d;
+}
+
+static
+void
+dir_close(struct dirstate *ds)
+{
+	close(ds->fd);
+}
+
 /*
  * List a directory.
  */
@@ -192,82 +246,57 @@ static
 void
 listdir(const char *path, int showheader)
 {
-	int fd;
-	char buf[1024];
+	struct dirstate ds;
+	struct dirent *d;
 	char newpath[1024];
-	ssize_t len;
 
 	if (showheader) {
 		printheader(path);
 	}
 
-	/*
-	 * Open it.
-	 */
-	fd = open(path, O_RDONLY);
-	if (fd<0) {
-		err(1, "%s", path);
-	}
-
-	/*
-	 * List the directory.
-	 */
-	while ((len = getdirentry(fd, buf, sizeof(buf)-1)) > 0) {
-		buf[len] = 0;
-
+	dir_open(&ds, path);
+	while ((d = dir_next(&ds)) != NULL) {
 		/* Assemble the full name of the new item */
-		snprintf(newpath, sizeof(newpath), "%s/%s", path, buf);
+		snprintf(newpath, sizeof(newpath), "%s/%s", path, d->d_name);
 
-		if (aopt || buf[0]!='.') {
+		if (aopt || d->d_name[0]!='.') {
 			/* Print it */
 			print(newpath);
 		}
 	}
-	if (len<0) {
-		err(1, "%s: getdirentry", path);
-	}
-
-	/* Done */
-	close(fd);
+	dir_close(&ds);
 }
 
 static
 void
 recursedir(const char *path)
 {
-	int fd;
-	char buf[1024];
+	struct dirstate ds;
+	struct dirent *d;
 	char newpath[1024];
-	int len;
-
-	/*
-	 * Open it.
-	 */
-	fd = open(path, O_RDONLY);
-	if (fd<0) {
-		err(1, "%s", path);
-	}
-
-	/*
-	 * List the directory.
-	 */
-	while ((len = getdirentry(fd, buf, sizeof(buf)-1)) > 0) {
-		buf[len] = 0;
 
+	dir_open(&ds, path);
+	while ((d = dir_next(&ds)) != NULL) {
 		/* Assemble the full name of the new item */
-		snprintf(newpath, sizeof(newpath), "%s/%s", path, buf);
+		snprintf(newpath, sizeof(newpath), "%s/%s", path, d->d_name);
 
-		if (!aopt && buf[0]=='.') {
+		if (!aopt && d->d_name[0]=='.') {
 			/* skip this one */
 			continue;
 		}
 
-		if (!strcmp(buf, ".") || !strcmp(buf, "..")) {
+		if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, "..")) {
 			/* always skip these */
 			continue;
 		}
 
-		if (!isdir(newpath)) {
+		/* Use the type if the filesystem told us; else stat it */
+		if (d->d_type != DT_UNKNOWN) {
+			if (d->d_type != DT_DIR) {
+				continue;
+			}
+		}
+		else if (!isdir(newpath)) {
 			continue;
 		}
 
@@ -276,11 +305,7 @@ recursedir(const char *path)
 			recursedir(newpath);
 		}
 	}
-	if (len<0) {
-		err(1, "%s", path);
-	}
-
-	close(fd);
+	dir_close(&ds);
 }
 
 static
@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _DIRENT_H_
+#define _DIRENT_H_
+
+/*
+ * Get struct dirent from the kernel.
+ */
+#include <sys/types.h>
+#include <kern/dirent.h>
+#include <kern/stattypes.h>
+
+/*
+ * Values for d_type. DT_UNKNOWN means the filesystem didn't say; use
+ * stat to find out.
+ */
+#define DT_UNKNOWN 0
+#define DT_REG     (_S_IFREG >> 12)
+#define DT_DIR     (_S_IFDIR >> 12)
+#define DT_LNK     (_S_IFLNK >> 12)
+#define DT_FIFO    (_S_IFIFO >> 12)
+#define DT_SOCK    (_S_IFSOCK >> 12)
+#define DT_CHR     (_S_IFCHR >> 12)
+#define DT_BLK     (_S_IFBLK >> 12)
+
+/*
+ * Read as many directory entries as fit in BUF, packed as struct
+ * dirents (step through them with d_reclen). Returns the number of
+ * bytes used, 0 at end of directory, or -1 on error. The one-at-a-time
+ * version is getdirentry() in unistd.h.
+ */
+ssize_t getdirentries(int filehandle, char *buf, size_t buflen);
+
+#endif /* _DIRENT_H_ */
@@ -69,6 +69,9 @@ extern const char *hostcompat_progname;
 #define ARRAYCOUNT(a) (sizeof(a) / sizeof((a)[0]))
 #define DIVROUNDUP(a, b) (((a) + (b) - 1) / (b))
 
+/* Bytes per inode on disk (SFS_BLOCKSIZE if they aren't packed) */
+static uint32_t inodesize = SFS_BLOCKSIZE;
+
 static bool dofiles, dodirs;
 static bool doindirect;
 static bool recurse;
@@ -132,16 +135,67 @@ dumplval(const char *desc, const char *lval)
 
 static void dumpinode(uint32_t ino, const char *name);
 
+/*
+ * Read the first SFS_BLOCKSIZE bytes of a block; that's all there is
+ * of the superblock.
+ */
+static
+void
+readpart(void *data, uint32_t block)
+{
+	uint8_t buf[SFS_MAXBLOCKSIZE];
+
+	diskread(buf, block);
+	memcpy(data, buf, SFS_BLOCKSIZE);
+}
+
+/*
+ * Read an inode, which may share its block with others.
+ */
+static
+void
+readinode(struct sfs_dinode *sfi, uint32_t ino)
+{
+	uint8_t buf[SFS_MAXBLOCKSIZE];
+
+	diskread(buf, SFS_INO_BLOCK(ino));
+	memset(sfi, 0, sizeof(*sfi));
+	memcpy(sfi, buf + SFS_INO_SLOT(ino) * inodesize, inodesize);
+}
+
 static
 uint32_t
 readsb(void)
 {
 	struct sfs_superblock sb;
+	uint32_t blocksize;
 
-	diskread(&sb, SFS_SUPER_BLOCK);
+	readpart(&sb, SFS_SUPER_BLOCK);
 	if (SWAP32(sb.sb_magic) != SFS_MAGIC) {
 		errx(1, "Not an sfs filesystem");
 	}
+
+	/* Zero means the original 512-byte blocks */
+	blocksize = SWAP32(sb.sb_blocksize);
+	if (blocksize == 0) {
+		blocksize = SFS_BLOCKSIZE;
+	}
+	if (blocksize < SFS_BLOCKSIZE || blocksize > SFS_MAXBLOCKSIZE ||
+	    (blocksize & (blocksize - 1)) != 0) {
+		errx(1, "Unsupported block size %u", blocksize);
+	}
+	disksetblocksize(blocksize);
+
+	/* Zero means each inode has its own block */
+	if (sb.sb_inodesize != 0) {
+		inodesize = SWAP32(sb.sb_inodesize);
+		if (inodesize < SFS_MININODESIZE ||
+		    inodesize > SFS_BLOCKSIZE ||
+		    (inodesize & (inodesize - 1)) != 0) {
+			errx(1, "Unsupported inode size %u", inodesize);
+		}
+	}
+
 	return SWAP32(sb.sb_nblocks);
 }
 
@@ -152,7 +206,7 @@ dumpsb(void)
 	struct sfs_superblock sb;
 	unsigned i;
 
-	diskread(&sb, SFS_SUPER_BLOCK);
+	readpart(&sb, SFS_SUPER_BLOCK);
 	sb.sb_volname[sizeof(sb.sb_volname)-1] = 0;
 
 	printf("Superblock\n");
@@ -160,9 +214,23 @@ dumpsb(void)
 	dumpvalf("Magic", "0x%8x", SWAP32(sb.sb_magic));
 	dumpvalf("Size", "%u blocks", SWAP32(sb.sb_nblocks));
 	dumpvalf("Freemap size", "%u blocks",
-		 SFS_FREEMAPBLOCKS(SWAP32(sb.sb_nblocks)));
-	dumpvalf("Block size", "%u bytes", SFS_BLOCKSIZE);
+		 SFS_FREEMAPBLOCKS(SWAP32(sb.sb_nblocks), diskblocksize()));
+	dumpvalf("Block size", "%u bytes", diskblocksize());
+	if (sb.sb_inodesize != 0) {
+		dumpvalf("Inode size", "%u bytes", inodesize);
+	}
+	else {
+		dumpvalf("Inode size", "1 block");
+	}
 	dumplval("Volume name", sb.sb_volname);
+	if (sb.sb_journalblocks != 0) {
+		dumpvalf("Journal", "%u blocks at %u",
+			 SWAP32(sb.sb_journalblocks),
+			 SWAP32(sb.sb_journalstart));
+	}
+	else {
+		dumpvalf("Journal", "none");
+	}
 
 	for (i=0; i<ARRAYCOUNT(sb.reserved); i++) {
 		if (sb.reserved[i] != 0) {
@@ -177,9 +245,11 @@ static
 void
 dumpfreemap(uint32_t fsblocks)
 {
-	uint32_t freemapblocks = SFS_FREEMAPBLOCKS(fsblocks);
+	uint32_t blocksize = diskblocksize();
+	uint32_t bitsperblock = SFS_BITSPERBLOCK(blocksize);
+	uint32_t freemapblocks = SFS_FREEMAPBLOCKS(fsblocks, blocksize);
 	uint32_t i, j, k, bn;
-	uint8_t data[SFS_BLOCKSIZE], mask;
+	uint8_t data[SFS_MAXBLOCKSIZE], mask;
 	char tmp[16];
 
 	printf("Free block bitmap\n");
@@ -189,16 +259,16 @@ dumpfreemap(uint32_t fsblocks)
 		printf("    Freemap block #%u in disk block %u: blocks %u - %u"
 		       " (0x%x - 0x%x)\n",
 		       i, SFS_FREEMAP_START+i,
-		       i*SFS_BITSPERBLOCK, (i+1)*SFS_BITSPERBLOCK - 1,
-		       i*SFS_BITSPERBLOCK, (i+1)*SFS_BITSPERBLOCK - 1);
-		for (j=0; j<SFS_BLOCKSIZE; j++) {
+		       i*bitsperblock, (i+1)*bitsperblock - 1,
+		       i*bitsperblock, (i+1)*bitsperblock - 1);
+		for (j=0; j<blocksize; j++) {
 			if (j % 8 == 0) {
 				snprintf(tmp, sizeof(tmp), "0x%x",
-					 i*SFS_BITSPERBLOCK + j*8);
+					 i*bitsperblock + j*8);
 				printf("%-7s ", tmp);
 			}
 			for (k=0; k<8; k++) {
-				bn = i*SFS_BITSPERBLOCK + j*8 + k;
+				bn = i*bitsperblock + j*8 + k;
 				mask = 1U << k;
 				if (bn >= fsblocks) {
 					if (data[j] & mask) {
@@ -232,7 +302,7 @@ static
 void
 dumpindirect(uint32_t block)
 {
-	uint32_t ib[SFS_BLOCKSIZE/sizeof(uint32_t)];
+	uint32_t ib[SFS_DBPERIDB(SFS_MAXBLOCKSIZE)];
 	char tmp[128];
 	unsigned i;
 
@@ -242,7 +312,7 @@ dumpindirect(uint32_t block)
 	printf("Indirect block %u\n", block);
 
 	diskread(ib, block);
-	for (i=0; i<ARRAYCOUNT(ib); i++) {
+	for (i=0; i<SFS_DBPERIDB(diskblocksize()); i++) {
 		if (i % 4 == 0) {
 			printf("@%-3u   ", i);
 		}
@@ -255,12 +325,15 @@ dumpindirect(uint32_t block)
 	}
 }
 
+/*
+ * LEVEL is 1 for a single indirect block, 2 for double, 3 for triple.
+ */
 static
 uint32_t
 traverse_ib(uint32_t fileblock, uint32_t numblocks, uint32_t block,
-	    void (*doblock)(uint32_t, uint32_t))
+	    unsigned level, void (*doblock)(uint32_t, uint32_t))
 {
-	uint32_t ib[SFS_BLOCKSIZE/sizeof(uint32_t)];
+	uint32_t ib[SFS_DBPERIDB(SFS_MAXBLOCKSIZE)];
 	unsigned i;
 
 	if (block == 0) {
@@ -269,8 +342,16 @@ traverse_ib(uint32_t fileblock, uint32_t numblocks, uint32_t block,
 	else {
 		diskread(ib, block);
 	}
-	for (i=0; i<ARRAYCOUNT(ib) && fileblock < numblocks; i++) {
-		doblock(fileblock++, SWAP32(ib[i]));
+	for (i=0; i<SFS_DBPERIDB(diskblocksize()) && fileblock < numblocks;
+	     i++) {
+		if (level > 1) {
+			fileblock = traverse_ib(fileblock, numblocks,
+						SWAP32(ib[i]), level - 1,
+						doblock);
+		}
+		else {
+			doblock(fileblock++, SWAP32(ib[i]));
+		}
 	}
 	return fileblock;
 }
@@ -283,7 +364,7 @@ traverse(const struct sfs_dinode *sfi, void (*doblock)(uint32_t, uint32_t))
 	uint32_t numblocks;
 	unsigned i;
 
-	numblocks = DIVROUNDUP(SWAP32(sfi->sfi_size), SFS_BLOCKSIZE);
+	numblocks = DIVROUNDUP(SWAP32(sfi->sfi_size), diskblocksize());
 
 	fileblock = 0;
 	for (i=0; i<SFS_NDIRECT && fileblock < numblocks; i++) {
@@ -291,7 +372,15 @@ traverse(const struct sfs_dinode *sfi, void (*doblock)(uint32_t, uint32_t))
 	}
 	if (fileblock < numblocks) {
 		fileblock = traverse_ib(fileblock, numblocks,
-					SWAP32(sfi->sfi_indirect), doblock);
+					SWAP32(sfi->sfi_indirect), 1, doblock);
+	}
+	if (fileblock < numblocks) {
+		fileblock = traverse_ib(fileblock, numblocks,
+					SWAP32(sfi->sfi_dindirect), 2, doblock);
+	}
+	if (fileblock < numblocks) {
+		fileblock = traverse_ib(fileblock, numblocks,
+					SWAP32(sfi->sfi_tindirect), 3, doblock);
 	}
 	assert(fileblock == numblocks);
 }
@@ -300,8 +389,8 @@ static
 void
 dumpdirblock(uint32_t fileblock, uint32_t diskblock)
 {
-	struct sfs_direntry sds[SFS_BLOCKSIZE/sizeof(struct sfs_direntry)];
-	int nsds = SFS_BLOCKSIZE/sizeof(struct sfs_direntry);
+	struct sfs_direntry sds[SFS_MAXBLOCKSIZE/sizeof(struct sfs_direntry)];
+	int nsds = diskblocksize()/sizeof(struct sfs_direntry);
 	int i;
 
 	(void)fileblock;
@@ -342,8 +431,8 @@ static
 void
 recursedirblock(uint32_t fileblock, uint32_t diskblock)
 {
-	struct sfs_direntry sds[SFS_BLOCKSIZE/sizeof(struct sfs_direntry)];
-	int nsds = SFS_BLOCKSIZE/sizeof(struct sfs_direntry);
+	struct sfs_direntry sds[SFS_MAXBLOCKSIZE/sizeof(struct sfs_direntry)];
+	int nsds = diskblocksize()/sizeof(struct sfs_direntry);
 	int i;
 
 	(void)fileblock;
@@ -374,23 +463,20 @@ recursedir(uint32_t ino, const struct sfs_dinode *sfi)
 	printf("Done with directory %u\n", ino);
 }
 
+/*
+ * Print LEN bytes of file data found at file offset POS in hex and
+ * ASCII, 16 to a line.
+ */
 static
-void dumpfileblock(uint32_t fileblock, uint32_t diskblock)
+void
+dumpdata(const uint8_t *data, unsigned len, uint32_t pos)
 {
-	uint8_t data[SFS_BLOCKSIZE];
 	unsigned i, j;
 	char tmp[128];
 
-	if (diskblock == 0) {
-		printf("    0x%6x  [sparse]\n", fileblock * SFS_BLOCKSIZE);
-		return;
-	}
-
-	diskread(data, diskblock);
-	for (i=0; i<SFS_BLOCKSIZE; i++) {
+	for (i=0; i<len; i++) {
 		if (i % 16 == 0) {
-			snprintf(tmp, sizeof(tmp), "0x%x",
-				 fileblock * SFS_BLOCKSIZE + i);
+			snprintf(tmp, sizeof(tmp), "0x%x", pos + i);
 			printf("%8s", tmp);
 		}
 		if (i % 8 == 0) {
@@ -400,9 +486,12 @@ void dumpfileblock(uint32_t fileblock, uint32_t diskblock)
 			printf(" ");
 		}
 		printf("%02x", data[i]);
-		if (i % 16 == 15) {
+		if (i % 16 == 15 || i == len - 1) {
+			for (j = i % 16; j < 15; j++) {
+				printf(j % 8 == 7 ? "    " : "   ");
+			}
 			printf("  ");
-			for (j = i-15; j<=i; j++) {
+			for (j = i - i % 16; j<=i; j++) {
 				if (data[j] < 32 || data[j] > 126) {
 					putchar('.');
 				}
@@ -415,11 +504,36 @@ void dumpfileblock(uint32_t fileblock, uint32_t diskblock)
 	}
 }
 
+static
+void dumpfileblock(uint32_t fileblock, uint32_t diskblock)
+{
+	uint8_t data[SFS_MAXBLOCKSIZE];
+
+	if (diskblock == 0) {
+		printf("    0x%6x  [sparse]\n", fileblock * diskblocksize());
+		return;
+	}
+
+	diskread(data, diskblock);
+	dumpdata(data, diskblocksize(), fileblock * diskblocksize());
+}
+
 static
 void
 dumpfile(uint32_t ino, const struct sfs_dinode *sfi)
 {
+	uint32_t size;
+
 	printf("File contents for inode %u:\n", ino);
+	if (SWAP32(sfi->sfi_flags) & SFS_INODE_INLINE) {
+		/* (don't trust a damaged size to stay inside the inode) */
+		size = SWAP32(sfi->sfi_size);
+		if (size > SFS_INLINEMAX(inodesize)) {
+			size = SFS_INLINEMAX(inodesize);
+		}
+		dumpdata((const uint8_t *)sfi->sfi_waste, size, 0);
+		return;
+	}
 	traverse(sfi, dumpfileblock);
 }
 
@@ -432,7 +546,7 @@ dumpinode(uint32_t ino, const char *name)
 	char tmp[128];
 	unsigned i;
 
-	diskread(&sfi, ino);
+	readinode(&sfi, ino);
 
 	printf("Inode %u", ino);
 	if (name != NULL) {
@@ -476,15 +590,34 @@ dumpinode(uint32_t ino, const char *name)
 	}
 	printf("    Indirect block: %u (0x%x)\n",
 	       SWAP32(sfi.sfi_indirect), SWAP32(sfi.sfi_indirect));
-	for (i=0; i<ARRAYCOUNT(sfi.sfi_waste); i++) {
-		if (sfi.sfi_waste[i] != 0) {
-			printf("    Word %u in waste area: 0x%x\n",
-			       i, SWAP32(sfi.sfi_waste[i]));
+	printf("    Double indirect block: %u (0x%x)\n",
+	       SWAP32(sfi.sfi_dindirect), SWAP32(sfi.sfi_dindirect));
+	printf("    Triple indirect block: %u (0x%x)\n",
+	       SWAP32(sfi.sfi_tindirect), SWAP32(sfi.sfi_tindirect));
+	if (sfi.sfi_dirindex != 0) {
+		printf("    Directory index: %u (0x%x)\n",
+		       SWAP32(sfi.sfi_dirindex), SWAP32(sfi.sfi_dirindex));
+	}
+	if (SWAP32(sfi.sfi_flags) & SFS_INODE_INLINE) {
+		printf("    Flags: 0x%x (data in inode)\n",
+		       SWAP32(sfi.sfi_flags));
+	}
+	else {
+		if (sfi.sfi_flags != 0) {
+			printf("    Flags: 0x%x\n", SWAP32(sfi.sfi_flags));
+		}
+		for (i=0; i<ARRAYCOUNT(sfi.sfi_waste); i++) {
+			if (sfi.sfi_waste[i] != 0) {
+				printf("    Word %u in waste area: 0x%x\n",
+				       i, SWAP32(sfi.sfi_waste[i]));
+			}
 		}
 	}
 
 	if (doindirect) {
 		dumpindirect(SWAP32(sfi.sfi_indirect));
+		dumpindirect(SWAP32(sfi.sfi_dindirect));
+		dumpindirect(SWAP32(sfi.sfi_tindirect));
 	}
 
 	if (SWAP16(sfi.sfi_type) == SFS_TYPE_DIR && dodirs) {
@@ -542,10 +675,12 @@ main(int argc, char **argv)
 				    case 'b': dofreemap = true; break;
 				    case 'i':
 					if (argv[i][j+1] == 0) {
-						dumpino = atoi(argv[++i]);
+						dumpino = strtoul(argv[++i],
+								  NULL, 0);
 					}
 					else {
-						dumpino = atoi(argv[i]+j+1);
+						dumpino = strtoul(argv[i]+j+1,
+								  NULL, 0);
 						j = strlen(argv[i]);
 					}
 					/* XXX ugly */
@@ -41,14 +41,15 @@
 #include "disk.h"
 
 #define HOSTSTRING "System/161 Disk Image"
-#define BLOCKSIZE  512
+#define SECTORSIZE 512
 
 #ifndef EINTR
 #define EINTR 0
 #endif
 
 static int fd=-1;
-static uint32_t nblocks;
+static off_t nbytes;
+static uint32_t blocksize = SECTORSIZE;
 
 /*
  * Open a disk. If we're built for the host OS, check that it's a
@@ -68,10 +69,10 @@ opendisk(const char *path)
 		err(1, "%s: fstat", path);
 	}
 
-	nblocks = statbuf.st_size / BLOCKSIZE;
+	nbytes = statbuf.st_size - statbuf.st_size % SECTORSIZE;
 
 #ifdef HOST
-	nblocks--;
+	nbytes -= SECTORSIZE;
 
 	{
 		char buf[64];
@@ -95,13 +96,25 @@ opendisk(const char *path)
 }
 
 /*
- * Return the block size. (This is fixed, but still...)
+ * Set the block size. Block numbers and transfers are in blocks of
+ * this size from here on; it starts out as the sector size.
+ */
+void
+disksetblocksize(uint32_t size)
+{
+	assert(fd>=0);
+	assert(size >= SECTORSIZE && size % SECTORSIZE == 0);
+	blocksize = size;
+}
+
+/*
+ * Return the block size.
  */
 uint32_t
 diskblocksize(void)
 {
 	assert(fd>=0);
-	return BLOCKSIZE;
+	return blocksize;
 }
 
 /*
@@ -111,7 +124,23 @@ uint32_t
 diskblocks(void)
 {
 	assert(fd>=0);
-	return nblocks;
+	return nbytes / blocksize;
+}
+
+/*
+ * Return the disk offset of a block.
+ */
+static
+off_t
+diskoffset(uint32_t block)
+{
+	off_t offset = (off_t)block * blocksize;
+
+#ifdef HOST
+	// skip over disk file header
+	offset += SECTORSIZE;
+#endif
+	return offset;
 }
 
 /*
@@ -126,17 +155,12 @@ diskwrite(const void *data, uint32_t block)
 
 	assert(fd>=0);
 
-#ifdef HOST
-	// skip over disk file header
-	block++;
-#endif
-
-	if (lseek(fd, block*BLOCKSIZE, SEEK_SET)<0) {
+	if (lseek(fd, diskoffset(block), SEEK_SET)<0) {
 		err(1, "lseek");
 	}
 
-	while (tot < BLOCKSIZE) {
-		len = write(fd, cdata + tot, BLOCKSIZE - tot);
+	while (tot < blocksize) {
+		len = write(fd, cdata + tot, blocksize - tot);
 		if (len < 0) {
 			if (errno==EINTR || errno==EAGAIN) {
 				continue;
@@ -162,17 +186,12 @@ diskread(void *data, uint32_t block)
 
 	assert(fd>=0);
 
-#ifdef HOST
-	// skip over disk file header
-	block++;
-#endif
-
-	if (lseek(fd, block*BLOCKSIZE, SEEK_SET)<0) {
+	if (lseek(fd, diskoffset(block), SEEK_SET)<0) {
 		err(1, "lseek");
 	}
 
-	while (tot < BLOCKSIZE) {
-		len = read(fd, cdata + tot, BLOCKSIZE - tot);
+	while (tot < blocksize) {
+		len = read(fd, cdata + tot, blocksize - tot);
 		if (len < 0) {
 			if (errno==EINTR || errno==EAGAIN) {
 				continue;
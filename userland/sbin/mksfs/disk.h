@@ -29,6 +29,7 @@
 
 void opendisk(const char *path);
 
+void disksetblocksize(uint32_t size);
 uint32_t diskblocksize(void);
 uint32_t diskblocks(void);
 
@@ -29,6 +29,7 @@
 
 #include <sys/types.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <limits.h>
@@ -60,8 +61,28 @@
 /* Maximum size of freemap we support */
 #define MAXFREEMAPBLOCKS 32
 
+/* Block size of the volume */
+static uint32_t blocksize = SFS_BLOCKSIZE;
+
+/* Bytes per inode; 0 gives each inode a block of its own */
+#define DEFAULTINODESIZE 256
+static uint32_t inodesize = DEFAULTINODESIZE;
+
 /* Free block bitmap */
-static char freemapbuf[MAXFREEMAPBLOCKS * SFS_BLOCKSIZE];
+static char freemapbuf[MAXFREEMAPBLOCKS * SFS_MAXBLOCKSIZE];
+
+/* Block holding the root directory's index (first block after freemap) */
+static uint32_t rootindexblock;
+
+/*
+ * Size of the metadata journal. Volumes too small to spare it (less
+ * than JOURNALMINFS times its size) get no journal.
+ */
+#define JOURNALBLOCKS 128
+#define JOURNALMINFS  8
+
+/* Location and size of the journal (right after the root index) */
+static uint32_t journalstart, journalblocks;
 
 /*
  * Assert that the on-disk data structures are correctly sized.
@@ -73,6 +94,27 @@ check(void)
 	assert(sizeof(struct sfs_superblock)==SFS_BLOCKSIZE);
 	assert(sizeof(struct sfs_dinode)==SFS_BLOCKSIZE);
 	assert(SFS_BLOCKSIZE % sizeof(struct sfs_direntry) == 0);
+	assert(sizeof(struct sfs_dirhash)==SFS_BLOCKSIZE);
+	assert(sizeof(struct sfs_dirhash_block)==SFS_BLOCKSIZE);
+	assert(sizeof(struct sfs_jheader)==SFS_BLOCKSIZE);
+	assert(sizeof(struct sfs_jdesc)==SFS_BLOCKSIZE);
+	assert(sizeof(struct sfs_jcommit)==SFS_BLOCKSIZE);
+}
+
+/*
+ * Write out a structure of LEN bytes at the start of a block; the
+ * rest of the block is zeros.
+ */
+static
+void
+writeblock(const void *data, size_t len, uint32_t block)
+{
+	char buf[SFS_MAXBLOCKSIZE];
+
+	assert(len <= blocksize);
+	bzero((void *)buf, blocksize);
+	memcpy(buf, data, len);
+	diskwrite(buf, block);
 }
 
 /*
@@ -96,14 +138,17 @@ static
 void
 initfreemap(uint32_t fsblocks)
 {
-	uint32_t freemapbits = SFS_FREEMAPBITS(fsblocks);
-	uint32_t freemapblocks = SFS_FREEMAPBLOCKS(fsblocks);
+	uint32_t freemapbits = SFS_FREEMAPBITS(fsblocks, blocksize);
+	uint32_t freemapblocks = SFS_FREEMAPBLOCKS(fsblocks, blocksize);
 	uint32_t i;
 
 	if (freemapblocks > MAXFREEMAPBLOCKS) {
 		errx(1, "Filesystem too large -- "
 		     "increase MAXFREEMAPBLOCKS and recompile");
 	}
+	if (inodesize != 0 && fsblocks > SFS_INO_MAXBLOCKS) {
+		errx(1, "Filesystem too large for packed inodes");
+	}
 
 	/* mark the superblock and root inode in use */
 	allocblock(SFS_SUPER_BLOCK);
@@ -114,6 +159,22 @@ initfreemap(uint32_t fsblocks)
 		allocblock(SFS_FREEMAP_START + i);
 	}
 
+	/* so must the root directory's index */
+	rootindexblock = SFS_FREEMAP_START + freemapblocks;
+	if (rootindexblock >= fsblocks) {
+		errx(1, "Filesystem too small");
+	}
+	allocblock(rootindexblock);
+
+	/* and the journal, if there's room for it */
+	if (fsblocks >= JOURNALBLOCKS * JOURNALMINFS) {
+		journalstart = rootindexblock + 1;
+		journalblocks = JOURNALBLOCKS;
+		for (i=0; i<journalblocks; i++) {
+			allocblock(journalstart + i);
+		}
+	}
+
 	/* all blocks in the freemap but past the volume end are "in use" */
 	for (i=fsblocks; i<freemapbits; i++) {
 		allocblock(i);
@@ -140,9 +201,13 @@ writesuper(const char *volname, uint32_t nblocks)
 	sb.sb_magic = SWAP32(SFS_MAGIC);
 	sb.sb_nblocks = SWAP32(nblocks);
 	strcpy(sb.sb_volname, volname);
+	sb.sb_journalstart = SWAP32(journalstart);
+	sb.sb_journalblocks = SWAP32(journalblocks);
+	sb.sb_blocksize = SWAP32(blocksize);
+	sb.sb_inodesize = SWAP32(inodesize);
 
 	/* and write it out. */
-	diskwrite(&sb, SFS_SUPER_BLOCK);
+	writeblock(&sb, sizeof(sb), SFS_SUPER_BLOCK);
 }
 
 /*
@@ -157,30 +222,68 @@ writefreemap(uint32_t fsblocks)
 	uint32_t i;
 
 	/* Write out each of the blocks in the free block bitmap. */
-	freemapblocks = SFS_FREEMAPBLOCKS(fsblocks);
+	freemapblocks = SFS_FREEMAPBLOCKS(fsblocks, blocksize);
 	for (i=0; i<freemapblocks; i++) {
-		ptr = freemapbuf + i*SFS_BLOCKSIZE;
+		ptr = freemapbuf + i*blocksize;
 		diskwrite(ptr, SFS_FREEMAP_START+i);
 	}
 }
 
 /*
- * Write out the root directory inode.
+ * Write out the root directory inode and its (empty) index.
  */
 static
 void
 writerootdir(void)
 {
 	struct sfs_dinode sfi;
+	struct sfs_dirhash dh;
 
 	/* Initialize the dinode */
 	bzero((void *)&sfi, sizeof(sfi));
 	sfi.sfi_size = SWAP32(0);
 	sfi.sfi_type = SWAP16(SFS_TYPE_DIR);
 	sfi.sfi_linkcount = SWAP16(1);
+	sfi.sfi_dirindex = SWAP32(rootindexblock);
+
+	/* Initialize the index root; all the chains start empty */
+	bzero((void *)&dh, sizeof(dh));
+	dh.dh_magic = SWAP32(SFS_DIRHASH_MAGIC);
+	dh.dh_nbuckets = SWAP32(SFS_DIRHASH_NBUCKETS);
+	dh.dh_freehint = SWAP32(0);
+
+	/*
+	 * Write them out. If inodes are packed, the root directory is
+	 * slot 0 of its inode block and the other slots start free.
+	 */
+	writeblock(&sfi, inodesize ? inodesize : sizeof(sfi),
+		   SFS_ROOTDIR_INO);
+	writeblock(&dh, sizeof(dh), rootindexblock);
+}
+
+/*
+ * Write out an empty journal: a header and a descriptor block that
+ * doesn't match it, so there's no transaction to replay.
+ */
+static
+void
+writejournal(void)
+{
+	struct sfs_jheader jh;
+	struct sfs_jdesc jd;
 
-	/* Write it out */
-	diskwrite(&sfi, SFS_ROOTDIR_INO);
+	if (journalblocks == 0) {
+		return;
+	}
+
+	bzero((void *)&jh, sizeof(jh));
+	jh.jh_magic = SWAP32(SFS_JHEADER_MAGIC);
+	jh.jh_seq = SWAP32(1);
+
+	bzero((void *)&jd, sizeof(jd));
+
+	writeblock(&jh, sizeof(jh), journalstart);
+	writeblock(&jd, sizeof(jd), journalstart + 1);
 }
 
 /*
@@ -189,15 +292,44 @@ writerootdir(void)
 int
 main(int argc, char **argv)
 {
-	uint32_t size, blocksize;
+	uint32_t size, devblocksize;
 	char *volname, *s;
 
 #ifdef HOST
 	hostcompat_init(argc, argv);
 #endif
 
+	while (argc >= 3 && argv[1][0] == '-') {
+		if (!strcmp(argv[1], "-b")) {
+			blocksize = atoi(argv[2]);
+			if (blocksize < SFS_BLOCKSIZE ||
+			    blocksize > SFS_MAXBLOCKSIZE ||
+			    (blocksize & (blocksize - 1)) != 0) {
+				errx(1, "Block size must be a power of 2 "
+				     "from %u to %u",
+				     SFS_BLOCKSIZE, SFS_MAXBLOCKSIZE);
+			}
+		}
+		else if (!strcmp(argv[1], "-i")) {
+			inodesize = atoi(argv[2]);
+			if (inodesize != 0 &&
+			    (inodesize < SFS_MININODESIZE ||
+			     inodesize > SFS_BLOCKSIZE ||
+			     (inodesize & (inodesize - 1)) != 0)) {
+				errx(1, "Inode size must be 0 or a power "
+				     "of 2 from %u to %u",
+				     SFS_MININODESIZE, SFS_BLOCKSIZE);
+			}
+		}
+		else {
+			break;
+		}
+		argc -= 2;
+		argv += 2;
+	}
 	if (argc!=3) {
-		errx(1, "Usage: mksfs device/diskfile volume-name");
+		errx(1, "Usage: mksfs [-b blocksize] [-i inodesize] "
+		     "device/diskfile volume-name");
 	}
 
 	check();
@@ -220,12 +352,13 @@ main(int argc, char **argv)
 	}
 
 	opendisk(argv[1]);
-	blocksize = diskblocksize();
+	devblocksize = diskblocksize();
 
-	if (blocksize!=SFS_BLOCKSIZE) {
+	if (devblocksize!=SFS_BLOCKSIZE) {
 		errx(1, "Device has wrong blocksize %u (should be %u)\n",
-		     blocksize, SFS_BLOCKSIZE);
+		     devblocksize, SFS_BLOCKSIZE);
 	}
+	disksetblocksize(blocksize);
 	size = diskblocks();
 
 	/* Write out the on-disk structures */
@@ -233,6 +366,7 @@ main(int argc, char **argv)
 	writesuper(volname, size);
 	writefreemap(size);
 	writerootdir();
+	writejournal();
 
 	closedisk();
 
@@ -60,7 +60,7 @@ freemap_setup(void)
 
 	fsblocks = sb_totalblocks();
 	mapblocks = sb_freemapblocks();
-	mapbytes = mapblocks * SFS_BLOCKSIZE;
+	mapbytes = mapblocks * sb_blocksize();
 
 	freemapdata = domalloc(mapbytes * sizeof(uint8_t));
 	tofreedata = domalloc(mapbytes * sizeof(uint8_t));
@@ -69,7 +69,7 @@ freemap_setup(void)
 	}
 
 	/* Mark off what's in the freemap but past the volume end. */
-	for (i=fsblocks; i < mapblocks*SFS_BITSPERBLOCK; i++) {
+	for (i=fsblocks; i < mapblocks*SFS_BITSPERBLOCK(sb_blocksize()); i++) {
 		freemap_blockinuse(i, B_PASTEND, 0);
 	}
 
@@ -78,6 +78,11 @@ freemap_setup(void)
 	for (i=0; i < mapblocks; i++) {
 		freemap_blockinuse(SFS_FREEMAP_START+i, B_FREEMAPBLOCK, i);
 	}
+
+	/* And so is the journal, if there is one */
+	for (i=0; i < sb_journalblocks(); i++) {
+		freemap_blockinuse(sb_journalstart()+i, B_JOURNAL, i);
+	}
 }
 
 /*
@@ -111,6 +116,14 @@ blockusagestr(blockusage_t how, uint32_t howdesc)
 		snprintf(rv, sizeof(rv), "file data from inode %lu",
 			 (unsigned long) howdesc);
 		break;
+	    case B_DIRINDEX:
+		snprintf(rv, sizeof(rv), "directory index of inode %lu",
+			 (unsigned long) howdesc);
+		break;
+	    case B_JOURNAL:
+		snprintf(rv, sizeof(rv), "journal block %lu",
+			 (unsigned long) howdesc);
+		break;
 	    case B_PASTEND:
 		return "past the end of the fs";
 	}
@@ -207,7 +220,7 @@ reportfreemap(uint32_t mapblock, uint32_t byte, uint8_t val, const char *what)
 
 	for (x=1, y=0; x; x<<=1, y++) {
 		if (val & x) {
-			blocknum = mapblock*SFS_BITSPERBLOCK +
+			blocknum = mapblock*SFS_BITSPERBLOCK(sb_blocksize()) +
 				byte*CHAR_BIT + y;
 			warnx("Block %lu erroneously shown %s in freemap",
 			      (unsigned long) blocknum, what);
@@ -224,7 +237,7 @@ reportfreemap(uint32_t mapblock, uint32_t byte, uint8_t val, const char *what)
 void
 freemap_check(void)
 {
-	uint8_t actual[SFS_BLOCKSIZE], *expected, *tofree, tmp;
+	uint8_t actual[SFS_MAXBLOCKSIZE], *expected, *tofree, tmp;
 	uint32_t alloccount=0, freecount=0, i, j;
 	int bchanged;
 	uint32_t bitblocks;
@@ -233,11 +246,11 @@ freemap_check(void)
 
 	for (i=0; i<bitblocks; i++) {
 		sfs_readfreemapblock(i, actual);
-		expected = freemapdata + i*SFS_BLOCKSIZE;
-		tofree = tofreedata + i*SFS_BLOCKSIZE;
+		expected = freemapdata + i*sb_blocksize();
+		tofree = tofreedata + i*sb_blocksize();
 		bchanged = 0;
 
-		for (j=0; j<SFS_BLOCKSIZE; j++) {
+		for (j=0; j<sb_blocksize(); j++) {
 			/* we shouldn't have blocks marked both ways */
 			assert((expected[j] & tofree[j])==0);
 
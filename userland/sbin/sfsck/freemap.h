@@ -45,6 +45,8 @@ typedef enum {
 	B_IBLOCK,	/* Indirect (or doubly-indirect etc.) block */
 	B_DIRDATA,	/* Data block of a directory */
 	B_DATA,		/* Data block */
+	B_DIRINDEX,	/* Directory index root or bucket block */
+	B_JOURNAL,	/* Metadata journal block */
 	B_PASTEND,	/* Block off the end of the fs */
 } blockusage_t;
 
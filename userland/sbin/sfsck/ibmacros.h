@@ -41,6 +41,10 @@
  * seamlessly provided that the values declared in kern/sfs.h are
  * correct.
  *
+ * The number of entries in an indirect block depends on the volume's
+ * block size, so the RANGE_x and INOMAX_x values other than the
+ * direct ones are computed at run time; include disk.h to use them.
+ *
  * SFS_NDIRECT, SFS_NINDIRECT, SFS_NDINDIRECT, and SFS_NTINDIRECT
  * should always be defined. If zero, no corresponding field is
  * assumed to exist in the inode. If one, the field is assumed to
@@ -141,19 +145,23 @@
 #define SET1_x(sfi, field, i)	(*((void)(i), &(sfi)->field))
 #define SETN_x(sfi, field, i)	((sfi)->field[(i)])
 
+/* entries per indirect block */
+
+#define DBPERIDB	SFS_DBPERIDB(diskblocksize())
+
 /* region sizes */
 
 #define RANGE_D		1
-#define RANGE_I		(RANGE_D * SFS_DBPERIDB)
-#define RANGE_II	(RANGE_I * SFS_DBPERIDB)
-#define RANGE_III	(RANGE_II * SFS_DBPERIDB)
+#define RANGE_I		(RANGE_D * DBPERIDB)
+#define RANGE_II	(RANGE_I * DBPERIDB)
+#define RANGE_III	(RANGE_II * DBPERIDB)
 
 /* max blocks */
 
 #define INOMAX_D 	NUM_D
-#define INOMAX_I 	(INOMAX_D + SFS_DBPERIDB * NUM_I)
-#define INOMAX_II	(INOMAX_I + SFS_DBPERIDB * NUM_II)
-#define INOMAX_III	(INOMAX_II + SFS_DBPERIDB * NUM_III)
+#define INOMAX_I 	(INOMAX_D + RANGE_I * NUM_I)
+#define INOMAX_II	(INOMAX_I + RANGE_II * NUM_II)
+#define INOMAX_III	(INOMAX_II + RANGE_III * NUM_III)
 
 
 #endif /* IBMACROS_H */
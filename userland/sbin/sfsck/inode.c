@@ -38,6 +38,7 @@
 
 #include "utils.h"
 #include "sfs.h"
+#include "sb.h"
 #include "freemap.h"
 #include "inode.h"
 #include "main.h"
@@ -124,17 +125,12 @@ inode_sorttable(void)
 }
 
 /*
- * Find an inode by binary search.
- *
- * This will error out if asked for an inode not in the table; that's
- * not supposed to happen. (This might need to change; if we improve
- * the handling of crosslinked directories as suggested in comments in
- * pass2.c, we'll need to be able to ask if an inode number is valid
- * and names a directory.)
+ * Look up an inode by binary search. Returns NULL if it isn't in the
+ * table.
  */
 static
 struct inodeinfo *
-inode_find(uint32_t ino)
+inode_lookup(uint32_t ino)
 {
 	unsigned min, max, i;
 
@@ -143,11 +139,7 @@ inode_find(uint32_t ino)
 
 	min = 0;
 	max = ninodes;
-	while (1) {
-		assert(min <= max);
-		if (min == max) {
-			errx(EXIT_UNRECOV, "FATAL: inode %u wasn't found in my inode table", ino);
-		}
+	while (min < max) {
 		i = min + (max - min)/2;
 		if (inodes[i].ino < ino) {
 			min = i + 1;
@@ -160,7 +152,49 @@ inode_find(uint32_t ino)
 			return &inodes[i];
 		}
 	}
-	/* NOTREACHED */
+	assert(min == max);
+	return NULL;
+}
+
+/*
+ * Find an inode by binary search.
+ *
+ * This will error out if asked for an inode not in the table; that's
+ * not supposed to happen. (This might need to change; if we improve
+ * the handling of crosslinked directories as suggested in comments in
+ * pass2.c, we'll need to be able to ask if an inode number is valid
+ * and names a directory.)
+ */
+static
+struct inodeinfo *
+inode_find(uint32_t ino)
+{
+	struct inodeinfo *inf;
+
+	inf = inode_lookup(ino);
+	if (inf == NULL) {
+		errx(EXIT_UNRECOV, "FATAL: inode %u wasn't found in my inode table", ino);
+	}
+	return inf;
+}
+
+/*
+ * Compare function for block numbers.
+ */
+static
+int
+block_compare(const void *av, const void *bv)
+{
+	uint32_t a = *(const uint32_t *)av;
+	uint32_t b = *(const uint32_t *)bv;
+
+	if (a < b) {
+		return -1;
+	}
+	if (a > b) {
+		return 1;
+	}
+	return 0;
 }
 
 ////////////////////////////////////////////////////////////
@@ -191,6 +225,72 @@ inode_add(uint32_t ino, int type)
 	return 0;
 }
 
+/*
+ * Check if some other inode we've seen is in the same block as INO.
+ * (Linear search, like inode_add.)
+ */
+int
+inode_blockseen(uint32_t ino)
+{
+	unsigned i;
+
+	for (i=0; i<ninodes; i++) {
+		if (inodes[i].ino != ino &&
+		    SFS_INO_BLOCK(inodes[i].ino) == SFS_INO_BLOCK(ino)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Clear any packed inode that no directory refers to but that shares
+ * a block with one that does. (A whole-block inode like that gets
+ * dropped with its block by freemap_check; these blocks stay in use,
+ * so the slots must be emptied or the kernel will never reuse them.)
+ * The blocks the cleared inodes pointed to have already been freed.
+ */
+void
+inode_clearunused(void)
+{
+	struct sfs_dinode sfi;
+	uint32_t *blocks;
+	uint32_t ino, slot, perblock;
+	unsigned i;
+
+	perblock = sb_inodesperblock();
+	if (perblock == 1 || ninodes == 0) {
+		return;
+	}
+
+	blocks = domalloc(ninodes * sizeof(blocks[0]));
+	for (i=0; i<ninodes; i++) {
+		blocks[i] = SFS_INO_BLOCK(inodes[i].ino);
+	}
+	qsort(blocks, ninodes, sizeof(blocks[0]), block_compare);
+
+	for (i=0; i<ninodes; i++) {
+		if (i > 0 && blocks[i] == blocks[i-1]) {
+			continue;
+		}
+		for (slot=0; slot<perblock; slot++) {
+			ino = SFS_MKINO(blocks[i], slot);
+			if (inode_lookup(ino) != NULL) {
+				continue;
+			}
+			sfs_readinode(ino, &sfi);
+			if (checkzeroed(&sfi, sizeof(sfi))) {
+				warnx("Inode %lu: not in any directory "
+				      "(cleared)", (unsigned long) ino);
+				setbadness(EXIT_RECOV);
+				memset(&sfi, 0, sizeof(sfi));
+				sfs_writeinode(ino, &sfi);
+			}
+		}
+	}
+	free(blocks);
+}
+
 /*
  * Mark an inode (directories only, because that's all the caller
  * does) visited. Returns nonzero if already visited.
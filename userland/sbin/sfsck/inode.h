@@ -39,9 +39,18 @@
 /* Add an inode. Returns 1 if we've seen this inode before. */
 int inode_add(uint32_t ino, int type);
 
+/* Check if another inode we've added shares INO's block. */
+int inode_blockseen(uint32_t ino);
+
 /* Sort the inode table for faster lookup once all inode_add() done. */
 void inode_sorttable(void);
 
+/*
+ * Clear unreferenced inodes in blocks shared with referenced ones.
+ * Requires inode_sorttable() first.
+ */
+void inode_clearunused(void);
+
 /*
  * Remember that we've seen a particular directory. Returns nonzero if
  * we've seen this directory before, which means the directory is
@@ -0,0 +1,159 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2006, 2009, 2013
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <err.h>
+
+#include "compat.h"
+#include <kern/sfs.h>
+
+#include "disk.h"
+#include "sb.h"
+#include "journal.h"
+#include "main.h"
+
+/*
+ * Rewrite the journal header with sequence number SEQ. This retires
+ * whatever transaction was in the journal.
+ */
+static
+void
+journal_writeheader(uint32_t start, uint32_t seq)
+{
+	uint32_t buf[SFS_MAXBLOCKSIZE / sizeof(uint32_t)];
+	struct sfs_jheader *jh = (struct sfs_jheader *)buf;
+
+	/* The cast is required on some outdated host systems. */
+	bzero((void *)buf, sb_blocksize());
+	jh->jh_magic = SWAP32(SFS_JHEADER_MAGIC);
+	jh->jh_seq = SWAP32(seq);
+	diskwrite(buf, start);
+}
+
+/*
+ * Read the SFS_BLOCKSIZE bytes at the start of a journal block.
+ */
+static
+void
+journal_readpart(void *data, uint32_t block)
+{
+	uint32_t buf[SFS_MAXBLOCKSIZE / sizeof(uint32_t)];
+
+	diskread(buf, block);
+	memcpy(data, buf, SFS_BLOCKSIZE);
+}
+
+/*
+ * Look for a committed transaction and, if there is one, copy its
+ * blocks to their home locations.
+ */
+int
+journal_replay(void)
+{
+	struct sfs_jheader jh;
+	struct sfs_jdesc jd;
+	struct sfs_jcommit jc;
+	uint32_t buf[SFS_MAXBLOCKSIZE / sizeof(uint32_t)];
+	uint32_t start, nblocks, fsblocks, seq, count, max, sum, home, i, j;
+
+	start = sb_journalstart();
+	nblocks = sb_journalblocks();
+	fsblocks = sb_totalblocks();
+
+	if (nblocks < 3 || start >= fsblocks || nblocks > fsblocks - start) {
+		/* no journal, or a bad one that sb_check will remove */
+		return 0;
+	}
+
+	journal_readpart(&jh, start);
+	if (SWAP32(jh.jh_magic) != SFS_JHEADER_MAGIC) {
+		warnx("Journal header invalid (fixed)");
+		setbadness(EXIT_RECOV);
+		journal_writeheader(start, 1);
+		return 0;
+	}
+	seq = SWAP32(jh.jh_seq);
+
+	max = nblocks - 3;
+	if (max > SFS_JDESC_MAXBLOCKS) {
+		max = SFS_JDESC_MAXBLOCKS;
+	}
+
+	journal_readpart(&jd, start + 1);
+	count = SWAP32(jd.jd_count);
+	if (SWAP32(jd.jd_magic) != SFS_JDESC_MAGIC ||
+	    SWAP32(jd.jd_seq) != seq || count == 0 || count > max) {
+		/* nothing pending */
+		return 0;
+	}
+
+	journal_readpart(&jc, start + 2 + count);
+	if (SWAP32(jc.jc_magic) != SFS_JCOMMIT_MAGIC ||
+	    SWAP32(jc.jc_seq) != seq || SWAP32(jc.jc_count) != count) {
+		/* never committed; the volume was not touched */
+		return 0;
+	}
+
+	sum = 0;
+	for (i=0; i<count; i++) {
+		home = SWAP32(jd.jd_blocks[i]);
+		if (home >= fsblocks ||
+		    (home >= start && home < start + nblocks)) {
+			warnx("Journal transaction %lu names bad block %lu "
+			      "(discarded)", (unsigned long)seq,
+			      (unsigned long)home);
+			setbadness(EXIT_RECOV);
+			journal_writeheader(start, seq + 1);
+			return 0;
+		}
+		diskread(buf, start + 2 + i);
+		for (j=0; j<sb_blocksize() / sizeof(uint32_t); j++) {
+			sum += SWAP32(buf[j]);
+		}
+	}
+	if (sum != SWAP32(jc.jc_sum)) {
+		warnx("Journal transaction %lu has bad checksum (discarded)",
+		      (unsigned long)seq);
+		setbadness(EXIT_RECOV);
+		journal_writeheader(start, seq + 1);
+		return 0;
+	}
+
+	printf("Replaying journal transaction %lu (%lu blocks)\n",
+	       (unsigned long)seq, (unsigned long)count);
+	for (i=0; i<count; i++) {
+		diskread(buf, start + 2 + i);
+		diskwrite(buf, SWAP32(jd.jd_blocks[i]));
+	}
+	journal_writeheader(start, seq + 1);
+	setbadness(EXIT_RECOV);
+	return 1;
+}
@@ -39,6 +39,7 @@
 #include "sb.h"
 #include "freemap.h"
 #include "inode.h"
+#include "journal.h"
 #include "passes.h"
 #include "main.h"
 
@@ -77,6 +78,10 @@ main(int argc, char **argv)
 
 	sfs_setup();
 	sb_load();
+	if (journal_replay()) {
+		/* the superblock may have been in the transaction */
+		sb_load();
+	}
 	sb_check();
 	freemap_setup();
 
@@ -86,6 +91,7 @@ main(int argc, char **argv)
 
 	printf("Phase 2 -- check directory tree\n");
 	inode_sorttable();
+	inode_clearunused();
 	pass2();
 
 	printf("Phase 3 -- check reference counts\n");
@@ -81,7 +81,7 @@ void
 check_indirect_block(struct ibstate *ibs, uint32_t *ientry, int *iechangedp,
 		     int indirection)
 {
-	uint32_t entries[SFS_DBPERIDB];
+	uint32_t entries[SFS_DBPERIDB(SFS_MAXBLOCKSIZE)];
 	uint32_t i, ct;
 	uint32_t coveredblocks;
 	int localchanged = 0;
@@ -105,14 +105,14 @@ check_indirect_block(struct ibstate *ibs, uint32_t *ientry, int *iechangedp,
 		}
 		coveredblocks = 1;
 		for (j=0; j<indirection; j++) {
-			coveredblocks *= SFS_DBPERIDB;
+			coveredblocks *= DBPERIDB;
 		}
 		ibs->curfileblock += coveredblocks;
 		return;
 	}
 
 	if (indirection > 1) {
-		for (i=0; i<SFS_DBPERIDB; i++) {
+		for (i=0; i<DBPERIDB; i++) {
 			check_indirect_block(ibs, &entries[i], &localchanged,
 					     indirection-1);
 		}
@@ -120,7 +120,7 @@ check_indirect_block(struct ibstate *ibs, uint32_t *ientry, int *iechangedp,
 	else {
 		assert(indirection==1);
 
-		for (i=0; i<SFS_DBPERIDB; i++) {
+		for (i=0; i<DBPERIDB; i++) {
 			if (entries[i] >= ibs->volblocks) {
 				setbadness(EXIT_RECOV);
 				warnx("Inode %lu: direct block pointer for "
@@ -151,7 +151,7 @@ check_indirect_block(struct ibstate *ibs, uint32_t *ientry, int *iechangedp,
 	}
 
 	ct=0;
-	for (i=ct=0; i<SFS_DBPERIDB; i++) {
+	for (i=ct=0; i<DBPERIDB; i++) {
 		if (entries[i]!=0) ct++;
 	}
 	if (ct==0) {
@@ -189,11 +189,11 @@ check_inode_blocks(uint32_t ino, struct sfs_dinode *sfi, int isdir)
 	int changed;
 	int i;
 
-	size = SFS_ROUNDUP(sfi->sfi_size, SFS_BLOCKSIZE);
+	size = SFS_ROUNDUP(sfi->sfi_size, sb_blocksize());
 
 	ibs.ino = ino;
 	/*ibs.curfileblock = 0;*/
-	ibs.fileblocks = size/SFS_BLOCKSIZE;
+	ibs.fileblocks = size/sb_blocksize();
 	ibs.volblocks = sb_totalblocks();
 	ibs.pasteofcount = 0;
 	ibs.usagetype = isdir ? B_DIRDATA : B_DATA;
@@ -247,6 +247,243 @@ check_inode_blocks(uint32_t ino, struct sfs_dinode *sfi, int isdir)
 	return changed;
 }
 
+/*
+ * Walk the index whose root is ROOTBLOCK. If INO is nonzero, mark its
+ * blocks in use by inode INO; otherwise just check the structure.
+ * Returns nonzero if the index is unusable.
+ */
+static
+int
+walk_dirindex(uint32_t rootblock, uint32_t ino)
+{
+	struct sfs_dirhash dh;
+	struct sfs_dirhash_block dhb;
+	uint32_t nblocks, block, seen, i;
+
+	nblocks = sb_totalblocks();
+	if (rootblock >= nblocks) {
+		return 1;
+	}
+	sfs_readdirhash(rootblock, &dh);
+	if (dh.dh_nbuckets == 0 || dh.dh_nbuckets > SFS_DIRHASH_NBUCKETS) {
+		return 1;
+	}
+	if (ino != 0) {
+		freemap_blockinuse(rootblock, B_DIRINDEX, ino);
+	}
+
+	seen = 1;
+	for (i=0; i<SFS_DIRHASH_NBUCKETS; i++) {
+		block = dh.dh_buckets[i];
+		if (i >= dh.dh_nbuckets && block != 0) {
+			return 1;
+		}
+		while (block != 0) {
+			/* the seen count catches loops */
+			if (block >= nblocks || ++seen > nblocks) {
+				return 1;
+			}
+			sfs_readdirhashblock(block, &dhb);
+			if (dhb.dhb_count > SFS_DIRHASH_PERBLOCK) {
+				return 1;
+			}
+			if (ino != 0) {
+				freemap_blockinuse(block, B_DIRINDEX, ino);
+			}
+			block = dhb.dhb_next;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Check the directory index pointer of inode INO. Only directories
+ * may have one, and its blocks must be sane; otherwise drop it (the
+ * kernel will make a new one) and let the freemap check reclaim the
+ * blocks.
+ *
+ * Returns nonzero if SFI was changed.
+ */
+static
+int
+check_dirindex(uint32_t ino, struct sfs_dinode *sfi, int isdir)
+{
+	if (sfi->sfi_dirindex == 0) {
+		return 0;
+	}
+	if (!isdir) {
+		warnx("Inode %lu: file has a directory index (cleared)",
+		      (unsigned long) ino);
+	}
+	else if (walk_dirindex(sfi->sfi_dirindex, 0)) {
+		warnx("Inode %lu: directory index is corrupt (cleared)",
+		      (unsigned long) ino);
+	}
+	else {
+		walk_dirindex(sfi->sfi_dirindex, ino);
+		return 0;
+	}
+	setbadness(EXIT_RECOV);
+	sfi->sfi_dirindex = 0;
+	return 1;
+}
+
+/*
+ * Check that the index of the directory SFI matches its entries
+ * (ND of them, in D). The structure has already been checked. The
+ * index is disposable, so if anything is wrong, mark it out of date
+ * and the kernel will rebuild it.
+ */
+static
+void
+check_dirindex_entries(const char *path, const struct sfs_dinode *sfi,
+		       const struct sfs_direntry *d, uint32_t nd)
+{
+	struct sfs_dirhash dh;
+	struct sfs_dirhash_block dhb;
+	unsigned char *found;
+	uint32_t block, slot, nused, nfound, i, j;
+	int bad = 0;
+
+	sfs_readdirhash(sfi->sfi_dirindex, &dh);
+	if (dh.dh_magic != SFS_DIRHASH_MAGIC) {
+		/* already going to be rebuilt */
+		return;
+	}
+
+	found = domalloc(nd > 0 ? nd : 1);
+	bzero(found, nd > 0 ? nd : 1);
+
+	nfound = 0;
+	for (i=0; i<dh.dh_nbuckets && !bad; i++) {
+		for (block = dh.dh_buckets[i]; block != 0 && !bad;
+		     block = dhb.dhb_next) {
+			sfs_readdirhashblock(block, &dhb);
+			for (j=0; j<dhb.dhb_count; j++) {
+				slot = dhb.dhb_entries[j].dhe_slot;
+				if (slot >= nd || found[slot] ||
+				    d[slot].sfd_ino == SFS_NOINO ||
+				    dhb.dhb_entries[j].dhe_hash !=
+				    sfsdir_hashname(d[slot].sfd_name) ||
+				    dhb.dhb_entries[j].dhe_hash %
+				    dh.dh_nbuckets != i) {
+					bad = 1;
+					break;
+				}
+				found[slot] = 1;
+				nfound++;
+			}
+		}
+	}
+
+	nused = 0;
+	for (i=0; i<nd; i++) {
+		if (d[i].sfd_ino != SFS_NOINO) {
+			nused++;
+		}
+		else if (i < dh.dh_freehint) {
+			bad = 1;
+		}
+	}
+	if (nused != nfound) {
+		bad = 1;
+	}
+
+	free(found);
+
+	if (bad) {
+		warnx("Directory %s: index does not match entries "
+		      "(marked for rebuild)", path);
+		setbadness(EXIT_RECOV);
+		sfsdir_staleindex(sfi);
+	}
+}
+
+/*
+ * Zero all the block pointers in SFI. Returns nonzero if any weren't.
+ */
+static
+int
+clear_blockptrs(struct sfs_dinode *sfi)
+{
+	int i, found = 0;
+
+	for (i=0; i<NUM_D; i++) {
+		found |= GET_D(sfi, i) != 0;
+		SET_D(sfi, i) = 0;
+	}
+	for (i=0; i<NUM_I; i++) {
+		found |= GET_I(sfi, i) != 0;
+		SET_I(sfi, i) = 0;
+	}
+	for (i=0; i<NUM_II; i++) {
+		found |= GET_II(sfi, i) != 0;
+		SET_II(sfi, i) = 0;
+	}
+	for (i=0; i<NUM_III; i++) {
+		found |= GET_III(sfi, i) != 0;
+		SET_III(sfi, i) = 0;
+	}
+	return found;
+}
+
+/*
+ * Check the inode flags, and the data of a file kept in its inode.
+ * Returns nonzero if SFI was changed.
+ */
+static
+int
+check_inode_flags(uint32_t ino, struct sfs_dinode *sfi)
+{
+	char *data = (char *)sfi->sfi_waste;
+	uint32_t max = SFS_INLINEMAX(sb_inodesize());
+	int changed = 0;
+
+	if (sfi->sfi_flags & ~SFS_INODE_INLINE) {
+		warnx("Inode %lu: unknown flags 0x%lx (cleared)",
+		      (unsigned long) ino, (unsigned long) sfi->sfi_flags);
+		setbadness(EXIT_RECOV);
+		sfi->sfi_flags &= SFS_INODE_INLINE;
+		changed = 1;
+	}
+	if ((sfi->sfi_flags & SFS_INODE_INLINE) == 0) {
+		return changed;
+	}
+
+	if (sfi->sfi_type != SFS_TYPE_FILE) {
+		warnx("Inode %lu: directory marked as inline file (fixed)",
+		      (unsigned long) ino);
+		setbadness(EXIT_RECOV);
+		sfi->sfi_flags &= ~SFS_INODE_INLINE;
+		return 1;
+	}
+
+	if (sfi->sfi_size > max) {
+		warnx("Inode %lu: inline file size %lu too large "
+		      "(truncated to %lu)", (unsigned long) ino,
+		      (unsigned long) sfi->sfi_size, (unsigned long) max);
+		setbadness(EXIT_RECOV);
+		sfi->sfi_size = max;
+		changed = 1;
+	}
+	if (checkzeroed(data + sfi->sfi_size, max - sfi->sfi_size)) {
+		warnx("Inode %lu: inline data past EOF not zeroed (fixed)",
+		      (unsigned long) ino);
+		setbadness(EXIT_RECOV);
+		memset(data + sfi->sfi_size, 0, max - sfi->sfi_size);
+		changed = 1;
+	}
+
+	/* Any blocks it names aren't its; freemap_check frees them */
+	if (clear_blockptrs(sfi)) {
+		warnx("Inode %lu: inline file has block pointers (cleared)",
+		      (unsigned long) ino);
+		setbadness(EXIT_RECOV);
+		changed = 1;
+	}
+	return changed;
+}
+
 /*
  * Do the pass1 inode-level checks on inode INO, which has already
  * been loaded into SFI. Note that sfi_type has already been
@@ -268,9 +505,18 @@ pass1_inode(uint32_t ino, struct sfs_dinode *sfi, int alreadychanged)
 		return 1;
 	}
 
-	freemap_blockinuse(ino, B_INODE, ino);
+	/* Packed inodes share a block; it only counts once */
+	if (!inode_blockseen(ino)) {
+		freemap_blockinuse(SFS_INO_BLOCK(ino), B_INODE, ino);
+	}
+
+	if (check_inode_flags(ino, sfi)) {
+		changed = 1;
+	}
 
-	if (checkzeroed(sfi->sfi_waste, sizeof(sfi->sfi_waste))) {
+	/* (an inline file's data is there instead) */
+	if ((sfi->sfi_flags & SFS_INODE_INLINE) == 0 &&
+	    checkzeroed(sfi->sfi_waste, sizeof(sfi->sfi_waste))) {
 		warnx("Inode %lu: sfi_waste section not zeroed (fixed)",
 		      (unsigned long) ino);
 		setbadness(EXIT_RECOV);
@@ -281,6 +527,10 @@ pass1_inode(uint32_t ino, struct sfs_dinode *sfi, int alreadychanged)
 		changed = 1;
 	}
 
+	if (check_dirindex(ino, sfi, isdir)) {
+		changed = 1;
+	}
+
 	if (changed) {
 		sfs_writeinode(ino, sfi);
 	}
@@ -309,7 +559,9 @@ pass1_direntry(const char *path, uint32_t index, struct sfs_direntry *sfd)
 			dchanged = 1;
 		}
 	}
-	else if (sfd->sfd_ino >= nblocks) {
+	else if (SFS_INO_BLOCK(sfd->sfd_ino) == SFS_SUPER_BLOCK ||
+		 SFS_INO_BLOCK(sfd->sfd_ino) >= nblocks ||
+		 SFS_INO_SLOT(sfd->sfd_ino) >= sb_inodesperblock()) {
 		setbadness(EXIT_RECOV);
 		warnx("Directory %s entry %lu has out of range "
 		      "inode (cleared)",
@@ -437,6 +689,11 @@ pass1_dir(uint32_t ino, const char *pathsofar)
 
 	if (dchanged) {
 		sfs_writedir(&sfi, direntries, ndirentries);
+		sfsdir_staleindex(&sfi);
+	}
+	else if (sfi.sfi_dirindex != 0) {
+		check_dirindex_entries(pathsofar, &sfi,
+				       direntries, ndirentries);
 	}
 
 	free(direntries);
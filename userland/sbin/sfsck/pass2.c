@@ -84,7 +84,7 @@ pass2_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 
 	ndirentries = sfi.sfi_size/sizeof(struct sfs_direntry);
 	maxdirentries = SFS_ROUNDUP(ndirentries,
-				    SFS_BLOCKSIZE/sizeof(struct sfs_direntry));
+				    sb_blocksize()/sizeof(struct sfs_direntry));
 	dirsize = maxdirentries * sizeof(struct sfs_direntry);
 	direntries = domalloc(dirsize);
 
@@ -303,6 +303,7 @@ pass2_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 
 	if (dchanged) {
 		sfs_writedir(&sfi, direntries, ndirentries);
+		sfsdir_staleindex(&sfi);
 	}
 
 	if (ichanged) {
@@ -36,6 +36,7 @@
 #include "compat.h"
 #include <kern/sfs.h>
 
+#include "disk.h"
 #include "utils.h"
 #include "sfs.h"
 #include "sb.h"
@@ -55,8 +56,30 @@ sb_load(void)
 		errx(EXIT_FATAL, "Not an sfs filesystem");
 	}
 
+	/* Zero means the original 512-byte blocks */
+	if (sb.sb_blocksize == 0) {
+		sb.sb_blocksize = SFS_BLOCKSIZE;
+	}
+	if (sb.sb_blocksize < SFS_BLOCKSIZE ||
+	    sb.sb_blocksize > SFS_MAXBLOCKSIZE ||
+	    (sb.sb_blocksize & (sb.sb_blocksize - 1)) != 0) {
+		errx(EXIT_FATAL, "Unsupported block size %lu",
+		     (unsigned long)sb.sb_blocksize);
+	}
+	disksetblocksize(sb.sb_blocksize);
+
+	/* Zero means each inode has its own block */
+	if (sb.sb_inodesize != 0 &&
+	    (sb.sb_inodesize < SFS_MININODESIZE ||
+	     sb.sb_inodesize > SFS_BLOCKSIZE ||
+	     (sb.sb_inodesize & (sb.sb_inodesize - 1)) != 0 ||
+	     sb.sb_nblocks > SFS_INO_MAXBLOCKS)) {
+		errx(EXIT_FATAL, "Unsupported inode size %lu",
+		     (unsigned long)sb.sb_inodesize);
+	}
+
 	assert(sb.sb_nblocks > 0);
-	assert(SFS_FREEMAPBLOCKS(sb.sb_nblocks) > 0);
+	assert(SFS_FREEMAPBLOCKS(sb.sb_nblocks, sb.sb_blocksize) > 0);
 }
 
 /*
@@ -83,6 +106,25 @@ sb_check(void)
 		setbadness(EXIT_RECOV);
 		schanged = 1;
 	}
+	if (sb.sb_journalblocks > 0 &&
+	    (sb.sb_journalblocks < 3 ||
+	     sb.sb_journalstart < SFS_FREEMAP_START + sb_freemapblocks() ||
+	     sb.sb_journalstart >= sb.sb_nblocks ||
+	     sb.sb_journalblocks > sb.sb_nblocks - sb.sb_journalstart)) {
+		warnx("Journal location %lu+%lu invalid (removed)",
+		      (unsigned long)sb.sb_journalstart,
+		      (unsigned long)sb.sb_journalblocks);
+		setbadness(EXIT_RECOV);
+		sb.sb_journalstart = 0;
+		sb.sb_journalblocks = 0;
+		schanged = 1;
+	}
+	if (sb.sb_journalblocks == 0 && sb.sb_journalstart != 0) {
+		warnx("Journal start set without a journal (fixed)");
+		setbadness(EXIT_RECOV);
+		sb.sb_journalstart = 0;
+		schanged = 1;
+	}
 	if (checkzeroed(sb.reserved, sizeof(sb.reserved))) {
 		warnx("Reserved section of superblock not zeroed (fixed)");
 		setbadness(EXIT_RECOV);
@@ -111,7 +153,34 @@ sb_totalblocks(void)
 uint32_t
 sb_freemapblocks(void)
 {
-	return SFS_FREEMAPBLOCKS(sb.sb_nblocks);
+	return SFS_FREEMAPBLOCKS(sb.sb_nblocks, sb.sb_blocksize);
+}
+
+/*
+ * Return the block size.
+ */
+uint32_t
+sb_blocksize(void)
+{
+	return sb.sb_blocksize;
+}
+
+/*
+ * Return the number of bytes each inode takes up on disk.
+ */
+uint32_t
+sb_inodesize(void)
+{
+	return sb.sb_inodesize ? sb.sb_inodesize : SFS_BLOCKSIZE;
+}
+
+/*
+ * Return the number of inodes in each inode block.
+ */
+uint32_t
+sb_inodesperblock(void)
+{
+	return sb.sb_inodesize ? sb.sb_blocksize / sb.sb_inodesize : 1;
 }
 
 /*
@@ -122,3 +191,21 @@ sb_volname(void)
 {
 	return sb.sb_volname;
 }
+
+/*
+ * Return the first block of the journal.
+ */
+uint32_t
+sb_journalstart(void)
+{
+	return sb.sb_journalstart;
+}
+
+/*
+ * Return the number of journal blocks (0 if there's no journal).
+ */
+uint32_t
+sb_journalblocks(void)
+{
+	return sb.sb_journalblocks;
+}
@@ -43,12 +43,23 @@ void sb_load(void);
 /* After the superblock is loaded: return volume size. */
 uint32_t sb_totalblocks(void);
 
+/* After the superblock is loaded: return the block size. */
+uint32_t sb_blocksize(void);
+
+/* After the superblock is loaded: return inode size and inodes per block. */
+uint32_t sb_inodesize(void);
+uint32_t sb_inodesperblock(void);
+
 /* After the superblock is loaded: return number of freemap blocks. */
 uint32_t sb_freemapblocks(void);
 
 /* After the superblock is loaded: return volume name. */
 const char *sb_volname(void);
 
+/* After the superblock is loaded: return journal location and size. */
+uint32_t sb_journalstart(void);
+uint32_t sb_journalblocks(void);
+
 /* Check the superblock. Must load it first. */
 void sb_check(void);
 
@@ -40,6 +40,7 @@
 #include "utils.h"
 #include "ibmacros.h"
 #include "sfs.h"
+#include "sb.h"
 #include "main.h"
 
 ////////////////////////////////////////////////////////////
@@ -51,6 +52,11 @@ sfs_setup(void)
 	assert(sizeof(struct sfs_superblock)==SFS_BLOCKSIZE);
 	assert(sizeof(struct sfs_dinode)==SFS_BLOCKSIZE);
 	assert(SFS_BLOCKSIZE % sizeof(struct sfs_direntry) == 0);
+	assert(sizeof(struct sfs_dirhash)==SFS_BLOCKSIZE);
+	assert(sizeof(struct sfs_dirhash_block)==SFS_BLOCKSIZE);
+	assert(sizeof(struct sfs_jheader)==SFS_BLOCKSIZE);
+	assert(sizeof(struct sfs_jdesc)==SFS_BLOCKSIZE);
+	assert(sizeof(struct sfs_jcommit)==SFS_BLOCKSIZE);
 }
 
 ////////////////////////////////////////////////////////////
@@ -62,6 +68,10 @@ swapsb(struct sfs_superblock *sb)
 {
 	sb->sb_magic = SWAP32(sb->sb_magic);
 	sb->sb_nblocks = SWAP32(sb->sb_nblocks);
+	sb->sb_journalstart = SWAP32(sb->sb_journalstart);
+	sb->sb_journalblocks = SWAP32(sb->sb_journalblocks);
+	sb->sb_blocksize = SWAP32(sb->sb_blocksize);
+	sb->sb_inodesize = SWAP32(sb->sb_inodesize);
 }
 
 static
@@ -81,6 +91,8 @@ swapinode(struct sfs_dinode *sfi)
 	sfi->sfi_size = SWAP32(sfi->sfi_size);
 	sfi->sfi_type = SWAP16(sfi->sfi_type);
 	sfi->sfi_linkcount = SWAP16(sfi->sfi_linkcount);
+	sfi->sfi_dirindex = SWAP32(sfi->sfi_dirindex);
+	sfi->sfi_flags = SWAP32(sfi->sfi_flags);
 
 	for (i=0; i<NUM_D; i++) {
 		SET_D(sfi, i) = SWAP32(GET_D(sfi, i));
@@ -110,12 +122,42 @@ static
 void
 swapindir(uint32_t *entries)
 {
-	int i;
-	for (i=0; i<SFS_DBPERIDB; i++) {
+	unsigned i;
+	for (i=0; i<DBPERIDB; i++) {
 		entries[i] = SWAP32(entries[i]);
 	}
 }
 
+static
+void
+swapdirhash(struct sfs_dirhash *dh)
+{
+	int i;
+
+	dh->dh_magic = SWAP32(dh->dh_magic);
+	dh->dh_nbuckets = SWAP32(dh->dh_nbuckets);
+	dh->dh_freehint = SWAP32(dh->dh_freehint);
+	for (i=0; i<SFS_DIRHASH_NBUCKETS; i++) {
+		dh->dh_buckets[i] = SWAP32(dh->dh_buckets[i]);
+	}
+}
+
+static
+void
+swapdirhashblock(struct sfs_dirhash_block *dhb)
+{
+	int i;
+
+	dhb->dhb_next = SWAP32(dhb->dhb_next);
+	dhb->dhb_count = SWAP32(dhb->dhb_count);
+	for (i=0; i<SFS_DIRHASH_PERBLOCK; i++) {
+		dhb->dhb_entries[i].dhe_hash =
+			SWAP32(dhb->dhb_entries[i].dhe_hash);
+		dhb->dhb_entries[i].dhe_slot =
+			SWAP32(dhb->dhb_entries[i].dhe_slot);
+	}
+}
+
 ////////////////////////////////////////////////////////////
 // bmap()
 
@@ -132,7 +174,7 @@ static
 uint32_t
 ibmap(uint32_t iblock, uint32_t offset, uint32_t entrysize)
 {
-	uint32_t entries[SFS_DBPERIDB];
+	uint32_t entries[SFS_DBPERIDB(SFS_MAXBLOCKSIZE)];
 
 	if (iblock == 0) {
 		return 0;
@@ -144,10 +186,10 @@ ibmap(uint32_t iblock, uint32_t offset, uint32_t entrysize)
 	if (entrysize > 1) {
 		uint32_t index = offset / entrysize;
 		offset %= entrysize;
-		return ibmap(entries[index], offset, entrysize/SFS_DBPERIDB);
+		return ibmap(entries[index], offset, entrysize/DBPERIDB);
 	}
 	else {
-		assert(offset < SFS_DBPERIDB);
+		assert(offset < DBPERIDB);
 		return entries[offset];
 	}
 }
@@ -187,6 +229,32 @@ bmap(const struct sfs_dinode *sfi, uint32_t fileblock)
 ////////////////////////////////////////////////////////////
 // superblock, free block bitmap, and inode I/O
 
+/*
+ * The superblock, inodes, and directory index blocks only fill the
+ * first SFS_BLOCKSIZE bytes of their blocks; the rest is zero.
+ */
+
+static
+void
+readpart(void *data, uint32_t blocknum)
+{
+	char buf[SFS_MAXBLOCKSIZE];
+
+	diskread(buf, blocknum);
+	memcpy(data, buf, SFS_BLOCKSIZE);
+}
+
+static
+void
+writepart(const void *data, uint32_t blocknum)
+{
+	char buf[SFS_MAXBLOCKSIZE];
+
+	memset(buf, 0, diskblocksize());
+	memcpy(buf, data, SFS_BLOCKSIZE);
+	diskwrite(buf, blocknum);
+}
+
 /*
  *  superblock - blocknum is a disk block number.
  */
@@ -194,7 +262,7 @@ bmap(const struct sfs_dinode *sfi, uint32_t fileblock)
 void
 sfs_readsb(uint32_t blocknum, struct sfs_superblock *sb)
 {
-	diskread(sb, blocknum);
+	readpart(sb, blocknum);
 	swapsb(sb);
 }
 
@@ -202,7 +270,7 @@ void
 sfs_writesb(uint32_t blocknum, struct sfs_superblock *sb)
 {
 	swapsb(sb);
-	diskwrite(sb, blocknum);
+	writepart(sb, blocknum);
 	swapsb(sb);
 }
 
@@ -227,22 +295,38 @@ sfs_writefreemapblock(uint32_t whichblock, uint8_t *bits)
 }
 
 /*
- *  inodes - ino is an inode number, which is a disk block number.
+ *  inodes - ino is an inode number, which is a disk block number
+ *  plus, if inodes are packed, the slot in that block.
  */
 
 void
 sfs_readinode(uint32_t ino, struct sfs_dinode *sfi)
 {
-	diskread(sfi, ino);
+	char buf[SFS_MAXBLOCKSIZE];
+	uint32_t size = sb_inodesize();
+
+	diskread(buf, SFS_INO_BLOCK(ino));
+	memset(sfi, 0, sizeof(*sfi));
+	memcpy(sfi, buf + SFS_INO_SLOT(ino) * size, size);
 	swapinode(sfi);
 }
 
 void
 sfs_writeinode(uint32_t ino, struct sfs_dinode *sfi)
 {
+	char buf[SFS_MAXBLOCKSIZE];
+	uint32_t size = sb_inodesize();
+
+	if (sb_inodesperblock() == 1) {
+		memset(buf, 0, diskblocksize());
+	}
+	else {
+		diskread(buf, SFS_INO_BLOCK(ino));
+	}
 	swapinode(sfi);
-	diskwrite(sfi, ino);
+	memcpy(buf + SFS_INO_SLOT(ino) * size, sfi, size);
 	swapinode(sfi);
+	diskwrite(buf, SFS_INO_BLOCK(ino));
 }
 
 /*
@@ -264,6 +348,32 @@ sfs_writeindirect(uint32_t blocknum, uint32_t *entries)
 	swapindir(entries);
 }
 
+/*
+ *  directory index blocks - blocknum is a disk block number.
+ */
+
+void
+sfs_readdirhash(uint32_t blocknum, struct sfs_dirhash *dh)
+{
+	readpart(dh, blocknum);
+	swapdirhash(dh);
+}
+
+void
+sfs_writedirhash(uint32_t blocknum, struct sfs_dirhash *dh)
+{
+	swapdirhash(dh);
+	writepart(dh, blocknum);
+	swapdirhash(dh);
+}
+
+void
+sfs_readdirhashblock(uint32_t blocknum, struct sfs_dirhash_block *dhb)
+{
+	readpart(dhb, blocknum);
+	swapdirhashblock(dhb);
+}
+
 ////////////////////////////////////////////////////////////
 // directory I/O
 
@@ -274,7 +384,7 @@ static
 void
 sfs_readdirblock(struct sfs_direntry *d, uint32_t diskblock)
 {
-	const unsigned atonce = SFS_BLOCKSIZE/sizeof(struct sfs_direntry);
+	const unsigned atonce = diskblocksize()/sizeof(struct sfs_direntry);
 	unsigned j;
 
 	if (diskblock != 0) {
@@ -285,7 +395,7 @@ sfs_readdirblock(struct sfs_direntry *d, uint32_t diskblock)
 	}
 	else {
 		warnx("Warning: sparse directory found");
-		bzero(d, SFS_BLOCKSIZE);
+		bzero(d, diskblocksize());
 	}
 }
 
@@ -297,7 +407,7 @@ sfs_readdirblock(struct sfs_direntry *d, uint32_t diskblock)
 void
 sfs_readdir(struct sfs_dinode *sfi, struct sfs_direntry *d, unsigned nd)
 {
-	const unsigned atonce = SFS_BLOCKSIZE/sizeof(struct sfs_direntry);
+	const unsigned atonce = diskblocksize()/sizeof(struct sfs_direntry);
 	unsigned nblocks = SFS_ROUNDUP(nd, atonce) / atonce;
 	unsigned i, j;
 	unsigned left, thismany;
@@ -330,7 +440,7 @@ static
 void
 sfs_writedirblock(struct sfs_direntry *d, uint32_t diskblock)
 {
-	const unsigned atonce = SFS_BLOCKSIZE/sizeof(struct sfs_direntry);
+	const unsigned atonce = diskblocksize()/sizeof(struct sfs_direntry);
 	unsigned j, bad;
 
 	if (diskblock != 0) {
@@ -362,7 +472,7 @@ sfs_writedirblock(struct sfs_direntry *d, uint32_t diskblock)
 void
 sfs_writedir(const struct sfs_dinode *sfi, struct sfs_direntry *d, unsigned nd)
 {
-	const unsigned atonce = SFS_BLOCKSIZE/sizeof(struct sfs_direntry);
+	const unsigned atonce = diskblocksize()/sizeof(struct sfs_direntry);
 	unsigned nblocks = SFS_ROUNDUP(nd, atonce) / atonce;
 	unsigned i, j;
 	unsigned left, thismany;
@@ -462,3 +572,37 @@ sfsdir_tryadd(struct sfs_direntry *d, int nd, const char *name, uint32_t ino)
 	}
 	return -1;
 }
+
+/*
+ * Hash a name the way the directory index does (32-bit FNV-1a).
+ */
+uint32_t
+sfsdir_hashname(const char *name)
+{
+	uint32_t h = 2166136261U;
+
+	while (*name) {
+		h ^= (unsigned char)*name++;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+/*
+ * Mark the index of the directory SFI out of date, so the kernel
+ * rebuilds it. Call this after changing an indexed directory.
+ */
+void
+sfsdir_staleindex(const struct sfs_dinode *sfi)
+{
+	struct sfs_dirhash dh;
+
+	if (sfi->sfi_dirindex == 0) {
+		return;
+	}
+	sfs_readdirhash(sfi->sfi_dirindex, &dh);
+	if (dh.dh_magic != 0) {
+		dh.dh_magic = 0;
+		sfs_writedirhash(sfi->sfi_dirindex, &dh);
+	}
+}
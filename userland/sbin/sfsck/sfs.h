@@ -41,6 +41,8 @@
 struct sfs_superblock;
 struct sfs_dinode;
 struct sfs_direntry;
+struct sfs_dirhash;
+struct sfs_dirhash_block;
 
 /* Call this before anything else in this module */
 void sfs_setup(void);
@@ -65,6 +67,11 @@ void sfs_writeinode(uint32_t inum, struct sfs_dinode *sfi);
 void sfs_readindirect(uint32_t blocknum, uint32_t *entries);
 void sfs_writeindirect(uint32_t blocknum, uint32_t *entries);
 
+/* directory index root and bucket blocks */
+void sfs_readdirhash(uint32_t blocknum, struct sfs_dirhash *dh);
+void sfs_writedirhash(uint32_t blocknum, struct sfs_dirhash *dh);
+void sfs_readdirhashblock(uint32_t blocknum, struct sfs_dirhash_block *dhb);
+
 /* directory - ND should be the number of directory entries D points to */
 void sfs_readdir(struct sfs_dinode *sfi, struct sfs_direntry *d, unsigned nd);
 void sfs_writedir(const struct sfs_dinode *sfi,
@@ -77,5 +84,11 @@ int sfsdir_tryadd(struct sfs_direntry *d, int nd,
 /* Sort a directory by creating a permutation vector. */
 void sfsdir_sort(struct sfs_direntry *d, unsigned nd, int *vector);
 
+/* Hash a name for the directory index. */
+uint32_t sfsdir_hashname(const char *name);
+
+/* Mark a directory's index out of date so the kernel rebuilds it. */
+void sfsdir_staleindex(const struct sfs_dinode *sfi);
+
 
 #endif /* SFS_H */
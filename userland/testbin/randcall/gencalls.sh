@@ -30,6 +30,7 @@ awk < $1 '
 	printf "#include <sys/stat.h>\n";
 	printf "#include <assert.h>\n";
 	printf "#include <unistd.h>\n";
+	printf "#include <dirent.h>\n";
 	printf "#include <stdio.h>\n";
 	printf "#include <stdlib.h>\n";
 	printf "#include <errno.h>\n";